@@ -8,101 +8,326 @@
 #include <libgen.h>
 #include "../structs.h"
 #include "../utils.h"
+#include "../stats.h"
+#include "../io.h"
+#include "../tree_index.h"
+#include "../columns.h"
+#include "../volume.h"
+#include "../dict.h"
+#include "../filter.h"
+#include "../delta.h"
+#include "../libmyz.h"
 #include "a_flag.h"
 
-void append_archive(const char *archive_name, char *files[], int file_count)
+/* Existing-catalog facts gathered for one command line entry */
+typedef struct {
+    int skip;               // Not found on the filesystem
+    mode_t mode;
+    char parent[1024];      // dirname() of the entry
+    char base[MAX_PATH_LENGTH];
+    int dir_dup;            // A directory with the same path is archived
+    int parent_exists;      // Its parent directory is archived
+    int path_dup;           // A non-directory with the same path is archived
+    int base_dup;           // A non-directory with the same basename is archived
+    // --delta: the newest archived version of a regular file, stored again as a new version
+    int has_previous;
+    size_t previous_index;      // Its record index
+    FileMetadata previous;
+    int replaced;           // The new version was stored, previous becomes ENTRY_SUPERSEDED
+    int covered;            // --watch: under a new directory that is stored whole
+} AppendCandidate;
+
+static int cmp_path_ptrs(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Whether path or (include_self) one of its parent directories is in sorted */
+static int path_under(const char *path, char **sorted, int count, int include_self)
 {
-    FILE *archive = fopen(archive_name, "r+b");
+    char prefix[MAX_PATH_LENGTH];
+    size_t len = strlen(path);
+    if (count == 0 || len >= sizeof(prefix))
+        return 0;
+    memcpy(prefix, path, len + 1);
+    const char *key = prefix;
+    for (size_t i = len; i > 0; i--) {
+        if (i == len ? !include_self : path[i] != '/')
+            continue;
+        prefix[i] = '\0';
+        if (bsearch(&key, sorted, (size_t)count, sizeof(char *), cmp_path_ptrs))
+            return 1;
+    }
+    return 0;
+}
+
+static void check_candidates(const FileMetadata *old, size_t index, AppendCandidate *cands, int file_count,
+                             char *files[], int versions)
+{
+    if (old->flags & ENTRY_SUPERSEDED)
+        return;             // Only the current version of a path counts
+    for (int i = 0; i < file_count; i++) {
+        if (cands[i].skip)
+            continue;
+        if (S_ISDIR(old->mode)) {
+            if (strcmp(old->path, files[i]) == 0)
+                cands[i].dir_dup = 1;
+            if (strcmp(old->path, cands[i].parent) == 0)
+                cands[i].parent_exists = 1;
+        } else {
+            if (strcmp(old->path, files[i]) == 0) {
+                cands[i].path_dup = 1;
+                // New records precede the old ones, so the first current one is the newest
+                if (versions && !S_ISDIR(cands[i].mode) && !cands[i].has_previous) {
+                    cands[i].has_previous = 1;
+                    cands[i].previous_index = index;
+                    cands[i].previous = *old;
+                }
+            }
+            if (strcmp(old->path, cands[i].base) == 0)
+                cands[i].base_dup = 1;
+        }
+    }
+}
+
+/*
+ * --delta / --watch: stores a path already in the archive as its newest
+ * version. A regular file replacing a regular file is a delta against the
+ * previous one under --delta, unless that has no content of its own (empty
+ * or a hard link) or the chain would get longer than the limit; anything
+ * else is stored in full.
+ */
+static int append_version(const char *path, AppendCandidate *cand, myz_archive *base_archive, FILE *archive,
+                          long *data_offset, MetadataArray *marr, size_t *deltas)
+{
+    struct stat st;
+    if (filter_path_excluded(path))
+        return -1;
+    if (lstat(path, &st) == -1) {
+        perror("lstat error");
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        size_t before = metadata_total(marr);
+        process_path(path, archive, data_offset, marr);
+        if (metadata_total(marr) == before)
+            return -1;
+        cand->replaced = 1;
+        return 0;
+    }
+    FileMetadata meta;
+    memset(&meta, 0, sizeof(meta));
+    snprintf(meta.path, sizeof(meta.path), "%s", path);
+    meta.mode = st.st_mode;
+    meta.uid = st.st_uid;
+    meta.gid = st.st_gid;
+    meta.atime = st.st_atime;
+    meta.mtime = st.st_mtime;
+    meta.ctime = st.st_ctime;
+    meta.inode = st.st_ino;
+    meta.dev = (uint64_t)st.st_dev;
+    const FileMetadata *base = &cand->previous;
+    int rc;
+    if (!S_ISREG(base->mode) || base->is_hardlink || base->size == 0 || base->logical_size == 0 ||
+        base->delta_depth >= delta_max_depth) {
+        rc = store_file_data(path, &st, archive, data_offset, &meta, compress_flag);
+    } else {
+        rc = delta_store_file(path, &st, base_archive, cand->previous_index, base, archive, data_offset, &meta);
+        if (rc == 0)
+            (*deltas)++;
+    }
+    if (rc != 0)
+        return -1;
+    add_metadata(marr, &meta);
+    stats_count_entry(st.st_mode, 0);
+    cand->replaced = 1;
+    return 0;
+}
+
+/*
+ * -a, and one batch of --watch (changes): the paths in removed (sorted)
+ * and everything under them become tombstones, existing paths in files
+ * (sorted) are stored as new versions, and new directories whole.
+ */
+static int append_entries(const char *archive_name, char *files[], int file_count, char *removed[],
+                          int removed_count, int changes)
+{
+    int versions = changes || delta_max_depth;
+    FILE *archive = io_fopen(archive_name, "r+b");
     if (!archive) {
         perror("Error opening archive for appending");
-        return;
+        return -1;
     }
     ArchiveHeader header;
-    if (fread(&header, 1, HEADER_SIZE, archive) != HEADER_SIZE) {
-        perror("Error reading header");
-        fclose(archive);
-        return;
+    if (read_archive_header(archive, &header) != 0) {
+        io_fclose(archive);
+        return -1;
     }
     uint32_t old_meta_count = header.metadata_count;
-    FileMetadata *old_metas = NULL;
-    if (old_meta_count > 0) {
-        old_metas = malloc(old_meta_count * sizeof(FileMetadata));
-        if (!old_metas) {
+
+    AppendCandidate *cands = calloc(file_count ? file_count : 1, sizeof(AppendCandidate));
+    if (!cands) {
+        perror("calloc");
+        io_fclose(archive);
+        return -1;
+    }
+    for (int i = 0; i < file_count; i++) {
+        struct stat st;
+        if (lstat(files[i], &st) == -1) {
+            cands[i].skip = 1;
+            continue;
+        }
+        cands[i].mode = st.st_mode;
+        char tmp[1024];
+        strncpy(tmp, files[i], sizeof(tmp));
+        tmp[sizeof(tmp) - 1] = '\0';
+        strncpy(cands[i].parent, dirname(tmp), sizeof(cands[i].parent) - 1);
+        strncpy(tmp, files[i], sizeof(tmp));
+        tmp[sizeof(tmp) - 1] = '\0';
+        strncpy(cands[i].base, basename(tmp), MAX_PATH_LENGTH - 1);
+    }
+
+    /*
+     * The new data overwrites the old metadata block, so the old records are
+     * kept in a MetadataArray (spilled to disk under --max-memory) and the
+     * duplicate checks are done in the same streaming pass.
+     */
+    MetadataArray old_marr, new_marr;
+    init_metadata_array(&old_marr);
+    init_metadata_array(&new_marr);
+    if (old_marr.max_records) {
+        /* Both catalogs share the memory budget */
+        old_marr.max_records = new_marr.max_records = old_marr.max_records / 2 > 16 ? old_marr.max_records / 2 : 16;
+    }
+    stats_phase_begin(PHASE_METADATA_READ);
+    MetadataReader reader;
+    metadata_reader_init(&reader, archive, &header);
+    FileMetadata chunk[64];
+    size_t n, total_read = 0, tombstones = 0;
+    int previous = 0;
+    while ((n = metadata_reader_next(&reader, chunk, sizeof(chunk) / sizeof(chunk[0]))) > 0) {
+        for (size_t j = 0; j < n; j++) {
+            // Tombstones are marked before the checks, a path created again is new
+            if (!(chunk[j].flags & ENTRY_SUPERSEDED) && path_under(chunk[j].path, removed, removed_count, 1)) {
+                chunk[j].flags |= ENTRY_SUPERSEDED;
+                tombstones++;
+            }
+            check_candidates(&chunk[j], total_read + j, cands, file_count, files, versions);
+            add_metadata(&old_marr, &chunk[j]);
+        }
+        total_read += n;
+    }
+    stats_phase_end(PHASE_METADATA_READ);
+    for (int i = 0; i < file_count; i++)
+        previous += cands[i].has_previous;
+    if (total_read != old_meta_count) {
+        /* Legacy records are converted by the reader and written back in the current format */
+        free_metadata_array(&old_marr);
+        free_metadata_array(&new_marr);
+        free(cands);
+        io_fclose(archive);
+        return -1;
+    }
+
+    /* --watch: paths under a directory that is new to the archive are stored with it */
+    if (changes) {
+        char **fresh = malloc((file_count ? file_count : 1) * sizeof(char *));
+        int fresh_count = 0;
+        if (!fresh) {
             perror("malloc");
-            fclose(archive);
-            return;
+            free_metadata_array(&old_marr);
+            free_metadata_array(&new_marr);
+            free(cands);
+            io_fclose(archive);
+            return -1;
         }
-        if (fseek(archive, header.metadata_offset, SEEK_SET) != 0) {
-            perror("fseek error");
-            free(old_metas);
-            fclose(archive);
-            return;
+        for (int i = 0; i < file_count; i++) {
+            if (!cands[i].skip && S_ISDIR(cands[i].mode) && !cands[i].dir_dup)
+                fresh[fresh_count++] = files[i];
         }
-        if (fread(old_metas, sizeof(FileMetadata), old_meta_count, archive) != old_meta_count) {
-            perror("Error reading old metadata");
-            free(old_metas);
-            fclose(archive);
-            return;
+        for (int i = 0; i < file_count; i++)
+            cands[i].covered = path_under(files[i], fresh, fresh_count, 0);
+        free(fresh);
+    }
+
+    /* Multi-volume archives: new data goes to the archive file itself (volume 0) */
+    VolumeTable volumes;
+    if (volume_table_read(archive, &header, &volumes) != 0) {
+        free_metadata_array(&old_marr);
+        free_metadata_array(&new_marr);
+        free(cands);
+        io_fclose(archive);
+        return -1;
+    }
+
+    /* -j on an archive with a dictionary compresses the new files against it too */
+    if (compress_flag && dict_read(archive, &header, &archive_dict) != 0) {
+        volume_table_free(&volumes);
+        free_metadata_array(&old_marr);
+        free_metadata_array(&new_marr);
+        free(cands);
+        io_fclose(archive);
+        return -1;
+    }
+
+    /* The old versions are decoded through a second handle, opened before their catalog is overwritten */
+    myz_archive *base_archive = NULL;
+    if (previous > 0) {
+        int rc = myz_open(archive_name, &base_archive);
+        if (rc != MYZ_OK) {
+            print_myz_error(archive_name, rc);
+            dict_free(&archive_dict);
+            volume_table_free(&volumes);
+            free_metadata_array(&old_marr);
+            free_metadata_array(&new_marr);
+            free(cands);
+            io_fclose(archive);
+            return -1;
         }
     }
-    long new_data_offset = header.metadata_offset;
-    if (fseek(archive, new_data_offset, SEEK_SET) != 0) {
+
+    /* New data goes over the old catalog, or at the end when the catalog is at the front */
+    long new_data_offset = archive_data_end(archive, &header);
+    if (new_data_offset < 0 || fseek(archive, new_data_offset, SEEK_SET) != 0) {
         perror("fseek error");
-        free(old_metas);
-        fclose(archive);
-        return;
+        myz_close(base_archive);
+        dict_free(&archive_dict);
+        volume_table_free(&volumes);
+        free_metadata_array(&old_marr);
+        free_metadata_array(&new_marr);
+        free(cands);
+        io_fclose(archive);
+        return -1;
     }
-    MetadataArray new_marr;
-    init_metadata_array(&new_marr);
 
+    size_t deltas = 0;
     for (int i = 0; i < file_count; i++) {
-        struct stat st;
-        if (lstat(files[i], &st) == -1) {
+        if (cands[i].skip) {
             fprintf(stderr, "Error: file/directory '%s' not found on filesystem.\n", files[i]);
             continue;
         }
-        char meta_entry[MAX_PATH_LENGTH];
-        strncpy(meta_entry, files[i], MAX_PATH_LENGTH);
-        meta_entry[MAX_PATH_LENGTH - 1] = '\0';
-
-        int duplicate = 0;
-        if (S_ISDIR(st.st_mode)) {
+        if (cands[i].covered)
+            continue;
+        if (cands[i].has_previous) {
+            append_version(files[i], &cands[i], base_archive, archive, &new_data_offset, &new_marr, &deltas);
+            continue;
+        }
+        if (changes) {
+            // Changed directories that are archived already (new entries in them come as paths of their own)
+            if (!cands[i].dir_dup)
+                process_path(files[i], archive, &new_data_offset, &new_marr);
+            continue;
+        }
+        if (S_ISDIR(cands[i].mode)) {
             /* Check if directory already exists */
-            for (size_t j = 0; j < old_meta_count; j++) {
-                if (S_ISDIR(old_metas[j].mode) && strcmp(old_metas[j].path, meta_entry) == 0) {
-                    duplicate = 1;
-                    break;
-                }
-            }
-            if (duplicate) {
-                fprintf(stderr, "Error: directory '%s' already exists in archive.\n", meta_entry);
+            if (cands[i].dir_dup) {
+                fprintf(stderr, "Error: directory '%s' already exists in archive.\n", files[i]);
                 continue;
             }
-        } else if (S_ISREG(st.st_mode)) {
-            char tmp[1024];
-            strncpy(tmp, files[i], sizeof(tmp));
-            tmp[sizeof(tmp) - 1] = '\0';
-            char *parent = dirname(tmp);
-            int parent_exists = 0;
-            for (size_t j = 0; j < old_meta_count; j++) {
-                if (S_ISDIR(old_metas[j].mode) && strcmp(old_metas[j].path, parent) == 0) {
-                    parent_exists = 1;
-                    break;
-                }
-            }
-            if (parent_exists) {
-                char *base = basename(files[i]);
-                strncpy(meta_entry, base, MAX_PATH_LENGTH);
-                meta_entry[MAX_PATH_LENGTH - 1] = '\0';
-            }
-            /* Check for existing file with same path */
-            for (size_t j = 0; j < old_meta_count; j++) {
-                if (!S_ISDIR(old_metas[j].mode) && strcmp(old_metas[j].path, meta_entry) == 0) {
-                    duplicate = 1;
-                    break;
-                }
-            }
-            if (duplicate) {
+        } else if (S_ISREG(cands[i].mode)) {
+            /* Check for existing file with same path (the basename if its parent is archived) */
+            const char *meta_entry = cands[i].parent_exists ? cands[i].base : files[i];
+            if (cands[i].parent_exists ? cands[i].base_dup : cands[i].path_dup) {
                 fprintf(stderr, "Error: file '%s' already exists in archive.\n", meta_entry);
                 continue;
             }
@@ -110,49 +335,100 @@ void append_archive(const char *archive_name, char *files[], int file_count)
         /* Process path for the new data */
         process_path(files[i], archive, &new_data_offset, &new_marr);
     }
+    myz_close(base_archive);
+    dict_free(&archive_dict);
 
-    if (new_marr.count == 0) {
-        fprintf(stderr, "No new entries were appended.\n");
+    if (metadata_total(&new_marr) == 0 && tombstones == 0) {
+        if (!changes)
+            fprintf(stderr, "No new entries were appended.\n");
+        free(cands);
+        volume_table_free(&volumes);
+        free_metadata_array(&old_marr);
         free_metadata_array(&new_marr);
-        free(old_metas);
-        fclose(archive);
-        return;
+        io_fclose(archive);
+        return changes ? 0 : -1;
     }
     long new_metadata_offset = new_data_offset;
+    size_t new_count = metadata_total(&new_marr);
     if (fseek(archive, new_data_offset, SEEK_SET) != 0) {
         perror("fseek error");
+        free(cands);
+        free_metadata_array(&old_marr);
         free_metadata_array(&new_marr);
-        free(old_metas);
-        fclose(archive);
-        return;
-    }
-    /* Write new metadata */
-    for (size_t i = 0; i < new_marr.count; i++) {
-        if (fwrite(&new_marr.records[i], sizeof(FileMetadata), 1, archive) != 1) {
-            perror("Error writing new metadata");
-        }
+        io_fclose(archive);
+        return -1;
     }
-    /* Write old metadata */
-    if (old_meta_count > 0) {
-        if (fwrite(old_metas, sizeof(FileMetadata), old_meta_count, archive) != old_meta_count) {
-            perror("Error writing old metadata");
-        }
+    stats_phase_begin(PHASE_METADATA_WRITE);
+    /* Write new metadata, then the old metadata */
+    if (write_metadata_array(&new_marr, archive) != 0 ||
+        write_metadata_array(&old_marr, archive) != 0) {
+        fprintf(stderr, "Error writing metadata, archive header left unchanged.\n");
+        stats_phase_end(PHASE_METADATA_WRITE);
+        free(cands);
+        volume_table_free(&volumes);
+        free_metadata_array(&old_marr);
+        free_metadata_array(&new_marr);
+        io_fclose(archive);
+        return -1;
     }
-    uint32_t total_meta_count = new_marr.count + old_meta_count;
+    /* The versions that got a newer one are marked in place, behind the new records */
+    size_t replaced = 0;
+    for (int i = 0; i < file_count; i++) {
+        if (!cands[i].replaced)
+            continue;
+        replaced++;
+        cands[i].previous.flags |= ENTRY_SUPERSEDED;
+        long pos = new_metadata_offset + (long)(new_count + cands[i].previous_index) * (long)sizeof(FileMetadata);
+        if (fseek(archive, pos, SEEK_SET) != 0 ||
+            stats_fwrite(&cands[i].previous, sizeof(FileMetadata), 1, archive) != 1)
+            perror("Error marking the older version");
+    }
+    if (previous > 0 && !changes)
+        printf("Stored %zu new versions, %zu of them as deltas.\n", replaced, deltas);
+    free(cands);
+    uint32_t total_meta_count = new_count + old_meta_count;
     header.metadata_count = total_meta_count;
     header.metadata_offset = new_metadata_offset;
+    header.magic = MYZ_MAGIC;
+    header.version = MYZ_VERSION;
+    write_tree_index(archive, &header);
+    write_columns(archive, &header);
+    /* The old volume table was overwritten, write it again after the index */
+    if (volumes.count > 0)
+        volumes.entries[0].size = (uint64_t)(new_metadata_offset - archive_data_start(&header));
+    volume_table_write(archive, &header, &volumes);
+    volume_table_free(&volumes);
     if (fseek(archive, 0, SEEK_SET) != 0) {
         perror("fseek error");
+        free_metadata_array(&old_marr);
         free_metadata_array(&new_marr);
-        free(old_metas);
-        fclose(archive);
-        return;
+        io_fclose(archive);
+        return -1;
     }
+    int rc = 0;
     if (fwrite(&header, 1, HEADER_SIZE, archive) != HEADER_SIZE) {
         perror("Error writing updated header");
+        rc = -1;
     }
+    stats_phase_end(PHASE_METADATA_WRITE);
+    free_metadata_array(&old_marr);
     free_metadata_array(&new_marr);
-    free(old_metas);
-    fclose(archive);
-    printf("Archive %s appended successfully.\n", archive_name);
+    if (io_fclose(archive) != 0)
+        rc = -1;
+    if (changes)
+        printf("Archive %s: %zu new entries, %zu new versions (%zu deltas), %zu tombstones.\n", archive_name,
+               new_count - replaced, replaced, deltas, tombstones);
+    else
+        printf("Archive %s appended successfully.\n", archive_name);
+    return rc;
+}
+
+void append_archive(const char *archive_name, char *files[], int file_count)
+{
+    append_entries(archive_name, files, file_count, NULL, 0, 0);
+}
+
+int append_changes(const char *archive_name, char *files[], int file_count, char *removed[], int removed_count)
+{
+    return append_entries(archive_name, files, file_count, removed, removed_count, 1);
 }
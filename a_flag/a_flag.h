@@ -9,4 +9,15 @@
  */
 void append_archive(const char *archive_name, char *files[], int file_count);
 
+/*
+ * Applies one batch of changes to an archive (--watch). files: paths that
+ * exist, sorted; those already archived are stored as new versions
+ * (deltas under --delta), new directories with everything in them.
+ * removed: paths that were deleted or moved away, sorted; their current
+ * records and everything under them are marked ENTRY_SUPERSEDED
+ * (tombstones). A path in both was replaced: the new one starts afresh.
+ * Returns 0 on success, -1 on error.
+ */
+int append_changes(const char *archive_name, char *files[], int file_count, char *removed[], int removed_count);
+
 #endif // A_FLAG_H
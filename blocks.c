@@ -0,0 +1,241 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "blocks.h"
+#include "utils.h"
+#include "stats.h"
+#include "io.h"
+
+/* A block between the reader, the workers and the writer */
+enum { SLOT_FREE, SLOT_READY, SLOT_BUSY, SLOT_DONE };
+
+typedef struct {
+    unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len;
+    int state;
+    int failed;
+} BlockSlot;
+
+typedef struct {
+    BlockSlot *slots;
+    size_t slot_count;
+    size_t out_capacity;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       // A block to compress, or stop
+    pthread_cond_t done;        // A block compressed
+    int stop;
+} BlockPool;
+
+int block_compress_wanted(off_t size)
+{
+    return size >= (off_t)BLOCK_MIN_COUNT * BLOCK_SIZE;
+}
+
+/* Worker: compresses ready blocks into gzip members until stopped */
+static void *compress_blocks(void *arg)
+{
+    BlockPool *pool = arg;
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    // No file name and no mtime in the member headers, like gzip -n
+    int ok = deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        BlockSlot *slot = NULL;
+        for (size_t i = 0; i < pool->slot_count && !slot; i++) {
+            if (pool->slots[i].state == SLOT_READY)
+                slot = &pool->slots[i];
+        }
+        if (!slot) {
+            if (pool->stop)
+                break;
+            pthread_cond_wait(&pool->ready, &pool->lock);
+            continue;
+        }
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock(&pool->lock);
+        int failed = !ok;
+        if (ok) {
+            deflateReset(&z);
+            z.next_in = slot->in;
+            z.avail_in = (uInt)slot->in_len;
+            z.next_out = slot->out;
+            z.avail_out = (uInt)pool->out_capacity;
+            failed = deflate(&z, Z_FINISH) != Z_STREAM_END;
+            slot->out_len = pool->out_capacity - z.avail_out;
+        }
+        pthread_mutex_lock(&pool->lock);
+        slot->failed = failed;
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (ok)
+        deflateEnd(&z);
+    return NULL;
+}
+
+typedef struct {
+    unsigned char *buf;
+    size_t len;
+} BlockFill;
+
+/* io_read_range() sink filling a block */
+static int fill_sink(void *ctx, const void *data, size_t n)
+{
+    BlockFill *fill = ctx;
+    memcpy(fill->buf + fill->len, data, n);
+    fill->len += n;
+    return 0;
+}
+
+static void free_pool(BlockPool *pool)
+{
+    for (size_t i = 0; pool->slots && i < pool->slot_count; i++) {
+        free(pool->slots[i].in);
+        free(pool->slots[i].out);
+    }
+    free(pool->slots);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->ready);
+    pthread_cond_destroy(&pool->done);
+}
+
+/* Writes an empty gzip member whose extra field holds data in subfield 'M', id */
+static int write_extra_member(FILE *archive, char id, const void *data, size_t len, long *data_offset)
+{
+    size_t xlen = len + 4;
+    unsigned char head[BLOCK_MEMBER_HEAD] = {
+        0x1f, 0x8b, 8, 4 /* FEXTRA */, 0, 0, 0, 0, 0, 255,
+        xlen & 0xff, xlen >> 8, 'M', (unsigned char)id, len & 0xff, len >> 8
+    };
+    // Stored empty final block, then CRC32 and ISIZE of no content
+    static const unsigned char tail[BLOCK_MEMBER_TAIL] = { 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    if (stats_fwrite(head, 1, sizeof(head), archive) != sizeof(head) ||
+        stats_fwrite(data, 1, len, archive) != len ||
+        stats_fwrite(tail, 1, sizeof(tail), archive) != sizeof(tail))
+        return -1;
+    *data_offset += (long)BLOCK_MEMBER_SIZE(len);
+    return 0;
+}
+
+/*
+ * The calling thread reads the blocks in order into a ring of two slots
+ * per worker and writes the compressed members out in the same order, so
+ * reading, compressing and writing overlap.
+ */
+int block_compress_file(const char *fs_path, off_t size, FILE *archive, long *data_offset)
+{
+    uint64_t count = ((uint64_t)size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    long workers = worker_count(count);
+    BlockPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.ready, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.slot_count = (size_t)workers * 2;
+    pool.out_capacity = compressBound(BLOCK_SIZE) + 64;     // Room for the gzip header and trailer
+    pool.slots = calloc(pool.slot_count, sizeof(BlockSlot));
+    uint64_t *sizes = malloc((count ? count : 1) * sizeof(uint64_t));
+    pthread_t *threads = calloc((size_t)workers, sizeof(pthread_t));
+    int rc = pool.slots && sizes && threads ? 0 : -1;
+    for (size_t i = 0; rc == 0 && i < pool.slot_count; i++) {
+        pool.slots[i].in = malloc(BLOCK_SIZE);
+        pool.slots[i].out = malloc(pool.out_capacity);
+        if (!pool.slots[i].in || !pool.slots[i].out)
+            rc = -1;
+    }
+    if (rc != 0) {
+        report_perror("malloc");
+        free(sizes);
+        free(threads);
+        free_pool(&pool);
+        return -1;
+    }
+    IoFile file;
+    if (io_open(&file, fs_path) != 0) {
+        report_perror("Error opening file for archiving");
+        free(sizes);
+        free(threads);
+        free_pool(&pool);
+        return -1;
+    }
+    long started = 0;
+    while (started < workers && pthread_create(&threads[started], NULL, compress_blocks, &pool) == 0)
+        started++;
+    if (started == 0) {
+        report_perror("pthread_create");
+        rc = -1;
+    }
+
+    stats_phase_begin(PHASE_COMPRESS);
+    uint64_t next_read = 0, next_write = 0;
+    while (rc == 0 && next_write < count) {
+        if (next_read < count && next_read - next_write < pool.slot_count) {
+            BlockSlot *slot = &pool.slots[next_read % pool.slot_count];
+            off_t offset = (off_t)next_read * BLOCK_SIZE;
+            size_t want = size - offset < BLOCK_SIZE ? (size_t)(size - offset) : BLOCK_SIZE;
+            BlockFill fill = { slot->in, 0 };
+            // A read error ends the entry early, like a file that shrank
+            if (io_read_range(&file, offset, (off_t)want, fill_sink, &fill) != 0 || fill.len < want)
+                count = next_read + (fill.len > 0);
+            if (fill.len == 0)
+                continue;
+            pthread_mutex_lock(&pool.lock);
+            slot->in_len = fill.len;
+            slot->state = SLOT_READY;
+            pthread_cond_signal(&pool.ready);
+            pthread_mutex_unlock(&pool.lock);
+            next_read++;
+            continue;
+        }
+        BlockSlot *slot = &pool.slots[next_write % pool.slot_count];
+        pthread_mutex_lock(&pool.lock);
+        while (slot->state != SLOT_DONE)
+            pthread_cond_wait(&pool.done, &pool.lock);
+        slot->state = SLOT_FREE;
+        pthread_mutex_unlock(&pool.lock);
+        if (slot->failed) {
+            report_error("Error compressing %s\n", fs_path);
+            rc = -1;
+        } else if (stats_fwrite(slot->out, 1, slot->out_len, archive) != slot->out_len) {
+            report_perror("Error writing compressed data to archive");
+            rc = -1;
+        } else {
+            sizes[next_write++] = slot->out_len;
+            *data_offset += (long)slot->out_len;
+        }
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+    for (long i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    io_close(&file);
+
+    /* The block table, read back from the end of the payload */
+    BlockTrailer trailer = { BLOCK_SIZE, count };
+    int table_rc = 0;
+    for (uint64_t i = 0; rc == 0 && table_rc == 0 && i < count; i += BLOCK_TABLE_CHUNK) {
+        uint64_t n = count - i < BLOCK_TABLE_CHUNK ? count - i : BLOCK_TABLE_CHUNK;
+        table_rc = write_extra_member(archive, 'Z', &sizes[i], n * sizeof(uint64_t), data_offset);
+    }
+    if (rc == 0 && table_rc == 0)
+        table_rc = write_extra_member(archive, 'T', &trailer, sizeof(trailer), data_offset);
+    if (table_rc != 0) {
+        report_perror("Error writing block table to archive");
+        rc = -1;
+    }
+    stats_phase_end(PHASE_COMPRESS);
+    free(sizes);
+    free(threads);
+    free_pool(&pool);
+    return rc;
+}
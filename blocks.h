@@ -0,0 +1,45 @@
+#ifndef BLOCKS_H
+#define BLOCKS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "structs.h"
+
+/*
+ * Block-parallel compression of large files (-j).
+ *
+ * gzip compresses one file on one core. A dense file of at least
+ * BLOCK_MIN_COUNT blocks is instead cut into BLOCK_SIZE pieces that worker
+ * threads (--threads, default one per CPU) compress at the same time, each
+ * into a gzip member of its own, written back to back (ENTRY_BLOCKS).
+ *
+ * The compressed size of every member follows, BLOCK_TABLE_CHUNK sizes at
+ * a time, in the extra field (subfield "MZ") of empty gzip members, and a
+ * last empty member carries the BlockTrailer (subfield "MT"), like the
+ * block index of BGZF. gzip skips extra fields, so the whole payload is
+ * one valid gzip stream (gzip -d and sequential readers see the content
+ * only). Extraction finds the trailer at a fixed distance from the end,
+ * reads the table and decodes the blocks in parallel (myz_blocks_open).
+ */
+
+#define BLOCK_SIZE (1 << 20)
+#define BLOCK_MIN_COUNT 8
+
+/* Sizes per table member: 8 bytes each, a subfield holds at most 65531 */
+#define BLOCK_TABLE_CHUNK 8191
+/* An empty member holding n bytes of extra data: gzip header, XLEN and subfield header before them */
+#define BLOCK_MEMBER_HEAD 16
+/* After them: the empty deflate block, CRC32 and ISIZE */
+#define BLOCK_MEMBER_TAIL 10
+#define BLOCK_MEMBER_SIZE(n) ((off_t)(n) + BLOCK_MEMBER_HEAD + BLOCK_MEMBER_TAIL)
+
+/* Whether store_file_data() compresses a file of this size in blocks */
+int block_compress_wanted(off_t size);
+
+/*
+ * Compresses [0, size) of a file in blocks, appending the members and the
+ * block table to the archive. Returns 0, or -1 on error.
+ */
+int block_compress_file(const char *fs_path, off_t size, FILE *archive, long *data_offset);
+
+#endif // BLOCKS_H
@@ -5,14 +5,22 @@
 #include <errno.h>
 #include "../structs.h"
 #include "../utils.h"
+#include "../stats.h"
+#include "../io.h"
+#include "../tree_index.h"
+#include "../columns.h"
+#include "../volume.h"
+#include "../dict.h"
+#include "../checkpoint.h"
 #include "c_flag.h"
 
-/* External global flag for compression (declared in myz.c) */
-extern int compress_flag;
-
 void create_archive(const char *archive_name, char *files[], int file_count)
 {
-    FILE *archive = fopen(archive_name, "wb+");
+    /* --resume: the archive is kept, the checkpoint says how much of it is good */
+    int resuming = resume_flag && checkpoint_can_resume(archive_name);
+    if (resume_flag && !resuming)
+        printf("No checkpoint of %s, creating it from the start.\n", archive_name);
+    FILE *archive = io_fopen(archive_name, resuming ? "r+b" : "wb+");
     if (!archive) {
         perror("Error creating archive");
         return;
@@ -20,7 +28,7 @@ void create_archive(const char *archive_name, char *files[], int file_count)
     /* Reserve space for header */
     if (fseek(archive, HEADER_SIZE, SEEK_SET) != 0) {
         perror("fseek error");
-        fclose(archive);
+        io_fclose(archive);
         return;
     }
     long data_offset = HEADER_SIZE;
@@ -28,40 +36,110 @@ void create_archive(const char *archive_name, char *files[], int file_count)
     MetadataArray marr;
     init_metadata_array(&marr);
 
+    /* Multi-volume: traversal only queues the files, the volumes are written afterwards */
+    VolumeWriter *volumes = NULL;
+    if (volume_mode_requested()) {
+        if (catalog_memory_limit) {
+            fprintf(stderr, "--max-memory cannot be combined with multi-volume output\n");
+            io_fclose(archive);
+            free_metadata_array(&marr);
+            return;
+        }
+        volumes = volume_writer_create(archive_name);
+        if (!volumes) {
+            io_fclose(archive);
+            free_metadata_array(&marr);
+            return;
+        }
+        active_volume_writer = volumes;
+    }
+
+    /* --dict: train on a sample of the input and store the dictionary before any data */
+    if (dict_size_option && compress_flag && dict_train(files, file_count, dict_size_option, &archive_dict) == 0) {
+        if (dict_store(archive, &data_offset, &archive_dict) != 0) {
+            dict_free(&archive_dict);
+            volume_writer_free(volumes);
+            io_fclose(archive);
+            free_metadata_array(&marr);
+            return;
+        }
+        printf("Trained a %u byte compression dictionary.\n", archive_dict.size);
+    }
+
+    /* --checkpoint: process_path() journals the catalog as it goes */
+    CreateCheckpoint *checkpoint = NULL;
+    if (checkpoint_interval) {
+        checkpoint = checkpoint_create_begin(archive_name, archive, files, file_count, resuming, &marr, &data_offset);
+        if (!checkpoint) {
+            io_fclose(archive);
+            free_metadata_array(&marr);
+            return;
+        }
+        active_checkpoint = checkpoint;
+    }
+
     /* Process each file/directory */
     for (int i = 0; i < file_count; i++) {
         process_path(files[i], archive, &data_offset, &marr);
     }
+    active_volume_writer = NULL;
+    active_checkpoint = NULL;
+    int run_failed = volumes && volume_writer_run(volumes, archive, &data_offset, &marr) != 0;
+    /* All data is written, the header only needs the dictionary's position */
+    uint32_t dict_size = archive_dict.size;
+    long dict_offset = archive_dict.offset;
+    dict_free(&archive_dict);
+    if (run_failed) {
+        volume_writer_free(volumes);
+        io_fclose(archive);
+        free_metadata_array(&marr);
+        return;
+    }
 
     long metadata_offset = data_offset;
-    /* Write all metadata entries */
-    for (size_t i = 0; i < marr.count; i++) {
-        if (fwrite(&marr.records[i], sizeof(FileMetadata), 1, archive) != 1) {
-            perror("Error writing metadata");
-            fclose(archive);
-            free_metadata_array(&marr);
-            return;
-        }
+    stats_phase_begin(PHASE_METADATA_WRITE);
+    /* Write all metadata entries (spilled records first under --max-memory) */
+    if (write_metadata_array(&marr, archive) != 0) {
+        stats_phase_end(PHASE_METADATA_WRITE);
+        checkpoint_create_end(checkpoint, 0);
+        volume_writer_free(volumes);
+        io_fclose(archive);
+        free_metadata_array(&marr);
+        return;
     }
 
     /* Construct header */
     ArchiveHeader header;
-    header.metadata_count = marr.count;
+    init_archive_header(&header);
+    header.metadata_count = metadata_total(&marr);
     header.metadata_offset = metadata_offset;
-    memset(header.reserved, 0, sizeof(header.reserved));
+    header.dict_size = dict_size;
+    header.dict_offset = dict_offset;
+    write_tree_index(archive, &header);
+    write_columns(archive, &header);
+    if (volumes) {
+        volume_table_write(archive, &header, volume_writer_table(volumes));
+        volume_writer_free(volumes);
+    }
 
     /* Write header at the beginning */
     if (fseek(archive, 0, SEEK_SET) != 0) {
         perror("fseek error");
-        fclose(archive);
+        stats_phase_end(PHASE_METADATA_WRITE);
+        checkpoint_create_end(checkpoint, 0);
+        io_fclose(archive);
         free_metadata_array(&marr);
         return;
     }
-    if (fwrite(&header, 1, HEADER_SIZE, archive) != HEADER_SIZE) {
+    int header_failed = fwrite(&header, 1, HEADER_SIZE, archive) != HEADER_SIZE;
+    if (header_failed) {
         perror("Error writing header");
     }
 
-    fclose(archive);
+    /* The journal goes once the archive is complete on disk */
+    header_failed |= io_fclose(archive) != 0;
+    checkpoint_create_end(checkpoint, !header_failed);
+    stats_phase_end(PHASE_METADATA_WRITE);
     free_metadata_array(&marr);
     printf("Archive %s created successfully.\n", archive_name);
 }
@@ -0,0 +1,738 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "../structs.h"
+#include "../utils.h"
+#include "../stats.h"
+#include "../io.h"
+#include "../pathset.h"
+#include "../libmyz.h"
+#include "catalog_index.h"
+
+/*
+ * Index file layout:
+ *   IndexHeader (64 bytes)
+ *   IndexArchive[archive_count]
+ *   entries, sorted by path then archive id, in blocks of INDEX_BLOCK keys.
+ *     Each entry: shared prefix length with the previous key (1 byte,
+ *     0 for the first key of a block), suffix length (1 byte), suffix,
+ *     IndexRecord. A block can be decoded without the ones before it.
+ *   uint64_t offset of every block, 8-byte aligned at directory_offset
+ * Lookups binary-search the first keys of the blocks and decode forward.
+ */
+#define INDEX_NAME "catalog.myzi"
+#define INDEX_MAGIC "MYZCIDX1"
+#define INDEX_VERSION 2         // 2: hard links carry the size of their content
+#define INDEX_BLOCK 128
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t archive_count;
+    uint64_t entry_count;
+    uint64_t entries_end;       // End of the last block
+    uint64_t block_count;
+    uint64_t directory_offset;
+    uint64_t reserved[2];
+} IndexHeader;
+
+typedef struct {
+    char name[MAX_PATH_LENGTH + 1];     // File name inside the directory
+    int64_t size;                       // Archive file size and mtime when indexed,
+    int64_t mtime_ns;                   // an archive is only re-read when they change
+    uint64_t entries;
+} IndexArchive;
+
+typedef struct {
+    uint32_t archive;           // Position in the archive table
+    uint32_t mode;
+    int64_t size;               // -1 for entries without content
+    int64_t mtime;
+} IndexRecord;
+
+/* A mapped index (or run file) */
+typedef struct {
+    unsigned char *map;
+    size_t size;
+    const IndexHeader *header;
+    const IndexArchive *archives;
+    const uint64_t *blocks;
+} Index;
+
+/* Decodes consecutive entries of an index or run */
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    char key[MAX_PATH_LENGTH + 1];
+    size_t len;
+    IndexRecord record;
+} Cursor;
+
+typedef struct {
+    FILE *out;
+    uint64_t pos;
+    char prev[MAX_PATH_LENGTH + 1];
+    size_t prev_len;
+    uint64_t count;
+    uint64_t *blocks;
+    size_t block_count;
+    size_t block_capacity;
+    int failed;
+} IndexWriter;
+
+static void index_path(char *buf, size_t size, const char *dir, const char *name)
+{
+    snprintf(buf, size, "%s/%s", dir, name);
+}
+
+/* Archive paths are relative, "./etc", "/etc" and "etc" are the same key */
+static const char *strip_prefix(const char *path)
+{
+    for (;;) {
+        if (path[0] == '.' && path[1] == '/')
+            path += 2;
+        else if (path[0] == '/')
+            path++;
+        else
+            return path;
+    }
+}
+
+/* Maps an index. Returns 0, 1 if there is none, 2 if an older version wrote it, -1 if it cannot be used */
+static int index_open(const char *path, Index *index)
+{
+    memset(index, 0, sizeof(*index));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT)
+            return 1;
+        perror("Error opening catalog index");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+        fprintf(stderr, "Invalid catalog index: %s\n", path);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    index->map = map;
+    index->size = (size_t)st.st_size;
+    index->header = map;
+    const IndexHeader *h = index->header;
+    if (memcmp(h->magic, INDEX_MAGIC, 8) == 0 && h->version < INDEX_VERSION) {
+        munmap(map, index->size);
+        memset(index, 0, sizeof(*index));
+        return 2;
+    }
+    uint64_t table_end = sizeof(IndexHeader) + (uint64_t)h->archive_count * sizeof(IndexArchive);
+    if (memcmp(h->magic, INDEX_MAGIC, 8) != 0 || h->version != INDEX_VERSION ||
+        table_end > h->entries_end || h->entries_end > h->directory_offset || h->directory_offset % 8 != 0 ||
+        h->block_count > (index->size - h->directory_offset) / sizeof(uint64_t)) {
+        fprintf(stderr, "Invalid catalog index: %s\n", path);
+        munmap(map, index->size);
+        return -1;
+    }
+    index->archives = (const IndexArchive *)(index->map + sizeof(IndexHeader));
+    index->blocks = (const uint64_t *)(index->map + h->directory_offset);
+    return 0;
+}
+
+static void index_close(Index *index)
+{
+    if (index->map)
+        munmap(index->map, index->size);
+}
+
+static void cursor_init(Cursor *c, const unsigned char *start, const unsigned char *end)
+{
+    c->p = start;
+    c->end = end;
+    c->len = 0;
+    c->key[0] = '\0';
+}
+
+/* Decodes the next entry, returns 0 at the end (or at a damaged entry) */
+static int cursor_next(Cursor *c)
+{
+    if (c->end - c->p < 2)
+        return 0;
+    size_t shared = c->p[0], suffix = c->p[1];
+    if (shared > c->len || shared + suffix > MAX_PATH_LENGTH ||
+        (size_t)(c->end - c->p) < 2 + suffix + sizeof(IndexRecord))
+        return 0;
+    memcpy(c->key + shared, c->p + 2, suffix);
+    c->len = shared + suffix;
+    c->key[c->len] = '\0';
+    memcpy(&c->record, c->p + 2 + suffix, sizeof(IndexRecord));
+    c->p += 2 + suffix + sizeof(IndexRecord);
+    return 1;
+}
+
+static void writer_add(IndexWriter *w, const char *key, const IndexRecord *record)
+{
+    size_t len = strnlen(key, MAX_PATH_LENGTH);
+    size_t shared = 0;
+    if (w->count % INDEX_BLOCK == 0) {
+        if (w->block_count == w->block_capacity) {
+            size_t capacity = w->block_capacity ? w->block_capacity * 2 : 256;
+            uint64_t *grown = realloc(w->blocks, capacity * sizeof(uint64_t));
+            if (!grown) {
+                perror("realloc");
+                w->failed = 1;
+                return;
+            }
+            w->blocks = grown;
+            w->block_capacity = capacity;
+        }
+        w->blocks[w->block_count++] = w->pos;
+    } else {
+        while (shared < len && shared < w->prev_len && key[shared] == w->prev[shared])
+            shared++;
+    }
+    unsigned char lengths[2] = { (unsigned char)shared, (unsigned char)(len - shared) };
+    if (stats_fwrite(lengths, 1, 2, w->out) != 2 ||
+        stats_fwrite(key + shared, 1, len - shared, w->out) != len - shared ||
+        stats_fwrite(record, sizeof(IndexRecord), 1, w->out) != 1)
+        w->failed = 1;
+    w->pos += 2 + (len - shared) + sizeof(IndexRecord);
+    memcpy(w->prev + shared, key + shared, len - shared);
+    w->prev_len = len;
+    w->count++;
+}
+
+/* An archive of the new table, and where its fresh entries are in the run file */
+typedef struct {
+    IndexArchive info;
+    int fresh;                  // Entries come from a run, not from the old index
+    uint64_t run_start;
+    uint64_t run_end;
+} TableEntry;
+
+typedef struct {
+    const char *path;           // Valid while the archive is open
+    IndexRecord record;
+} Pending;
+
+static int cmp_pending(const void *a, const void *b)
+{
+    return strcmp(((const Pending *)a)->path, ((const Pending *)b)->path);
+}
+
+/*
+ * Reads the entries of one archive, sorts them by path and appends them
+ * to the run file. Returns the entry count, or -1 if the archive cannot
+ * be read.
+ */
+static long long write_run(const char *dir, TableEntry *entry, uint32_t id, IndexWriter *runs)
+{
+    char path[PATH_MAX];
+    index_path(path, sizeof(path), dir, entry->info.name);
+    myz_archive *archive;
+    int rc = myz_open(path, &archive);
+    if (rc != MYZ_OK) {
+        print_myz_error(path, rc);
+        return -1;
+    }
+    size_t count = myz_entry_count(archive);
+    Pending *pending = malloc((count ? count : 1) * sizeof(Pending));
+    if (!pending) {
+        perror("malloc");
+        myz_close(archive);
+        return -1;
+    }
+    myz_iter iter;
+    myz_entry e;
+    size_t n = 0;
+    myz_iter_init(&iter, archive);
+    while (myz_iter_next(&iter, &e)) {
+        pending[n].path = strip_prefix(e.path);
+        // Hard links too: e.size is the size of the content, like -l and the extracted file
+        pending[n].record = (IndexRecord){ id, (uint32_t)e.mode, S_ISREG(e.mode) ? (int64_t)e.size : -1,
+                                           (int64_t)e.mtime };
+        n++;
+    }
+    qsort(pending, n, sizeof(Pending), cmp_pending);
+    // Every run starts a block, so its first key is stored whole
+    runs->count = 0;
+    entry->run_start = runs->pos;
+    for (size_t i = 0; i < n; i++)
+        writer_add(runs, pending[i].path, &pending[i].record);
+    entry->run_end = runs->pos;
+    free(pending);
+    myz_close(archive);
+    return runs->failed ? -1 : (long long)n;
+}
+
+/* Sources of the merge: the kept entries of the old index and one run per fresh archive */
+typedef struct {
+    Cursor cursor;
+    const uint32_t *remap;      // Old index: new id of every old archive, UINT32_MAX to drop
+} Source;
+
+static int source_next(Source *s)
+{
+    while (cursor_next(&s->cursor)) {
+        if (!s->remap)
+            return 1;
+        uint32_t id = s->remap[s->cursor.record.archive];
+        if (id != UINT32_MAX) {
+            s->cursor.record.archive = id;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int source_less(const Source *a, const Source *b)
+{
+    int c = strcmp(a->cursor.key, b->cursor.key);
+    return c < 0 || (c == 0 && a->cursor.record.archive < b->cursor.record.archive);
+}
+
+static void heap_down(Source **heap, size_t n, size_t i)
+{
+    for (;;) {
+        size_t least = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && source_less(heap[l], heap[least]))
+            least = l;
+        if (r < n && source_less(heap[r], heap[least]))
+            least = r;
+        if (least == i)
+            return;
+        Source *t = heap[i];
+        heap[i] = heap[least];
+        heap[least] = t;
+        i = least;
+    }
+}
+
+/* Writes the new index: header, table, the k-way merge of all sources and the block directory */
+static int write_index(const char *tmp_path, const TableEntry *table, size_t table_count,
+                       Source *sources, size_t source_count)
+{
+    FILE *out = io_fopen(tmp_path, "wb");
+    if (!out) {
+        perror("Error creating catalog index");
+        return -1;
+    }
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, 8);
+    header.version = INDEX_VERSION;
+    header.archive_count = (uint32_t)table_count;
+    int failed = stats_fwrite(&header, sizeof(header), 1, out) != 1;
+    for (size_t i = 0; i < table_count && !failed; i++)
+        failed = stats_fwrite(&table[i].info, sizeof(IndexArchive), 1, out) != 1;
+
+    IndexWriter w;
+    memset(&w, 0, sizeof(w));
+    w.out = out;
+    w.pos = sizeof(IndexHeader) + table_count * sizeof(IndexArchive);
+    Source **heap = malloc((source_count ? source_count : 1) * sizeof(Source *));
+    size_t n = 0;
+    if (!heap) {
+        perror("malloc");
+        failed = 1;
+    }
+    for (size_t i = 0; !failed && i < source_count; i++) {
+        if (source_next(&sources[i]))
+            heap[n++] = &sources[i];
+    }
+    for (size_t i = n; !failed && i-- > 0;)
+        heap_down(heap, n, i);
+    while (!failed && n > 0) {
+        writer_add(&w, heap[0]->cursor.key, &heap[0]->cursor.record);
+        if (!source_next(heap[0]))
+            heap[0] = heap[--n];
+        heap_down(heap, n, 0);
+        failed = w.failed;
+    }
+    free(heap);
+
+    header.entry_count = w.count;
+    header.entries_end = w.pos;
+    header.block_count = w.block_count;
+    header.directory_offset = (w.pos + 7) & ~(uint64_t)7;
+    static const char zeros[8];
+    if (!failed)
+        failed = stats_fwrite(zeros, 1, header.directory_offset - w.pos, out) != header.directory_offset - w.pos ||
+                 stats_fwrite(w.blocks, sizeof(uint64_t), w.block_count, out) != w.block_count ||
+                 fseek(out, 0, SEEK_SET) != 0 || stats_fwrite(&header, sizeof(header), 1, out) != 1;
+    free(w.blocks);
+    if (io_fclose(out) != 0)
+        failed = 1;
+    if (failed) {
+        perror("Error writing catalog index");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    char name[MAX_PATH_LENGTH + 1];
+    int64_t size;
+    int64_t mtime_ns;
+    long old;                   // Slot in the old index, -1 if new
+} Found;
+
+static int cmp_found(const void *a, const void *b)
+{
+    return strcmp(((const Found *)a)->name, ((const Found *)b)->name);
+}
+
+/* The *.myz files of dir, sorted by name */
+static Found *scan_archives(const char *dir, size_t *count)
+{
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror("Error opening archive directory");
+        return NULL;
+    }
+    Found *found = NULL;
+    size_t n = 0, capacity = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len < 5 || len > MAX_PATH_LENGTH || strcmp(de->d_name + len - 4, ".myz") != 0)
+            continue;
+        struct stat st;
+        char path[PATH_MAX];
+        index_path(path, sizeof(path), dir, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (n == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            Found *grown = realloc(found, capacity * sizeof(Found));
+            if (!grown) {
+                perror("realloc");
+                free(found);
+                closedir(d);
+                return NULL;
+            }
+            found = grown;
+        }
+        memcpy(found[n].name, de->d_name, len + 1);
+        found[n].size = st.st_size;
+        found[n].mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        found[n].old = -1;
+        n++;
+    }
+    closedir(d);
+    if (found)
+        qsort(found, n, sizeof(Found), cmp_found);
+    *count = n;
+    return found ? found : calloc(1, sizeof(Found));
+}
+
+int catalog_index_update(const char *dir)
+{
+    char path[PATH_MAX], tmp_path[PATH_MAX], run_path[PATH_MAX];
+    index_path(path, sizeof(path), dir, INDEX_NAME);
+    index_path(tmp_path, sizeof(tmp_path), dir, INDEX_NAME ".tmp");
+    index_path(run_path, sizeof(run_path), dir, INDEX_NAME ".runs");
+
+    Index old;
+    int rc = index_open(path, &old);
+    if (rc < 0)
+        return -1;
+    if (rc == 2)
+        printf("Catalog index %s is from an older version, rebuilding it.\n", path);
+    uint32_t old_count = rc == 0 ? old.header->archive_count : 0;
+    size_t found_count = 0;
+    Found *found = scan_archives(dir, &found_count);
+    if (!found) {
+        index_close(&old);
+        return -1;
+    }
+
+    /* Match the archives on disk with the slots of the old index */
+    PathSet names = { 0 };
+    int failed = 0;
+    for (uint32_t i = 0; i < old_count && !failed; i++)
+        failed = path_insert(&names, old.archives[i].name, 0, i) != 0;
+    long *slot_found = malloc((old_count ? old_count : 1) * sizeof(long));
+    uint32_t *remap = malloc((old_count ? old_count : 1) * sizeof(uint32_t));
+    TableEntry *table = calloc(found_count ? found_count : 1, sizeof(TableEntry));
+    if (failed || !slot_found || !remap || !table) {
+        perror("malloc");
+        path_set_free(&names);
+        free(slot_found);
+        free(remap);
+        free(table);
+        free(found);
+        index_close(&old);
+        return -1;
+    }
+    for (uint32_t i = 0; i < old_count; i++)
+        slot_found[i] = -1;
+    for (size_t i = 0; i < found_count; i++) {
+        PathSlot *slot = path_find(&names, found[i].name);
+        if (slot) {
+            found[i].old = (long)slot->record;
+            slot_found[slot->record] = (long)i;
+        }
+    }
+    path_set_free(&names);
+
+    /*
+     * New table: the old archives still present keep their order (so old
+     * entries stay sorted after renumbering), new ones follow by name.
+     * Changed and new archives are read into sorted runs.
+     */
+    FILE *run_file = NULL;
+    IndexWriter runs;
+    memset(&runs, 0, sizeof(runs));
+    size_t table_count = 0, added = 0, changed = 0, removed = 0, unreadable = 0;
+    for (size_t pass = 0; pass < 2 && !failed; pass++) {
+        size_t limit = pass == 0 ? old_count : found_count;
+        for (size_t k = 0; k < limit && !failed; k++) {
+            const Found *f;
+            if (pass == 0) {
+                remap[k] = UINT32_MAX;
+                if (slot_found[k] < 0) {
+                    removed++;
+                    continue;
+                }
+                f = &found[slot_found[k]];
+            } else {
+                if (found[k].old >= 0)
+                    continue;
+                f = &found[k];
+            }
+            TableEntry *entry = &table[table_count];
+            memcpy(entry->info.name, f->name, sizeof(entry->info.name));
+            entry->info.size = f->size;
+            entry->info.mtime_ns = f->mtime_ns;
+            if (pass == 0 && old.archives[k].size == f->size && old.archives[k].mtime_ns == f->mtime_ns) {
+                entry->info.entries = old.archives[k].entries;
+                remap[k] = (uint32_t)table_count++;
+                continue;
+            }
+            if (!run_file && !(run_file = io_fopen(run_path, "wb+"))) {
+                perror("Error creating catalog index run file");
+                failed = 1;
+                break;
+            }
+            runs.out = run_file;
+            stats_phase_begin(PHASE_METADATA_READ);
+            long long n = write_run(dir, entry, (uint32_t)table_count, &runs);
+            stats_phase_end(PHASE_METADATA_READ);
+            if (runs.failed) {
+                perror("Error writing catalog index run file");
+                failed = 1;
+            } else if (n < 0) {
+                // Unreadable (or still being written): left out, retried by the next update
+                unreadable++;
+            } else {
+                entry->info.entries = (uint64_t)n;
+                entry->fresh = 1;
+                table_count++;
+                if (pass == 0)
+                    changed++;
+                else
+                    added++;
+            }
+        }
+    }
+    free(slot_found);
+    free(runs.blocks);
+
+    if (!failed && added == 0 && changed == 0 && removed == 0 && rc == 0) {
+        printf("Catalog index of %s is up to date (%zu archives, %llu entries).\n",
+               dir, table_count, (unsigned long long)old.header->entry_count);
+    } else if (!failed) {
+        /* Merge the kept old entries with every run into the new index */
+        Index run_map = { 0 };
+        if (run_file && fflush(run_file) != 0)
+            failed = 1;
+        if (!failed && run_file && runs.pos > 0) {
+            run_map.size = (size_t)runs.pos;
+            void *map = mmap(NULL, run_map.size, PROT_READ, MAP_PRIVATE, fileno(run_file), 0);
+            if (map == MAP_FAILED) {
+                perror("mmap");
+                failed = 1;
+            } else {
+                run_map.map = map;
+            }
+        }
+        Source *sources = calloc(table_count + 1, sizeof(Source));
+        size_t source_count = 0;
+        if (!sources) {
+            perror("calloc");
+            failed = 1;
+        }
+        if (!failed && rc == 0) {
+            cursor_init(&sources[source_count].cursor, old.map + sizeof(IndexHeader) + old_count * sizeof(IndexArchive),
+                        old.map + old.header->entries_end);
+            sources[source_count++].remap = remap;
+        }
+        for (size_t i = 0; !failed && i < table_count; i++) {
+            if (table[i].fresh && table[i].run_end > table[i].run_start)
+                cursor_init(&sources[source_count++].cursor, run_map.map + table[i].run_start,
+                            run_map.map + table[i].run_end);
+        }
+        if (!failed) {
+            stats_phase_begin(PHASE_METADATA_WRITE);
+            failed = write_index(tmp_path, table, table_count, sources, source_count) != 0;
+            stats_phase_end(PHASE_METADATA_WRITE);
+        }
+        if (!failed && rename(tmp_path, path) != 0) {
+            perror("Error replacing catalog index");
+            unlink(tmp_path);
+            failed = 1;
+        }
+        free(sources);
+        index_close(&run_map);
+        if (!failed) {
+            uint64_t entries = 0;
+            for (size_t i = 0; i < table_count; i++)
+                entries += table[i].info.entries;
+            printf("Catalog index of %s: %zu archives (%zu added, %zu changed, %zu removed), %llu entries.\n",
+                   dir, table_count, added, changed, removed, (unsigned long long)entries);
+        }
+    }
+    if (unreadable)
+        fprintf(stderr, "%zu archives could not be read and are not indexed\n", unreadable);
+    if (run_file) {
+        io_fclose(run_file);
+        unlink(run_path);
+    }
+    free(remap);
+    free(table);
+    free(found);
+    index_close(&old);
+    return failed ? -1 : 0;
+}
+
+typedef struct {
+    char *path;
+    const char *archive;
+    IndexRecord record;
+} Match;
+
+static int cmp_matches(const void *a, const void *b)
+{
+    const Match *x = a, *y = b;
+    int c = strcmp(x->path, y->path);
+    return c ? c : strcmp(x->archive, y->archive);
+}
+
+/* Compares the first key of a block with the query */
+static int block_key_cmp(const Index *index, uint64_t block, const char *query, size_t len)
+{
+    const unsigned char *p = index->map + index->blocks[block];
+    size_t key_len = p[1];
+    int c = memcmp(p + 2, query, key_len < len ? key_len : len);
+    if (c != 0)
+        return c;
+    return (key_len > len) - (key_len < len);
+}
+
+int catalog_index_query(const char *dir, char *paths[], int path_count)
+{
+    char path[PATH_MAX];
+    index_path(path, sizeof(path), dir, INDEX_NAME);
+    Index index;
+    int rc = index_open(path, &index);
+    if (rc != 0) {
+        if (rc == 1)
+            fprintf(stderr, "No catalog index in %s, build it with --catalog-index %s\n", dir, dir);
+        else if (rc == 2)
+            fprintf(stderr, "Catalog index in %s is outdated, rebuild it with --catalog-index %s\n", dir, dir);
+        return 2;
+    }
+    const IndexHeader *h = index.header;
+    Match *matches = NULL;
+    size_t count = 0, capacity = 0;
+    int failed = 0;
+    for (int q = 0; q < path_count && !failed; q++) {
+        const char *query = strip_prefix(paths[q]);
+        size_t len = strlen(query);
+        while (len > 0 && query[len - 1] == '/')
+            len--;
+        if (len > MAX_PATH_LENGTH)
+            continue;
+        // Start in the last block whose first key sorts before the query
+        uint64_t lo = 0, hi = h->block_count;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (block_key_cmp(&index, mid, query, len) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (h->block_count == 0)
+            continue;
+        Cursor c;
+        cursor_init(&c, index.map + index.blocks[lo > 0 ? lo - 1 : 0], index.map + h->entries_end);
+        while (cursor_next(&c)) {
+            int cmp = strncmp(c.key, query, len);
+            if (cmp < 0)
+                continue;
+            if (cmp > 0)
+                break;
+            // Same prefix: the path itself or something under it, not "etc/nginx-old"
+            if (c.len != len && c.key[len] != '/' && len > 0)
+                continue;
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                Match *grown = realloc(matches, capacity * sizeof(Match));
+                if (!grown) {
+                    perror("realloc");
+                    failed = 1;
+                    break;
+                }
+                matches = grown;
+            }
+            matches[count].path = strdup(c.key);
+            matches[count].archive = c.record.archive < h->archive_count ? index.archives[c.record.archive].name : "?";
+            matches[count].record = c.record;
+            if (!matches[count].path) {
+                perror("strdup");
+                failed = 1;
+                break;
+            }
+            count++;
+        }
+    }
+    if (!failed) {
+        qsort(matches, count, sizeof(Match), cmp_matches);
+        for (size_t i = 0; i < count; i++) {
+            const Match *m = &matches[i];
+            mode_t mode = (mode_t)m->record.mode;
+            char mode_str[10], mtime[32];
+            mode_to_string(mode, mode_str);
+            char type = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : '-';
+            time_t t = (time_t)m->record.mtime;
+            struct tm tm;
+            strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", localtime_r(&t, &tm));
+            if (m->record.size >= 0)
+                printf("%s %c%s %lld %s %s\n", m->archive, type, mode_str, (long long)m->record.size, mtime, m->path);
+            else
+                printf("%s %c%s - %s %s\n", m->archive, type, mode_str, mtime, m->path);
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+        free(matches[i].path);
+    free(matches);
+    index_close(&index);
+    if (failed)
+        return 2;
+    return count > 0 ? 0 : 1;
+}
@@ -0,0 +1,23 @@
+#ifndef CATALOG_INDEX_H
+#define CATALOG_INDEX_H
+
+/*
+ * Builds or incrementally updates the catalog index of a directory of
+ * archives (DIR/catalog.myzi): every path of every *.myz file in it with
+ * its size, mtime, type and archive, sorted by path in prefix-compressed
+ * blocks. Only archives that are new or whose size or mtime changed are
+ * opened; the entries of the others are carried over from the old index.
+ * Returns 0 on success, -1 on error.
+ */
+int catalog_index_update(const char *dir);
+
+/*
+ * Looks paths up in the index of dir without opening any archive and
+ * prints every version of each path (and of everything under it when it
+ * is a directory): archive, size, mtime and path, ordered by path and
+ * archive name. Returns 0 if something was found, 1 if nothing was, 2 on
+ * error.
+ */
+int catalog_index_query(const char *dir, char *paths[], int path_count);
+
+#endif // CATALOG_INDEX_H
@@ -0,0 +1,478 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "checkpoint.h"
+#include "utils.h"
+#include "pathset.h"
+
+#define BLOCK_MAGIC 0x4b4c424dU     // "MBLK"
+#define CREATE_MAGIC "MYZCKPTc"
+#define EXTRACT_MAGIC "MYZCKPTx"
+#define CHUNK_RECORDS 64
+
+unsigned int checkpoint_interval = 0;
+int resume_flag = 0;
+CreateCheckpoint *active_checkpoint = NULL;
+
+typedef struct {
+    char magic[8];              // CREATE_MAGIC or EXTRACT_MAGIC
+    uint32_t compress;          // -c: -j
+    uint32_t reserved;
+    uint64_t identity;          // -c: hash of the paths given, -x: size of the archive
+    unsigned char archive_header[HEADER_SIZE];  // -x: header of the archive
+} JournalHeader;
+
+/* A block: this, count records (-c) or uint64_t indices (-x), then the CRC of both */
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t count;
+    int64_t data_offset;        // -c: end of the data the records cover
+} JournalBlock;
+
+struct CreateCheckpoint {
+    char path[1024];
+    FILE *file;
+    size_t journaled;           // Records of the catalog already in the journal
+    long data_offset;           // Of the last block
+    struct timespec last;
+    PathSet done;               // Restored paths: hard link original in input, data offset in record
+    int failed;                 // Journal write failed, the run goes on without checkpoints
+};
+
+struct ExtractCheckpoint {
+    char path[1024];
+    FILE *file;
+    unsigned char *done;        // Per catalog index
+    size_t entry_count;
+    int resuming;
+    uint64_t *pending;          // Extracted since the last block
+    size_t pending_count;
+    size_t pending_capacity;
+    struct timespec last;
+    pthread_mutex_t lock;
+    int failed;
+};
+
+static int interval_passed(struct timespec *last)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - last->tv_sec < (time_t)checkpoint_interval)
+        return 0;
+    *last = now;
+    return 1;
+}
+
+static uint64_t hash_paths(char *files[], int file_count)
+{
+    uint64_t h = 1469598103934665603ull;
+    for (int i = 0; i < file_count; i++) {
+        for (const unsigned char *p = (const unsigned char *)files[i]; ; p++) {
+            h = (h ^ *p) * 1099511628211ull;    // The NUL separates the paths
+            if (!*p)
+                break;
+        }
+    }
+    return h;
+}
+
+static int write_header(FILE *file, const JournalHeader *header)
+{
+    if (fwrite(header, sizeof(*header), 1, file) != 1 || fflush(file) != 0 || fdatasync(fileno(file)) != 0) {
+        perror("Error writing checkpoint");
+        return -1;
+    }
+    return 0;
+}
+
+/* Appends payload pieces as one block; the block only counts once its CRC is on disk */
+static int block_begin(FILE *file, uint64_t count, int64_t data_offset, uLong *crc)
+{
+    JournalBlock block = { BLOCK_MAGIC, 0, count, data_offset };
+    *crc = crc32(0L, (const Bytef *)&block, sizeof(block));
+    return fwrite(&block, sizeof(block), 1, file) == 1 ? 0 : -1;
+}
+
+static int block_data(FILE *file, const void *data, size_t size, uLong *crc)
+{
+    if (size == 0)
+        return 0;
+    *crc = crc32(*crc, data, (uInt)size);
+    return fwrite(data, 1, size, file) == size ? 0 : -1;
+}
+
+static int block_end(FILE *file, uLong crc)
+{
+    uint32_t value = (uint32_t)crc;
+    if (fwrite(&value, sizeof(value), 1, file) != 1 || fflush(file) != 0 || fdatasync(fileno(file)) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Reads the next block with a valid CRC, passing its payload in pieces of
+ * at most max items to sink (NULL to only check). Returns 1 for a block, 0
+ * at the end of the journal or at a torn block.
+ */
+static int block_read(FILE *file, size_t item_size, void *buf, size_t max, JournalBlock *block,
+                      void (*sink)(void *ctx, const void *items, size_t n), void *ctx)
+{
+    if (fread(block, sizeof(*block), 1, file) != 1 || block->magic != BLOCK_MAGIC)
+        return 0;
+    uLong crc = crc32(0L, (const Bytef *)block, sizeof(*block));
+    for (uint64_t left = block->count; left > 0;) {
+        size_t n = left < max ? (size_t)left : max;
+        if (fread(buf, item_size, n, file) != n)
+            return 0;
+        crc = crc32(crc, buf, (uInt)(n * item_size));
+        if (sink)
+            sink(ctx, buf, n);
+        left -= n;
+    }
+    uint32_t stored;
+    return fread(&stored, sizeof(stored), 1, file) == 1 && stored == (uint32_t)crc;
+}
+
+/*
+ * Valid blocks of a journal: returns the offset after the last one and the
+ * last block in *last (count 0 if there is none). The items are only passed
+ * to sink in a second pass, so a torn block never adds anything.
+ */
+static long journal_scan(FILE *file, size_t item_size, JournalBlock *last,
+                         void (*sink)(void *ctx, const void *items, size_t n), void *ctx)
+{
+    unsigned char buf[CHUNK_RECORDS * sizeof(FileMetadata)];
+    size_t max = sizeof(buf) / item_size;
+    long start = (long)sizeof(JournalHeader), good = start;
+    JournalBlock block;
+    memset(last, 0, sizeof(*last));
+    fseek(file, start, SEEK_SET);
+    while (block_read(file, item_size, buf, max, &block, NULL, NULL)) {
+        good = ftell(file);
+        *last = block;
+    }
+    fseek(file, start, SEEK_SET);
+    while (ftell(file) < good && block_read(file, item_size, buf, max, &block, sink, ctx))
+        ;
+    return good;
+}
+
+/* Drops a torn block at the end, the next block goes after the valid ones */
+static int journal_cut(FILE *file, long good)
+{
+    if (fflush(file) != 0 || ftruncate(fileno(file), good) != 0 || fseek(file, good, SEEK_SET) != 0) {
+        perror("Error truncating checkpoint");
+        return -1;
+    }
+    return 0;
+}
+
+int checkpoint_can_resume(const char *archive_name)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.ckpt", archive_name);
+    return access(path, F_OK) == 0;
+}
+
+typedef struct {
+    CreateCheckpoint *cp;
+    MetadataArray *marr;
+    int failed;
+} RestoreContext;
+
+static void restore_records(void *ctx, const void *items, size_t n)
+{
+    RestoreContext *rc = ctx;
+    const FileMetadata *records = items;
+    for (size_t i = 0; i < n && !rc->failed; i++) {
+        add_metadata(rc->marr, &records[i]);
+        char *path = strdup(records[i].path);
+        int original = S_ISREG(records[i].mode) && !records[i].is_hardlink;
+        if (!path || path_insert(&rc->cp->done, path, original, (size_t)records[i].data_offset) != 0) {
+            free(path);
+            rc->failed = 1;
+        }
+    }
+}
+
+static void free_done(PathSet *done)
+{
+    for (size_t i = 0; i < done->capacity; i++)
+        free((char *)done->slots[i].path);
+    path_set_free(done);
+}
+
+CreateCheckpoint *checkpoint_create_begin(const char *archive_name, FILE *archive, char *files[], int file_count,
+                                          int resume, MetadataArray *marr, long *data_offset)
+{
+    CreateCheckpoint *cp = calloc(1, sizeof(CreateCheckpoint));
+    if (!cp) {
+        perror("calloc");
+        return NULL;
+    }
+    snprintf(cp->path, sizeof(cp->path), "%s.ckpt", archive_name);
+    clock_gettime(CLOCK_MONOTONIC, &cp->last);
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CREATE_MAGIC, sizeof(header.magic));
+    header.compress = (uint32_t)compress_flag;
+    header.identity = hash_paths(files, file_count);
+    if (!resume) {
+        cp->file = fopen(cp->path, "wb");
+        if (!cp->file || write_header(cp->file, &header) != 0) {
+            perror(cp->path);
+            if (cp->file)
+                fclose(cp->file);
+            free(cp);
+            return NULL;
+        }
+        cp->data_offset = *data_offset;
+        return cp;
+    }
+
+    cp->file = fopen(cp->path, "r+b");
+    JournalHeader stored;
+    if (!cp->file || fread(&stored, sizeof(stored), 1, cp->file) != 1 ||
+        memcmp(stored.magic, header.magic, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s: not a checkpoint of -c\n", cp->path);
+        if (cp->file)
+            fclose(cp->file);
+        free(cp);
+        return NULL;
+    }
+    if (stored.compress != header.compress || stored.identity != header.identity) {
+        fprintf(stderr, "%s was written by another command line: resume with the same paths and -j\n", cp->path);
+        fclose(cp->file);
+        free(cp);
+        return NULL;
+    }
+    JournalBlock last;
+    RestoreContext ctx = { cp, marr, 0 };
+    long good = journal_scan(cp->file, sizeof(FileMetadata), &last, restore_records, &ctx);
+    if (ctx.failed || journal_cut(cp->file, good) != 0) {
+        if (ctx.failed)
+            perror("Error restoring checkpoint");
+        checkpoint_create_end(cp, 0);
+        return NULL;
+    }
+    /* The data after the checkpoint may be torn: it is written again */
+    if (good > (long)sizeof(JournalHeader))
+        *data_offset = (long)last.data_offset;
+    if (fflush(archive) != 0 || ftruncate(fileno(archive), *data_offset) != 0 ||
+        fseek(archive, *data_offset, SEEK_SET) != 0) {
+        perror("Error cutting the archive back to the checkpoint");
+        checkpoint_create_end(cp, 0);
+        return NULL;
+    }
+    cp->journaled = metadata_total(marr);
+    cp->data_offset = *data_offset;
+    printf("Resuming %s: %zu entries and %ld bytes from the checkpoint.\n", archive_name, cp->journaled,
+           *data_offset);
+    return cp;
+}
+
+int checkpoint_restored(CreateCheckpoint *cp, const char *path, const struct stat *st, MetadataArray *marr)
+{
+    const PathSlot *slot = path_find(&cp->done, path);
+    if (!slot)
+        return 0;
+    if (slot->input && S_ISREG(st->st_mode) && st->st_nlink > 1)
+        inode_index_add(&marr->links, st->st_dev, st->st_ino, (long)slot->record);
+    return 1;
+}
+
+/* The records added since the last block: spilled ones first, then the ones in memory */
+static int journal_records(CreateCheckpoint *cp, MetadataArray *marr, uLong *crc)
+{
+    if (cp->journaled < marr->spilled) {
+        FileMetadata chunk[CHUNK_RECORDS];
+        if (fflush(marr->spill) != 0 ||
+            fseek(marr->spill, (long)(cp->journaled * sizeof(FileMetadata)), SEEK_SET) != 0)
+            return -1;
+        for (size_t i = cp->journaled; i < marr->spilled;) {
+            size_t n = marr->spilled - i < CHUNK_RECORDS ? marr->spilled - i : CHUNK_RECORDS;
+            if (fread(chunk, sizeof(FileMetadata), n, marr->spill) != n ||
+                block_data(cp->file, chunk, n * sizeof(FileMetadata), crc) != 0)
+                return -1;
+            i += n;
+        }
+    }
+    size_t first = cp->journaled > marr->spilled ? cp->journaled - marr->spilled : 0;
+    return block_data(cp->file, marr->records + first, (marr->count - first) * sizeof(FileMetadata), crc);
+}
+
+void checkpoint_tick(CreateCheckpoint *cp, FILE *archive, long data_offset, MetadataArray *marr)
+{
+    if (cp->failed || !interval_passed(&cp->last))
+        return;
+    size_t total = metadata_total(marr);
+    if (total == cp->journaled && data_offset == cp->data_offset)
+        return;
+    /* The records may only point at data that is on disk */
+    uLong crc;
+    if (fflush(archive) != 0 || fdatasync(fileno(archive)) != 0 ||
+        block_begin(cp->file, total - cp->journaled, data_offset, &crc) != 0 ||
+        journal_records(cp, marr, &crc) != 0 || block_end(cp->file, crc) != 0) {
+        perror("Error writing checkpoint, continuing without");
+        cp->failed = 1;
+        return;
+    }
+    cp->journaled = total;
+    cp->data_offset = data_offset;
+}
+
+void checkpoint_create_end(CreateCheckpoint *cp, int complete)
+{
+    if (!cp)
+        return;
+    if (cp->file)
+        fclose(cp->file);
+    if (complete)
+        remove(cp->path);
+    free_done(&cp->done);
+    free(cp);
+}
+
+/* Extract */
+
+static void restore_indices(void *ctx, const void *items, size_t n)
+{
+    ExtractCheckpoint *cp = ctx;
+    const uint64_t *indices = items;
+    for (size_t i = 0; i < n; i++) {
+        if (indices[i] < cp->entry_count)
+            cp->done[indices[i]] = 1;
+    }
+}
+
+ExtractCheckpoint *checkpoint_extract_begin(const char *archive_name, size_t entry_count, int resume)
+{
+    ExtractCheckpoint *cp = calloc(1, sizeof(ExtractCheckpoint));
+    if (!cp) {
+        perror("calloc");
+        return NULL;
+    }
+    char name[1024];
+    snprintf(name, sizeof(name), "%s", archive_name);
+    snprintf(cp->path, sizeof(cp->path), ".%s.xckpt", basename(name));
+    cp->entry_count = entry_count;
+    cp->done = calloc(entry_count ? entry_count : 1, 1);
+    pthread_mutex_init(&cp->lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &cp->last);
+    /* The journal belongs to this archive as it is: same size and header */
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EXTRACT_MAGIC, sizeof(header.magic));
+    FILE *archive = fopen(archive_name, "rb");
+    int identified = archive && fread(header.archive_header, HEADER_SIZE, 1, archive) == 1 &&
+                     fseek(archive, 0, SEEK_END) == 0;
+    if (identified)
+        header.identity = (uint64_t)ftell(archive);
+    if (archive)
+        fclose(archive);
+    if (!cp->done || !identified) {
+        perror(cp->done ? archive_name : "calloc");
+        checkpoint_extract_end(cp, 0);
+        return NULL;
+    }
+    if (resume && access(cp->path, F_OK) == 0) {
+        cp->file = fopen(cp->path, "r+b");
+        JournalHeader stored;
+        if (!cp->file || fread(&stored, sizeof(stored), 1, cp->file) != 1 ||
+            memcmp(&stored, &header, sizeof(header)) != 0) {
+            fprintf(stderr, "%s does not belong to %s as it is now, extract it again without --resume\n", cp->path,
+                    archive_name);
+            checkpoint_extract_end(cp, 0);
+            return NULL;
+        }
+        JournalBlock last;
+        long good = journal_scan(cp->file, sizeof(uint64_t), &last, restore_indices, cp);
+        if (journal_cut(cp->file, good) != 0) {
+            checkpoint_extract_end(cp, 0);
+            return NULL;
+        }
+        cp->resuming = 1;
+        return cp;
+    }
+    cp->file = fopen(cp->path, "wb");
+    if (!cp->file || write_header(cp->file, &header) != 0) {
+        perror(cp->path);
+        checkpoint_extract_end(cp, 0);
+        return NULL;
+    }
+    return cp;
+}
+
+int checkpoint_extract_resuming(const ExtractCheckpoint *cp)
+{
+    return cp->resuming;
+}
+
+int checkpoint_extract_done(const ExtractCheckpoint *cp, size_t index)
+{
+    return index < cp->entry_count && cp->done[index];
+}
+
+/* Under the lock: the extracted files have to be on disk before the block says so */
+static void flush_pending(ExtractCheckpoint *cp)
+{
+    if (cp->failed || cp->pending_count == 0)
+        return;
+    sync();
+    uLong crc;
+    if (block_begin(cp->file, cp->pending_count, 0, &crc) != 0 ||
+        block_data(cp->file, cp->pending, cp->pending_count * sizeof(uint64_t), &crc) != 0 ||
+        block_end(cp->file, crc) != 0) {
+        perror("Error writing checkpoint, continuing without");
+        cp->failed = 1;
+        return;
+    }
+    cp->pending_count = 0;
+}
+
+void checkpoint_extract_mark(ExtractCheckpoint *cp, size_t index)
+{
+    pthread_mutex_lock(&cp->lock);
+    if (cp->pending_count == cp->pending_capacity) {
+        size_t capacity = cp->pending_capacity ? cp->pending_capacity * 2 : 1024;
+        uint64_t *grown = realloc(cp->pending, capacity * sizeof(uint64_t));
+        if (!grown) {
+            perror("realloc");
+            cp->failed = 1;
+            pthread_mutex_unlock(&cp->lock);
+            return;
+        }
+        cp->pending = grown;
+        cp->pending_capacity = capacity;
+    }
+    cp->pending[cp->pending_count++] = index;
+    if (interval_passed(&cp->last))
+        flush_pending(cp);
+    pthread_mutex_unlock(&cp->lock);
+}
+
+void checkpoint_extract_end(ExtractCheckpoint *cp, int complete)
+{
+    if (!cp)
+        return;
+    if (cp->file) {
+        if (!complete)
+            flush_pending(cp);
+        fclose(cp->file);
+        if (complete)
+            remove(cp->path);
+    }
+    pthread_mutex_destroy(&cp->lock);
+    free(cp->pending);
+    free(cp->done);
+    free(cp);
+}
@@ -0,0 +1,76 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "structs.h"
+
+/*
+ * Checkpoints of long -c and -x runs (--checkpoint, --resume). A journal
+ * next to the output gets a block every checkpoint_interval seconds, once
+ * the data it covers is on disk:
+ *
+ *   -c: <archive>.ckpt, the catalog records added since the last block and
+ *       the archive offset the data reached. --resume restores the
+ *       catalog, cuts the archive back to that offset and walks the tree
+ *       again, skipping the paths already stored.
+ *   -x: .<archive name>.xckpt in the current directory, the catalog indices
+ *       of the entries extracted since the last block. --resume skips them
+ *       and replaces what the interrupted run left of the others.
+ *
+ * Every block carries a CRC, so a block torn by the crash is ignored and
+ * the run resumes from the one before. The journal is removed when the run
+ * completes.
+ */
+
+#define CHECKPOINT_DEFAULT_INTERVAL 60
+
+extern unsigned int checkpoint_interval;    // --checkpoint[=SECONDS], 0 when off
+extern int resume_flag;                     // --resume
+
+typedef struct CreateCheckpoint CreateCheckpoint;
+typedef struct ExtractCheckpoint ExtractCheckpoint;
+
+/* The create being checkpointed, process_path() reports to it */
+extern CreateCheckpoint *active_checkpoint;
+
+/* Whether archive_name has a create journal to resume from */
+int checkpoint_can_resume(const char *archive_name);
+
+/*
+ * Starts the journal of a create over files. With resume, the records of
+ * the journal go into marr and *data_offset is where the archive was cut
+ * back to (the archive must be open for update). NULL on error.
+ */
+CreateCheckpoint *checkpoint_create_begin(const char *archive_name, FILE *archive, char *files[], int file_count,
+                                          int resume, MetadataArray *marr, long *data_offset);
+
+/*
+ * process_path(): whether path was stored before the interruption. Its
+ * directory is walked again all the same; a restored original of hard
+ * links goes back into the inode index of marr.
+ */
+int checkpoint_restored(CreateCheckpoint *cp, const char *path, const struct stat *st, MetadataArray *marr);
+
+/* process_path(): writes a block when the interval has passed */
+void checkpoint_tick(CreateCheckpoint *cp, FILE *archive, long data_offset, MetadataArray *marr);
+
+/* Ends the journal, removing it when the archive is complete */
+void checkpoint_create_end(CreateCheckpoint *cp, int complete);
+
+/* Starts the journal of an extract of archive_name (with resume, reads the entries done). NULL on error */
+ExtractCheckpoint *checkpoint_extract_begin(const char *archive_name, size_t entry_count, int resume);
+
+/* Whether the journal came from an interrupted run (not a fresh one) */
+int checkpoint_extract_resuming(const ExtractCheckpoint *cp);
+
+/* Whether the entry was extracted before the interruption */
+int checkpoint_extract_done(const ExtractCheckpoint *cp, size_t index);
+
+/* Records an extracted entry (thread-safe), writes a block when the interval has passed */
+void checkpoint_extract_mark(ExtractCheckpoint *cp, size_t index);
+
+void checkpoint_extract_end(ExtractCheckpoint *cp, int complete);
+
+#endif // CHECKPOINT_H
@@ -0,0 +1,127 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "columns.h"
+#include "utils.h"
+#include "stats.h"
+
+#define READ_CHUNK 4096
+
+/* All five arrays in one allocation, the 8-byte columns first */
+static int columns_alloc(Columns *cols, size_t count)
+{
+    memset(cols, 0, sizeof(*cols));
+    size_t n = count ? count : 1;
+    char *block = malloc(n * (2 * sizeof(int64_t) + 3 * sizeof(uint32_t)));
+    if (!block) {
+        report_perror("malloc");
+        return -1;
+    }
+    cols->count = count;
+    cols->size = (int64_t *)block;
+    cols->mtime = cols->size + n;
+    cols->uid = (uint32_t *)(cols->mtime + n);
+    cols->gid = cols->uid + n;
+    cols->mode = cols->gid + n;
+    return 0;
+}
+
+void columns_free(Columns *cols)
+{
+    free(cols->size);
+    memset(cols, 0, sizeof(*cols));
+}
+
+/* One pass over the metadata block */
+static int columns_build(FILE *archive, const ArchiveHeader *header, Columns *cols)
+{
+    if (columns_alloc(cols, header->metadata_count) != 0)
+        return -1;
+    FileMetadata *chunk = malloc(READ_CHUNK * sizeof(FileMetadata));
+    if (!chunk) {
+        report_perror("malloc");
+        columns_free(cols);
+        return -1;
+    }
+    MetadataReader reader;
+    metadata_reader_init(&reader, archive, header);
+    size_t n, base = 0;
+    while ((n = metadata_reader_next(&reader, chunk, READ_CHUNK)) > 0) {
+        for (size_t j = 0; j < n; j++) {
+            const FileMetadata *meta = &chunk[j];
+            cols->size[base + j] = S_ISREG(meta->mode) ? (int64_t)meta->logical_size : 0;
+            cols->mtime[base + j] = (int64_t)meta->mtime;
+            cols->uid[base + j] = (uint32_t)meta->uid;
+            cols->gid[base + j] = (uint32_t)meta->gid;
+            cols->mode[base + j] = (uint32_t)meta->mode;
+        }
+        base += n;
+    }
+    free(chunk);
+    if (base != cols->count) {
+        report_error("Error reading metadata block\n");
+        columns_free(cols);
+        return -1;
+    }
+    return 0;
+}
+
+int write_columns(FILE *archive, ArchiveHeader *header)
+{
+    header->column_offset = 0;
+    long offset = header->tree_offset ? ftell(archive)
+                                      : header->metadata_offset + (long)header->metadata_count * (long)sizeof(FileMetadata);
+    if (offset < 0 || fflush(archive) != 0) {
+        report_perror("ftell error");
+        return -1;
+    }
+    Columns cols;
+    if (columns_build(archive, header, &cols) != 0)
+        return -1;
+    size_t count = cols.count;
+    ColumnHeader ch = { count, COLUMN_COUNT, 0 };
+    int rc = 0;
+    if (fseek(archive, offset, SEEK_SET) != 0 ||
+        stats_fwrite(&ch, sizeof(ch), 1, archive) != 1 ||
+        stats_fwrite(cols.size, sizeof(int64_t), count, archive) != count ||
+        stats_fwrite(cols.mtime, sizeof(int64_t), count, archive) != count ||
+        stats_fwrite(cols.uid, sizeof(uint32_t), count, archive) != count ||
+        stats_fwrite(cols.gid, sizeof(uint32_t), count, archive) != count ||
+        stats_fwrite(cols.mode, sizeof(uint32_t), count, archive) != count) {
+        report_perror("Error writing column section");
+        rc = -1;
+    } else {
+        header->column_offset = offset;
+    }
+    columns_free(&cols);
+    return rc;
+}
+
+int columns_read(FILE *archive, const ArchiveHeader *header, Columns *cols)
+{
+    if (header->column_offset == 0)
+        return columns_build(archive, header, cols);
+    ColumnHeader ch;
+    if (fseek(archive, header->column_offset, SEEK_SET) != 0 ||
+        stats_fread(&ch, sizeof(ch), 1, archive) != 1) {
+        report_perror("Error reading column section");
+        return -1;
+    }
+    // A section from another catalog (or a newer layout) is rebuilt from the records
+    if (ch.count != header->metadata_count || ch.columns != COLUMN_COUNT)
+        return columns_build(archive, header, cols);
+    if (columns_alloc(cols, ch.count) != 0)
+        return -1;
+    size_t count = cols->count;
+    if (stats_fread(cols->size, sizeof(int64_t), count, archive) != count ||
+        stats_fread(cols->mtime, sizeof(int64_t), count, archive) != count ||
+        stats_fread(cols->uid, sizeof(uint32_t), count, archive) != count ||
+        stats_fread(cols->gid, sizeof(uint32_t), count, archive) != count ||
+        stats_fread(cols->mode, sizeof(uint32_t), count, archive) != count) {
+        report_perror("Error reading column section");
+        columns_free(cols);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef COLUMNS_H
+#define COLUMNS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "structs.h"
+
+/* In-memory copy of the columnar catalog section, one element per record */
+typedef struct {
+    size_t count;
+    int64_t *size;              // Logical size, -1 if unknown
+    int64_t *mtime;
+    uint32_t *uid;
+    uint32_t *gid;
+    uint32_t *mode;
+} Columns;
+
+/*
+ * Builds the columns from the metadata block described by header and
+ * writes them at the current position, which must be right after the tree
+ * index (or at the end of the metadata block if there is none). On success
+ * sets header->column_offset and returns 0, otherwise leaves it at 0.
+ */
+int write_columns(FILE *archive, ArchiveHeader *header);
+
+/* Loads the column section, or builds the columns from the records of archives without one */
+int columns_read(FILE *archive, const ArchiveHeader *header, Columns *cols);
+void columns_free(Columns *cols);
+
+#endif // COLUMNS_H
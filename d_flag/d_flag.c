@@ -8,83 +8,105 @@
 #include <sys/stat.h>
 #include "../structs.h"
 #include "../utils.h"
+#include "../stats.h"
+#include "../io.h"
+#include "../filter.h"
+#include "../tree_index.h"
+#include "../columns.h"
+#include "../volume.h"
+#include "../dict.h"
+#include "../segment.h"
 #include "d_flag.h"
 
+static int archive_fd(void *ctx, uint32_t volume)
+{
+    (void)volume;       // Only volume 0 is compacted
+    return fileno((FILE *)ctx);
+}
+
 void delete_entities(const char *archive_name, char *del_list[], int del_count)
 {
-    FILE *orig = fopen(archive_name, "rb");
+    FILE *orig = io_fopen(archive_name, "rb");
     if (!orig) {
         perror("Error opening archive for deletion");
         return;
     }
     ArchiveHeader header;
-    if (fread(&header, 1, HEADER_SIZE, orig) != HEADER_SIZE) {
-        perror("Error reading header");
-        fclose(orig);
+    if (read_archive_header(orig, &header) != 0) {
+        io_fclose(orig);
         return;
     }
+    stats_phase_begin(PHASE_METADATA_READ);
     size_t meta_count = header.metadata_count;
-    FileMetadata *metas = malloc(meta_count * sizeof(FileMetadata));
+    FileMetadata *metas = read_metadata_block(orig, &header);
     if (!metas) {
-        perror("malloc");
-        fclose(orig);
+        io_fclose(orig);
         return;
     }
-    if (fseek(orig, header.metadata_offset, SEEK_SET) != 0) {
-        perror("fseek error");
+    stats_phase_end(PHASE_METADATA_READ);
+    /* Data in the other volumes of a multi-volume archive stays where it is */
+    VolumeTable volumes;
+    if (volume_table_read(orig, &header, &volumes) != 0) {
         free(metas);
-        fclose(orig);
+        io_fclose(orig);
         return;
     }
-    if (fread(metas, sizeof(FileMetadata), meta_count, orig) != meta_count) {
-        perror("Error reading metadata");
+    /* Exact paths, subpaths ("dir" -> "dir/file") and globs; --exclude protects entries */
+    PathFilter *path_filter = filter_compile(del_list, del_count, 0);
+    unsigned char *keep = malloc(meta_count ? meta_count : 1);
+    if (!path_filter || !keep) {
+        if (!keep)
+            perror("malloc");
+        filter_free(path_filter);
+        free(keep);
         free(metas);
-        fclose(orig);
+        volume_table_free(&volumes);
+        io_fclose(orig);
         return;
     }
-    /* Filter out the entries to delete */
-    FileMetadata *new_metas = malloc(meta_count * sizeof(FileMetadata));
-    if (!new_metas) {
-        perror("malloc");
+    for (size_t i = 0; i < meta_count; i++)
+        keep[i] = !filter_match(path_filter, metas[i].path);
+    filter_free(path_filter);
+
+    /* Surviving data, in archive order; only the archive file itself is compacted */
+    size_t seg_count;
+    Segment *segs = segments_build(metas, meta_count, &seg_count);
+    if (!segs) {
+        free(keep);
         free(metas);
-        fclose(orig);
+        volume_table_free(&volumes);
+        io_fclose(orig);
         return;
     }
-    size_t new_count = 0;
-    for (size_t i = 0; i < meta_count; i++) {
-        int to_delete = 0;
-        for (int j = 0; j < del_count; j++) {
-            size_t len = strlen(del_list[j]);
-            /* If exactly the same path or a subpath (like "dir" -> "dir/file") */
-            if (strcmp(metas[i].path, del_list[j]) == 0 ||
-                (strncmp(metas[i].path, del_list[j], len) == 0 &&
-                 (metas[i].path[len] == '/' || metas[i].path[len] == '\0'))) {
-                to_delete = 1;
-                break;
-            }
-        }
-        if (!to_delete) {
-            new_metas[new_count++] = metas[i];
-        }
+    segments_keep_bases(segs, seg_count, metas, meta_count, keep);
+    segments_mark_live(segs, seg_count, metas, meta_count, keep);
+    for (size_t i = 0; i < seg_count; i++) {
+        if (segs[i].volume != 0)
+            segs[i].live = 0;
     }
-    free(metas);
 
     /* Create a temporary archive file */
     char temp_archive_name[] = "temp_archiveXXXXXX";
     int temp_fd = mkstemp(temp_archive_name);
     if (temp_fd == -1) {
         perror("mkstemp error");
-        free(new_metas);
-        fclose(orig);
+        free(segs);
+        free(keep);
+        free(metas);
+        volume_table_free(&volumes);
+        io_fclose(orig);
         return;
     }
-    FILE *temp_archive = fdopen(temp_fd, "wb+");
+    FILE *temp_archive = io_fdopen(temp_fd, "wb+");
     if (!temp_archive) {
         perror("fdopen error");
         close(temp_fd);
         remove(temp_archive_name);
-        free(new_metas);
-        fclose(orig);
+        free(segs);
+        free(keep);
+        free(metas);
+        volume_table_free(&volumes);
+        io_fclose(orig);
         return;
     }
     /* Write placeholder header */
@@ -92,61 +114,91 @@ void delete_entities(const char *archive_name, char *del_list[], int del_count)
     memset(header_placeholder, 0, HEADER_SIZE);
     if (fwrite(header_placeholder, 1, HEADER_SIZE, temp_archive) != HEADER_SIZE) {
         perror("Error writing placeholder header");
-        fclose(temp_archive);
+        io_fclose(temp_archive);
         remove(temp_archive_name);
-        free(new_metas);
-        fclose(orig);
+        free(segs);
+        free(keep);
+        free(metas);
+        volume_table_free(&volumes);
+        io_fclose(orig);
         return;
     }
     long new_data_offset = HEADER_SIZE;
+    /* The compressed entries still need the dictionary, it moves to the new data area */
+    Dictionary dict;
+    if (dict_read(orig, &header, &dict) != 0 ||
+        (dict.size && dict_store(temp_archive, &new_data_offset, &dict) != 0)) {
+        dict_free(&dict);
+        io_fclose(temp_archive);
+        remove(temp_archive_name);
+        free(segs);
+        free(keep);
+        free(metas);
+        volume_table_free(&volumes);
+        io_fclose(orig);
+        return;
+    }
+    stats_phase_begin(PHASE_COPY);
     /* Copy file data for the remaining entries */
-    for (size_t i = 0; i < new_count; i++) {
-        if (S_ISREG(new_metas[i].mode)) {
-            if (fseek(orig, new_metas[i].data_offset, SEEK_SET) != 0) {
-                perror("fseek error in original archive");
-                continue;
-            }
-            size_t remaining = (size_t)new_metas[i].size;
-            char buffer[1024];
-            while (remaining > 0) {
-                size_t chunk = (remaining < sizeof(buffer)) ? remaining : sizeof(buffer);
-                size_t r = fread(buffer, 1, chunk, orig);
-                if (r != chunk) {
-                    perror("Error reading file data from original archive");
-                    break;
-                }
-                if (fwrite(buffer, 1, r, temp_archive) != r) {
-                    perror("Error writing file data to new archive");
-                    break;
-                }
-                remaining -= r;
-            }
-            new_metas[i].data_offset = new_data_offset;
-            new_data_offset += new_metas[i].size;
-        } else {
-            new_metas[i].data_offset = 0;
-        }
+    fflush(temp_archive);
+    int rc = segments_copy(segs, seg_count, archive_fd, orig, fileno(temp_archive), &new_data_offset);
+    stats_phase_end(PHASE_COPY);
+    if (rc != 0) {
+        io_fclose(temp_archive);
+        remove(temp_archive_name);
+        dict_free(&dict);
+        free(segs);
+        free(keep);
+        free(metas);
+        volume_table_free(&volumes);
+        io_fclose(orig);
+        return;
     }
+    stats_phase_begin(PHASE_METADATA_WRITE);
     /* Write the updated metadata */
-    for (size_t i = 0; i < new_count; i++) {
-        if (fwrite(&new_metas[i], sizeof(FileMetadata), 1, temp_archive) != 1) {
+    if (fseek(temp_archive, new_data_offset, SEEK_SET) != 0)
+        perror("fseek error");
+    size_t new_count = 0;
+    for (size_t i = 0; i < meta_count; i++) {
+        if (!keep[i])
+            continue;
+        FileMetadata meta = metas[i];
+        if (S_ISREG(meta.mode))
+            segment_rebase(segs, seg_count, metas, &meta);
+        else
+            meta.data_offset = 0;
+        stats_count_entry(meta.mode, meta.is_hardlink);
+        if (stats_fwrite(&meta, sizeof(FileMetadata), 1, temp_archive) != 1) {
             perror("Error writing new metadata");
         }
+        new_count++;
     }
+    free(segs);
+    free(keep);
+    free(metas);
     /* Create new header */
     ArchiveHeader new_header;
+    init_archive_header(&new_header);
     new_header.metadata_count = new_count;
     new_header.metadata_offset = new_data_offset;
-    memset(new_header.reserved, 0, sizeof(new_header.reserved));
+    new_header.dict_size = dict.size;
+    new_header.dict_offset = dict.offset;
+    dict_free(&dict);
+    write_tree_index(temp_archive, &new_header);
+    write_columns(temp_archive, &new_header);
+    if (volumes.count > 0)
+        volumes.entries[0].size = (uint64_t)(new_data_offset - HEADER_SIZE);
+    volume_table_write(temp_archive, &new_header, &volumes);
+    volume_table_free(&volumes);
     if (fseek(temp_archive, 0, SEEK_SET) != 0) {
         perror("fseek error while writing new header");
     }
     if (fwrite(&new_header, 1, HEADER_SIZE, temp_archive) != HEADER_SIZE) {
         perror("Error writing new header");
     }
-    fclose(temp_archive);
-    free(new_metas);
-    fclose(orig);
+    stats_phase_end(PHASE_METADATA_WRITE);
+    io_fclose(temp_archive);
+    io_fclose(orig);
 
     /* Replace original archive with the new one */
     if (rename(temp_archive_name, archive_name) != 0) {
@@ -0,0 +1,596 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../structs.h"
+#include "../utils.h"
+#include "../pathset.h"
+#include "../libmyz.h"
+#include "daemon.h"
+
+#define REQUEST_MAX 65536       // Longest request line
+#define MAX_FIELDS 4096
+#define NO_ENTRY SIZE_MAX
+#define READ_BUFFER 65536
+
+const char *daemon_socket = NULL;
+const char *request_socket = NULL;
+
+/*
+ * A cached catalog: the open archive (its metadata block in memory), a hash
+ * of its current paths and the children of every directory. It is valid
+ * as long as the file's identity, mtime, size and header are the same.
+ */
+typedef struct Catalog {
+    char key[PATH_MAX];         // realpath() of the archive
+    myz_archive *archive;
+    PathSet index;              // Current paths, record in PathSlot.record
+    size_t *first_child;        // Per record, NO_ENTRY for none
+    size_t *next_sibling;
+    size_t first_root;          // Entries without an archived parent
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    unsigned char header[HEADER_SIZE];
+    size_t bytes;               // Estimated memory, for the cache limit
+    int refs;                   // Requests using it, it is only freed at 0
+    int stale;                  // Out of the cache, freed by its last user
+    unsigned long long used;    // LRU clock
+    struct Catalog *next;
+} Catalog;
+
+static struct {
+    pthread_mutex_t lock;
+    Catalog *head;
+    size_t bytes;
+    size_t limit;
+    unsigned long long clock;
+} cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 };
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+/* Identity of the archive file: stat and its header, what a rewrite changes */
+static int read_identity(const char *path, struct stat *st, unsigned char header[HEADER_SIZE])
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    int rc = fstat(fd, st) == 0 && pread(fd, header, HEADER_SIZE, 0) == HEADER_SIZE ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+static int same_identity(const Catalog *c, const struct stat *st, const unsigned char header[HEADER_SIZE])
+{
+    return c->dev == st->st_dev && c->ino == st->st_ino && c->size == st->st_size &&
+           c->mtime.tv_sec == st->st_mtim.tv_sec && c->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           memcmp(c->header, header, HEADER_SIZE) == 0;
+}
+
+static void catalog_free(Catalog *c)
+{
+    path_set_free(&c->index);
+    free(c->first_child);
+    free(c->next_sibling);
+    myz_close(c->archive);
+    free(c);
+}
+
+static Catalog *catalog_load(const char *key, const char **error)
+{
+    Catalog *c = calloc(1, sizeof(Catalog));
+    if (!c) {
+        *error = "out of memory";
+        return NULL;
+    }
+    snprintf(c->key, sizeof(c->key), "%s", key);
+    struct stat st;
+    if (read_identity(key, &st, c->header) != 0) {
+        *error = strerror(errno);
+        free(c);
+        return NULL;
+    }
+    c->dev = st.st_dev;
+    c->ino = st.st_ino;
+    c->size = st.st_size;
+    c->mtime = st.st_mtim;
+    int rc = myz_open(key, &c->archive);
+    if (rc != MYZ_OK) {
+        *error = myz_strerror(rc);
+        free(c);
+        return NULL;
+    }
+    size_t count = myz_entry_count(c->archive);
+    c->first_child = malloc((count ? count : 1) * sizeof(size_t));
+    c->next_sibling = malloc((count ? count : 1) * sizeof(size_t));
+    if (!c->first_child || !c->next_sibling) {
+        *error = "out of memory";
+        catalog_free(c);
+        return NULL;
+    }
+    myz_iter iter;
+    myz_entry entry;
+    myz_iter_init(&iter, c->archive);
+    while (myz_iter_next(&iter, &entry)) {
+        if (path_insert(&c->index, entry.path, 0, entry.index) != 0) {
+            *error = "out of memory";
+            catalog_free(c);
+            return NULL;
+        }
+    }
+    /* Children lists in catalog order: built back to front, each entry goes in first */
+    c->first_root = NO_ENTRY;
+    for (size_t i = 0; i < count; i++)
+        c->first_child[i] = c->next_sibling[i] = NO_ENTRY;
+    for (size_t i = count; i-- > 0;) {
+        myz_entry_at(c->archive, i, &entry);
+        if (entry.flags & MYZ_ENTRY_SUPERSEDED)
+            continue;
+        char parent[MAX_PATH_LENGTH];
+        snprintf(parent, sizeof(parent), "%s", entry.path);
+        char *slash = strrchr(parent, '/');
+        const PathSlot *slot = NULL;
+        if (slash) {
+            *slash = '\0';
+            slot = path_find(&c->index, parent);
+        }
+        size_t *head = slot ? &c->first_child[slot->record] : &c->first_root;
+        c->next_sibling[i] = *head;
+        *head = i;
+    }
+    c->bytes = sizeof(Catalog) + count * (sizeof(FileMetadata) + 2 * sizeof(size_t)) +
+               c->index.capacity * sizeof(PathSlot);
+    return c;
+}
+
+/* Takes a catalog out of the list (under the lock), freeing it unless a request still uses it */
+static void cache_remove(Catalog **link)
+{
+    Catalog *c = *link;
+    *link = c->next;
+    cache.bytes -= c->bytes;
+    c->stale = 1;
+    if (c->refs == 0)
+        catalog_free(c);
+}
+
+/* Drops least recently used catalogs until the cache fits (under the lock) */
+static void cache_evict(void)
+{
+    while (cache.bytes > cache.limit) {
+        Catalog **oldest = NULL;
+        for (Catalog **link = &cache.head; *link; link = &(*link)->next) {
+            if ((*link)->refs == 0 && (!oldest || (*link)->used < (*oldest)->used))
+                oldest = link;
+        }
+        if (!oldest)
+            break;      // Everything is in use, the limit is exceeded until it is released
+        cache_remove(oldest);
+    }
+}
+
+static Catalog *catalog_get(const char *archive_name, const char **error)
+{
+    char key[PATH_MAX];
+    if (!realpath(archive_name, key)) {
+        *error = strerror(errno);
+        return NULL;
+    }
+    struct stat st;
+    unsigned char header[HEADER_SIZE];
+    pthread_mutex_lock(&cache.lock);
+    for (Catalog **link = &cache.head; *link; link = &(*link)->next) {
+        Catalog *c = *link;
+        if (strcmp(c->key, key) != 0)
+            continue;
+        if (read_identity(key, &st, header) != 0 || !same_identity(c, &st, header)) {
+            cache_remove(link);
+            break;
+        }
+        c->refs++;
+        c->used = ++cache.clock;
+        pthread_mutex_unlock(&cache.lock);
+        return c;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    /* Loaded without the lock; two requests racing for one archive may both load it, the older copy ages out */
+    Catalog *c = catalog_load(key, error);
+    if (!c)
+        return NULL;
+    pthread_mutex_lock(&cache.lock);
+    c->refs = 1;
+    c->used = ++cache.clock;
+    c->next = cache.head;
+    cache.head = c;
+    cache.bytes += c->bytes;
+    cache_evict();
+    pthread_mutex_unlock(&cache.lock);
+    return c;
+}
+
+static void catalog_release(Catalog *c)
+{
+    pthread_mutex_lock(&cache.lock);
+    if (--c->refs == 0 && c->stale)
+        catalog_free(c);
+    else
+        cache_evict();
+    pthread_mutex_unlock(&cache.lock);
+}
+
+static void json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(out, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf(out, "\\u%04x", *p);
+        else
+            fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+/* "size" is the content's, hard links included, as -l shows it; "stored" is what the archive holds */
+static void json_entry(FILE *out, const myz_entry *e)
+{
+    fputs("{\"path\":", out);
+    json_string(out, e->path);
+    fprintf(out, ",\"type\":\"%c\",\"mode\":\"%04o\",\"uid\":%lu,\"gid\":%lu,\"size\":%lld,\"stored\":%lld,"
+                 "\"mtime\":%lld,\"atime\":%lld,\"ctime\":%lld,\"inode\":%llu,\"hardlink\":%s,\"volume\":%u",
+            S_ISDIR(e->mode) ? 'd' : S_ISLNK(e->mode) ? 'l' : 'f', (unsigned)(e->mode & 07777),
+            (unsigned long)e->uid, (unsigned long)e->gid, (long long)e->size, (long long)e->stored_size,
+            (long long)e->mtime, (long long)e->atime, (long long)e->ctime, (unsigned long long)e->inode,
+            e->is_hardlink ? "true" : "false", e->volume);
+    if (S_ISLNK(e->mode)) {
+        fputs(",\"target\":", out);
+        json_string(out, e->link_target);
+    }
+    fputs("}\n", out);
+}
+
+static void json_missing(FILE *out, const char *path)
+{
+    fputs("{\"path\":", out);
+    json_string(out, path);
+    fputs(",\"found\":false}\n", out);
+}
+
+static int lookup(const Catalog *c, const char *path, myz_entry *entry)
+{
+    const PathSlot *slot = path_find(&c->index, path);
+    return slot && myz_entry_at(c->archive, slot->record, entry) == MYZ_OK;
+}
+
+static int send_error(FILE *out, const char *message)
+{
+    fprintf(out, "ERR %s\n", message);
+    return fflush(out) == 0 ? 0 : -1;
+}
+
+/* Content of one regular entry, its length first */
+static int send_content(FILE *out, Catalog *c, const myz_entry *e)
+{
+    myz_stream *stream;
+    int rc = myz_stream_open(c->archive, e->index, &stream);
+    if (rc != MYZ_OK)
+        return send_error(out, myz_strerror(rc));
+    char *buf = malloc(READ_BUFFER);
+    if (!buf) {
+        myz_stream_close(stream);
+        return send_error(out, "out of memory");
+    }
+    off_t size = e->size;       // A hard link streams its original's content, of the same size
+    ssize_t n = 0;
+    if (size < 0) {
+        // Old compressed entries do not record their size: decode once to count
+        size = 0;
+        while ((n = myz_stream_read(stream, buf, READ_BUFFER)) > 0)
+            size += n;
+        myz_stream_close(stream);
+        if (n < 0 || (rc = myz_stream_open(c->archive, e->index, &stream)) != MYZ_OK) {
+            free(buf);
+            return send_error(out, myz_strerror(n < 0 ? (int)n : rc));
+        }
+    }
+    fprintf(out, "OK %lld\n", (long long)size);
+    off_t done = 0;
+    while (done < size && (n = myz_stream_read(stream, buf, READ_BUFFER)) > 0) {
+        size_t step = n < size - done ? (size_t)n : (size_t)(size - done);
+        if (fwrite(buf, 1, step, out) != step)
+            break;
+        done += (off_t)step;
+    }
+    myz_stream_close(stream);
+    free(buf);
+    // A short answer cannot be told from a long one: the connection is dropped instead
+    return done == size && fflush(out) == 0 ? 0 : -1;
+}
+
+/* Answers one request line, -1 when the connection is to be closed */
+static int handle_request(FILE *out, char *line)
+{
+    char *fields[MAX_FIELDS];
+    int count = 0;
+    for (char *field = line; field && count < MAX_FIELDS; count++) {
+        fields[count] = field;
+        field = strchr(field, '\t');
+        if (field)
+            *field++ = '\0';
+    }
+    const char *command = fields[0];
+    if (strcmp(command, "ping") == 0) {
+        fputs("OK 0\n", out);
+        return fflush(out) == 0 ? 0 : -1;
+    }
+    if (count < 2)
+        return send_error(out, "usage: query|stat|list|read ARCHIVE [paths]");
+    int query = strcmp(command, "query") == 0, stat_all = strcmp(command, "stat") == 0;
+    int list = strcmp(command, "list") == 0, content = strcmp(command, "read") == 0;
+    if (!query && !stat_all && !list && !content)
+        return send_error(out, "unknown command");
+    if ((content && count != 3) || (list && count > 3))
+        return send_error(out, content ? "read takes one path" : "list takes at most one directory");
+    const char *error = NULL;
+    Catalog *c = catalog_get(fields[1], &error);
+    if (!c)
+        return send_error(out, error);
+    myz_entry entry;
+    int rc;
+    if (content) {
+        if (!lookup(c, fields[2], &entry))
+            rc = send_error(out, "not found");
+        else if (!S_ISREG(entry.mode))
+            rc = send_error(out, "not a regular file");
+        else
+            rc = send_content(out, c, &entry);
+        catalog_release(c);
+        return rc;
+    }
+    char *payload = NULL;
+    size_t length = 0;
+    FILE *mem = open_memstream(&payload, &length);
+    if (!mem) {
+        catalog_release(c);
+        return send_error(out, "out of memory");
+    }
+    const char *failure = NULL;
+    if (query) {
+        for (int i = 2; i < count; i++) {
+            fputs("{\"path\":", mem);
+            json_string(mem, fields[i]);
+            fprintf(mem, ",\"found\":%s}\n", path_find(&c->index, fields[i]) ? "true" : "false");
+        }
+    } else if (stat_all && count == 2) {
+        myz_iter iter;
+        myz_iter_init(&iter, c->archive);
+        while (myz_iter_next(&iter, &entry))
+            json_entry(mem, &entry);
+    } else if (stat_all) {
+        for (int i = 2; i < count; i++) {
+            if (lookup(c, fields[i], &entry))
+                json_entry(mem, &entry);
+            else
+                json_missing(mem, fields[i]);
+        }
+    } else {
+        size_t child = c->first_root;
+        if (count == 3) {
+            const PathSlot *slot = path_find(&c->index, fields[2]);
+            if (!slot || myz_entry_at(c->archive, slot->record, &entry) != MYZ_OK || !S_ISDIR(entry.mode))
+                failure = slot ? "not a directory" : "not found";
+            else
+                child = c->first_child[slot->record];
+        }
+        for (; !failure && child != NO_ENTRY; child = c->next_sibling[child]) {
+            myz_entry_at(c->archive, child, &entry);
+            json_entry(mem, &entry);
+        }
+    }
+    catalog_release(c);
+    if (fclose(mem) != 0)
+        failure = "out of memory";
+    if (failure) {
+        free(payload);
+        return send_error(out, failure);
+    }
+    fprintf(out, "OK %zu\n", length);
+    rc = fwrite(payload, 1, length, out) == length && fflush(out) == 0 ? 0 : -1;
+    free(payload);
+    return rc;
+}
+
+static void *serve_connection(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    int out_fd = dup(fd);
+    FILE *in = fdopen(fd, "r");
+    FILE *out = out_fd == -1 ? NULL : fdopen(out_fd, "w");
+    if (!in || !out) {
+        if (in)
+            fclose(in);
+        else
+            close(fd);
+        if (out)
+            fclose(out);
+        else if (out_fd != -1)
+            close(out_fd);
+        return NULL;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    while ((len = getline(&line, &capacity, in)) > 0) {
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len > REQUEST_MAX) {
+            send_error(out, "request too long");
+            break;
+        }
+        if (handle_request(out, line) != 0)
+            break;
+    }
+    free(line);
+    fclose(in);
+    fclose(out);
+    return NULL;
+}
+
+int daemon_run(const char *socket_path, unsigned long long cache_limit)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    memcpy(addr.sun_path, socket_path, strlen(socket_path) + 1);
+    cache.limit = cache_limit ? (size_t)cache_limit : (size_t)DAEMON_DEFAULT_CACHE;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    /* A socket file nobody answers on is left over from a daemon that died */
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "A daemon is already serving %s\n", socket_path);
+        close(fd);
+        return -1;
+    }
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(socket_path);
+    // Only the owner may talk to it: requests can read any archive the daemon can
+    mode_t old_mask = umask(077);
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound != 0 || listen(fd, 64) != 0) {
+        perror(socket_path);
+        close(fd);
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);      // Clients that hang up are only a failed write
+
+    printf("Serving archives on %s (catalog cache %zu bytes).\n", socket_path, cache.limit);
+    fflush(stdout);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = 0;
+    while (!stop_requested) {
+        int client = accept(fd, NULL, NULL);
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            rc = -1;
+            break;
+        }
+        /* A thread per connection: catalogs are shared, each request holds a reference */
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, serve_connection, (void *)(intptr_t)client) != 0) {
+            perror("pthread_create");
+            close(client);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    close(fd);
+    unlink(socket_path);
+    // Connections still open die with the process, the catalogs are freed with it too
+    return rc;
+}
+
+int daemon_request(const char *socket_path, char *args[], int arg_count)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    memcpy(addr.sun_path, socket_path, strlen(socket_path) + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(socket_path);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    FILE *conn = fdopen(fd, "r+");
+    if (!conn) {
+        perror("fdopen");
+        close(fd);
+        return -1;
+    }
+    // The daemon has its own working directory: archives go as absolute paths
+    char archive_path[PATH_MAX];
+    if (arg_count > 1 && realpath(args[1], archive_path))
+        args[1] = archive_path;
+    for (int i = 0; i < arg_count; i++) {
+        if (strpbrk(args[i], "\t\n")) {
+            fprintf(stderr, "Request fields cannot contain tabs or newlines: %s\n", args[i]);
+            fclose(conn);
+            return -1;
+        }
+        fprintf(conn, "%s%s", i ? "\t" : "", args[i]);
+    }
+    fputc('\n', conn);
+    fflush(conn);
+    char status[1024];
+    if (!fgets(status, sizeof(status), conn)) {
+        fprintf(stderr, "No answer from %s\n", socket_path);
+        fclose(conn);
+        return -1;
+    }
+    if (strncmp(status, "OK ", 3) != 0) {
+        fprintf(stderr, "%s", strncmp(status, "ERR ", 4) == 0 ? status + 4 : status);
+        fclose(conn);
+        return -1;
+    }
+    unsigned long long length = strtoull(status + 3, NULL, 10), done = 0;
+    char buf[READ_BUFFER];
+    while (done < length) {
+        size_t want = length - done < sizeof(buf) ? (size_t)(length - done) : sizeof(buf);
+        size_t n = fread(buf, 1, want, conn);
+        if (n == 0)
+            break;
+        fwrite(buf, 1, n, stdout);
+        done += n;
+    }
+    fclose(conn);
+    if (done < length) {
+        fprintf(stderr, "Answer cut short by %s\n", socket_path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+/*
+ * myzd: a daemon answering catalog requests over a Unix-domain socket,
+ * with the parsed catalogs of recently used archives cached in memory.
+ *
+ * A request is one line, tab-separated: a command, the archive and its
+ * arguments.
+ *
+ *   query ARCHIVE PATH...   does each path exist
+ *   stat  ARCHIVE [PATH...] metadata of the paths (of every entry without)
+ *   list  ARCHIVE [DIR]     metadata of the children of DIR (top level without)
+ *   read  ARCHIVE PATH      content of a regular file
+ *   ping
+ *
+ * The answer is "OK <length>\n" followed by length bytes, JSON lines for
+ * query, stat and list and the raw content for read, or "ERR <message>\n".
+ * A connection can carry any number of requests.
+ */
+
+#define DAEMON_DEFAULT_CACHE (256ull << 20)
+
+extern const char *daemon_socket;       // --daemon=SOCKET (or running as myzd SOCKET)
+extern const char *request_socket;      // --request=SOCKET
+
+/*
+ * Serves requests on socket_path until SIGINT or SIGTERM, keeping at most
+ * cache_limit bytes of catalogs (least recently used go first; 0 for the
+ * default). Returns 0 on a clean stop, -1 on error.
+ */
+int daemon_run(const char *socket_path, unsigned long long cache_limit);
+
+/*
+ * Sends one request (args[0] is the command) and writes the payload of the
+ * answer to stdout. Returns 0 on OK, -1 on ERR or a failed connection.
+ */
+int daemon_request(const char *socket_path, char *args[], int arg_count);
+
+#endif // DAEMON_H
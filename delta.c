@@ -0,0 +1,354 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "delta.h"
+#include "utils.h"
+#include "stats.h"
+
+#define DELTA_MIN_BLOCK 1024        // Base blocks are at least this long
+#define DELTA_MAX_BLOCKS (1u << 20) // and grow until there are at most this many
+#define DELTA_MAX_TRIES 16          // Candidates compared per position (runs of equal blocks)
+#define DELTA_NONE UINT32_MAX
+#define OUT_BUFFER 65536
+
+unsigned int delta_max_depth = 0;
+
+/* Operation stream, through zlib (gzip wrapper) with -j */
+typedef struct {
+    FILE *archive;
+    long *data_offset;
+    int gzip;
+    z_stream z;
+    unsigned char buf[OUT_BUFFER];
+    size_t used;
+    // A COPY is held back so that adjacent ones are written as one
+    uint64_t copy_offset, copy_length;
+    int failed;
+} DeltaOut;
+
+static void out_flush(DeltaOut *out)
+{
+    if (out->used == 0 || out->failed)
+        return;
+    if (stats_fwrite(out->buf, 1, out->used, out->archive) != out->used) {
+        perror("Error writing delta to archive");
+        out->failed = 1;
+        return;
+    }
+    *out->data_offset += (long)out->used;
+    out->used = 0;
+}
+
+static void out_deflate(DeltaOut *out, const void *data, size_t n, int flush)
+{
+    out->z.next_in = (unsigned char *)data;
+    out->z.avail_in = (uInt)n;
+    do {
+        if (out->used == sizeof(out->buf))
+            out_flush(out);
+        out->z.next_out = out->buf + out->used;
+        out->z.avail_out = (uInt)(sizeof(out->buf) - out->used);
+        int zr = deflate(&out->z, flush);
+        out->used = sizeof(out->buf) - out->z.avail_out;
+        if (zr == Z_STREAM_END)
+            break;
+        if (zr != Z_OK && zr != Z_BUF_ERROR) {
+            fprintf(stderr, "Error compressing delta\n");
+            out->failed = 1;
+            return;
+        }
+    } while (out->z.avail_in > 0 || (flush == Z_FINISH && !out->failed));
+}
+
+static void out_write(DeltaOut *out, const void *data, size_t n)
+{
+    if (out->gzip) {
+        out_deflate(out, data, n, Z_NO_FLUSH);
+        return;
+    }
+    const unsigned char *p = data;
+    while (n > 0 && !out->failed) {
+        if (out->used == sizeof(out->buf))
+            out_flush(out);
+        size_t step = sizeof(out->buf) - out->used < n ? sizeof(out->buf) - out->used : n;
+        memcpy(out->buf + out->used, p, step);
+        out->used += step;
+        p += step;
+        n -= step;
+    }
+}
+
+static void out_op(DeltaOut *out, int op, uint64_t a, uint64_t b, int two)
+{
+    unsigned char head[1 + 2 * 10];
+    size_t n = 0;
+    head[n++] = (unsigned char)op;
+    for (int k = 0; k < (two ? 2 : 1); k++) {
+        uint64_t v = k == 0 ? a : b;
+        do {
+            head[n++] = (unsigned char)((v & 0x7f) | (v > 0x7f ? 0x80 : 0));
+            v >>= 7;
+        } while (v);
+    }
+    out_write(out, head, n);
+}
+
+static void out_pending_copy(DeltaOut *out)
+{
+    if (out->copy_length > 0)
+        out_op(out, DELTA_COPY, out->copy_offset, out->copy_length, 1);
+    out->copy_length = 0;
+}
+
+static void emit_copy(DeltaOut *out, uint64_t offset, uint64_t length)
+{
+    if (out->copy_length > 0 && out->copy_offset + out->copy_length == offset) {
+        out->copy_length += length;
+        return;
+    }
+    out_pending_copy(out);
+    out->copy_offset = offset;
+    out->copy_length = length;
+}
+
+static void emit_add(DeltaOut *out, const unsigned char *data, size_t length)
+{
+    if (length == 0)
+        return;
+    out_pending_copy(out);
+    out_op(out, DELTA_ADD, length, 0, 0);
+    out_write(out, data, length);
+}
+
+/* rsync's weak checksum of a window: a = sum of the bytes, b = sum of the running a */
+static uint32_t weak_sum(uint32_t a, uint32_t b)
+{
+    return (a & 0xffff) | (b << 16);
+}
+
+static uint32_t slot_of(uint32_t sum, uint32_t mask)
+{
+    return (sum * 2654435761u >> 7) & mask;
+}
+
+/*
+ * Matches the new content against the base in fixed blocks: every block
+ * of the base goes into a hash table by weak checksum, a window the size
+ * of a block rolls over the new content, and a window whose checksum hits
+ * is compared with the block. Matches are extended in both directions
+ * byte by byte, so shifted data costs only the bytes around the change.
+ */
+static int encode(const unsigned char *base, size_t base_len, const unsigned char *data, size_t len, DeltaOut *out)
+{
+    size_t block = DELTA_MIN_BLOCK;
+    while (base_len / block > DELTA_MAX_BLOCKS)
+        block *= 2;
+    size_t blocks = base_len / block;
+    uint32_t mask = 1;
+    while (mask < blocks * 2)
+        mask <<= 1;
+    uint32_t *heads = malloc(mask * sizeof(uint32_t));
+    uint32_t *next = malloc((blocks ? blocks : 1) * sizeof(uint32_t));
+    uint32_t *sums = malloc((blocks ? blocks : 1) * sizeof(uint32_t));
+    if (!heads || !next || !sums) {
+        perror("malloc");
+        free(heads);
+        free(next);
+        free(sums);
+        return -1;
+    }
+    mask--;
+    memset(heads, 0xff, ((size_t)mask + 1) * sizeof(uint32_t));
+    // Later blocks first in the chains, so runs of equal blocks match their first copy
+    for (size_t k = blocks; k-- > 0;) {
+        uint32_t a = 0, b = 0;
+        const unsigned char *p = base + k * block;
+        for (size_t i = 0; i < block; i++) {
+            a += p[i];
+            b += a;
+        }
+        sums[k] = weak_sum(a, b);
+        uint32_t slot = slot_of(sums[k], mask);
+        next[k] = heads[slot];
+        heads[slot] = (uint32_t)k;
+    }
+
+    size_t pos = 0, literal = 0;
+    uint32_t a = 0, b = 0;
+    int have_sum = 0;
+    while (blocks > 0 && pos + block <= len && !out->failed) {
+        if (!have_sum) {
+            a = b = 0;
+            for (size_t i = 0; i < block; i++) {
+                a += data[pos + i];
+                b += a;
+            }
+            have_sum = 1;
+        }
+        uint32_t sum = weak_sum(a, b);
+        uint32_t found = DELTA_NONE;
+        int tries = 0;
+        for (uint32_t k = heads[slot_of(sum, mask)]; k != DELTA_NONE && tries < DELTA_MAX_TRIES; k = next[k], tries++) {
+            if (sums[k] == sum && memcmp(base + (size_t)k * block, data + pos, block) == 0) {
+                found = k;
+                break;
+            }
+        }
+        if (found != DELTA_NONE) {
+            size_t from = (size_t)found * block, match = block;
+            while (pos > literal && from > 0 && data[pos - 1] == base[from - 1]) {
+                pos--;
+                from--;
+                match++;
+            }
+            while (pos + match + block <= len && from + match + block <= base_len &&
+                   memcmp(data + pos + match, base + from + match, block) == 0)
+                match += block;
+            while (pos + match < len && from + match < base_len && data[pos + match] == base[from + match])
+                match++;
+            emit_add(out, data + literal, pos - literal);
+            emit_copy(out, from, match);
+            pos += match;
+            literal = pos;
+            have_sum = 0;
+            continue;
+        }
+        if (pos + block == len)
+            break;
+        // Roll the window one byte
+        uint32_t leaving = data[pos], entering = data[pos + block];
+        a += entering - leaving;
+        b += a - (uint32_t)block * leaving;
+        pos++;
+    }
+    emit_add(out, data + literal, len - literal);
+    out_pending_copy(out);
+    free(heads);
+    free(next);
+    free(sums);
+    return out->failed ? -1 : 0;
+}
+
+/* Decodes the base version into an unlinked temporary file and maps it */
+static unsigned char *map_base(myz_archive *archive, size_t index, size_t *len)
+{
+    myz_stream *stream;
+    int rc = myz_stream_open(archive, index, &stream);
+    if (rc != MYZ_OK) {
+        print_myz_error("Error reading delta base", rc);
+        return NULL;
+    }
+    FILE *tmp = tmpfile();
+    unsigned char *buf = malloc(OUT_BUFFER);
+    if (!tmp || !buf) {
+        perror(tmp ? "malloc" : "tmpfile");
+        free(buf);
+        if (tmp)
+            fclose(tmp);
+        myz_stream_close(stream);
+        return NULL;
+    }
+    size_t total = 0;
+    ssize_t n;
+    while ((n = myz_stream_read(stream, buf, OUT_BUFFER)) > 0) {
+        if (fwrite(buf, 1, (size_t)n, tmp) != (size_t)n) {
+            n = MYZ_ERR_IO;
+            break;
+        }
+        total += (size_t)n;
+    }
+    free(buf);
+    myz_stream_close(stream);
+    if (n < 0 || fflush(tmp) != 0) {
+        print_myz_error("Error reading delta base", n < 0 ? (int)n : MYZ_ERR_IO);
+        fclose(tmp);
+        return NULL;
+    }
+    void *map = total ? mmap(NULL, total, PROT_READ, MAP_PRIVATE, fileno(tmp), 0) : NULL;
+    fclose(tmp);        // The mapping keeps the data
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    *len = total;
+    return map;
+}
+
+int delta_store_file(const char *path, const struct stat *st, myz_archive *base, size_t base_index,
+                     const FileMetadata *base_meta, FILE *archive, long *data_offset, FileMetadata *meta)
+{
+    uint64_t file_start = stats_enabled ? stats_now() : 0;
+    size_t base_len = 0;
+    unsigned char *base_data = map_base(base, base_index, &base_len);
+    if (!base_data)
+        return -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("Error opening file for archiving");
+        munmap(base_data, base_len);
+        return -1;
+    }
+    size_t len = (size_t)st->st_size;
+    void *map = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        munmap(base_data, base_len);
+        return -1;
+    }
+    if (map)
+        posix_madvise(map, len, POSIX_MADV_SEQUENTIAL);
+
+    DeltaOut *out = calloc(1, sizeof(DeltaOut));
+    if (!out) {
+        perror("calloc");
+        munmap(base_data, base_len);
+        if (map)
+            munmap(map, len);
+        return -1;
+    }
+    out->archive = archive;
+    out->data_offset = data_offset;
+    out->gzip = compress_flag;
+    if (out->gzip && deflateInit2(&out->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                                  Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Error initializing zlib\n");
+        free(out);
+        munmap(base_data, base_len);
+        if (map)
+            munmap(map, len);
+        return -1;
+    }
+    meta->data_offset = *data_offset;
+    stats_phase_begin(PHASE_COMPRESS);
+    int rc = encode(base_data, base_len, map, len, out);
+    if (out->gzip) {
+        if (rc == 0)
+            out_deflate(out, NULL, 0, Z_FINISH);
+        deflateEnd(&out->z);
+    }
+    out_flush(out);
+    stats_phase_end(PHASE_COMPRESS);
+    if (out->failed)
+        rc = -1;
+    free(out);
+    munmap(base_data, base_len);
+    if (map)
+        munmap(map, len);
+    if (rc != 0)
+        return -1;
+    meta->logical_size = st->st_size;
+    meta->size = *data_offset - meta->data_offset;
+    meta->flags = ENTRY_DELTA | (compress_flag ? ENTRY_GZIP : 0);
+    meta->delta_base = base_meta->data_offset;
+    meta->delta_base_volume = base_meta->volume;
+    meta->delta_depth = base_meta->delta_depth + 1;
+    stats_add_bytes(st->st_size, meta->size);
+    stats_file_done(path, file_start, st->st_size);
+    return 0;
+}
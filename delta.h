@@ -0,0 +1,43 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "structs.h"
+#include "libmyz.h"
+
+/*
+ * Delta entries (ENTRY_DELTA, -a --delta) store a new version of a file as
+ * a list of operations against the content of an older version of the same
+ * path, its base. The base is found by the location of its data
+ * (delta_base_volume, delta_base), which compaction and --merge rebase like
+ * data_offset. The operations, gzip-compressed as one stream with
+ * ENTRY_GZIP:
+ *
+ *   DELTA_COPY varint offset, varint length   bytes of the base
+ *   DELTA_ADD  varint length, length bytes    new bytes
+ *
+ * Varints are little-endian base 128. The operations produce the whole
+ * content in order, logical_size bytes.
+ */
+
+#define DELTA_COPY 1
+#define DELTA_ADD  2
+
+#define DELTA_DEFAULT_DEPTH 8
+
+extern unsigned int delta_max_depth;    // --delta[=DEPTH], 0 when off
+
+/*
+ * Stores the file at path as a delta against record base_index (base_meta)
+ * of base, the archive being appended to opened before its metadata block
+ * is overwritten, and fills the record like store_file_data(). The base
+ * must be a data-owning regular entry with content.
+ * Returns 0 on success, -1 on error.
+ */
+int delta_store_file(const char *path, const struct stat *st, myz_archive *base, size_t base_index,
+                     const FileMetadata *base_meta, FILE *archive, long *data_offset, FileMetadata *meta);
+
+#endif // DELTA_H
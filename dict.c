@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "dict.h"
+#include "stats.h"
+#include "io.h"
+#include "filter.h"
+#include "utils.h"
+
+#define DICT_DMER 8                 // Substring length counted by the trainer
+#define DICT_SEGMENT 256            // Bytes taken per selected segment
+#define SAMPLE_FILE_MAX 16384       // Bytes sampled from the start of each file
+#define SAMPLE_BUDGET (1 << 20)     // Total sample bytes
+#define EMPTY_SLOT UINT32_MAX
+
+unsigned long long dict_size_option = 0;
+Dictionary archive_dict = { NULL, 0, 0 };
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t files;
+} Samples;
+
+typedef struct {
+    uint64_t key;
+    uint32_t freq;              // Number of samples containing the substring
+    uint32_t last;              // Last sample counted, EMPTY_SLOT if unused
+} DmerSlot;
+
+typedef struct {
+    size_t start;
+    size_t length;
+    uint64_t score;
+} DictSegment;
+
+/* Reads the start of every regular file under path, same walk, order and excludes as process_path() */
+static void sample_path(const char *path, Samples *samples, size_t **ends, size_t *ends_cap)
+{
+    if (samples->size >= SAMPLE_BUDGET || filter_path_excluded(path))
+        return;
+    struct stat st;
+    if (lstat(path, &st) == -1)
+        return;
+    if (S_ISDIR(st.st_mode)) {
+        size_t count;
+        char **names = read_dir_entries(path, &count);
+        if (!names)
+            return;
+        for (size_t i = 0; i < count && samples->size < SAMPLE_BUDGET; i++) {
+            char child[1024];
+            snprintf(child, sizeof(child), "%s/%s", path, names[i]);
+            sample_path(child, samples, ends, ends_cap);
+        }
+        free_dir_entries(names, count);
+        return;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size < DICT_DMER)
+        return;
+    size_t want = st.st_size < SAMPLE_FILE_MAX ? (size_t)st.st_size : SAMPLE_FILE_MAX;
+    if (want > SAMPLE_BUDGET - samples->size)
+        want = SAMPLE_BUDGET - samples->size;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return;
+    ssize_t n = stats_pread(fd, samples->data + samples->size, want, 0);
+    close(fd);
+    if (n < DICT_DMER)
+        return;
+    if (samples->files == *ends_cap) {
+        size_t capacity = *ends_cap ? *ends_cap * 2 : 256;
+        size_t *grown = realloc(*ends, capacity * sizeof(size_t));
+        if (!grown)
+            return;
+        *ends = grown;
+        *ends_cap = capacity;
+    }
+    samples->size += (size_t)n;
+    (*ends)[samples->files++] = samples->size;
+}
+
+static uint64_t dmer_at(const unsigned char *p)
+{
+    uint64_t key;
+    memcpy(&key, p, sizeof(key));
+    return key;
+}
+
+static int cmp_segments(const void *a, const void *b)
+{
+    const DictSegment *x = a, *y = b;
+    return (x->score > y->score) - (x->score < y->score);
+}
+
+int dict_train(char *paths[], int count, size_t max_size, Dictionary *dict)
+{
+    memset(dict, 0, sizeof(*dict));
+    if (max_size > DICT_MAX_SIZE)
+        max_size = DICT_MAX_SIZE;
+    Samples samples = { malloc(SAMPLE_BUDGET), 0, 0 };
+    size_t *ends = NULL, ends_cap = 0;
+    if (!samples.data) {
+        perror("malloc");
+        return -1;
+    }
+    for (int i = 0; i < count; i++)
+        sample_path(paths[i], &samples, &ends, &ends_cap);
+    if (samples.files < 2) {
+        fprintf(stderr, "Not enough files to train a dictionary\n");
+        free(samples.data);
+        free(ends);
+        return -1;
+    }
+    size_t n = samples.size;
+    dict->data = malloc(max_size);
+    if (!dict->data) {
+        perror("malloc");
+        free(samples.data);
+        free(ends);
+        return -1;
+    }
+    if (n <= max_size) {
+        /* Less sample data than dictionary space: keep all of it */
+        memcpy(dict->data, samples.data, n);
+        dict->size = (uint32_t)n;
+        free(samples.data);
+        free(ends);
+        return 0;
+    }
+
+    /* Count in how many samples every substring occurs */
+    size_t capacity = 1;
+    int bits = 0;
+    while (capacity < n + n / 2) {
+        capacity <<= 1;
+        bits++;
+    }
+    DmerSlot *slots = malloc(capacity * sizeof(DmerSlot));
+    uint32_t *slot_of = malloc(n * sizeof(uint32_t));
+    DictSegment *segs = malloc((max_size / DICT_SEGMENT + 1) * sizeof(DictSegment));
+    if (!slots || !slot_of || !segs) {
+        perror("malloc");
+        free(slots);
+        free(slot_of);
+        free(segs);
+        dict_free(dict);
+        free(samples.data);
+        free(ends);
+        return -1;
+    }
+    memset(slots, 0xff, capacity * sizeof(DmerSlot));
+    size_t start = 0;
+    for (size_t f = 0; f < samples.files; f++) {
+        for (size_t p = start; p < ends[f]; p++) {
+            if (p + DICT_DMER > ends[f]) {
+                slot_of[p] = EMPTY_SLOT;    // Would span two samples
+                continue;
+            }
+            uint64_t key = dmer_at(samples.data + p);
+            size_t h = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+            while (slots[h].last != EMPTY_SLOT && slots[h].key != key)
+                h = (h + 1) & (capacity - 1);
+            if (slots[h].last == EMPTY_SLOT) {
+                slots[h].key = key;
+                slots[h].freq = 0;
+            }
+            if (slots[h].last != (uint32_t)f) {
+                slots[h].freq++;
+                slots[h].last = (uint32_t)f;
+            }
+            slot_of[p] = (uint32_t)h;
+        }
+        start = ends[f];
+    }
+
+    /*
+     * One segment per epoch: the window whose substrings are shared by the
+     * most samples. Substrings already covered stop counting.
+     */
+    size_t epochs = max_size / DICT_SEGMENT ? max_size / DICT_SEGMENT : 1;
+    size_t epoch = n / epochs;
+    if (epoch < DICT_SEGMENT) {
+        epoch = DICT_SEGMENT;
+        epochs = n / epoch;
+    }
+    size_t seg_count = 0;
+    for (size_t e = 0; e < epochs; e++) {
+        size_t lo = e * epoch;
+        size_t hi = e + 1 == epochs ? n : lo + epoch;
+        size_t len = hi - lo < DICT_SEGMENT ? hi - lo : DICT_SEGMENT;
+        size_t window = len - DICT_DMER + 1;
+        uint64_t sum = 0, best = 0;
+        size_t best_start = lo;
+        for (size_t p = lo; p + DICT_DMER <= hi; p++) {
+            if (slot_of[p] != EMPTY_SLOT && slots[slot_of[p]].freq > 1)
+                sum += slots[slot_of[p]].freq;
+            if (p >= lo + window) {
+                size_t q = p - window;
+                if (slot_of[q] != EMPTY_SLOT && slots[slot_of[q]].freq > 1)
+                    sum -= slots[slot_of[q]].freq;
+            }
+            if (p + 1 >= lo + window && sum > best) {
+                best = sum;
+                best_start = p + 1 - window;
+            }
+        }
+        if (best == 0)
+            continue;
+        for (size_t p = best_start; p < best_start + window; p++) {
+            if (slot_of[p] != EMPTY_SLOT)
+                slots[slot_of[p]].freq = 0;
+        }
+        segs[seg_count++] = (DictSegment){ best_start, len, best };
+    }
+
+    /* Deflate codes short distances cheaper: the best segments go last */
+    qsort(segs, seg_count, sizeof(DictSegment), cmp_segments);
+    size_t size = 0;
+    for (size_t i = 0; i < seg_count && size + segs[i].length <= max_size; i++) {
+        memcpy(dict->data + size, samples.data + segs[i].start, segs[i].length);
+        size += segs[i].length;
+    }
+    dict->size = (uint32_t)size;
+    free(slots);
+    free(slot_of);
+    free(segs);
+    free(samples.data);
+    free(ends);
+    if (size == 0) {
+        fprintf(stderr, "The sampled files share no content, no dictionary trained\n");
+        dict_free(dict);
+        return -1;
+    }
+    return 0;
+}
+
+int dict_store(FILE *archive, long *data_offset, Dictionary *dict)
+{
+    if (fseek(archive, *data_offset, SEEK_SET) != 0 ||
+        stats_fwrite(dict->data, 1, dict->size, archive) != dict->size ||
+        fflush(archive) != 0) {
+        report_perror("Error writing dictionary");
+        return -1;
+    }
+    dict->offset = *data_offset;
+    *data_offset += dict->size;
+    return 0;
+}
+
+int dict_read(FILE *archive, const ArchiveHeader *header, Dictionary *dict)
+{
+    memset(dict, 0, sizeof(*dict));
+    if (header->magic != MYZ_MAGIC || header->dict_size == 0)
+        return 0;
+    if (header->dict_size > DICT_MAX_SIZE) {
+        report_error("Invalid dictionary size in archive header\n");
+        return -1;
+    }
+    dict->data = malloc(header->dict_size);
+    if (!dict->data) {
+        report_perror("malloc");
+        return -1;
+    }
+    if (fseek(archive, header->dict_offset, SEEK_SET) != 0 ||
+        stats_fread(dict->data, 1, header->dict_size, archive) != header->dict_size) {
+        report_perror("Error reading dictionary");
+        dict_free(dict);
+        return -1;
+    }
+    dict->size = header->dict_size;
+    dict->offset = header->dict_offset;
+    return 0;
+}
+
+int dict_equal(const Dictionary *a, const Dictionary *b)
+{
+    return a->size == b->size && memcmp(a->data, b->data, a->size) == 0;
+}
+
+void dict_free(Dictionary *dict)
+{
+    free(dict->data);
+    memset(dict, 0, sizeof(*dict));
+}
+
+/* Runs deflate with the given flush mode and appends its output to the archive */
+static int deflate_to_archive(z_stream *z, int flush, unsigned char *out, size_t out_size,
+                              FILE *archive, long *data_offset)
+{
+    int zr;
+    do {
+        z->next_out = out;
+        z->avail_out = (uInt)out_size;
+        zr = deflate(z, flush);
+        if (zr == Z_STREAM_ERROR)
+            return -1;
+        size_t produced = out_size - z->avail_out;
+        if (stats_fwrite(out, 1, produced, archive) != produced) {
+            report_perror("Error writing compressed data to archive");
+            return -1;
+        }
+        *data_offset += (long)produced;
+    } while (z->avail_out == 0 || (flush == Z_FINISH && zr != Z_STREAM_END));
+    return 0;
+}
+
+typedef struct {
+    z_stream *z;
+    unsigned char *out;
+    size_t out_size;
+    FILE *archive;
+    long *data_offset;
+    int rc;
+} DeflateSink;
+
+/* io_read_range() sink compressing into the archive */
+static int deflate_sink(void *ctx, const void *data, size_t n)
+{
+    DeflateSink *sink = ctx;
+    sink->z->next_in = (unsigned char *)data;
+    sink->z->avail_in = (uInt)n;
+    sink->rc = deflate_to_archive(sink->z, Z_NO_FLUSH, sink->out, sink->out_size, sink->archive, sink->data_offset);
+    return sink->rc;
+}
+
+int dict_compress_file(const char *fs_path, const SparseExtent *extents, size_t extent_count, off_t size,
+                       const Dictionary *dict, FILE *archive, long *data_offset)
+{
+    IoFile file;
+    if (io_open(&file, fs_path) != 0) {
+        report_perror("Error opening file for archiving");
+        return -1;
+    }
+    const size_t buf_size = 65536;
+    unsigned char *out = malloc(buf_size);
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (!out ||
+        deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        report_perror("Error initialising compression");
+        free(out);
+        io_close(&file);
+        return -1;
+    }
+    stats_phase_begin(PHASE_COMPRESS);
+    DeflateSink sink = { &z, out, buf_size, archive, data_offset, 0 };
+    sink.rc = deflateSetDictionary(&z, dict->data, dict->size) == Z_OK ? 0 : -1;
+    /* A dense file is a single extent */
+    SparseExtent whole = { 0, size };
+    if (!extents) {
+        extents = &whole;
+        extent_count = 1;
+    }
+    for (size_t e = 0; e < extent_count && sink.rc == 0; e++) {
+        // A read error ends the entry early, like a file that shrank
+        if (io_read_range(&file, extents[e].offset, extents[e].length, deflate_sink, &sink) != 0)
+            break;
+    }
+    int rc = sink.rc;
+    if (rc == 0)
+        rc = deflate_to_archive(&z, Z_FINISH, out, buf_size, archive, data_offset);
+    deflateEnd(&z);
+    stats_phase_end(PHASE_COMPRESS);
+    free(out);
+    io_close(&file);
+    return rc;
+}
@@ -0,0 +1,49 @@
+#ifndef DICT_H
+#define DICT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "structs.h"
+
+/*
+ * Trained compression dictionaries (--dict[=SIZE], with -c -j).
+ *
+ * Before the traversal, -c samples the start of the files to archive and
+ * picks the segments whose 8-byte substrings occur in the most files
+ * (a simplified COVER trainer). The dictionary is stored once, right after
+ * the header, and every compressed entry is then a zlib stream primed with
+ * it (ENTRY_DICT). Deflate only looks back 32 KiB, so that is the limit.
+ */
+
+#define DICT_MAX_SIZE 32768
+
+typedef struct {
+    unsigned char *data;
+    uint32_t size;              // 0 = no dictionary
+    long offset;                // Position in the archive
+} Dictionary;
+
+/* --dict size, 0 = not requested */
+extern unsigned long long dict_size_option;
+
+/* Dictionary used by store_file_data() for the archive being written */
+extern Dictionary archive_dict;
+
+/* Samples the files under paths and trains a dictionary of at most max_size bytes */
+int dict_train(char *paths[], int count, size_t max_size, Dictionary *dict);
+/* Writes the dictionary at *data_offset and advances it */
+int dict_store(FILE *archive, long *data_offset, Dictionary *dict);
+/* Loads the dictionary of an archive, size 0 if it has none */
+int dict_read(FILE *archive, const ArchiveHeader *header, Dictionary *dict);
+/* Dictionaries with the same content */
+int dict_equal(const Dictionary *a, const Dictionary *b);
+void dict_free(Dictionary *dict);
+
+/*
+ * Compresses a file (only its extents if extents != NULL) in-process
+ * against the dictionary, appending the zlib stream to the archive.
+ */
+int dict_compress_file(const char *fs_path, const SparseExtent *extents, size_t extent_count, off_t size,
+                       const Dictionary *dict, FILE *archive, long *data_offset);
+
+#endif // DICT_H
@@ -0,0 +1,468 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "../structs.h"
+#include "../utils.h"
+#include "../stats.h"
+#include "../io.h"
+#include "../filter.h"
+#include "../pathset.h"
+#include "../libmyz.h"
+#include "diff.h"
+
+int diff_content = 0;
+
+#define DIFF_BATCH 64           // Entries handed to a worker at a time
+
+typedef struct {
+    char kind;                  // 'A', 'D', 'M' or 'm'
+    char detail[24];            // What differs, "" for added/removed
+    char *path;
+} Change;
+
+/* The other side of a comparison: a stat() result or an entry of the newer archive */
+typedef struct {
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    off_t size;                 // -1 if unknown
+    const char *link_target;
+} Attr;
+
+typedef struct {
+    myz_archive *old;
+    myz_archive *new;           // NULL when comparing against a directory tree
+    int root_fd;
+    const PathSet *old_paths;
+    const PathSet *new_paths;
+    const PathFilter *filter;
+    size_t count;
+    size_t next;                // Next old entry to hand out
+    int failed;
+    pthread_mutex_t lock;
+} DiffJob;
+
+typedef struct {
+    DiffJob *job;
+    Change *changes;
+    size_t count;
+    size_t capacity;
+    unsigned char *buf_old;     // --content buffers
+    unsigned char *buf_new;
+} DiffWorker;
+
+static int add_change(DiffWorker *w, char kind, const char *path, const char *detail)
+{
+    if (w->count == w->capacity) {
+        size_t capacity = w->capacity ? w->capacity * 2 : 64;
+        Change *grown = realloc(w->changes, capacity * sizeof(Change));
+        if (!grown) {
+            perror("realloc");
+            return -1;
+        }
+        w->changes = grown;
+        w->capacity = capacity;
+    }
+    Change *c = &w->changes[w->count];
+    c->kind = kind;
+    snprintf(c->detail, sizeof(c->detail), "%s", detail);
+    c->path = strdup(path);
+    if (!c->path) {
+        perror("strdup");
+        return -1;
+    }
+    w->count++;
+    return 0;
+}
+
+static void fail(DiffJob *job)
+{
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Reads up to len bytes, short only at the end */
+static ssize_t stream_fill(myz_stream *stream, unsigned char *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = myz_stream_read(stream, buf + done, len - done);
+        if (n < 0)
+            return n;
+        if (n == 0)
+            break;
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+static ssize_t fd_fill(int fd, unsigned char *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = stats_read(fd, buf + done, len - done);
+        if (n < 0)
+            return MYZ_ERR_IO;
+        if (n == 0)
+            break;
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+/* 1 if the content of the old entry equals the file or newer entry, 0 if not, -1 on error */
+static int content_equal(DiffWorker *w, const myz_entry *entry, const char *path, size_t new_index)
+{
+    DiffJob *job = w->job;
+    myz_stream *old_stream = NULL, *new_stream = NULL;
+    int fd = -1;
+    int rc = myz_stream_open(job->old, entry->index, &old_stream);
+    if (rc == MYZ_OK && job->new)
+        rc = myz_stream_open(job->new, new_index, &new_stream);
+    else if (rc == MYZ_OK && (fd = openat(job->root_fd, path, O_RDONLY | O_CLOEXEC)) == -1)
+        rc = MYZ_ERR_IO;
+    int equal = -1;
+    while (rc == MYZ_OK) {
+        ssize_t a = stream_fill(old_stream, w->buf_old, io_buffer_size);
+        ssize_t b = new_stream ? stream_fill(new_stream, w->buf_new, io_buffer_size)
+                               : fd_fill(fd, w->buf_new, io_buffer_size);
+        if (a < 0 || b < 0) {
+            rc = a < 0 ? (int)a : (int)b;
+            break;
+        }
+        if (a != b || memcmp(w->buf_old, w->buf_new, (size_t)a) != 0) {
+            equal = 0;
+            break;
+        }
+        if (a == 0) {
+            equal = 1;
+            break;
+        }
+    }
+    if (rc != MYZ_OK)
+        print_myz_error(path, rc);
+    myz_stream_close(old_stream);
+    myz_stream_close(new_stream);
+    if (fd != -1)
+        close(fd);
+    return equal;
+}
+
+static void append_detail(char *detail, size_t size, const char *what)
+{
+    size_t len = strlen(detail);
+    snprintf(detail + len, size - len, "%s%s", len ? ", " : "", what);
+}
+
+/*
+ * Classifies one path present on both sides. Size and mtime decide for
+ * regular files unless --content is given; directory mtimes change with
+ * every entry added or removed below them and are ignored.
+ */
+static int compare(DiffWorker *w, const myz_entry *entry, const Attr *cur, size_t new_index)
+{
+    char detail[24] = "";
+    char kind = 0;
+    if ((entry->mode & S_IFMT) != (cur->mode & S_IFMT)) {
+        kind = 'M';
+        append_detail(detail, sizeof(detail), "type");
+    } else if (S_ISLNK(entry->mode)) {
+        if (strcmp(entry->link_target, cur->link_target) != 0) {
+            kind = 'M';
+            append_detail(detail, sizeof(detail), "target");
+        }
+    } else if (S_ISREG(entry->mode)) {
+        int mtime_differs = entry->mtime != cur->mtime;
+        if (entry->size >= 0 && cur->size >= 0 && entry->size != cur->size) {
+            kind = 'M';
+            append_detail(detail, sizeof(detail), "size");
+        } else if (diff_content) {
+            int equal = content_equal(w, entry, entry->path, new_index);
+            if (equal < 0)
+                return -1;
+            if (!equal) {
+                kind = 'M';
+                append_detail(detail, sizeof(detail), "content");
+            } else if (mtime_differs) {
+                append_detail(detail, sizeof(detail), "mtime");
+            }
+        } else if (mtime_differs) {
+            kind = 'M';
+            append_detail(detail, sizeof(detail), "mtime");
+        }
+    }
+    if ((entry->mode & 07777) != (cur->mode & 07777))
+        append_detail(detail, sizeof(detail), "mode");
+    if (entry->uid != cur->uid || entry->gid != cur->gid)
+        append_detail(detail, sizeof(detail), "owner");
+    if (!kind && detail[0])
+        kind = 'm';
+    return kind ? add_change(w, kind, entry->path, detail) : 0;
+}
+
+/* Reports the children of an archived directory that the archive lacks, whole subtrees for new directories */
+static int scan_new_children(DiffWorker *w, const char *dir)
+{
+    DiffJob *job = w->job;
+    int fd = openat(job->root_fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = fd == -1 ? NULL : fdopendir(fd);
+    if (!d) {
+        perror(dir);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    int rc = 0;
+    struct dirent *de;
+    while (rc == 0 && (de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        char child[PATH_MAX];
+        snprintf(child, sizeof(child), "%s/%s", dir, de->d_name);
+        if (filter_path_excluded(child) || path_find(job->old_paths, child))
+            continue;
+        rc = add_change(w, 'A', child, "");
+        int is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(job->root_fd, child, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (rc == 0 && is_dir)
+            rc = scan_new_children(w, child);
+    }
+    closedir(d);
+    return rc;
+}
+
+/* One old entry against the directory tree */
+static int diff_tree_entry(DiffWorker *w, const myz_entry *entry)
+{
+    DiffJob *job = w->job;
+    struct stat st;
+    if (fstatat(job->root_fd, entry->path, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        if (errno == ENOENT || errno == ENOTDIR)
+            return add_change(w, 'D', entry->path, "");
+        perror(entry->path);
+        return -1;
+    }
+    char target[MAX_PATH_LENGTH] = "";
+    if (S_ISLNK(st.st_mode)) {
+        ssize_t n = readlinkat(job->root_fd, entry->path, target, sizeof(target) - 1);
+        if (n >= 0)
+            target[n] = '\0';
+    }
+    Attr cur = { st.st_mode, st.st_uid, st.st_gid, st.st_mtime, st.st_size, target };
+    if (compare(w, entry, &cur, 0) != 0)
+        return -1;
+    if (S_ISDIR(entry->mode) && S_ISDIR(st.st_mode))
+        return scan_new_children(w, entry->path);
+    return 0;
+}
+
+/* One old entry against the newer archive */
+static int diff_archive_entry(DiffWorker *w, const myz_entry *entry)
+{
+    const PathSlot *slot = path_find(w->job->new_paths, entry->path);
+    if (!slot)
+        return add_change(w, 'D', entry->path, "");
+    myz_entry other;
+    myz_entry_at(w->job->new, slot->record, &other);
+    Attr cur = { other.mode, other.uid, other.gid, other.mtime,
+                 other.size, other.link_target };
+    return compare(w, entry, &cur, slot->record);
+}
+
+static void *diff_worker(void *arg)
+{
+    DiffWorker *w = arg;
+    DiffJob *job = w->job;
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        size_t first = job->next;
+        job->next += DIFF_BATCH;
+        pthread_mutex_unlock(&job->lock);
+        if (first >= job->count)
+            break;
+        size_t last = first + DIFF_BATCH < job->count ? first + DIFF_BATCH : job->count;
+        for (size_t i = first; i < last; i++) {
+            myz_entry entry;
+            myz_entry_at(job->old, i, &entry);
+            if ((entry.flags & MYZ_ENTRY_SUPERSEDED) || !filter_match(job->filter, entry.path))
+                continue;
+            stats_count_entry(entry.mode, entry.is_hardlink);
+            int rc = job->new ? diff_archive_entry(w, &entry) : diff_tree_entry(w, &entry);
+            if (rc != 0)
+                fail(job);
+        }
+    }
+    return NULL;
+}
+
+static int build_path_set(myz_archive *archive, PathSet *set)
+{
+    myz_iter iter;
+    myz_entry entry;
+    myz_iter_init(&iter, archive);
+    while (myz_iter_next(&iter, &entry)) {
+        if (!path_find(set, entry.path) && path_insert(set, entry.path, 0, entry.index) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int cmp_changes(const void *a, const void *b)
+{
+    return strcmp(((const Change *)a)->path, ((const Change *)b)->path);
+}
+
+/* Sorts and prints the changes of all workers, returns whether there were any */
+static int print_changes(DiffWorker *workers, long count)
+{
+    size_t total = 0, n = 0;
+    for (long t = 0; t < count; t++)
+        total += workers[t].count;
+    Change *all = malloc((total ? total : 1) * sizeof(Change));
+    if (!all) {
+        perror("malloc");
+        return -1;
+    }
+    for (long t = 0; t < count; t++) {
+        memcpy(all + n, workers[t].changes, workers[t].count * sizeof(Change));
+        n += workers[t].count;
+    }
+    qsort(all, total, sizeof(Change), cmp_changes);
+    size_t added = 0, removed = 0, modified = 0, metadata = 0;
+    for (size_t i = 0; i < total; i++) {
+        if (all[i].detail[0])
+            printf("%c %s (%s)\n", all[i].kind, all[i].path, all[i].detail);
+        else
+            printf("%c %s\n", all[i].kind, all[i].path);
+        added += all[i].kind == 'A';
+        removed += all[i].kind == 'D';
+        modified += all[i].kind == 'M';
+        metadata += all[i].kind == 'm';
+    }
+    printf("%zu added, %zu removed, %zu modified, %zu metadata-only\n", added, removed, modified, metadata);
+    free(all);
+    return total > 0;
+}
+
+int diff_archive(const char *archive_name, const char *target)
+{
+    struct stat st;
+    if (stat(target, &st) != 0) {
+        perror(target);
+        return 2;
+    }
+    DiffJob job = { NULL, NULL, -1, NULL, NULL, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+    PathSet old_paths = { NULL, 0, 0 }, new_paths = { NULL, 0, 0 };
+    PathFilter *filter = NULL;
+    DiffWorker *workers = NULL;
+    pthread_t *tids = NULL;
+    long threads = 0;
+    int result = 2;
+
+    stats_phase_begin(PHASE_METADATA_READ);
+    int rc = myz_open(archive_name, &job.old);
+    if (rc != MYZ_OK)
+        print_myz_error(archive_name, rc);
+    else if (!S_ISDIR(st.st_mode) && (rc = myz_open(target, &job.new)) != MYZ_OK)
+        print_myz_error(target, rc);
+    stats_phase_end(PHASE_METADATA_READ);
+    if (rc != MYZ_OK)
+        goto out;
+    if (!job.new && (job.root_fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        perror(target);
+        goto out;
+    }
+    // The hash join: every path of each side, to look up the other one's
+    if (build_path_set(job.old, &old_paths) != 0 || (job.new && build_path_set(job.new, &new_paths) != 0))
+        goto out;
+    filter = filter_compile(NULL, 0, 0);
+    if (!filter) {
+        perror("malloc");
+        goto out;
+    }
+    job.old_paths = &old_paths;
+    job.new_paths = &new_paths;
+    job.filter = filter;
+    job.count = myz_entry_count(job.old);
+
+    threads = worker_count((job.count + DIFF_BATCH - 1) / DIFF_BATCH);
+    workers = calloc((size_t)threads, sizeof(DiffWorker));
+    tids = calloc((size_t)threads, sizeof(pthread_t));
+    if (!workers || !tids) {
+        perror("calloc");
+        goto out;
+    }
+    for (long t = 0; t < threads; t++) {
+        workers[t].job = &job;
+        if (diff_content) {
+            workers[t].buf_old = io_alloc(io_buffer_size);
+            workers[t].buf_new = io_alloc(io_buffer_size);
+            if (!workers[t].buf_old || !workers[t].buf_new) {
+                perror("malloc");
+                goto out;
+            }
+        }
+    }
+    stats_phase_begin(PHASE_COMPARE);
+    long started = 0;
+    for (; threads > 1 && started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, diff_worker, &workers[started]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    if (started == 0)
+        diff_worker(&workers[0]);
+    for (long t = 0; t < started; t++)
+        pthread_join(tids[t], NULL);
+    if (job.new) {
+        // Added entries: paths of the newer archive the old one lacks
+        myz_iter iter;
+        myz_entry entry;
+        myz_iter_init(&iter, job.new);
+        while (myz_iter_next(&iter, &entry)) {
+            if (filter_match(filter, entry.path) && !path_find(&old_paths, entry.path) &&
+                add_change(&workers[0], 'A', entry.path, "") != 0)
+                job.failed = 1;
+        }
+    }
+    stats_phase_end(PHASE_COMPARE);
+    int changed = print_changes(workers, threads);
+    if (changed >= 0 && !job.failed)
+        result = changed;
+
+out:
+    for (long t = 0; workers && t < threads; t++) {
+        for (size_t i = 0; i < workers[t].count; i++)
+            free(workers[t].changes[i].path);
+        free(workers[t].changes);
+        free(workers[t].buf_old);
+        free(workers[t].buf_new);
+    }
+    free(workers);
+    free(tids);
+    filter_free(filter);
+    path_set_free(&old_paths);
+    path_set_free(&new_paths);
+    if (job.root_fd != -1)
+        close(job.root_fd);
+    if (job.new)
+        myz_close(job.new);
+    if (job.old)
+        myz_close(job.old);
+    pthread_mutex_destroy(&job.lock);
+    return result;
+}
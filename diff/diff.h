@@ -0,0 +1,16 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+/* --content: compare file contents, not only size and mtime */
+extern int diff_content;
+
+/*
+ * Compares the catalog of an archive against a directory tree (archive
+ * paths resolved relative to it) or against a newer archive, and prints
+ * the added (A), removed (D), modified (M) and metadata-only (m) paths.
+ * Unchanged file contents are never read unless --content is given.
+ * Returns 0 if nothing differs, 1 if something does, 2 on error.
+ */
+int diff_archive(const char *archive_name, const char *target);
+
+#endif // DIFF_H
@@ -0,0 +1,97 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "../structs.h"
+#include "../utils.h"
+#include "../stats.h"
+#include "../io.h"
+#include "../columns.h"
+#include "../query.h"
+#include "f_flag.h"
+
+#define READ_CHUNK 256
+
+static void print_match(const FileMetadata *meta)
+{
+    char mode_str[10];
+    mode_to_string(meta->mode, mode_str);
+    char type = S_ISDIR(meta->mode) ? 'd' : S_ISLNK(meta->mode) ? 'l' : '-';
+    char when[32];
+    struct tm tm;
+    time_t mtime = meta->mtime;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime_r(&mtime, &tm));
+    if (S_ISREG(meta->mode) && meta->logical_size >= 0)
+        printf("%c%s %u %u %lld %s %s\n", type, mode_str, (unsigned)meta->uid, (unsigned)meta->gid,
+               (long long)meta->logical_size, when, meta->path);
+    else
+        printf("%c%s %u %u - %s %s\n", type, mode_str, (unsigned)meta->uid, (unsigned)meta->gid,
+               when, meta->path);
+}
+
+int find_entries(const char *archive_name, const char *expr)
+{
+    Query *query = query_compile(expr);
+    if (!query)
+        return -1;
+    FILE *archive = io_fopen(archive_name, "rb");
+    if (!archive) {
+        perror("Error opening archive");
+        query_free(query);
+        return -1;
+    }
+    ArchiveHeader header;
+    Columns cols;
+    stats_phase_begin(PHASE_METADATA_READ);
+    int rc = read_archive_header(archive, &header);
+    if (rc == 0)
+        rc = columns_read(archive, &header, &cols);
+    stats_phase_end(PHASE_METADATA_READ);
+    if (rc != 0) {
+        io_fclose(archive);
+        query_free(query);
+        return -1;
+    }
+    size_t count = cols.count;
+    unsigned char *mask = malloc(count ? count : 1);
+    FileMetadata *chunk = malloc(READ_CHUNK * sizeof(FileMetadata));
+    stats_phase_begin(PHASE_SEARCH);
+    rc = -1;
+    if (!mask || !chunk)
+        perror("malloc");
+    else if (query_eval(query, &cols, mask) == 0) {
+        rc = 0;
+        /* Only the records of matches are read, a chunk from each match on */
+        MetadataReader reader;
+        metadata_reader_init(&reader, archive, &header);
+        size_t i = 0;
+        while (i < count) {
+            if (!mask[i]) {
+                i++;
+                continue;
+            }
+            reader.next = i;
+            size_t n = metadata_reader_next(&reader, chunk, READ_CHUNK);
+            if (n == 0) {
+                rc = -1;
+                break;
+            }
+            for (size_t j = 0; j < n; j++) {
+                if (mask[i + j] && !(chunk[j].flags & ENTRY_SUPERSEDED)) {
+                    print_match(&chunk[j]);
+                    stats_count_entry(chunk[j].mode, chunk[j].is_hardlink);
+                }
+            }
+            i += n;
+        }
+    }
+    stats_phase_end(PHASE_SEARCH);
+    free(chunk);
+    free(mask);
+    columns_free(&cols);
+    io_fclose(archive);
+    query_free(query);
+    return rc;
+}
@@ -0,0 +1,13 @@
+#ifndef F_FLAG_H
+#define F_FLAG_H
+
+/*
+ * Lists the entries matching a metadata expression (see query.h), one
+ * "type+permissions uid gid size mtime path" line each. The expression is
+ * evaluated over the columnar catalog, only matching records are read.
+ * Returns 0 (with or without matches), or -1 on a bad expression or an
+ * archive that cannot be read.
+ */
+int find_entries(const char *archive_name, const char *expr);
+
+#endif // F_FLAG_H
@@ -0,0 +1,323 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include "filter.h"
+
+#define MAX_ACTIVE 64
+
+typedef struct FilterNode FilterNode;
+
+typedef struct {
+    char *component;
+    FilterNode *child;
+} FilterEdge;
+
+struct FilterNode {
+    FilterEdge *literals;       // Sorted by component after compilation
+    size_t literal_count;
+    FilterEdge *globs;
+    size_t glob_count;
+    FilterNode *any_depth;      // "**" edge, its target loops on every component
+    int loops;                  // Target of a "**" edge
+    int terminal;               // A pattern ends here
+};
+
+typedef struct {
+    FilterNode *root;
+    int active;                 // At least one pattern was added
+} FilterTrie;
+
+struct PathFilter {
+    FilterTrie include;
+    FilterTrie exclude;
+    int flags;
+};
+
+static char **exclude_patterns = NULL;
+static int exclude_count = 0;
+static PathFilter *exclude_filter = NULL;   // Compiled lazily for filter_path_excluded()
+
+static FilterNode *new_node(void)
+{
+    FilterNode *node = calloc(1, sizeof(FilterNode));
+    if (!node) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    return node;
+}
+
+static void free_node(FilterNode *node)
+{
+    if (!node)
+        return;
+    for (size_t i = 0; i < node->literal_count; i++) {
+        free(node->literals[i].component);
+        free_node(node->literals[i].child);
+    }
+    for (size_t i = 0; i < node->glob_count; i++) {
+        free(node->globs[i].component);
+        free_node(node->globs[i].child);
+    }
+    free(node->literals);
+    free(node->globs);
+    free_node(node->any_depth);
+    free(node);
+}
+
+static FilterNode *edge_child(FilterEdge **edges, size_t *count, const char *component)
+{
+    for (size_t i = 0; i < *count; i++) {
+        if (strcmp((*edges)[i].component, component) == 0)
+            return (*edges)[i].child;
+    }
+    FilterEdge *grown = realloc(*edges, (*count + 1) * sizeof(FilterEdge));
+    if (!grown) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    *edges = grown;
+    grown[*count].component = strdup(component);
+    grown[*count].child = new_node();
+    return grown[(*count)++].child;
+}
+
+static int is_glob(const char *component)
+{
+    return strpbrk(component, "*?[") != NULL;
+}
+
+/* Adds one pattern, component by component */
+static void trie_add(FilterTrie *trie, const char *pattern, int exclude)
+{
+    char buf[4096];
+    if (strncmp(pattern, "./", 2) == 0)
+        pattern += 2;
+    if (exclude && !strchr(pattern, '/'))
+        snprintf(buf, sizeof(buf), "**/%s", pattern);
+    else
+        snprintf(buf, sizeof(buf), "%s", pattern);
+    if (!trie->root)
+        trie->root = new_node();
+    trie->active = 1;
+    FilterNode *node = trie->root;
+    char *save = NULL;
+    for (char *comp = strtok_r(buf, "/", &save); comp; comp = strtok_r(NULL, "/", &save)) {
+        if (strcmp(comp, "**") == 0) {
+            if (!node->any_depth) {
+                node->any_depth = new_node();
+                node->any_depth->loops = 1;
+            }
+            node = node->any_depth;
+        } else if (is_glob(comp)) {
+            node = edge_child(&node->globs, &node->glob_count, comp);
+        } else {
+            node = edge_child(&node->literals, &node->literal_count, comp);
+        }
+    }
+    node->terminal = 1;
+}
+
+static int cmp_edges(const void *a, const void *b)
+{
+    return strcmp(((const FilterEdge *)a)->component, ((const FilterEdge *)b)->component);
+}
+
+static void sort_node(FilterNode *node)
+{
+    if (!node)
+        return;
+    qsort(node->literals, node->literal_count, sizeof(FilterEdge), cmp_edges);
+    for (size_t i = 0; i < node->literal_count; i++)
+        sort_node(node->literals[i].child);
+    for (size_t i = 0; i < node->glob_count; i++)
+        sort_node(node->globs[i].child);
+    sort_node(node->any_depth);
+}
+
+static FilterNode *find_literal(const FilterNode *node, const char *component)
+{
+    FilterEdge key;
+    key.component = (char *)component;
+    FilterEdge *edge = bsearch(&key, node->literals, node->literal_count, sizeof(FilterEdge), cmp_edges);
+    return edge ? edge->child : NULL;
+}
+
+/* Adds a node and its "**" target (zero components) to the active set */
+static void activate(const FilterNode **set, int *count, const FilterNode *node)
+{
+    while (node) {
+        for (int i = 0; i < *count; i++) {
+            if (set[i] == node)
+                return;
+        }
+        if (*count == MAX_ACTIVE)
+            return;
+        set[(*count)++] = node;
+        node = node->any_depth;
+    }
+}
+
+/* Renamed collision: "abc(1)" or "abc(1).txt" for the literal "abc" / "abc.txt" */
+static const FilterNode *find_collision(const FilterNode *node, const char *component)
+{
+    const char *open = strrchr(component, '(');
+    if (!open || open == component)
+        return NULL;
+    const char *close = strchr(open, ')');
+    if (!close)
+        return NULL;
+    char candidate[4096];
+    snprintf(candidate, sizeof(candidate), "%.*s%s", (int)(open - component), component, close + 1);
+    FilterNode *child = find_literal(node, candidate);
+    if (child && child->terminal)
+        return child;
+    /* The old prefix rule: "abc" selected everything starting with "abc(" */
+    snprintf(candidate, sizeof(candidate), "%.*s", (int)(open - component), component);
+    child = find_literal(node, candidate);
+    return (child && child->terminal) ? child : NULL;
+}
+
+static int trie_match(const FilterTrie *trie, const char *path, int flags)
+{
+    if (!trie->root)
+        return 0;
+    const FilterNode *set_a[MAX_ACTIVE], *set_b[MAX_ACTIVE];
+    const FilterNode **cur = set_a, **next = set_b;
+    int cur_count = 0;
+    activate(cur, &cur_count, trie->root);
+
+    const char *p = path;
+    if (strncmp(p, "./", 2) == 0)
+        p += 2;
+    char component[4096];
+    while (*p) {
+        while (*p == '/')
+            p++;
+        if (!*p)
+            break;
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len >= sizeof(component))
+            len = sizeof(component) - 1;
+        memcpy(component, p, len);
+        component[len] = '\0';
+        p += len;
+
+        int next_count = 0;
+        for (int i = 0; i < cur_count; i++) {
+            const FilterNode *node = cur[i];
+            if (node->loops)
+                activate(next, &next_count, node);
+            const FilterNode *child = find_literal(node, component);
+            if (child)
+                activate(next, &next_count, child);
+            else if (flags & FILTER_COLLISIONS) {
+                child = find_collision(node, component);
+                if (child)
+                    activate(next, &next_count, child);
+            }
+            for (size_t g = 0; g < node->glob_count; g++) {
+                if (fnmatch(node->globs[g].component, component, 0) == 0)
+                    activate(next, &next_count, node->globs[g].child);
+            }
+        }
+        if (next_count == 0)
+            return 0;
+        /* A pattern matching a parent directory selects the whole subtree */
+        for (int i = 0; i < next_count; i++) {
+            if (next[i]->terminal)
+                return 1;
+        }
+        const FilterNode **tmp = cur;
+        cur = next;
+        next = tmp;
+        cur_count = next_count;
+    }
+    return 0;
+}
+
+int filter_add_exclude(const char *pattern)
+{
+    char **grown = realloc(exclude_patterns, (exclude_count + 1) * sizeof(char *));
+    if (!grown) {
+        perror("realloc");
+        return -1;
+    }
+    exclude_patterns = grown;
+    exclude_patterns[exclude_count] = strdup(pattern);
+    if (!exclude_patterns[exclude_count])
+        return -1;
+    exclude_count++;
+    filter_free(exclude_filter);
+    exclude_filter = NULL;
+    return 0;
+}
+
+int filter_add_exclude_file(const char *file)
+{
+    FILE *in = fopen(file, "r");
+    if (!in) {
+        perror("Error opening exclude file");
+        return -1;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *start = line;
+        while (*start == ' ' || *start == '\t')
+            start++;
+        if (*start == '\0' || *start == '#')
+            continue;
+        if (filter_add_exclude(start) != 0) {
+            fclose(in);
+            return -1;
+        }
+    }
+    fclose(in);
+    return 0;
+}
+
+PathFilter *filter_compile(char **includes, int include_count, int flags)
+{
+    PathFilter *filter = calloc(1, sizeof(PathFilter));
+    if (!filter) {
+        perror("calloc");
+        return NULL;
+    }
+    filter->flags = flags;
+    for (int i = 0; i < include_count; i++)
+        trie_add(&filter->include, includes[i], 0);
+    for (int i = 0; i < exclude_count; i++)
+        trie_add(&filter->exclude, exclude_patterns[i], 1);
+    sort_node(filter->include.root);
+    sort_node(filter->exclude.root);
+    return filter;
+}
+
+void filter_free(PathFilter *filter)
+{
+    if (!filter)
+        return;
+    free_node(filter->include.root);
+    free_node(filter->exclude.root);
+    free(filter);
+}
+
+int filter_match(const PathFilter *filter, const char *path)
+{
+    if (filter->include.active && !trie_match(&filter->include, path, filter->flags))
+        return 0;
+    return !trie_match(&filter->exclude, path, 0);
+}
+
+int filter_path_excluded(const char *path)
+{
+    if (exclude_count == 0)
+        return 0;
+    if (!exclude_filter)
+        exclude_filter = filter_compile(NULL, 0, 0);
+    return exclude_filter && trie_match(&exclude_filter->exclude, path, 0);
+}
@@ -0,0 +1,37 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+/*
+ * Path filter engine shared by create (-c/-a), extract (-x) and delete (-d).
+ *
+ * Patterns are compiled once into a trie of path components:
+ *   - literal components ("dir/sub")      exact edges, binary searched
+ *   - glob components ("*.tmp", "a?c")    fnmatch() edges
+ *   - "**"                                any number of components
+ * A pattern matches a path when it matches the path or one of its parent
+ * directories, so "dir" selects "dir/file" too. Exclude patterns without a
+ * slash match at any depth ("node_modules" == "**" "/node_modules").
+ * Matching walks the path once, with a small set of active trie nodes.
+ */
+
+/* filter_compile() flags */
+#define FILTER_COLLISIONS 0x1   // "abc" also matches renamed collisions "abc(1)"
+
+typedef struct PathFilter PathFilter;
+
+/* Registers --exclude patterns, applied by every compiled filter */
+int filter_add_exclude(const char *pattern);
+/* --exclude-from: one pattern per line, blank lines and '#' comments skipped */
+int filter_add_exclude_file(const char *file);
+
+/* Compiles the include patterns (none = everything) plus the registered excludes */
+PathFilter *filter_compile(char **includes, int include_count, int flags);
+void filter_free(PathFilter *filter);
+
+/* 1 if the path is selected by the includes and not excluded */
+int filter_match(const PathFilter *filter, const char *path);
+
+/* 1 if a registered exclude matches the path (traversal pruning) */
+int filter_path_excluded(const char *path);
+
+#endif // FILTER_H
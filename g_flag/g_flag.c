@@ -0,0 +1,340 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <regex.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "../utils.h"
+#include "../stats.h"
+#include "../io.h"
+#include "../filter.h"
+#include "../libmyz.h"
+#include "../query.h"
+#include "g_flag.h"
+
+int grep_regex = 0;
+int grep_offsets = 0;
+
+typedef struct {
+    const unsigned char *needle;
+    size_t len;
+    regex_t re;                 // --regex
+} Matcher;
+
+/* Regular entries to scan, in data order so the archive is read front to back */
+typedef struct {
+    size_t index;
+    uint32_t volume;
+    off_t offset;
+} GrepItem;
+
+typedef struct {
+    myz_archive *archive;
+    const Matcher *matcher;
+    const GrepItem *items;
+    size_t count;
+    size_t next;                // Next item to hand out
+    long matched;               // Entries with at least one match
+    int failed;
+    pthread_mutex_t lock;       // next, matched, failed and stdout
+} GrepJob;
+
+static int cmp_items(const void *a, const void *b)
+{
+    const GrepItem *x = a, *y = b;
+    if (x->volume != y->volume)
+        return x->volume < y->volume ? -1 : 1;
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return 0;
+}
+
+/*
+ * First occurrence of the needle in [p, p + len), or NULL. With SSE2, 16
+ * positions are tested per step: the first and last needle bytes are
+ * compared against two shifted loads, and only positions where both agree
+ * are checked with memcmp.
+ */
+static const unsigned char *find_substring(const Matcher *m, const unsigned char *p, size_t len)
+{
+    size_t n = m->len;
+    if (n > len)
+        return NULL;
+    if (n == 1)
+        return memchr(p, m->needle[0], len);
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8((char)m->needle[0]);
+    const __m128i last = _mm_set1_epi8((char)m->needle[n - 1]);
+    for (; i + n - 1 + 16 <= len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(p + i + n - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                                  _mm_cmpeq_epi8(block_last, last)));
+        while (mask) {
+            unsigned bit = (unsigned)__builtin_ctz(mask);
+            if (memcmp(p + i + bit + 1, m->needle + 1, n - 2) == 0)
+                return p + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    // Tail (or the whole buffer without SSE2): memchr for the first byte
+    while (i + n <= len) {
+        const unsigned char *hit = memchr(p + i, m->needle[0], len - n + 1 - i);
+        if (!hit)
+            return NULL;
+        if (memcmp(hit + 1, m->needle + 1, n - 1) == 0)
+            return hit;
+        i = (size_t)(hit - p) + 1;
+    }
+    return NULL;
+}
+
+static void report(GrepJob *job, const char *path, off_t offset)
+{
+    pthread_mutex_lock(&job->lock);
+    if (grep_offsets)
+        printf("%s:%lld\n", path, (long long)offset);
+    else
+        printf("%s\n", path);
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Substring matches in a window starting at file offset base, returns the match count */
+static long scan_substring(GrepJob *job, const char *path, const unsigned char *p, size_t len, off_t base)
+{
+    long found = 0;
+    size_t pos = 0;
+    const unsigned char *hit;
+    while ((hit = find_substring(job->matcher, p + pos, len - pos)) != NULL) {
+        found++;
+        report(job, path, base + (hit - p));
+        if (!grep_offsets)
+            break;
+        pos = (size_t)(hit - p) + 1;
+    }
+    return found;
+}
+
+/* Regex matches in one line (NUL-terminated in place), returns the match count */
+static long scan_line(GrepJob *job, const char *path, char *line, off_t base)
+{
+    regmatch_t match;
+    if (regexec(&job->matcher->re, line, 1, &match, 0) != 0)
+        return 0;
+    report(job, path, base + match.rm_so);
+    return 1;
+}
+
+/*
+ * Streams one entry through the matcher. Chunks are read into the buffer
+ * after a carry: the last needle length - 1 bytes for substrings, so
+ * matches across chunk boundaries are found, or the unfinished line for
+ * regexes. Holes of sparse entries break the carry, a pattern cannot
+ * contain the NUL bytes they read as.
+ */
+static long grep_entry(GrepJob *job, const myz_entry *entry, unsigned char *buf, size_t cap)
+{
+    myz_stream *stream;
+    int rc = myz_stream_open(job->archive, entry->index, &stream);
+    if (rc != MYZ_OK) {
+        print_myz_error(entry->path, rc);
+        return -1;
+    }
+    const Matcher *m = job->matcher;
+    size_t keep = grep_regex ? 0 : m->len - 1;
+    size_t carry = 0;
+    off_t base = 0;             // File offset of buf[0]
+    long found = 0;
+    ssize_t n;
+    off_t offset;
+    while ((n = myz_stream_read_chunk(stream, buf + carry, cap - carry, &offset)) > 0) {
+        if (offset != base + (off_t)carry) {
+            if (grep_regex && carry > 0 && (!found || grep_offsets)) {
+                buf[carry] = '\0';
+                found += scan_line(job, entry->path, (char *)buf, base);
+            }
+            memmove(buf, buf + carry, (size_t)n);
+            carry = 0;
+        }
+        base = offset - (off_t)carry;
+        size_t len = carry + (size_t)n;
+        if (!grep_regex) {
+            found += scan_substring(job, entry->path, buf, len, base);
+            carry = len < keep ? len : keep;
+        } else {
+            size_t start = 0;
+            unsigned char *nl;
+            while ((!found || grep_offsets) &&
+                   (nl = memchr(buf + start, '\n', len - start)) != NULL) {
+                *nl = '\0';
+                found += scan_line(job, entry->path, (char *)buf + start, base + (off_t)start);
+                start = (size_t)(nl - buf) + 1;
+            }
+            carry = len - start;
+            if (carry == cap) {
+                // A line longer than the buffer is matched in buffer-sized pieces
+                buf[carry] = '\0';
+                found += scan_line(job, entry->path, (char *)buf, base);
+                carry = 0;
+            }
+        }
+        if (found && !grep_offsets)
+            break;
+        memmove(buf, buf + len - carry, carry);
+        base += (off_t)(len - carry);
+    }
+    if (n < 0) {
+        print_myz_error(entry->path, (int)n);
+        found = -1;
+    } else if (grep_regex && carry > 0 && (!found || grep_offsets)) {
+        // Last line without a newline
+        buf[carry] = '\0';
+        found += scan_line(job, entry->path, (char *)buf, base);
+    }
+    myz_stream_close(stream);
+    return found;
+}
+
+static void *grep_worker(void *arg)
+{
+    GrepJob *job = arg;
+    size_t cap = io_buffer_size;
+    // One spare byte terminates regex lines
+    unsigned char *buf = io_alloc(cap + 1);
+    if (!buf) {
+        perror("malloc");
+        pthread_mutex_lock(&job->lock);
+        job->failed = 1;
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
+    }
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        size_t i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->count)
+            break;
+        myz_entry entry;
+        if (myz_entry_at(job->archive, job->items[i].index, &entry) != MYZ_OK)
+            continue;
+        uint64_t start = stats_now();
+        long found = grep_entry(job, &entry, buf, cap);
+        stats_count_entry(entry.mode, entry.is_hardlink);
+        stats_add_bytes(entry.size > 0 ? entry.size : 0, entry.stored_size);
+        stats_file_done(entry.path, start, entry.size > 0 ? entry.size : 0);
+        pthread_mutex_lock(&job->lock);
+        if (found > 0)
+            job->matched++;
+        else if (found < 0)
+            job->failed = 1;
+        pthread_mutex_unlock(&job->lock);
+    }
+    free(buf);
+    return NULL;
+}
+
+long grep_archive(const char *archive_name, const char *pattern, char **filter, int filter_count)
+{
+    Matcher matcher = { (const unsigned char *)pattern, strlen(pattern), { 0 } };
+    if (matcher.len == 0) {
+        fprintf(stderr, "Empty search pattern\n");
+        return -1;
+    }
+    if (grep_regex) {
+        int rc = regcomp(&matcher.re, pattern, REG_EXTENDED | REG_NEWLINE);
+        if (rc != 0) {
+            char msg[256];
+            regerror(rc, &matcher.re, msg, sizeof(msg));
+            fprintf(stderr, "Invalid regex '%s': %s\n", pattern, msg);
+            return -1;
+        }
+    } else if (matcher.len > io_buffer_size / 2) {
+        fprintf(stderr, "Search pattern longer than half the --buffer-size\n");
+        return -1;
+    }
+
+    stats_phase_begin(PHASE_METADATA_READ);
+    myz_archive *archive;
+    int rc = myz_open(archive_name, &archive);
+    stats_phase_end(PHASE_METADATA_READ);
+    if (rc != MYZ_OK) {
+        print_myz_error("Error opening archive", rc);
+        if (grep_regex)
+            regfree(&matcher.re);
+        return -1;
+    }
+    size_t meta_count = myz_entry_count(archive);
+
+    /* --where: metadata predicate over the columnar catalog */
+    unsigned char *where = NULL;
+    if (where_option) {
+        size_t where_count = 0;
+        where = query_select(archive_name, where_option, &where_count);
+        if (!where || where_count != meta_count) {
+            free(where);
+            myz_close(archive);
+            if (grep_regex)
+                regfree(&matcher.re);
+            return -1;
+        }
+    }
+    PathFilter *path_filter = filter_compile(filter, filter_count, 0);
+    GrepItem *items = malloc((meta_count ? meta_count : 1) * sizeof(GrepItem));
+    if (!path_filter || !items) {
+        perror("malloc");
+        free(where);
+        filter_free(path_filter);
+        free(items);
+        myz_close(archive);
+        if (grep_regex)
+            regfree(&matcher.re);
+        return -1;
+    }
+    size_t count = 0;
+    myz_iter iter;
+    myz_entry entry;
+    myz_iter_init(&iter, archive);
+    while (myz_iter_next(&iter, &entry)) {
+        if (S_ISREG(entry.mode) && filter_match(path_filter, entry.path) && (!where || where[entry.index]))
+            items[count++] = (GrepItem){ entry.index, entry.volume, entry.offset };
+    }
+    filter_free(path_filter);
+    free(where);
+    qsort(items, count, sizeof(GrepItem), cmp_items);
+
+    GrepJob job = { archive, &matcher, items, count, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+    long threads = worker_count(count);
+    stats_phase_begin(PHASE_SEARCH);
+    if (threads == 1) {
+        grep_worker(&job);
+    } else {
+        pthread_t *tids = calloc((size_t)threads, sizeof(pthread_t));
+        long started = 0;
+        if (!tids)
+            perror("calloc");
+        for (; tids && started < threads; started++) {
+            if (pthread_create(&tids[started], NULL, grep_worker, &job) != 0) {
+                perror("pthread_create");
+                break;
+            }
+        }
+        if (started == 0)
+            grep_worker(&job);
+        for (long t = 0; t < started; t++)
+            pthread_join(tids[t], NULL);
+        free(tids);
+    }
+    stats_phase_end(PHASE_SEARCH);
+    pthread_mutex_destroy(&job.lock);
+    free(items);
+    myz_close(archive);
+    if (grep_regex)
+        regfree(&matcher.re);
+    return job.failed && job.matched == 0 ? -1 : job.matched;
+}
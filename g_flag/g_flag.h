@@ -0,0 +1,17 @@
+#ifndef G_FLAG_H
+#define G_FLAG_H
+
+/* --regex: the pattern is a POSIX extended regex matched per line */
+extern int grep_regex;
+/* --offsets: print every match as path:offset instead of the path once */
+extern int grep_offsets;
+
+/*
+ * Searches the content of the regular entries (optionally only those under
+ * the filter paths) for the pattern and prints the matching archive paths.
+ * Nothing is written to disk. Returns the number of matching entries, or -1
+ * on error.
+ */
+long grep_archive(const char *archive_name, const char *pattern, char **filter, int filter_count);
+
+#endif // G_FLAG_H
@@ -0,0 +1,197 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "stats.h"
+#include "io.h"
+#include "governor.h"
+
+#define BURST_NS 100000000ull       // A bucket saves up at most 100 ms worth of tokens
+#define CPU_CHECK_NS 10000000ull    // CPU time is sampled at most every 10 ms
+#define CPU_WINDOW_NS 1000000000ull // and measured over windows of about a second
+#define ADJUST_NS 100000000ull      // --adaptive changes the rates every 100 ms
+#define MIN_RATE (1024.0 * 1024.0)  // and never backs off below 1 MiB/s
+#define MAX_CHILDREN 64             // Running gzip children whose CPU time is counted
+
+unsigned long long governor_read_rate = 0;
+unsigned long long governor_write_rate = 0;
+unsigned int governor_cpu = 0;
+unsigned int governor_adaptive_ms = 0;
+int governor_enabled = 0;
+
+typedef struct {
+    double limit;               // Configured rate, 0 unlimited
+    double rate;                // Current rate, below limit while --adaptive backs off
+    double tokens;              // Negative: debt the callers are sleeping off
+    uint64_t last_ns;           // Last refill
+    // --adaptive: calls and bytes of the current interval
+    uint64_t window_start;
+    uint64_t window_bytes;
+    uint64_t samples, slow;
+    double peak;                // Highest throughput seen, sizes the increase step
+} Bucket;
+
+static Bucket buckets[2];
+static uint64_t cpu_window_start, cpu_window_used, cpu_next_check, cpu_resume;
+static pid_t children[MAX_CHILDREN];
+static int child_count;
+static pthread_mutex_t governor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void sleep_ns(uint64_t ns)
+{
+    struct timespec ts = { (time_t)(ns / 1000000000ull), (long)(ns % 1000000000ull) };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+/* CPU time of all threads, of the running gzip children and of those already waited for */
+static uint64_t cpu_used(void)
+{
+    struct timespec ts;
+    struct rusage ru;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    uint64_t ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    for (int i = 0; i < child_count; i++) {
+        clockid_t clock;
+        // Fails once the child is reaped, RUSAGE_CHILDREN has it then
+        if (clock_getcpuclockid(children[i], &clock) == 0 && clock_gettime(clock, &ts) == 0)
+            ns += (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    }
+    if (getrusage(RUSAGE_CHILDREN, &ru) == 0) {
+        ns += ((uint64_t)ru.ru_utime.tv_sec + (uint64_t)ru.ru_stime.tv_sec) * 1000000000ull;
+        ns += ((uint64_t)ru.ru_utime.tv_usec + (uint64_t)ru.ru_stime.tv_usec) * 1000ull;
+    }
+    return ns;
+}
+
+void governor_init(void)
+{
+    governor_enabled = governor_read_rate || governor_write_rate || governor_cpu || governor_adaptive_ms;
+    uint64_t now = stats_now();
+    buckets[GOV_READ].limit = buckets[GOV_READ].rate = (double)governor_read_rate;
+    buckets[GOV_WRITE].limit = buckets[GOV_WRITE].rate = (double)governor_write_rate;
+    for (int k = 0; k < 2; k++)
+        buckets[k].last_ns = buckets[k].window_start = now;
+    cpu_window_start = now;
+    cpu_window_used = governor_cpu ? cpu_used() : 0;
+}
+
+void governor_child(pid_t pid, int running)
+{
+    if (!governor_cpu)
+        return;
+    pthread_mutex_lock(&governor_lock);
+    if (running && child_count < MAX_CHILDREN) {
+        children[child_count++] = pid;
+    } else if (!running) {
+        for (int i = 0; i < child_count; i++) {
+            if (children[i] == pid) {
+                children[i] = children[--child_count];
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&governor_lock);
+}
+
+/*
+ * --max-cpu: CPU time over the current window may not exceed the share of
+ * its wall time. The excess is turned into a pause every thread passing
+ * through here sleeps until, which also stalls gzip on its full pipe.
+ */
+static uint64_t cpu_pause(uint64_t now)
+{
+    if (now >= cpu_next_check) {
+        cpu_next_check = now + CPU_CHECK_NS;
+        uint64_t used = cpu_used();
+        uint64_t spent = used - cpu_window_used;
+        uint64_t allowed = (now - cpu_window_start) * governor_cpu / 100;
+        if (spent > allowed)
+            cpu_resume = now + (spent - allowed) * 100 / governor_cpu;
+        if (now - cpu_window_start >= CPU_WINDOW_NS) {
+            // The pause already pays for this window, the next one starts after it
+            cpu_window_start = cpu_resume > now ? cpu_resume : now;
+            cpu_window_used = used;
+        }
+    }
+    return cpu_resume > now ? cpu_resume - now : 0;
+}
+
+void governor_wait(int kind, size_t bytes)
+{
+    if (!governor_enabled)
+        return;
+    pthread_mutex_lock(&governor_lock);
+    uint64_t now = stats_now();
+    uint64_t pause = governor_cpu ? cpu_pause(now) : 0;
+    if (kind != GOV_CPU) {
+        Bucket *b = &buckets[kind];
+        if (b->rate > 0) {
+            // Callers queue behind each other's debt
+            b->tokens += b->rate * (double)(now - b->last_ns) / 1e9;
+            double burst = b->rate * (double)BURST_NS / 1e9;
+            if (b->tokens > burst)
+                b->tokens = burst;
+            b->tokens -= (double)bytes;
+            if (b->tokens < 0) {
+                uint64_t debt = (uint64_t)(-b->tokens / b->rate * 1e9);
+                if (debt > pause)
+                    pause = debt;
+            }
+        }
+        b->last_ns = now;
+    }
+    pthread_mutex_unlock(&governor_lock);
+    if (pause > 0)
+        sleep_ns(pause);
+}
+
+/*
+ * --adaptive: additive increase, multiplicative decrease. When more than a
+ * quarter of the calls of an interval took longer than the target the
+ * device is congested and the rate is halved (starting from the measured
+ * throughput when it was unlimited); otherwise it grows by a sixteenth of
+ * the best throughput seen, back up to the configured limit, or to
+ * unlimited when there is none.
+ */
+static void adjust(Bucket *b, uint64_t now)
+{
+    double seconds = (double)(now - b->window_start) / 1e9;
+    double throughput = (double)b->window_bytes / seconds;
+    if (throughput > b->peak)
+        b->peak = throughput;
+    if (b->slow * 4 > b->samples) {
+        double base = b->rate > 0 ? b->rate : throughput;
+        b->rate = base / 2 > MIN_RATE ? base / 2 : MIN_RATE;
+    } else if (b->samples > 0 && b->rate > 0) {
+        double step = b->peak / 16 > MIN_RATE ? b->peak / 16 : MIN_RATE;
+        b->rate += step;
+        if (b->limit > 0 && b->rate >= b->limit)
+            b->rate = b->limit;
+        else if (b->limit == 0 && b->rate >= b->peak * 2)
+            b->rate = 0;
+    }
+    b->window_start = now;
+    b->window_bytes = b->samples = b->slow = 0;
+}
+
+void governor_done(int kind, uint64_t ns, size_t bytes)
+{
+    if (!governor_adaptive_ms || kind == GOV_CPU)
+        return;
+    pthread_mutex_lock(&governor_lock);
+    Bucket *b = &buckets[kind];
+    b->window_bytes += bytes;
+    // Small calls (headers, records) say little about the device
+    if (bytes >= IO_ALIGN) {
+        b->samples++;
+        if (ns > (uint64_t)governor_adaptive_ms * 1000000ull)
+            b->slow++;
+    }
+    uint64_t now = stats_now();
+    if (now - b->window_start >= ADJUST_NS)
+        adjust(b, now);
+    pthread_mutex_unlock(&governor_lock);
+}
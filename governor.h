@@ -0,0 +1,38 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * I/O and CPU governor (--max-read-rate, --max-write-rate, --max-cpu,
+ * --adaptive) for archiving on hosts that also serve latency-sensitive
+ * work. The stats_* I/O wrappers ask it before every read and write and
+ * report how long the call took. Reads and writes each draw from one token
+ * bucket shared by all threads; --max-cpu pauses every thread that reaches
+ * a wrapper while the process and its gzip children are over their CPU
+ * share. Like the stats hooks, everything is a single branch while no
+ * option is given.
+ */
+
+#define GOV_READ  0
+#define GOV_WRITE 1
+#define GOV_CPU   2     // No bytes, only the --max-cpu pause
+
+extern unsigned long long governor_read_rate;   // --max-read-rate, bytes per second (0: unlimited)
+extern unsigned long long governor_write_rate;  // --max-write-rate
+extern unsigned int governor_cpu;               // --max-cpu, percent of one CPU (0: unlimited)
+extern unsigned int governor_adaptive_ms;       // --adaptive, call latency target in ms (0: off)
+extern int governor_enabled;
+
+/* Sets governor_enabled from the options, call once they are parsed */
+void governor_init(void);
+/* Waits until bytes may be read or written (kind GOV_READ / GOV_WRITE) */
+void governor_wait(int kind, size_t bytes);
+/* Registers a gzip child for --max-cpu when it starts (running 1) and after it is reaped */
+void governor_child(pid_t pid, int running);
+/* Reports a finished call, --adaptive adjusts the rates from its latency */
+void governor_done(int kind, uint64_t ns, size_t bytes);
+
+#endif // GOVERNOR_H
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "io.h"
+#include "stats.h"
+#include "utils.h"
+
+size_t io_buffer_size = IO_DEFAULT_BUFFER;
+int io_direct = 0;
+
+/* Buffers handed to setvbuf(), released by io_fclose() */
+typedef struct {
+    FILE *stream;
+    void *buf;
+} StreamBuffer;
+
+static StreamBuffer *stream_buffers = NULL;
+static size_t stream_buffer_count = 0;
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t round_up(size_t size)
+{
+    return (size + IO_ALIGN - 1) & ~(size_t)(IO_ALIGN - 1);
+}
+
+int io_set_buffer_size(unsigned long long size)
+{
+    if (size < IO_ALIGN || size > (1ULL << 30))
+        return -1;
+    io_buffer_size = round_up((size_t)size);
+    return 0;
+}
+
+void *io_alloc(size_t size)
+{
+    void *ptr;
+    if (posix_memalign(&ptr, IO_ALIGN, round_up(size ? size : 1)) != 0)
+        return NULL;
+    return ptr;
+}
+
+static FILE *with_buffer(FILE *stream)
+{
+    if (!stream)
+        return NULL;
+    void *buf = io_alloc(io_buffer_size);
+    pthread_mutex_lock(&stream_lock);
+    StreamBuffer *grown = buf ? realloc(stream_buffers, (stream_buffer_count + 1) * sizeof(StreamBuffer)) : NULL;
+    if (grown) {
+        stream_buffers = grown;
+        stream_buffers[stream_buffer_count++] = (StreamBuffer){ stream, buf };
+    }
+    pthread_mutex_unlock(&stream_lock);
+    // Without memory for a big buffer the stream keeps the stdio default
+    if (!grown)
+        free(buf);
+    else
+        setvbuf(stream, buf, _IOFBF, io_buffer_size);
+    return stream;
+}
+
+FILE *io_fopen(const char *path, const char *mode)
+{
+    return with_buffer(fopen(path, mode));
+}
+
+FILE *io_fdopen(int fd, const char *mode)
+{
+    return with_buffer(fdopen(fd, mode));
+}
+
+int io_fclose(FILE *stream)
+{
+    void *buf = NULL;
+    pthread_mutex_lock(&stream_lock);
+    for (size_t i = 0; i < stream_buffer_count; i++) {
+        if (stream_buffers[i].stream == stream) {
+            buf = stream_buffers[i].buf;
+            stream_buffers[i] = stream_buffers[--stream_buffer_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stream_lock);
+    int rc = 0;
+    if (io_direct) {
+        // Written pages can only be dropped once they are on disk
+        if (fflush(stream) != 0)
+            rc = EOF;
+        int fd = fileno(stream);
+        if (fdatasync(fd) != 0 && errno != EINVAL && errno != EBADF)
+            rc = EOF;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    if (fclose(stream) != 0)
+        rc = EOF;
+    free(buf);
+    return rc;
+}
+
+/* O_NOATIME keeps archiving from changing the atimes it records, it is only allowed to the owner (or root) */
+static int open_noatime(const char *path, int flags)
+{
+    int fd = open(path, flags | O_NOATIME);
+    if (fd == -1 && errno == EPERM)
+        fd = open(path, flags);
+    return fd;
+}
+
+int io_open(IoFile *file, const char *path)
+{
+    file->direct = 0;
+    if (io_direct) {
+        file->fd = open_noatime(path, O_RDONLY | O_CLOEXEC | O_DIRECT);
+        if (file->fd != -1) {
+            file->direct = 1;
+            return 0;
+        }
+        if (errno != EINVAL)
+            return -1;
+        // tmpfs and some network filesystems refuse O_DIRECT
+    }
+    file->fd = open_noatime(path, O_RDONLY | O_CLOEXEC);
+    return file->fd == -1 ? -1 : 0;
+}
+
+DIR *io_opendir(const char *path)
+{
+    int fd = open_noatime(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    return dir;
+}
+
+int io_read_range(IoFile *file, off_t offset, off_t len,
+                  int (*sink)(void *ctx, const void *data, size_t n), void *ctx)
+{
+    if (len <= 0)
+        return 0;
+    // Small files get a small buffer, O_DIRECT needs room for the alignment slack
+    size_t size = (off_t)io_buffer_size < len + IO_ALIGN ? io_buffer_size : round_up((size_t)len + IO_ALIGN);
+    unsigned char *buf = io_alloc(size);
+    if (!buf) {
+        report_perror("malloc");
+        return -1;
+    }
+    int rc = 0;
+    off_t pos = offset, end = offset + len;
+    while (pos < end) {
+        // O_DIRECT reads start on an aligned offset and read whole blocks
+        off_t base = file->direct ? pos & ~(off_t)(IO_ALIGN - 1) : pos;
+        size_t skip = (size_t)(pos - base);
+        size_t want = end - base < (off_t)size ? (size_t)(end - base) : size;
+        if (file->direct)
+            want = round_up(want) < size ? round_up(want) : size;
+        ssize_t n = stats_pread(file->fd, buf, want, base);
+        if (n < 0 && file->direct && errno == EINVAL) {
+            // Alignment the device does not accept: continue through the page cache
+            int flags = fcntl(file->fd, F_GETFL);
+            if (flags != -1 && fcntl(file->fd, F_SETFL, flags & ~O_DIRECT) == 0) {
+                file->direct = 0;
+                continue;
+            }
+        }
+        if (n < 0) {
+            report_perror("Error reading file data");
+            rc = -1;
+            break;
+        }
+        if ((size_t)n <= skip)
+            break;
+        size_t avail = (size_t)n - skip;
+        if ((off_t)avail > end - pos)
+            avail = (size_t)(end - pos);
+        if (sink(ctx, buf + skip, avail) != 0) {
+            rc = -1;
+            break;
+        }
+        pos += (off_t)avail;
+    }
+    free(buf);
+    return rc;
+}
+
+void io_close(IoFile *file)
+{
+    // Files read through the cache are dropped from it after archiving
+    if (io_direct && !file->direct)
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(file->fd);
+    file->fd = -1;
+}
@@ -0,0 +1,54 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <dirent.h>
+
+/*
+ * Shared I/O layer (--buffer-size=SIZE, --direct).
+ *
+ * Archive streams are stdio with one large page-aligned buffer each, so
+ * data and metadata go to the kernel in io_buffer_size writes. The files
+ * being archived are read through IoFile in buffer-sized pieces; with
+ * --direct they are opened O_DIRECT where the filesystem allows it, and
+ * archive streams drop their pages from the cache when closed, so a large
+ * backup does not push other services' data out of the page cache.
+ */
+
+#define IO_ALIGN 4096
+#define IO_DEFAULT_BUFFER (1 << 20)
+
+extern size_t io_buffer_size;   // --buffer-size, a multiple of IO_ALIGN
+extern int io_direct;           // --direct
+
+/* io_buffer_size from a --buffer-size value, -1 if out of range */
+int io_set_buffer_size(unsigned long long size);
+/* Page-aligned allocation, the size is rounded up to IO_ALIGN */
+void *io_alloc(size_t size);
+
+FILE *io_fopen(const char *path, const char *mode);
+FILE *io_fdopen(int fd, const char *mode);
+/* Frees the stream buffer, with --direct also drops the file from the page cache */
+int io_fclose(FILE *stream);
+
+typedef struct {
+    int fd;
+    int direct;                 // Opened O_DIRECT, reads must be aligned
+} IoFile;
+
+/* Opens a file to archive for reading */
+int io_open(IoFile *file, const char *path);
+/*
+ * Reads [offset, offset + len) and passes it to sink in pieces of at most
+ * io_buffer_size bytes. Stops early at end of file (the file shrank).
+ * Returns 0, or -1 on a read error or when sink fails.
+ */
+int io_read_range(IoFile *file, off_t offset, off_t len,
+                  int (*sink)(void *ctx, const void *data, size_t n), void *ctx);
+void io_close(IoFile *file);
+
+/* Opens a directory to walk, O_NOATIME like io_open() so the walk leaves its atime alone */
+DIR *io_opendir(const char *path);
+
+#endif // IO_H
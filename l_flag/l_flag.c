@@ -0,0 +1,90 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "../structs.h"
+#include "../utils.h"
+#include "../stats.h"
+#include "../io.h"
+#include "../tree_index.h"
+#include "l_flag.h"
+
+static void print_entry(const char *name, mode_t mode)
+{
+    if (S_ISDIR(mode))
+        printf("%s/\n", name);
+    else
+        printf("%s\n", name);
+}
+
+/* Without a tree index: one pass over the metadata block */
+static void list_by_scan(FILE *archive, const ArchiveHeader *header, const char *dir)
+{
+    size_t dir_len = dir ? strlen(dir) : 0;
+    MetadataReader reader;
+    metadata_reader_init(&reader, archive, header);
+    FileMetadata chunk[64];
+    size_t n;
+    while ((n = metadata_reader_next(&reader, chunk, sizeof(chunk) / sizeof(chunk[0]))) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            const char *path = chunk[i].path;
+            if (chunk[i].flags & ENTRY_SUPERSEDED)
+                continue;
+            if (!dir) {
+                if (!strchr(path, '/'))
+                    print_entry(path, chunk[i].mode);
+            } else if (strncmp(path, dir, dir_len) == 0 && path[dir_len] == '/' &&
+                       path[dir_len + 1] != '\0' && !strchr(path + dir_len + 1, '/')) {
+                print_entry(path + dir_len + 1, chunk[i].mode);
+            }
+        }
+    }
+}
+
+void list_directory(const char *archive_name, const char *dir)
+{
+    FILE *archive = io_fopen(archive_name, "rb");
+    if (!archive) {
+        perror("Error opening archive");
+        return;
+    }
+    ArchiveHeader header;
+    if (read_archive_header(archive, &header) != 0) {
+        io_fclose(archive);
+        return;
+    }
+    TreeReader tree;
+    if (tree_open(&tree, archive, &header, 0) != 0) {
+        list_by_scan(archive, &header, dir);
+        io_fclose(archive);
+        return;
+    }
+    /* Only the path components and the children are read: O(children) */
+    uint32_t first = tree.hdr.first_root;
+    if (dir) {
+        uint32_t id = tree_lookup(&tree, dir);
+        TreeNode node;
+        if (id == TREE_NONE || tree_node(&tree, id, &node) != 0) {
+            fprintf(stderr, "%s: not found in archive\n", dir);
+            io_fclose(archive);
+            return;
+        }
+        if (!S_ISDIR(node.mode)) {
+            fprintf(stderr, "%s: not a directory\n", dir);
+            io_fclose(archive);
+            return;
+        }
+        first = node.first_child;
+    }
+    char name[MAX_PATH_LENGTH + 1];
+    for (uint32_t id = first; id != TREE_NONE;) {
+        TreeNode node;
+        if (tree_node(&tree, id, &node) != 0 || tree_name(&tree, &node, name, sizeof(name)) != 0)
+            break;
+        print_entry(name, node.mode);
+        id = node.next_sibling;
+    }
+    tree_close(&tree);
+    io_fclose(archive);
+}
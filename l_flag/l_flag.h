@@ -0,0 +1,11 @@
+#ifndef L_FLAG_H
+#define L_FLAG_H
+
+/*
+ * Lists the direct children of one archived directory.
+ * archive_name: The existing archive.
+ * dir: Archived directory path, or NULL to list the top-level entries.
+ */
+void list_directory(const char *archive_name, const char *dir);
+
+#endif // L_FLAG_H
@@ -0,0 +1,1100 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "libmyz.h"
+#include "structs.h"
+#include "utils.h"
+#include "stats.h"
+#include "io.h"
+#include "tree_index.h"
+#include "columns.h"
+#include "volume.h"
+#include "dict.h"
+#include "delta.h"
+#include "blocks.h"
+
+#define STREAM_BUFFER 65536
+#define DELTA_OPS_BUFFER 4096
+
+/* A record that owns stored data, where hard links and delta bases find it */
+typedef struct {
+    uint32_t volume;
+    long offset;
+    ino_t inode;
+    uint64_t dev;
+    size_t record;
+} DataOwner;
+
+struct myz_archive {
+    char name[PATH_MAX];
+    FILE *file;
+    ArchiveHeader header;
+    FileMetadata *metas;
+    DataOwner *owners;          // Regular records that are not hard links, sorted by location
+    size_t owner_count;
+    VolumeTable volumes;
+    Dictionary dict;            // Trained dictionary of ENTRY_DICT entries
+    int *volume_fds;            // -1 until first use, [0] is the archive itself
+    TreeReader tree;
+    int has_tree;
+    pthread_mutex_t lock;       // Lazy volume opens and tree reads
+};
+
+struct myz_stream {
+    myz_archive *archive;
+    int fd;
+    off_t pos;                  // Next stored byte of the payload
+    off_t end;                  // End of the payload
+    off_t size;                 // Logical size of the content
+    SparseExtent *extents;      // Sparse entries only
+    uint64_t extent_count;
+    uint64_t extent;            // Current extent
+    off_t extent_done;          // Bytes of the current extent already returned
+    off_t offset;               // Logical offset of the next chunk (dense entries)
+    off_t read_pos;             // myz_stream_read() position
+    int gzip;
+    int z_done;
+    z_stream z;
+    unsigned char in[STREAM_BUFFER];
+    // ENTRY_DELTA: the payload is a list of operations on the base version,
+    // whose content is decoded once into an unlinked temporary file
+    int delta;
+    FILE *base;
+    int op;                     // Current operation, 0 between operations
+    uint64_t op_offset;         // DELTA_COPY: next base byte
+    uint64_t op_left;
+    unsigned char *ops;         // Operations read ahead from the payload
+    size_t ops_len, ops_pos;
+};
+
+struct myz_writer {
+    char name[PATH_MAX];
+    FILE *out;
+    int flags;
+    long data_offset;
+    MetadataArray marr;
+    FileMetadata cur;           // Entry between myz_write_begin() and myz_write_end()
+    int in_entry;
+    int gzip;
+    z_stream z;
+    unsigned char zbuf[STREAM_BUFFER];
+};
+
+const char *myz_strerror(int err)
+{
+    switch (err) {
+    case MYZ_OK:            return "Success";
+    case MYZ_ERR_IO:        return "I/O error";
+    case MYZ_ERR_NOMEM:     return "Out of memory";
+    case MYZ_ERR_FORMAT:    return "Not a myz archive or corrupt archive";
+    case MYZ_ERR_NOT_FOUND: return "Entry not found";
+    case MYZ_ERR_INVALID:   return "Invalid argument";
+    case MYZ_ERR_DATA:      return "Corrupt compressed data";
+    case MYZ_ERR_VOLUME:    return "Volume file missing";
+    default:                return "Unknown error";
+    }
+}
+
+/* Reading */
+
+static int cmp_owners(const void *a, const void *b)
+{
+    const DataOwner *x = a, *y = b;
+    if (x->volume != y->volume)
+        return x->volume < y->volume ? -1 : 1;
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    if (x->inode != y->inode)
+        return x->inode < y->inode ? -1 : 1;
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    return (x->record > y->record) - (x->record < y->record);
+}
+
+/* Sorted once, so that streams of hard links and deltas never scan the catalog */
+static int build_owners(myz_archive *archive)
+{
+    size_t count = archive->header.metadata_count;
+    archive->owners = malloc((count ? count : 1) * sizeof(DataOwner));
+    if (!archive->owners)
+        return MYZ_ERR_NOMEM;
+    for (size_t i = 0; i < count; i++) {
+        const FileMetadata *meta = &archive->metas[i];
+        if (S_ISREG(meta->mode) && !meta->is_hardlink)
+            archive->owners[archive->owner_count++] = (DataOwner){ meta->volume, meta->data_offset, meta->inode, meta->dev, i };
+    }
+    qsort(archive->owners, archive->owner_count, sizeof(DataOwner), cmp_owners);
+    return MYZ_OK;
+}
+
+/* First owner at or after (volume, offset, inode, dev) */
+static size_t find_owner(const myz_archive *archive, uint32_t volume, long offset, ino_t inode, uint64_t dev)
+{
+    DataOwner key = { volume, offset, inode, dev, 0 };
+    size_t lo = 0, hi = archive->owner_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cmp_owners(&archive->owners[mid], &key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int open_archive(const char *path, myz_archive **out)
+{
+    myz_archive *archive = calloc(1, sizeof(myz_archive));
+    if (!archive)
+        return MYZ_ERR_NOMEM;
+    snprintf(archive->name, sizeof(archive->name), "%s", path);
+    pthread_mutex_init(&archive->lock, NULL);
+    archive->file = io_fopen(path, "rb");
+    if (!archive->file) {
+        myz_close(archive);
+        return MYZ_ERR_IO;
+    }
+    struct stat st;
+    if (fstat(fileno(archive->file), &st) != 0) {
+        myz_close(archive);
+        return MYZ_ERR_IO;
+    }
+    if (stats_fread(&archive->header, 1, HEADER_SIZE, archive->file) != HEADER_SIZE) {
+        myz_close(archive);
+        return MYZ_ERR_FORMAT;
+    }
+    /* The metadata block must lie inside the file */
+    const ArchiveHeader *header = &archive->header;
+    long record_size = is_legacy_archive(header) ? (long)sizeof(LegacyFileMetadata) : (long)sizeof(FileMetadata);
+    if (header->metadata_offset < HEADER_SIZE ||
+        header->metadata_offset + (long)header->metadata_count * record_size > st.st_size) {
+        myz_close(archive);
+        return MYZ_ERR_FORMAT;
+    }
+    /* Catalog at the front (--relayout): everything below is read from this one range */
+    if (!is_legacy_archive(header) && header->data_start > HEADER_SIZE && header->data_start <= st.st_size)
+        posix_fadvise(fileno(archive->file), 0, header->data_start, POSIX_FADV_WILLNEED);
+    archive->metas = malloc((header->metadata_count ? header->metadata_count : 1) * sizeof(FileMetadata));
+    if (!archive->metas) {
+        myz_close(archive);
+        return MYZ_ERR_NOMEM;
+    }
+    MetadataReader reader;
+    metadata_reader_init(&reader, archive->file, header);
+    if (metadata_reader_next(&reader, archive->metas, header->metadata_count) != header->metadata_count ||
+        volume_table_read(archive->file, header, &archive->volumes) != 0 ||
+        dict_read(archive->file, header, &archive->dict) != 0) {
+        myz_close(archive);
+        return MYZ_ERR_FORMAT;
+    }
+    uint32_t volume_count = archive->volumes.count ? archive->volumes.count : 1;
+    archive->volume_fds = malloc(volume_count * sizeof(int));
+    if (!archive->volume_fds || build_owners(archive) != MYZ_OK) {
+        myz_close(archive);
+        return MYZ_ERR_NOMEM;
+    }
+    archive->volume_fds[0] = fileno(archive->file);
+    for (uint32_t v = 1; v < volume_count; v++)
+        archive->volume_fds[v] = -1;
+    archive->has_tree = tree_open(&archive->tree, archive->file, header, 0) == 0;
+    *out = archive;
+    return MYZ_OK;
+}
+
+int myz_open(const char *path, myz_archive **out)
+{
+    *out = NULL;
+    /* The catalog helpers print their errors, here they are only returned */
+    int quiet = quiet_errors;
+    quiet_errors = 1;
+    int rc = open_archive(path, out);
+    quiet_errors = quiet;
+    return rc;
+}
+
+void myz_close(myz_archive *archive)
+{
+    if (!archive)
+        return;
+    if (archive->volume_fds) {
+        for (uint32_t v = 1; v < archive->volumes.count; v++) {
+            if (archive->volume_fds[v] != -1)
+                close(archive->volume_fds[v]);
+        }
+        free(archive->volume_fds);
+    }
+    if (archive->has_tree)
+        tree_close(&archive->tree);
+    volume_table_free(&archive->volumes);
+    dict_free(&archive->dict);
+    free(archive->metas);
+    free(archive->owners);
+    if (archive->file)
+        io_fclose(archive->file);
+    pthread_mutex_destroy(&archive->lock);
+    free(archive);
+}
+
+size_t myz_entry_count(const myz_archive *archive)
+{
+    return archive->header.metadata_count;
+}
+
+int myz_entry_at(const myz_archive *archive, size_t index, myz_entry *entry)
+{
+    if (index >= archive->header.metadata_count)
+        return MYZ_ERR_NOT_FOUND;
+    const FileMetadata *meta = &archive->metas[index];
+    entry->path = meta->path;
+    entry->link_target = meta->link_target;
+    entry->mode = meta->mode;
+    entry->uid = meta->uid;
+    entry->gid = meta->gid;
+    entry->atime = meta->atime;
+    entry->mtime = meta->mtime;
+    entry->ctime = meta->ctime;
+    entry->size = S_ISREG(meta->mode) ? meta->logical_size : 0;
+    entry->stored_size = meta->size;
+    entry->offset = meta->data_offset;
+    entry->inode = (uint64_t)meta->inode;
+    entry->is_hardlink = meta->is_hardlink;
+    entry->flags = meta->flags;
+    entry->volume = meta->volume;
+    entry->index = index;
+    return MYZ_OK;
+}
+
+int myz_lookup(myz_archive *archive, const char *path, myz_entry *entry)
+{
+    if (archive->has_tree) {
+        pthread_mutex_lock(&archive->lock);
+        int quiet = quiet_errors;
+        quiet_errors = 1;
+        uint32_t node = tree_lookup(&archive->tree, path);
+        quiet_errors = quiet;
+        pthread_mutex_unlock(&archive->lock);
+        /* The tree also accepts "dir/", only exact paths match here */
+        if (node == TREE_NONE || strcmp(archive->metas[node].path, path) != 0)
+            return MYZ_ERR_NOT_FOUND;
+        return myz_entry_at(archive, node, entry);
+    }
+    for (size_t i = 0; i < archive->header.metadata_count; i++) {
+        if (strcmp(archive->metas[i].path, path) == 0 && !(archive->metas[i].flags & ENTRY_SUPERSEDED))
+            return myz_entry_at(archive, i, entry);
+    }
+    return MYZ_ERR_NOT_FOUND;
+}
+
+void myz_iter_init(myz_iter *iter, const myz_archive *archive)
+{
+    iter->archive = archive;
+    iter->next = 0;
+}
+
+int myz_iter_next(myz_iter *iter, myz_entry *entry)
+{
+    /* Older versions are only reachable as the base of a delta */
+    while (iter->next < iter->archive->header.metadata_count &&
+           (iter->archive->metas[iter->next].flags & ENTRY_SUPERSEDED))
+        iter->next++;
+    if (iter->next >= iter->archive->header.metadata_count)
+        return 0;
+    myz_entry_at(iter->archive, iter->next++, entry);
+    return 1;
+}
+
+/* Descriptor of a volume, opened on first use */
+static int volume_fd(myz_archive *archive, uint32_t volume)
+{
+    if (volume == 0)
+        return archive->volume_fds[0];
+    if (volume >= archive->volumes.count)
+        return MYZ_ERR_VOLUME;
+    pthread_mutex_lock(&archive->lock);
+    if (archive->volume_fds[volume] == -1) {
+        char path[PATH_MAX];
+        volume_file_path(archive->name, &archive->volumes, volume, path, sizeof(path));
+        archive->volume_fds[volume] = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    int fd = archive->volume_fds[volume];
+    pthread_mutex_unlock(&archive->lock);
+    return fd == -1 ? MYZ_ERR_VOLUME : fd;
+}
+
+/* Decodes the base version of a delta entry into an unlinked temporary file */
+static int open_delta_base(myz_stream *stream, const FileMetadata *meta)
+{
+    myz_archive *archive = stream->archive;
+    size_t count = archive->header.metadata_count;
+    size_t base_index = count;
+    /* Empty files may share the offset of the base, the base has data */
+    for (size_t i = find_owner(archive, meta->delta_base_volume, meta->delta_base, 0, 0);
+         i < archive->owner_count && base_index == count; i++) {
+        const DataOwner *owner = &archive->owners[i];
+        if (owner->volume != meta->delta_base_volume || owner->offset != meta->delta_base)
+            break;
+        if (archive->metas[owner->record].size > 0)
+            base_index = owner->record;
+    }
+    /* Chains get shorter towards the full copy, anything else is corrupt */
+    if (base_index == count ||
+        ((archive->metas[base_index].flags & ENTRY_DELTA) && archive->metas[base_index].delta_depth >= meta->delta_depth))
+        return MYZ_ERR_FORMAT;
+    stream->delta = 1;
+    stream->ops = malloc(DELTA_OPS_BUFFER);
+    if (!stream->ops)
+        return MYZ_ERR_NOMEM;
+    stream->base = tmpfile();
+    if (!stream->base)
+        return MYZ_ERR_IO;
+    myz_stream *base;
+    int rc = myz_stream_open(archive, base_index, &base);
+    if (rc != MYZ_OK)
+        return rc;
+    ssize_t n;
+    while ((n = myz_stream_read(base, stream->in, sizeof(stream->in))) > 0) {
+        if (fwrite(stream->in, 1, (size_t)n, stream->base) != (size_t)n) {
+            n = MYZ_ERR_IO;
+            break;
+        }
+    }
+    myz_stream_close(base);
+    if (n == 0 && fflush(stream->base) != 0)
+        n = MYZ_ERR_IO;
+    return n < 0 ? (int)n : MYZ_OK;
+}
+
+/*
+ * The record a hard link was made from: the owner of the data at the
+ * link's own offset with its inode and device. Inode numbers of different
+ * filesystems collide, and empty files share the offset of the next one. A link keeps the data it was recorded
+ * with, so this may be an older version of its original's path.
+ */
+static const FileMetadata *link_owner(const myz_archive *archive, const FileMetadata *link)
+{
+    size_t i = find_owner(archive, link->volume, link->data_offset, link->inode, link->dev);
+    const DataOwner *owner = &archive->owners[i];
+    if (i < archive->owner_count && owner->volume == link->volume && owner->offset == link->data_offset &&
+        owner->inode == link->inode && owner->dev == link->dev)
+        return &archive->metas[owner->record];
+    return NULL;
+}
+
+/* The record holding the content of an entry: hard links use the entry the link was made from */
+static const FileMetadata *content_meta(const myz_archive *archive, size_t index)
+{
+    const FileMetadata *meta = &archive->metas[index];
+    const FileMetadata *owner = meta->is_hardlink ? link_owner(archive, meta) : NULL;
+    return owner ? owner : meta;
+}
+
+int myz_link_origin(const myz_archive *archive, size_t index, myz_entry *origin)
+{
+    if (index >= archive->header.metadata_count || !S_ISREG(archive->metas[index].mode) ||
+        !archive->metas[index].is_hardlink)
+        return MYZ_ERR_INVALID;
+    const FileMetadata *owner = link_owner(archive, &archive->metas[index]);
+    if (!owner)
+        return MYZ_ERR_NOT_FOUND;
+    return myz_entry_at(archive, (size_t)(owner - archive->metas), origin);
+}
+
+/* Reads the extra data of an empty member written by blocks.c, checking its header */
+static int read_extra_member(int fd, off_t offset, char id, void *data, size_t len)
+{
+    unsigned char head[BLOCK_MEMBER_HEAD];
+    if (stats_pread(fd, head, sizeof(head), offset) != (ssize_t)sizeof(head) ||
+        stats_pread(fd, data, len, offset + BLOCK_MEMBER_HEAD) != (ssize_t)len)
+        return MYZ_ERR_FORMAT;
+    if (head[0] != 0x1f || head[1] != 0x8b || !(head[3] & 4) || head[12] != 'M' || head[13] != (unsigned char)id ||
+        (size_t)(head[14] | head[15] << 8) != len)
+        return MYZ_ERR_FORMAT;
+    return MYZ_OK;
+}
+
+/* Size of the table members of count blocks */
+static off_t block_table_size(uint64_t count)
+{
+    uint64_t chunks = (count + BLOCK_TABLE_CHUNK - 1) / BLOCK_TABLE_CHUNK;
+    return (off_t)(count * sizeof(uint64_t)) + (off_t)chunks * BLOCK_MEMBER_SIZE(0);
+}
+
+/* ENTRY_BLOCKS: the trailer member at the end of the payload, checked against the payload size */
+static int read_block_trailer(int fd, const FileMetadata *meta, BlockTrailer *trailer)
+{
+    off_t member = BLOCK_MEMBER_SIZE(sizeof(*trailer));
+    if (meta->size < member || read_extra_member(fd, meta->data_offset + meta->size - member, 'T', trailer,
+                                                 sizeof(*trailer)) != MYZ_OK)
+        return MYZ_ERR_FORMAT;
+    if (trailer->block_size == 0 || trailer->block_count > (uint64_t)meta->size / sizeof(uint64_t) ||
+        block_table_size(trailer->block_count) > meta->size - member)
+        return MYZ_ERR_FORMAT;
+    return MYZ_OK;
+}
+
+int myz_stream_open(myz_archive *archive, size_t index, myz_stream **out)
+{
+    *out = NULL;
+    if (index >= archive->header.metadata_count || !S_ISREG(archive->metas[index].mode))
+        return MYZ_ERR_INVALID;
+    const FileMetadata *meta = content_meta(archive, index);
+    myz_stream *stream = calloc(1, sizeof(myz_stream));
+    if (!stream)
+        return MYZ_ERR_NOMEM;
+    stream->archive = archive;
+    stream->fd = volume_fd(archive, meta->volume);
+    if (stream->fd < 0) {
+        int rc = stream->fd;
+        free(stream);
+        return rc;
+    }
+    stream->pos = meta->data_offset;
+    stream->end = meta->data_offset + meta->size;
+    stream->size = meta->logical_size;
+    if (meta->is_hardlink)
+        stream->end = stream->pos;      // Original not archived, no content
+    if (meta->flags & ENTRY_SPARSE) {
+        uint64_t count;
+        if (stats_pread(stream->fd, &count, sizeof(count), stream->pos) != (ssize_t)sizeof(count) ||
+            count > (uint64_t)meta->size / sizeof(SparseExtent)) {
+            free(stream);
+            return MYZ_ERR_FORMAT;
+        }
+        stream->extents = malloc((count ? count : 1) * sizeof(SparseExtent));
+        if (!stream->extents) {
+            free(stream);
+            return MYZ_ERR_NOMEM;
+        }
+        ssize_t map_size = (ssize_t)(count * sizeof(SparseExtent));
+        if (stats_pread(stream->fd, stream->extents, (size_t)map_size, stream->pos + (off_t)sizeof(count)) != map_size) {
+            free(stream->extents);
+            free(stream);
+            return MYZ_ERR_FORMAT;
+        }
+        stream->extent_count = count;
+        stream->pos += (off_t)sizeof(count) + map_size;
+    }
+    if (meta->flags & (ENTRY_GZIP | ENTRY_DICT)) {
+        /* gzip wrapper (concatenated members are read as one stream) or zlib with the dictionary */
+        int window = meta->flags & ENTRY_DICT ? MAX_WBITS : 16 + MAX_WBITS;
+        if (inflateInit2(&stream->z, window) != Z_OK) {
+            free(stream->extents);
+            free(stream);
+            return MYZ_ERR_NOMEM;
+        }
+        stream->gzip = 1;
+    }
+    if (meta->flags & ENTRY_DELTA) {
+        int rc = open_delta_base(stream, meta);
+        if (rc != MYZ_OK) {
+            myz_stream_close(stream);
+            return rc;
+        }
+    }
+    *out = stream;
+    return MYZ_OK;
+}
+
+/* Next bytes of the decoded payload, 0 at its end */
+static ssize_t content_read(myz_stream *stream, void *buf, size_t len)
+{
+    if (len > UINT_MAX)
+        len = UINT_MAX;
+    if (!stream->gzip) {
+        off_t left = stream->end - stream->pos;
+        if (left <= 0)
+            return 0;
+        if ((off_t)len > left)
+            len = (size_t)left;
+        ssize_t n = stats_pread(stream->fd, buf, len, stream->pos);
+        if (n < 0)
+            return MYZ_ERR_IO;
+        if (n == 0)
+            return MYZ_ERR_FORMAT;
+        stream->pos += n;
+        return n;
+    }
+    if (stream->z_done)
+        return 0;
+    stats_phase_begin(PHASE_DECOMPRESS);
+    stream->z.next_out = buf;
+    stream->z.avail_out = (uInt)len;
+    ssize_t rc = 0;
+    while (stream->z.avail_out > 0) {
+        if (stream->z.avail_in == 0) {
+            off_t left = stream->end - stream->pos;
+            if (left <= 0)
+                break;
+            size_t chunk = left < (off_t)sizeof(stream->in) ? (size_t)left : sizeof(stream->in);
+            ssize_t n = stats_pread(stream->fd, stream->in, chunk, stream->pos);
+            if (n <= 0) {
+                rc = n < 0 ? MYZ_ERR_IO : MYZ_ERR_FORMAT;
+                break;
+            }
+            stream->pos += n;
+            stream->z.next_in = stream->in;
+            stream->z.avail_in = (uInt)n;
+        }
+        int zr = inflate(&stream->z, Z_NO_FLUSH);
+        if (zr == Z_NEED_DICT) {
+            const Dictionary *dict = &stream->archive->dict;
+            if (dict->size == 0 || inflateSetDictionary(&stream->z, dict->data, dict->size) != Z_OK) {
+                rc = MYZ_ERR_DATA;
+                break;
+            }
+            continue;
+        }
+        if (zr == Z_STREAM_END) {
+            if (stream->z.avail_in == 0 && stream->pos >= stream->end) {
+                stream->z_done = 1;
+                break;
+            }
+            inflateReset(&stream->z);
+        } else if (zr != Z_OK) {
+            rc = MYZ_ERR_DATA;
+            break;
+        }
+    }
+    stats_phase_end(PHASE_DECOMPRESS);
+    size_t produced = len - stream->z.avail_out;
+    if (produced > 0)
+        return (ssize_t)produced;
+    if (rc == 0 && !stream->z_done)
+        rc = MYZ_ERR_DATA;      // Payload ended inside a gzip member
+    return rc;
+}
+
+/* Next byte of the operation stream: 1, 0 at its end, or an error */
+static int ops_byte(myz_stream *stream, unsigned char *c)
+{
+    if (stream->ops_pos == stream->ops_len) {
+        ssize_t n = content_read(stream, stream->ops, DELTA_OPS_BUFFER);
+        if (n <= 0)
+            return (int)n;
+        stream->ops_len = (size_t)n;
+        stream->ops_pos = 0;
+    }
+    *c = stream->ops[stream->ops_pos++];
+    return 1;
+}
+
+static int ops_varint(myz_stream *stream, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        unsigned char c;
+        int rc = ops_byte(stream, &c);
+        if (rc <= 0)
+            return rc < 0 ? rc : MYZ_ERR_FORMAT;
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return MYZ_OK;
+    }
+    return MYZ_ERR_FORMAT;
+}
+
+/* Content of a delta entry: the operations applied to the base, see delta.h */
+static ssize_t delta_read(myz_stream *stream, unsigned char *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        if (stream->op_left == 0) {
+            unsigned char op;
+            int rc = ops_byte(stream, &op);
+            if (rc < 0)
+                return rc;
+            if (rc == 0)
+                break;
+            stream->op = op;
+            rc = MYZ_OK;
+            if (op == DELTA_COPY)
+                rc = ops_varint(stream, &stream->op_offset);
+            else if (op != DELTA_ADD)
+                rc = MYZ_ERR_FORMAT;
+            if (rc == MYZ_OK)
+                rc = ops_varint(stream, &stream->op_left);
+            if (rc != MYZ_OK)
+                return rc;
+            continue;
+        }
+        size_t want = len - done;
+        if ((uint64_t)want > stream->op_left)
+            want = (size_t)stream->op_left;
+        ssize_t n;
+        if (stream->op == DELTA_COPY) {
+            n = pread(fileno(stream->base), buf + done, want, (off_t)stream->op_offset);
+            if (n <= 0)
+                return n < 0 ? MYZ_ERR_IO : MYZ_ERR_FORMAT;
+            stream->op_offset += (uint64_t)n;
+        } else if (stream->ops_pos < stream->ops_len) {
+            n = stream->ops_len - stream->ops_pos < want ? (ssize_t)(stream->ops_len - stream->ops_pos) : (ssize_t)want;
+            memcpy(buf + done, stream->ops + stream->ops_pos, (size_t)n);
+            stream->ops_pos += (size_t)n;
+        } else {
+            n = content_read(stream, buf + done, want);
+            if (n <= 0)
+                return n < 0 ? n : MYZ_ERR_FORMAT;
+        }
+        stream->op_left -= (uint64_t)n;
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+/* Decoded content of a dense entry */
+static ssize_t payload_read(myz_stream *stream, void *buf, size_t len)
+{
+    return stream->delta ? delta_read(stream, buf, len) : content_read(stream, buf, len);
+}
+
+/* Skips the extents that were fully returned */
+static void next_extent(myz_stream *stream)
+{
+    while (stream->extent < stream->extent_count &&
+           stream->extent_done >= stream->extents[stream->extent].length) {
+        stream->extent++;
+        stream->extent_done = 0;
+    }
+}
+
+ssize_t myz_stream_read_chunk(myz_stream *stream, void *buf, size_t len, off_t *offset)
+{
+    if (!stream->extents) {
+        ssize_t n = payload_read(stream, buf, len);
+        if (n > 0) {
+            *offset = stream->offset;
+            stream->offset += n;
+        }
+        return n;
+    }
+    next_extent(stream);
+    if (stream->extent == stream->extent_count)
+        return 0;
+    const SparseExtent *extent = &stream->extents[stream->extent];
+    off_t left = extent->length - stream->extent_done;
+    if ((off_t)len > left)
+        len = (size_t)left;
+    ssize_t n = content_read(stream, buf, len);
+    if (n == 0)
+        return MYZ_ERR_FORMAT;
+    if (n < 0)
+        return n;
+    *offset = extent->offset + stream->extent_done;
+    stream->extent_done += n;
+    return n;
+}
+
+ssize_t myz_stream_read(myz_stream *stream, void *buf, size_t len)
+{
+    if (!stream->extents)
+        return payload_read(stream, buf, len);
+    if (stream->read_pos >= stream->size || len == 0)
+        return 0;
+    next_extent(stream);
+    off_t data = stream->extent < stream->extent_count
+                     ? stream->extents[stream->extent].offset + stream->extent_done
+                     : stream->size;
+    if (stream->read_pos < data) {
+        /* Inside a hole */
+        off_t hole = data - stream->read_pos;
+        size_t n = (off_t)len < hole ? len : (size_t)hole;
+        memset(buf, 0, n);
+        stream->read_pos += (off_t)n;
+        return (ssize_t)n;
+    }
+    off_t offset;
+    ssize_t n = myz_stream_read_chunk(stream, buf, len, &offset);
+    if (n > 0)
+        stream->read_pos = offset + n;
+    return n;
+}
+
+int myz_prefetch(myz_archive *archive, uint32_t volume, off_t offset, off_t length)
+{
+    int fd = volume_fd(archive, volume);
+    if (fd < 0)
+        return fd;
+    int rc = posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+    if (rc != 0) {
+        errno = rc;
+        return MYZ_ERR_IO;
+    }
+    return MYZ_OK;
+}
+
+struct myz_blocks {
+    int fd;
+    uint64_t block_size;
+    uint64_t count;
+    off_t *offsets;             // Of every member, and the end of the last one
+};
+
+int myz_blocks_open(myz_archive *archive, size_t index, myz_blocks **out)
+{
+    *out = NULL;
+    if (index >= archive->header.metadata_count || !S_ISREG(archive->metas[index].mode))
+        return MYZ_ERR_INVALID;
+    const FileMetadata *meta = content_meta(archive, index);
+    if (!(meta->flags & ENTRY_BLOCKS) || meta->is_hardlink)
+        return MYZ_ERR_INVALID;
+    myz_blocks *blocks = calloc(1, sizeof(myz_blocks));
+    if (!blocks)
+        return MYZ_ERR_NOMEM;
+    blocks->fd = volume_fd(archive, meta->volume);
+    if (blocks->fd < 0) {
+        int rc = blocks->fd;
+        free(blocks);
+        return rc;
+    }
+    BlockTrailer trailer;
+    int rc = read_block_trailer(blocks->fd, meta, &trailer);
+    if (rc != MYZ_OK) {
+        free(blocks);
+        return rc;
+    }
+    blocks->block_size = trailer.block_size;
+    blocks->count = trailer.block_count;
+    blocks->offsets = malloc((blocks->count + 1) * sizeof(off_t));
+    uint64_t *sizes = malloc((blocks->count ? blocks->count : 1) * sizeof(uint64_t));
+    if (!blocks->offsets || !sizes) {
+        free(sizes);
+        myz_blocks_close(blocks);
+        return MYZ_ERR_NOMEM;
+    }
+    off_t table = meta->data_offset + meta->size - BLOCK_MEMBER_SIZE(sizeof(trailer)) - block_table_size(blocks->count);
+    off_t member = table;
+    for (uint64_t i = 0; i < blocks->count; i += BLOCK_TABLE_CHUNK) {
+        uint64_t n = blocks->count - i < BLOCK_TABLE_CHUNK ? blocks->count - i : BLOCK_TABLE_CHUNK;
+        if (read_extra_member(blocks->fd, member, 'Z', &sizes[i], n * sizeof(uint64_t)) != MYZ_OK) {
+            free(sizes);
+            myz_blocks_close(blocks);
+            return MYZ_ERR_FORMAT;
+        }
+        member += BLOCK_MEMBER_SIZE(n * sizeof(uint64_t));
+    }
+    /* The members have to fill the payload up to the table */
+    blocks->offsets[0] = meta->data_offset;
+    for (uint64_t i = 0; i < blocks->count; i++) {
+        if (sizes[i] > (uint64_t)(table - blocks->offsets[i])) {
+            free(sizes);
+            myz_blocks_close(blocks);
+            return MYZ_ERR_FORMAT;
+        }
+        blocks->offsets[i + 1] = blocks->offsets[i] + (off_t)sizes[i];
+    }
+    free(sizes);
+    if (blocks->offsets[blocks->count] != table) {
+        myz_blocks_close(blocks);
+        return MYZ_ERR_FORMAT;
+    }
+    *out = blocks;
+    return MYZ_OK;
+}
+
+void myz_blocks_layout(const myz_blocks *blocks, uint64_t *block_size, uint64_t *block_count)
+{
+    *block_size = blocks->block_size;
+    *block_count = blocks->count;
+}
+
+ssize_t myz_blocks_read(myz_blocks *blocks, uint64_t block, void *buf, size_t len)
+{
+    if (block >= blocks->count || len < blocks->block_size || len > UINT_MAX)
+        return MYZ_ERR_INVALID;
+    size_t stored = (size_t)(blocks->offsets[block + 1] - blocks->offsets[block]);
+    unsigned char *in = malloc(stored ? stored : 1);
+    if (!in)
+        return MYZ_ERR_NOMEM;
+    if (stats_pread(blocks->fd, in, stored, blocks->offsets[block]) != (ssize_t)stored) {
+        free(in);
+        return MYZ_ERR_IO;
+    }
+    stats_phase_begin(PHASE_DECOMPRESS);
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    ssize_t rc = MYZ_ERR_NOMEM;
+    if (inflateInit2(&z, 16 + MAX_WBITS) == Z_OK) {
+        z.next_in = in;
+        z.avail_in = (uInt)stored;
+        z.next_out = buf;
+        z.avail_out = (uInt)len;
+        // One whole member, nothing before or after it
+        rc = inflate(&z, Z_FINISH) == Z_STREAM_END && z.avail_in == 0 ? (ssize_t)(len - z.avail_out) : MYZ_ERR_DATA;
+        inflateEnd(&z);
+    }
+    stats_phase_end(PHASE_DECOMPRESS);
+    free(in);
+    return rc;
+}
+
+void myz_blocks_close(myz_blocks *blocks)
+{
+    if (!blocks)
+        return;
+    free(blocks->offsets);
+    free(blocks);
+}
+
+void myz_stream_close(myz_stream *stream)
+{
+    if (!stream)
+        return;
+    if (stream->gzip)
+        inflateEnd(&stream->z);
+    if (stream->base)
+        fclose(stream->base);
+    free(stream->ops);
+    free(stream->extents);
+    free(stream);
+}
+
+/* Writing */
+
+int myz_create(const char *path, int flags, myz_writer **out)
+{
+    *out = NULL;
+    myz_writer *writer = calloc(1, sizeof(myz_writer));
+    if (!writer)
+        return MYZ_ERR_NOMEM;
+    snprintf(writer->name, sizeof(writer->name), "%s", path);
+    writer->flags = flags;
+    writer->out = io_fopen(path, "wb+");
+    if (!writer->out) {
+        free(writer);
+        return MYZ_ERR_IO;
+    }
+    /* Reserve space for the header */
+    if (fseek(writer->out, HEADER_SIZE, SEEK_SET) != 0) {
+        myz_abort(writer);
+        return MYZ_ERR_IO;
+    }
+    writer->data_offset = HEADER_SIZE;
+    if (try_init_metadata_array(&writer->marr) != 0) {
+        myz_abort(writer);
+        return MYZ_ERR_NOMEM;
+    }
+    *out = writer;
+    return MYZ_OK;
+}
+
+static int entry_to_metadata(const myz_entry *info, mode_t type, FileMetadata *meta)
+{
+    if (!info->path || strlen(info->path) >= MAX_PATH_LENGTH)
+        return MYZ_ERR_INVALID;
+    memset(meta, 0, sizeof(*meta));
+    strcpy(meta->path, info->path);
+    meta->mode = (info->mode & ~S_IFMT) | type;
+    meta->uid = info->uid;
+    meta->gid = info->gid;
+    meta->atime = info->atime;
+    meta->mtime = info->mtime;
+    meta->ctime = info->ctime;
+    return MYZ_OK;
+}
+
+static int add_record(myz_writer *writer, const FileMetadata *meta)
+{
+    int quiet = quiet_errors;
+    quiet_errors = 1;
+    int rc = try_add_metadata(&writer->marr, meta) == 0 ? MYZ_OK : MYZ_ERR_NOMEM;
+    quiet_errors = quiet;
+    return rc;
+}
+
+int myz_add_directory(myz_writer *writer, const myz_entry *info)
+{
+    FileMetadata meta;
+    if (writer->in_entry)
+        return MYZ_ERR_INVALID;
+    int rc = entry_to_metadata(info, S_IFDIR, &meta);
+    if (rc != MYZ_OK)
+        return rc;
+    return add_record(writer, &meta);
+}
+
+int myz_add_symlink(myz_writer *writer, const myz_entry *info)
+{
+    FileMetadata meta;
+    if (writer->in_entry || !info->link_target || strlen(info->link_target) >= MAX_PATH_LENGTH)
+        return MYZ_ERR_INVALID;
+    int rc = entry_to_metadata(info, S_IFLNK, &meta);
+    if (rc != MYZ_OK)
+        return rc;
+    strcpy(meta.link_target, info->link_target);
+    return add_record(writer, &meta);
+}
+
+/* Stored bytes go straight to the archive */
+static int emit(myz_writer *writer, const void *buf, size_t len)
+{
+    if (stats_fwrite(buf, 1, len, writer->out) != len)
+        return MYZ_ERR_IO;
+    writer->data_offset += (long)len;
+    return MYZ_OK;
+}
+
+/* Starts the data of writer->cur */
+static int begin_data(myz_writer *writer)
+{
+    writer->cur.data_offset = writer->data_offset;
+    if (writer->flags & MYZ_CREATE_GZIP) {
+        if (deflateInit2(&writer->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return MYZ_ERR_NOMEM;
+        writer->gzip = 1;
+        writer->cur.flags |= ENTRY_GZIP;
+    }
+    writer->in_entry = 1;
+    return MYZ_OK;
+}
+
+static int deflate_out(myz_writer *writer, int flush)
+{
+    int zr;
+    do {
+        writer->z.next_out = writer->zbuf;
+        writer->z.avail_out = sizeof(writer->zbuf);
+        zr = deflate(&writer->z, flush);
+        if (zr == Z_STREAM_ERROR)
+            return MYZ_ERR_DATA;
+        size_t produced = sizeof(writer->zbuf) - writer->z.avail_out;
+        if (produced > 0 && emit(writer, writer->zbuf, produced) != MYZ_OK)
+            return MYZ_ERR_IO;
+    } while (writer->z.avail_out == 0 || (flush == Z_FINISH && zr != Z_STREAM_END));
+    return MYZ_OK;
+}
+
+/* Content bytes of the current entry */
+static int write_content(myz_writer *writer, const void *buf, size_t len)
+{
+    if (!writer->gzip)
+        return emit(writer, buf, len);
+    stats_phase_begin(PHASE_COMPRESS);
+    writer->z.next_in = (Bytef *)buf;
+    writer->z.avail_in = (uInt)len;
+    int rc = deflate_out(writer, Z_NO_FLUSH);
+    stats_phase_end(PHASE_COMPRESS);
+    return rc;
+}
+
+static int end_data(myz_writer *writer)
+{
+    int rc = MYZ_OK;
+    if (writer->gzip) {
+        stats_phase_begin(PHASE_COMPRESS);
+        writer->z.next_in = NULL;
+        writer->z.avail_in = 0;
+        rc = deflate_out(writer, Z_FINISH);
+        deflateEnd(&writer->z);
+        writer->gzip = 0;
+        stats_phase_end(PHASE_COMPRESS);
+    }
+    writer->in_entry = 0;
+    if (rc != MYZ_OK)
+        return rc;
+    writer->cur.size = writer->data_offset - writer->cur.data_offset;
+    stats_add_bytes(writer->cur.logical_size, writer->cur.size);
+    return add_record(writer, &writer->cur);
+}
+
+int myz_write_begin(myz_writer *writer, const myz_entry *info)
+{
+    if (writer->in_entry)
+        return MYZ_ERR_INVALID;
+    int rc = entry_to_metadata(info, S_IFREG, &writer->cur);
+    if (rc != MYZ_OK)
+        return rc;
+    return begin_data(writer);
+}
+
+int myz_write(myz_writer *writer, const void *buf, size_t len)
+{
+    if (!writer->in_entry)
+        return MYZ_ERR_INVALID;
+    while (len > 0) {
+        size_t chunk = len > UINT_MAX ? UINT_MAX : len;
+        int rc = write_content(writer, buf, chunk);
+        if (rc != MYZ_OK)
+            return rc;
+        writer->cur.logical_size += (off_t)chunk;
+        buf = (const char *)buf + chunk;
+        len -= chunk;
+    }
+    return MYZ_OK;
+}
+
+int myz_write_end(myz_writer *writer)
+{
+    if (!writer->in_entry)
+        return MYZ_ERR_INVALID;
+    return end_data(writer);
+}
+
+int myz_add_path(myz_writer *writer, const char *fs_path)
+{
+    if (writer->in_entry)
+        return MYZ_ERR_INVALID;
+    /* The walk of -c: excludes, --order, hard links, sparse files and block compression */
+    int quiet = quiet_errors;
+    quiet_errors = 1;
+    int rc = walk_path(fs_path, writer->out, &writer->data_offset, &writer->marr,
+                       (writer->flags & MYZ_CREATE_GZIP) != 0, 1);
+    quiet_errors = quiet;
+    switch (rc) {
+    case WALK_OK:           return MYZ_OK;
+    case WALK_ERR_NOMEM:    return MYZ_ERR_NOMEM;
+    case WALK_ERR_TOOLONG:  return MYZ_ERR_INVALID;
+    default:                return MYZ_ERR_IO;
+    }
+}
+
+int myz_finish(myz_writer *writer)
+{
+    if (writer->in_entry)
+        return MYZ_ERR_INVALID;
+    int rc = MYZ_OK;
+    int quiet = quiet_errors;
+    quiet_errors = 1;
+    stats_phase_begin(PHASE_METADATA_WRITE);
+    ArchiveHeader header;
+    init_archive_header(&header);
+    header.metadata_count = metadata_total(&writer->marr);
+    header.metadata_offset = writer->data_offset;
+    if (write_metadata_array(&writer->marr, writer->out) != 0 || write_tree_index(writer->out, &header) != 0 ||
+        write_columns(writer->out, &header) != 0)
+        rc = MYZ_ERR_IO;
+    if (rc == MYZ_OK && (fseek(writer->out, 0, SEEK_SET) != 0 ||
+                         stats_fwrite(&header, 1, HEADER_SIZE, writer->out) != HEADER_SIZE))
+        rc = MYZ_ERR_IO;
+    if (io_fclose(writer->out) != 0 && rc == MYZ_OK)
+        rc = MYZ_ERR_IO;
+    stats_phase_end(PHASE_METADATA_WRITE);
+    quiet_errors = quiet;
+    writer->out = NULL;
+    if (rc != MYZ_OK)
+        remove(writer->name);
+    free_metadata_array(&writer->marr);
+    free(writer);
+    return rc;
+}
+
+void myz_abort(myz_writer *writer)
+{
+    if (!writer)
+        return;
+    if (writer->gzip)
+        deflateEnd(&writer->z);
+    if (writer->out) {
+        io_fclose(writer->out);
+        remove(writer->name);
+    }
+    free_metadata_array(&writer->marr);
+    free(writer);
+}
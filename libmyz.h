@@ -0,0 +1,149 @@
+#ifndef LIBMYZ_H
+#define LIBMYZ_H
+
+/*
+ * libmyz: in-process access to myz archives (libmyz.a / libmyz.so).
+ *
+ * Every function returns MYZ_OK or a negative MYZ_ERR_* code and prints
+ * nothing. An opened archive keeps its catalog in memory, so iterating,
+ * looking up and reading entries never re-parses the metadata block.
+ * Entry streams read with pread() and may be used from several threads,
+ * one stream per thread. Compressed entries are inflated with zlib.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MYZ_API __attribute__((visibility("default")))
+
+#define MYZ_OK              0
+#define MYZ_ERR_IO         -1   // System call failed, errno holds the cause
+#define MYZ_ERR_NOMEM      -2
+#define MYZ_ERR_FORMAT     -3   // Not a myz archive, or a corrupt one
+#define MYZ_ERR_NOT_FOUND  -4
+#define MYZ_ERR_INVALID    -5   // Bad argument or call out of order
+#define MYZ_ERR_DATA       -6   // Corrupt compressed data
+#define MYZ_ERR_VOLUME     -7   // Volume file of a multi-volume archive missing
+
+/* myz_entry.flags */
+#define MYZ_ENTRY_GZIP   0x1
+#define MYZ_ENTRY_SPARSE 0x2
+#define MYZ_ENTRY_DICT   0x4     // zlib against the archive's trained dictionary (--dict)
+#define MYZ_ENTRY_DELTA  0x8     // Delta against an older version, streams decode it
+#define MYZ_ENTRY_SUPERSEDED 0x10 // Older version of a path, skipped by myz_iter_next()
+#define MYZ_ENTRY_BLOCKS 0x20    // Compressed in independent blocks, see myz_blocks_open()
+
+typedef struct {
+    const char *path;           // Valid until the archive is closed
+    const char *link_target;    // Symlinks only, "" otherwise
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t atime;
+    time_t mtime;
+    time_t ctime;
+    off_t size;                 // Size of the content (hard links too), -1 if unknown (old compressed entries)
+    off_t stored_size;          // Bytes stored in the archive
+    off_t offset;               // Position of the stored bytes in their volume, for read scheduling
+    uint64_t inode;
+    int is_hardlink;            // Content belongs to another entry, see myz_link_origin()
+    uint32_t flags;             // MYZ_ENTRY_*
+    uint32_t volume;
+    size_t index;
+} myz_entry;
+
+MYZ_API const char *myz_strerror(int err);
+
+/* Reading */
+
+typedef struct myz_archive myz_archive;
+
+MYZ_API int myz_open(const char *path, myz_archive **out);
+MYZ_API void myz_close(myz_archive *archive);
+MYZ_API size_t myz_entry_count(const myz_archive *archive);
+MYZ_API int myz_entry_at(const myz_archive *archive, size_t index, myz_entry *entry);
+/* Exact path lookup, through the tree index when the archive has one */
+MYZ_API int myz_lookup(myz_archive *archive, const char *path, myz_entry *entry);
+
+/*
+ * The entry a hard link was made from, which holds its content. A link
+ * keeps the content it was archived with, so the origin is an older
+ * version (MYZ_ENTRY_SUPERSEDED) when its path was archived again since.
+ * MYZ_ERR_NOT_FOUND if the original is not in the archive.
+ */
+MYZ_API int myz_link_origin(const myz_archive *archive, size_t index, myz_entry *origin);
+
+typedef struct {
+    const myz_archive *archive;
+    size_t next;
+} myz_iter;
+
+MYZ_API void myz_iter_init(myz_iter *iter, const myz_archive *archive);
+/* 1 with the next entry, 0 at the end */
+MYZ_API int myz_iter_next(myz_iter *iter, myz_entry *entry);
+
+/*
+ * Content of a regular entry (hard links read their original's data).
+ * Use either myz_stream_read() or myz_stream_read_chunk() on one stream.
+ */
+typedef struct myz_stream myz_stream;
+
+MYZ_API int myz_stream_open(myz_archive *archive, size_t index, myz_stream **out);
+/* Sequential content, holes of sparse entries read as zeros. Returns bytes, 0 at the end */
+MYZ_API ssize_t myz_stream_read(myz_stream *stream, void *buf, size_t len);
+/*
+ * Next piece of stored content and its offset in the file. Holes of sparse
+ * entries are skipped, so writing every chunk at *offset and extending the
+ * file to the entry size recreates them. Returns bytes, 0 at the end.
+ */
+MYZ_API ssize_t myz_stream_read_chunk(myz_stream *stream, void *buf, size_t len, off_t *offset);
+MYZ_API void myz_stream_close(myz_stream *stream);
+/*
+ * Block-compressed entries (MYZ_ENTRY_BLOCKS) can also be decoded block by
+ * block, from several threads at once: block i holds the content at
+ * i * block_size, every block but the last is full. Streams read them
+ * sequentially like any other entry.
+ */
+typedef struct myz_blocks myz_blocks;
+
+MYZ_API int myz_blocks_open(myz_archive *archive, size_t index, myz_blocks **out);
+MYZ_API void myz_blocks_layout(const myz_blocks *blocks, uint64_t *block_size, uint64_t *block_count);
+/* Decodes one block into buf (at least block_size bytes). Returns its length */
+MYZ_API ssize_t myz_blocks_read(myz_blocks *blocks, uint64_t block, void *buf, size_t len);
+MYZ_API void myz_blocks_close(myz_blocks *blocks);
+/*
+ * Hints that [offset, offset + length) of a volume will be read soon
+ * (posix_fadvise WILLNEED), so the kernel reads it ahead in large requests.
+ */
+MYZ_API int myz_prefetch(myz_archive *archive, uint32_t volume, off_t offset, off_t length);
+
+/* Writing */
+
+/* myz_create() flags */
+#define MYZ_CREATE_GZIP 0x1     // Compress regular file data
+
+typedef struct myz_writer myz_writer;
+
+MYZ_API int myz_create(const char *path, int flags, myz_writer **out);
+/*
+ * Adds a file, symlink or directory tree from the filesystem with the walk
+ * of -c (excludes, --order, hard links, sparse and block-compressed files;
+ * MYZ_CREATE_GZIP compresses like -j). Stops at the first entry that
+ * cannot be stored: MYZ_ERR_INVALID for a path or symlink target longer
+ * than a record holds, MYZ_ERR_IO or MYZ_ERR_NOMEM otherwise.
+ */
+MYZ_API int myz_add_path(myz_writer *writer, const char *fs_path);
+/* Entries built by the caller: path, mode, uid, gid and times are used */
+MYZ_API int myz_add_directory(myz_writer *writer, const myz_entry *info);
+MYZ_API int myz_add_symlink(myz_writer *writer, const myz_entry *info);
+/* A regular file whose content follows in myz_write() calls */
+MYZ_API int myz_write_begin(myz_writer *writer, const myz_entry *info);
+MYZ_API int myz_write(myz_writer *writer, const void *buf, size_t len);
+MYZ_API int myz_write_end(myz_writer *writer);
+/* Writes the catalog, tree index and header, then frees the writer */
+MYZ_API int myz_finish(myz_writer *writer);
+/* Frees the writer and removes the partial archive */
+MYZ_API void myz_abort(myz_writer *writer);
+
+#endif // LIBMYZ_H
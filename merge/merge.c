@@ -0,0 +1,396 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../structs.h"
+#include "../utils.h"
+#include "../stats.h"
+#include "../io.h"
+#include "../tree_index.h"
+#include "../columns.h"
+#include "../volume.h"
+#include "../dict.h"
+#include "../segment.h"
+#include "../pathset.h"
+#include "merge.h"
+
+int merge_policy = MERGE_RENAME;
+
+typedef struct {
+    const char *name;
+    FILE *file;
+    ArchiveHeader header;
+    FileMetadata *metas;
+    unsigned char *keep;        // Record survives the conflict resolution
+    VolumeTable volumes;
+    FILE **volume_files;        // Opened on demand, index 0 unused
+} MergeInput;
+
+int merge_parse_policy(const char *name)
+{
+    if (strcmp(name, "rename") == 0)
+        return MERGE_RENAME;
+    if (strcmp(name, "first") == 0)
+        return MERGE_FIRST;
+    if (strcmp(name, "last") == 0)
+        return MERGE_LAST;
+    if (strcmp(name, "error") == 0)
+        return MERGE_ERROR;
+    return -1;
+}
+
+/* "dir/file.c" -> "dir/file(1).c", the first name not in the set */
+static void unique_path(const PathSet *set, char *path)
+{
+    char original[MAX_PATH_LENGTH];
+    snprintf(original, sizeof(original), "%s", path);
+    const char *slash = strrchr(original, '/');
+    const char *base = slash ? slash + 1 : original;
+    const char *dot = strrchr(base, '.');
+    if (!dot || dot == base)
+        dot = original + strlen(original);
+    int stem = (int)(dot - original);
+    for (unsigned n = 1; ; n++) {
+        snprintf(path, MAX_PATH_LENGTH, "%.*s(%u)%s", stem, original, n, dot);
+        if (!path_find(set, path))
+            return;
+    }
+}
+
+/*
+ * Decides which records survive. Directories present in several inputs are
+ * merged, duplicates inside one input and older versions (-a --delta) are
+ * left alone, every other path found again in a later input is resolved by
+ * merge_policy.
+ */
+static int resolve_conflicts(MergeInput *in, int input_count)
+{
+    PathSet set = { NULL, 0, 0 };
+    int rc = 0;
+    for (int k = 0; k < input_count && rc == 0; k++) {
+        for (size_t i = 0; i < in[k].header.metadata_count; i++) {
+            FileMetadata *meta = &in[k].metas[i];
+            in[k].keep[i] = 1;
+            if (meta->flags & ENTRY_SUPERSEDED)
+                continue;
+            PathSlot *slot = path_find(&set, meta->path);
+            if (!slot) {
+                if (path_insert(&set, meta->path, k, i) != 0) {
+                    rc = -1;
+                    break;
+                }
+                continue;
+            }
+            FileMetadata *owner = &in[slot->input].metas[slot->record];
+            if (slot->input == k)
+                continue;
+            if (S_ISDIR(owner->mode) && S_ISDIR(meta->mode)) {
+                in[k].keep[i] = 0;
+                continue;
+            }
+            if (merge_policy == MERGE_ERROR) {
+                fprintf(stderr, "Path conflict: '%s' exists in %s and %s\n",
+                        meta->path, in[slot->input].name, in[k].name);
+                rc = -1;
+            } else if (merge_policy == MERGE_FIRST) {
+                in[k].keep[i] = 0;
+            } else if (merge_policy == MERGE_LAST) {
+                in[slot->input].keep[slot->record] = 0;
+                slot->path = meta->path;
+                slot->input = k;
+                slot->record = i;
+            } else if (!S_ISDIR(meta->mode)) {
+                /* Rename the later entry */
+                char old_path[MAX_PATH_LENGTH];
+                snprintf(old_path, sizeof(old_path), "%s", meta->path);
+                unique_path(&set, meta->path);
+                printf("Path conflict: '%s' from %s stored as '%s'.\n", old_path, in[k].name, meta->path);
+                rc = path_insert(&set, meta->path, k, i);
+            } else {
+                /* A directory cannot be renamed without its children, rename the earlier entry */
+                int owner_input = slot->input;
+                size_t owner_record = slot->record;
+                slot->path = meta->path;
+                slot->input = k;
+                slot->record = i;
+                char old_path[MAX_PATH_LENGTH];
+                snprintf(old_path, sizeof(old_path), "%s", owner->path);
+                unique_path(&set, owner->path);
+                printf("Path conflict: '%s' from %s stored as '%s'.\n", old_path, in[owner_input].name, owner->path);
+                rc = path_insert(&set, owner->path, owner_input, owner_record);
+            }
+        }
+    }
+    path_set_free(&set);
+    return rc;
+}
+
+static int input_fd(void *ctx, uint32_t volume)
+{
+    MergeInput *in = ctx;
+    if (volume == 0)
+        return fileno(in->file);
+    if (!in->volume_files) {
+        in->volume_files = calloc(in->volumes.count ? in->volumes.count : 1, sizeof(FILE *));
+        if (!in->volume_files) {
+            perror("calloc");
+            return -1;
+        }
+    }
+    if (volume >= in->volumes.count) {
+        fprintf(stderr, "%s refers to missing volume %u\n", in->name, volume);
+        return -1;
+    }
+    if (!in->volume_files[volume])
+        in->volume_files[volume] = volume_open(in->name, &in->volumes, volume);
+    return in->volume_files[volume] ? fileno(in->volume_files[volume]) : -1;
+}
+
+static int cmp_inodes(const void *a, const void *b)
+{
+    ino_t x = *(const ino_t *)a, y = *(const ino_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Hard links find their original by inode on extraction. Inode numbers of
+ * different inputs may collide, so every hard link group after the first
+ * input gets a fresh number above all inodes seen.
+ */
+static ino_t *hardlink_groups(const MergeInput *in, size_t *count)
+{
+    size_t n = 0;
+    ino_t *groups = malloc((in->header.metadata_count ? in->header.metadata_count : 1) * sizeof(ino_t));
+    if (!groups) {
+        perror("malloc");
+        return NULL;
+    }
+    for (size_t i = 0; i < in->header.metadata_count; i++) {
+        if (in->keep[i] && S_ISREG(in->metas[i].mode) && in->metas[i].is_hardlink)
+            groups[n++] = in->metas[i].inode;
+    }
+    qsort(groups, n, sizeof(ino_t), cmp_inodes);
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (unique == 0 || groups[unique - 1] != groups[i])
+            groups[unique++] = groups[i];
+    }
+    *count = unique;
+    return groups;
+}
+
+/* Adds the kept records of one input to the catalog with rebased offsets */
+static int merge_records(MergeInput *in, Segment *segs, size_t seg_count, int remap, ino_t *next_inode, MetadataArray *marr)
+{
+    size_t group_count = 0;
+    ino_t *groups = NULL;
+    if (remap) {
+        groups = hardlink_groups(in, &group_count);
+        if (!groups)
+            return -1;
+    }
+    for (size_t i = 0; i < in->header.metadata_count; i++) {
+        if (!in->keep[i])
+            continue;
+        FileMetadata meta = in->metas[i];
+        if (S_ISREG(meta.mode)) {
+            segment_rebase(segs, seg_count, in->metas, &meta);
+            ino_t *group = groups ? bsearch(&meta.inode, groups, group_count, sizeof(ino_t), cmp_inodes) : NULL;
+            if (group)
+                meta.inode = *next_inode + (ino_t)(group - groups);
+        } else {
+            meta.data_offset = 0;
+        }
+        meta.volume = 0;
+        meta.delta_base_volume = 0;
+        add_metadata(marr, &meta);
+        stats_count_entry(meta.mode, meta.is_hardlink);
+    }
+    *next_inode += (ino_t)group_count;
+    free(groups);
+    return 0;
+}
+
+static void close_inputs(MergeInput *in, int input_count)
+{
+    for (int k = 0; k < input_count; k++) {
+        if (in[k].volume_files) {
+            for (uint32_t v = 1; v < in[k].volumes.count; v++) {
+                if (in[k].volume_files[v])
+                    io_fclose(in[k].volume_files[v]);
+            }
+            free(in[k].volume_files);
+        }
+        volume_table_free(&in[k].volumes);
+        free(in[k].metas);
+        free(in[k].keep);
+        if (in[k].file)
+            io_fclose(in[k].file);
+    }
+    free(in);
+}
+
+int merge_archives(const char *out_name, char *inputs[], int input_count)
+{
+    MergeInput *in = calloc(input_count, sizeof(MergeInput));
+    if (!in) {
+        perror("calloc");
+        return -1;
+    }
+    struct stat out_st;
+    int out_exists = stat(out_name, &out_st) == 0;
+    ino_t next_inode = 0;
+    stats_phase_begin(PHASE_METADATA_READ);
+    for (int k = 0; k < input_count; k++) {
+        in[k].name = inputs[k];
+        in[k].file = io_fopen(inputs[k], "rb");
+        if (!in[k].file) {
+            perror(inputs[k]);
+            stats_phase_end(PHASE_METADATA_READ);
+            close_inputs(in, input_count);
+            return -1;
+        }
+        struct stat st;
+        if (out_exists && fstat(fileno(in[k].file), &st) == 0 &&
+            st.st_dev == out_st.st_dev && st.st_ino == out_st.st_ino) {
+            fprintf(stderr, "Output archive %s is also an input\n", out_name);
+            stats_phase_end(PHASE_METADATA_READ);
+            close_inputs(in, input_count);
+            return -1;
+        }
+        if (read_archive_header(in[k].file, &in[k].header) != 0 ||
+            !(in[k].metas = read_metadata_block(in[k].file, &in[k].header)) ||
+            volume_table_read(in[k].file, &in[k].header, &in[k].volumes) != 0) {
+            fprintf(stderr, "Cannot read archive %s\n", inputs[k]);
+            stats_phase_end(PHASE_METADATA_READ);
+            close_inputs(in, input_count);
+            return -1;
+        }
+        in[k].keep = malloc(in[k].header.metadata_count ? in[k].header.metadata_count : 1);
+        if (!in[k].keep) {
+            perror("malloc");
+            stats_phase_end(PHASE_METADATA_READ);
+            close_inputs(in, input_count);
+            return -1;
+        }
+        for (size_t i = 0; i < in[k].header.metadata_count; i++) {
+            if (in[k].metas[i].inode >= next_inode)
+                next_inode = in[k].metas[i].inode + 1;
+        }
+    }
+    /* Entries are copied still compressed, so all inputs must share one dictionary */
+    Dictionary dict = { NULL, 0, 0 };
+    for (int k = 0; k < input_count; k++) {
+        Dictionary input_dict;
+        if (dict_read(in[k].file, &in[k].header, &input_dict) != 0) {
+            stats_phase_end(PHASE_METADATA_READ);
+            dict_free(&dict);
+            close_inputs(in, input_count);
+            return -1;
+        }
+        if (input_dict.size == 0)
+            continue;
+        if (dict.size == 0) {
+            dict = input_dict;
+            continue;
+        }
+        int same = dict_equal(&dict, &input_dict);
+        dict_free(&input_dict);
+        if (!same) {
+            fprintf(stderr, "Archives with different compression dictionaries cannot be merged (%s)\n", inputs[k]);
+            stats_phase_end(PHASE_METADATA_READ);
+            dict_free(&dict);
+            close_inputs(in, input_count);
+            return -1;
+        }
+    }
+    stats_phase_end(PHASE_METADATA_READ);
+    if (resolve_conflicts(in, input_count) != 0) {
+        dict_free(&dict);
+        close_inputs(in, input_count);
+        return -1;
+    }
+
+    FILE *out = io_fopen(out_name, "wb+");
+    if (!out) {
+        perror("Error creating archive");
+        dict_free(&dict);
+        close_inputs(in, input_count);
+        return -1;
+    }
+    /* Data goes straight to the file descriptor, the header is written last */
+    long out_pos = HEADER_SIZE;
+    if (dict.size && dict_store(out, &out_pos, &dict) != 0) {
+        dict_free(&dict);
+        io_fclose(out);
+        remove(out_name);
+        close_inputs(in, input_count);
+        return -1;
+    }
+    uint32_t dict_size = dict.size;
+    long dict_offset = dict.offset;
+    dict_free(&dict);
+    MetadataArray marr;
+    init_metadata_array(&marr);
+    int rc = 0;
+    for (int k = 0; k < input_count && rc == 0; k++) {
+        size_t count = in[k].header.metadata_count;
+        size_t seg_count;
+        Segment *segs = segments_build(in[k].metas, count, &seg_count);
+        if (!segs) {
+            rc = -1;
+            break;
+        }
+        segments_keep_bases(segs, seg_count, in[k].metas, count, in[k].keep);
+        segments_mark_live(segs, seg_count, in[k].metas, count, in[k].keep);
+        stats_phase_begin(PHASE_COPY);
+        rc = segments_copy(segs, seg_count, input_fd, &in[k], fileno(out), &out_pos);
+        stats_phase_end(PHASE_COPY);
+        if (rc == 0)
+            rc = merge_records(&in[k], segs, seg_count, k > 0, &next_inode, &marr);
+        free(segs);
+    }
+    close_inputs(in, input_count);
+    if (rc != 0) {
+        io_fclose(out);
+        free_metadata_array(&marr);
+        remove(out_name);
+        return -1;
+    }
+
+    stats_phase_begin(PHASE_METADATA_WRITE);
+    ArchiveHeader header;
+    init_archive_header(&header);
+    header.metadata_count = metadata_total(&marr);
+    header.metadata_offset = out_pos;
+    header.dict_size = dict_size;
+    header.dict_offset = dict_offset;
+    if (fseek(out, out_pos, SEEK_SET) != 0 || write_metadata_array(&marr, out) != 0) {
+        perror("Error writing metadata");
+        stats_phase_end(PHASE_METADATA_WRITE);
+        io_fclose(out);
+        free_metadata_array(&marr);
+        remove(out_name);
+        return -1;
+    }
+    free_metadata_array(&marr);
+    rc = write_tree_index(out, &header) != 0 || write_columns(out, &header) != 0 ? -1 : 0;
+    if (rc == 0 && (fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, 1, HEADER_SIZE, out) != HEADER_SIZE)) {
+        perror("Error writing header");
+        rc = -1;
+    }
+    if (io_fclose(out) != 0 && rc == 0) {
+        perror(out_name);
+        rc = -1;
+    }
+    stats_phase_end(PHASE_METADATA_WRITE);
+    if (rc != 0) {
+        remove(out_name);
+        return -1;
+    }
+    printf("Archives merged successfully into %s.\n", out_name);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+/* --on-conflict policies for paths found in more than one input */
+#define MERGE_RENAME 0      // Keep both, the later entry gets a "(1)" suffix
+#define MERGE_FIRST  1      // Keep the entry of the first archive listing it
+#define MERGE_LAST   2      // Keep the entry of the last archive listing it
+#define MERGE_ERROR  3      // Refuse to merge
+
+extern int merge_policy;
+
+/* Returns the policy for its name ("rename", "first", "last", "error"), -1 if unknown */
+int merge_parse_policy(const char *name);
+
+/*
+ * Merges archives into out_name without extracting them: the stored data
+ * (compressed or not) is copied unchanged with copy_file_range(), the data
+ * offsets are rebased and a single catalog is written. Returns 0, or -1
+ * if no output was written (unreadable input, --on-conflict=error conflict,
+ * write error).
+ */
+int merge_archives(const char *out_name, char *inputs[], int input_count);
+
+#endif // MERGE_H
@@ -1,9 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <libgen.h>
 
 #include "structs.h"   // Struct definition (FileMetadata, ArchiveHeader, MetadataArray)
 #include "utils.h"     // Helper functions (mode_to_string, init_metadata_array, generate_unique_filename, κλπ.)
+#include "stats.h"     // --stats instrumentation
+#include "filter.h"    // --exclude / --exclude-from
+#include "volume.h"    // --volumes / --volume-size / --volume-path
+#include "dict.h"      // --dict
+#include "io.h"        // --buffer-size / --direct
+#include "query.h"     // --where
+#include "governor.h"  // --max-read-rate / --max-write-rate / --max-cpu / --adaptive
+#include "delta.h"     // --delta
 
 #include "c_flag/c_flag.h"   // Flag -c (create archive)
 #include "x_flag/x_flag.h"   // Flag -x (extract archive)
@@ -12,22 +21,459 @@
 #include "m_flag/m_flag.h"   // Flag -m (print metadata)
 #include "q_flag/q_flag.h"   // Flag -q (query if entities exist)
 #include "p_flag/p_flag.h"   // Flag -p (print file hierarchy)
+#include "l_flag/l_flag.h"   // Flag -l (list one directory)
+#include "g_flag/g_flag.h"   // Flag -g (search file contents)
+#include "f_flag/f_flag.h"   // Flag -f (find entries by metadata)
+#include "merge/merge.h"     // --merge (combine archives)
+#include "diff/diff.h"       // --diff (compare with a tree or archive)
+#include "catalog_index/catalog_index.h"  // --catalog-index (index over many archives)
+#include "tar/tar.h"         // --from-tar / --to-tar (tar streams)
+#include "watch/watch.h"     // --watch (continuous archiving)
+#include "daemon/daemon.h"   // --daemon / --request (myzd)
+#include "checkpoint.h"      // --checkpoint / --resume
+#include "relayout/relayout.h"  // --relayout (catalog at the front)
 
-/* Global compression flag (-j) */
-int compress_flag = 0;
+/* --stats report format: -1 disabled, 0 text, 1 json */
+static int stats_format = -1;
+
+/* --merge: the positional arguments are the output and the input archives */
+static int merge_mode = 0;
+
+/* --diff: the positional arguments are the archive and a directory or newer archive */
+static int diff_mode = 0;
+
+/* --catalog-index: the positional arguments are a directory of archives and the paths to look up */
+static int catalog_index_mode = 0;
+
+/* --relayout: the positional arguments are archives to move the catalog of */
+static int relayout_mode = 0;
+
+/* --catalog-first: -c relays the archive out once it is complete */
+static int catalog_first = 0;
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s {-c|-a|-x|-m|-d|-p|-l|-g|-f|-j} <archive-file> [files/dirs...]\nUsage of -j: %s {-c|-a} <archive-file> -j [files/dirs...]\n", prog, prog);
+    fprintf(stderr, "Usage of -g: %s -g <archive-file> <pattern> [files/dirs...]\n", prog);
+    fprintf(stderr, "Usage of -f: %s -f <archive-file> '<expression>'  (e.g. 'size>1G && mtime>2026-10-01')\n", prog);
+    fprintf(stderr, "Usage of --merge: %s --merge <out-archive> <archive> [archives...]\n", prog);
+    fprintf(stderr, "Usage of --diff: %s --diff <archive> {<dir>|<newer-archive>}\n", prog);
+    fprintf(stderr, "Usage of --daemon: %s --daemon=<socket> [--max-memory=SIZE]  (or: myzd <socket>)\n", prog);
+    fprintf(stderr, "Usage of --request: %s --request=<socket> {query|stat|list|read} <archive> [paths...]\n", prog);
+    fprintf(stderr, "Usage of --relayout: %s --relayout <archive> [archives...]  (move the catalog to the front)\n", prog);
+    fprintf(stderr, "Usage of --catalog-index: %s --catalog-index <dir> [paths...]  (update the index of dir, or look paths up)\n", prog);
+    fprintf(stderr, "Options:\n  --stats[=text|json]  print a runtime report to stderr at exit\n"
+                    "  --max-memory=SIZE    cap the in-memory catalog of -c/-a (e.g. 256M), spill the rest to disk;\n"
+                    "                       --daemon: cap the catalog cache (default 256M)\n"
+                    "  --exclude=PATTERN    skip matching paths in -c/-a/-x/-d (globs: *, ?, [], **)\n"
+                    "  --exclude-from=FILE  read exclude patterns from FILE, one per line\n"
+                    "  --volumes=N          -c: spread the data over N volume files written in parallel\n"
+                    "  --volume-size=SIZE   -c: start a new volume file every SIZE bytes of input (e.g. 64G)\n"
+                    "  --volume-path=DIR    -c: put the volume files in DIR (repeat for round-robin over disks)\n"
+                    "  --order=ORDER        -c/-a: store directory children by path, type (extension) or size\n"
+                    "  --delta[=DEPTH]      -a: store archived files again as deltas against their previous version,\n"
+                    "                       at most DEPTH deltas in a row (default 8)\n"
+                    "  --watch[=SECONDS]    -c: keep watching the paths and append the changes every SECONDS (default 5)\n"
+                    "  --checkpoint[=SECONDS] -c, -x: journal the progress every SECONDS (default 60)\n"
+                    "  --resume             -c, -x: continue the interrupted run from its last checkpoint\n"
+                    "  --catalog-first      -c: put the catalog at the front of the archive, like --relayout\n"
+                    "  --dict[=SIZE]        -c -j: train a shared compression dictionary (default and max 32K)\n"
+                    "  --buffer-size=SIZE   I/O buffer per stream and file read (default 1M, 4K to 1G)\n"
+                    "  --direct             bypass or drop the page cache for file data (O_DIRECT where supported)\n"
+                    "  --max-read-rate=SIZE  read at most SIZE bytes per second (e.g. 50M)\n"
+                    "  --max-write-rate=SIZE write at most SIZE bytes per second\n"
+                    "  --max-cpu=PERCENT    CPU time of myz and its gzip children, percent of one CPU\n"
+                    "  --adaptive[=MS]      back off the I/O rates while calls take longer than MS (default 20)\n"
+                    "  --regex              -g: the pattern is a POSIX extended regex, matched per line\n"
+                    "  --offsets            -g: print every match as path:offset\n"
+                    "  --threads=N          -g, --diff: worker threads (default: one per CPU)\n"
+                    "  --skip-existing      -x: leave files that already exist alone\n"
+                    "  --overwrite          -x: replace files that already exist\n"
+                    "  --update             -x: replace existing files unless size and mtime match\n"
+                    "  --where=EXPR         -x, -g: only entries matching a -f expression\n"
+                    "  --from-tar FILE      -c: build the archive from a tar file or stream (- for stdin)\n"
+                    "  --to-tar FILE        -x: write the entries as a tar file or stream (- for stdout)\n"
+                    "  --content            --diff: compare file contents, not only size and mtime\n"
+                    "  --on-conflict=POLICY --merge: rename (default), first, last or error for paths in several inputs\n");
+}
+
+/*
+ * Strips the long options (--name[=value]) out of argv so that the
+ * positional layout expected by the flag dispatch below stays the same.
+ * Returns 0 on success, -1 on an unknown option.
+ */
+static int parse_long_options(int *argc, char *argv[]) {
+    int out = 1;
+    for (int i = 1; i < *argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0) {
+            argv[out++] = argv[i];
+            continue;
+        }
+        if (strcmp(arg, "--stats") == 0 || strcmp(arg, "--stats=text") == 0) {
+            stats_format = 0;
+        } else if (strcmp(arg, "--stats=json") == 0) {
+            stats_format = 1;
+        } else if (strncmp(arg, "--exclude=", 10) == 0) {
+            if (filter_add_exclude(arg + 10) != 0)
+                return -1;
+        } else if (strncmp(arg, "--exclude-from=", 15) == 0) {
+            if (filter_add_exclude_file(arg + 15) != 0)
+                return -1;
+        } else if (strncmp(arg, "--max-memory=", 13) == 0) {
+            if (parse_size(arg + 13, &catalog_memory_limit) != 0) {
+                fprintf(stderr, "Invalid size: %s\n", arg + 13);
+                return -1;
+            }
+        } else if (strcmp(arg, "--dict") == 0) {
+            dict_size_option = DICT_MAX_SIZE;
+        } else if (strncmp(arg, "--dict=", 7) == 0) {
+            if (parse_size(arg + 7, &dict_size_option) != 0 ||
+                dict_size_option < 256 || dict_size_option > DICT_MAX_SIZE) {
+                fprintf(stderr, "Invalid dictionary size: %s (256 to 32K)\n", arg + 7);
+                return -1;
+            }
+        } else if (strncmp(arg, "--buffer-size=", 14) == 0) {
+            unsigned long long size;
+            if (parse_size(arg + 14, &size) != 0 || io_set_buffer_size(size) != 0) {
+                fprintf(stderr, "Invalid buffer size: %s (4K to 1G)\n", arg + 14);
+                return -1;
+            }
+        } else if (strncmp(arg, "--max-read-rate=", 16) == 0 || strncmp(arg, "--max-write-rate=", 17) == 0) {
+            int write_rate = arg[6] == 'w';
+            const char *value = arg + (write_rate ? 17 : 16);
+            unsigned long long rate;
+            if (parse_size(value, &rate) != 0 || rate == 0) {
+                fprintf(stderr, "Invalid rate: %s (bytes per second, e.g. 50M)\n", value);
+                return -1;
+            }
+            if (write_rate)
+                governor_write_rate = rate;
+            else
+                governor_read_rate = rate;
+        } else if (strncmp(arg, "--max-cpu=", 10) == 0) {
+            char *end;
+            unsigned long percent = strtoul(arg + 10, &end, 10);
+            if (end == arg + 10 || (*end != '\0' && strcmp(end, "%") != 0) || percent == 0 || percent > 102400) {
+                fprintf(stderr, "Invalid CPU limit: %s (percent of one CPU, e.g. 50)\n", arg + 10);
+                return -1;
+            }
+            governor_cpu = (unsigned int)percent;
+        } else if (strcmp(arg, "--adaptive") == 0 || strncmp(arg, "--adaptive=", 11) == 0) {
+            unsigned long ms = 20;
+            if (arg[10] == '=') {
+                char *end;
+                ms = strtoul(arg + 11, &end, 10);
+                if (end == arg + 11 || *end != '\0' || ms == 0 || ms > 60000) {
+                    fprintf(stderr, "Invalid latency target: %s (milliseconds)\n", arg + 11);
+                    return -1;
+                }
+            }
+            governor_adaptive_ms = (unsigned int)ms;
+        } else if (strncmp(arg, "--order=", 8) == 0) {
+            order_option = order_parse(arg + 8);
+            if (order_option < 0) {
+                fprintf(stderr, "Unknown order: %s (path, type or size)\n", arg + 8);
+                return -1;
+            }
+        } else if (strcmp(arg, "--delta") == 0 || strncmp(arg, "--delta=", 8) == 0) {
+            unsigned long depth = DELTA_DEFAULT_DEPTH;
+            if (arg[7] == '=') {
+                char *end;
+                depth = strtoul(arg + 8, &end, 10);
+                if (end == arg + 8 || *end != '\0' || depth == 0 || depth > 1000) {
+                    fprintf(stderr, "Invalid delta chain depth: %s\n", arg + 8);
+                    return -1;
+                }
+            }
+            delta_max_depth = (unsigned int)depth;
+        } else if (strcmp(arg, "--watch") == 0 || strncmp(arg, "--watch=", 8) == 0) {
+            unsigned long seconds = WATCH_DEFAULT_INTERVAL;
+            if (arg[7] == '=') {
+                char *end;
+                seconds = strtoul(arg + 8, &end, 10);
+                if (end == arg + 8 || *end != '\0' || seconds == 0 || seconds > 86400) {
+                    fprintf(stderr, "Invalid watch interval: %s (seconds)\n", arg + 8);
+                    return -1;
+                }
+            }
+            watch_interval = (unsigned int)seconds;
+        } else if (strcmp(arg, "--checkpoint") == 0 || strncmp(arg, "--checkpoint=", 13) == 0) {
+            unsigned long seconds = CHECKPOINT_DEFAULT_INTERVAL;
+            if (arg[12] == '=') {
+                char *end;
+                seconds = strtoul(arg + 13, &end, 10);
+                if (end == arg + 13 || *end != '\0' || seconds == 0 || seconds > 86400) {
+                    fprintf(stderr, "Invalid checkpoint interval: %s (seconds)\n", arg + 13);
+                    return -1;
+                }
+            }
+            checkpoint_interval = (unsigned int)seconds;
+        } else if (strcmp(arg, "--resume") == 0) {
+            resume_flag = 1;
+        } else if (strcmp(arg, "--direct") == 0) {
+            io_direct = 1;
+        } else if (strcmp(arg, "--regex") == 0) {
+            grep_regex = 1;
+        } else if (strcmp(arg, "--offsets") == 0) {
+            grep_offsets = 1;
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            char *end;
+            unsigned long n = strtoul(arg + 10, &end, 10);
+            if (*end != '\0' || n == 0 || n > 1024) {
+                fprintf(stderr, "Invalid thread count: %s\n", arg + 10);
+                return -1;
+            }
+            thread_option = (unsigned int)n;
+        } else if (strcmp(arg, "--skip-existing") == 0) {
+            restore_policy = RESTORE_SKIP;
+        } else if (strcmp(arg, "--overwrite") == 0) {
+            restore_policy = RESTORE_OVERWRITE;
+        } else if (strcmp(arg, "--update") == 0) {
+            restore_policy = RESTORE_UPDATE;
+        } else if (strncmp(arg, "--where=", 8) == 0) {
+            where_option = arg + 8;
+        } else if (strncmp(arg, "--from-tar", 10) == 0 || strncmp(arg, "--to-tar", 8) == 0) {
+            // --from-tar FILE or --from-tar=FILE, "-" being the standard stream
+            int from = arg[2] == 'f';
+            const char *value = arg + (from ? 10 : 8);
+            if (*value == '=') {
+                value++;
+            } else if (*value == '\0' && i + 1 < *argc) {
+                value = argv[++i];
+            } else {
+                fprintf(stderr, "Unknown option: %s\n", arg);
+                return -1;
+            }
+            if (*value == '\0') {
+                fprintf(stderr, "%s needs a tar file or -\n", from ? "--from-tar" : "--to-tar");
+                return -1;
+            }
+            if (from)
+                from_tar_option = value;
+            else
+                to_tar_option = value;
+        } else if (strncmp(arg, "--daemon=", 9) == 0 && arg[9]) {
+            daemon_socket = arg + 9;
+        } else if (strncmp(arg, "--request=", 10) == 0 && arg[10]) {
+            request_socket = arg + 10;
+        } else if (strcmp(arg, "--diff") == 0) {
+            diff_mode = 1;
+        } else if (strcmp(arg, "--catalog-index") == 0) {
+            catalog_index_mode = 1;
+        } else if (strcmp(arg, "--relayout") == 0) {
+            relayout_mode = 1;
+        } else if (strcmp(arg, "--catalog-first") == 0) {
+            catalog_first = 1;
+        } else if (strcmp(arg, "--content") == 0) {
+            diff_content = 1;
+        } else if (strcmp(arg, "--merge") == 0) {
+            merge_mode = 1;
+        } else if (strncmp(arg, "--on-conflict=", 14) == 0) {
+            merge_policy = merge_parse_policy(arg + 14);
+            if (merge_policy < 0) {
+                fprintf(stderr, "Unknown conflict policy: %s\n", arg + 14);
+                return -1;
+            }
+        } else if (strncmp(arg, "--volumes=", 10) == 0) {
+            char *end;
+            unsigned long n = strtoul(arg + 10, &end, 10);
+            if (*end != '\0' || n == 0 || n > 4096) {
+                fprintf(stderr, "Invalid volume count: %s\n", arg + 10);
+                return -1;
+            }
+            volume_count_option = (unsigned int)n;
+        } else if (strncmp(arg, "--volume-size=", 14) == 0) {
+            if (parse_size(arg + 14, &volume_size_option) != 0 || volume_size_option == 0) {
+                fprintf(stderr, "Invalid size: %s\n", arg + 14);
+                return -1;
+            }
+        } else if (strncmp(arg, "--volume-path=", 14) == 0) {
+            if (volume_add_path(arg + 14) != 0)
+                return -1;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            return -1;
+        }
+    }
+    *argc = out;
+    argv[out] = NULL;
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
+    if (parse_long_options(&argc, argv) != 0)
+        return EXIT_FAILURE;
+    governor_init();
+    /* Started as myzd: the daemon, on the socket given as the first argument */
+    char prog[1024];
+    snprintf(prog, sizeof(prog), "%s", argv[0]);
+    if (strcmp(basename(prog), "myzd") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Usage: myzd <socket> [--max-memory=SIZE]\n");
+            return EXIT_FAILURE;
+        }
+        daemon_socket = argv[1];
+        argc = 1;
+    }
+    if (daemon_socket) {
+        if (argc != 1) {
+            fprintf(stderr, "--daemon takes no other arguments\n");
+            return EXIT_FAILURE;
+        }
+        return daemon_run(daemon_socket, catalog_memory_limit) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (request_socket) {
+        if (argc < 2) {
+            fprintf(stderr, "Usage: %s --request=<socket> {query|stat|list|read} <archive> [paths...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return daemon_request(request_socket, &argv[1], argc - 1) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (catalog_index_mode) {
+        if (argc < 2) {
+            fprintf(stderr, "Usage: %s --catalog-index <dir> [paths...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (stats_format >= 0)
+            stats_init("--catalog-index", stats_format);
+        int result = argc == 2 ? (catalog_index_update(argv[1]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE)
+                               : catalog_index_query(argv[1], &argv[2], argc - 2);
+        stats_report(stderr);
+        return result;
+    }
+    if (relayout_mode) {
+        if (argc < 2) {
+            fprintf(stderr, "Usage: %s --relayout <archive> [archives...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (stats_format >= 0)
+            stats_init("--relayout", stats_format);
+        int result = EXIT_SUCCESS;
+        for (int i = 1; i < argc; i++) {
+            if (relayout_archive(argv[i]) != 0)
+                result = EXIT_FAILURE;
+        }
+        stats_report(stderr);
+        return result;
+    }
     if (argc < 3) {
-        fprintf(stderr, "Usage: %s {-c|-a|-x|-m|-d|-p|-j} <archive-file> [files/dirs...]\nUsage of -j: %s {-c|-a} <archive-file> -j [files/dirs...]\n", argv[0], argv[0]);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (volume_count_option && volume_size_option) {
+        fprintf(stderr, "Use either --volumes or --volume-size\n");
+        return EXIT_FAILURE;
+    }
+    if (merge_mode) {
+        if (volume_mode_requested()) {
+            fprintf(stderr, "Volume options only apply to -c\n");
+            return EXIT_FAILURE;
+        }
+        if (stats_format >= 0)
+            stats_init("--merge", stats_format);
+        int result = merge_archives(argv[1], &argv[2], argc - 2) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        stats_report(stderr);
+        return result;
+    }
+    if (diff_mode) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s --diff <archive> {<dir>|<newer-archive>}\n", argv[0]);
+            return 2;
+        }
+        if (stats_format >= 0)
+            stats_init("--diff", stats_format);
+        int result = diff_archive(argv[1], argv[2]);
+        stats_report(stderr);
+        return result;
+    }
+    if (volume_mode_requested() && strcmp(argv[1], "-c") != 0) {
+        fprintf(stderr, "Volume options only apply to -c\n");
+        return EXIT_FAILURE;
+    }
+    if (dict_size_option && (strcmp(argv[1], "-c") != 0 || argc < 4 || strcmp(argv[3], "-j") != 0)) {
+        fprintf(stderr, "--dict only applies to -c with -j\n");
+        return EXIT_FAILURE;
+    }
+    if (restore_policy != RESTORE_RENAME && strcmp(argv[1], "-x") != 0) {
+        fprintf(stderr, "--skip-existing, --overwrite and --update only apply to -x\n");
+        return EXIT_FAILURE;
+    }
+    if (order_option != ORDER_NONE && strcmp(argv[1], "-c") != 0 && strcmp(argv[1], "-a") != 0) {
+        fprintf(stderr, "--order only applies to -c and -a\n");
+        return EXIT_FAILURE;
+    }
+    if (delta_max_depth && strcmp(argv[1], "-a") != 0 && !(watch_interval && strcmp(argv[1], "-c") == 0)) {
+        fprintf(stderr, "--delta only applies to -a and -c --watch\n");
+        return EXIT_FAILURE;
+    }
+    if (where_option && strcmp(argv[1], "-x") != 0 && strcmp(argv[1], "-g") != 0) {
+        fprintf(stderr, "--where only applies to -x and -g\n");
+        return EXIT_FAILURE;
+    }
+    if (from_tar_option && strcmp(argv[1], "-c") != 0) {
+        fprintf(stderr, "--from-tar only applies to -c\n");
+        return EXIT_FAILURE;
+    }
+    if (to_tar_option && strcmp(argv[1], "-x") != 0) {
+        fprintf(stderr, "--to-tar only applies to -x\n");
+        return EXIT_FAILURE;
+    }
+    if (watch_interval && (strcmp(argv[1], "-c") != 0 || from_tar_option)) {
+        fprintf(stderr, "--watch only applies to -c with files/dirs\n");
+        return EXIT_FAILURE;
+    }
+    if (from_tar_option && (dict_size_option || volume_mode_requested() || order_option != ORDER_NONE)) {
+        fprintf(stderr, "--from-tar does not combine with --dict, volumes or --order\n");
+        return EXIT_FAILURE;
+    }
+    if (catalog_first && (strcmp(argv[1], "-c") != 0 || watch_interval)) {
+        fprintf(stderr, "--catalog-first only applies to -c (without --watch)\n");
         return EXIT_FAILURE;
     }
-    if (strcmp(argv[1], "-c") == 0) {
+    if (checkpoint_interval || resume_flag) {
+        if (strcmp(argv[1], "-c") != 0 && strcmp(argv[1], "-x") != 0) {
+            fprintf(stderr, "--checkpoint and --resume only apply to -c and -x\n");
+            return EXIT_FAILURE;
+        }
+        if (watch_interval || from_tar_option || to_tar_option || dict_size_option || volume_mode_requested()) {
+            fprintf(stderr, "--checkpoint and --resume do not combine with --watch, tar streams, --dict or volumes\n");
+            return EXIT_FAILURE;
+        }
+        // The resumed run goes on checkpointing
+        if (!checkpoint_interval)
+            checkpoint_interval = CHECKPOINT_DEFAULT_INTERVAL;
+    }
+    if (stats_format >= 0)
+        stats_init(argv[1], stats_format);
+    if (strcmp(argv[1], "-c") == 0 && from_tar_option) {
+        int paths = argc - ((argc >= 4 && strcmp(argv[3], "-j") == 0) ? 4 : 3);
+        if (paths > 0) {
+            fprintf(stderr, "--from-tar takes no files/dirs, the tar stream is the input\n");
+            return EXIT_FAILURE;
+        }
+        compress_flag = argc >= 4;
+        tar_import(argv[2], from_tar_option);
+        if (catalog_first && relayout_archive(argv[2]) != 0)
+            return EXIT_FAILURE;
+    } else if (strcmp(argv[1], "-x") == 0 && to_tar_option) {
+        int result = tar_export(argv[2], to_tar_option, &argv[3], argc > 3 ? argc - 3 : 0);
+        stats_report(stderr);
+        return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if (strcmp(argv[1], "-c") == 0 && watch_interval) {
+        int first = (argc >= 4 && strcmp(argv[3], "-j") == 0) ? 4 : 3;
+        compress_flag = first == 4;
+        int result = watch_archive(argv[2], &argv[first], argc - first);
+        stats_report(stderr);
+        return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if (strcmp(argv[1], "-c") == 0) {
         if (argc >= 4 && strcmp(argv[3], "-j") == 0) {
             compress_flag = 1;
             create_archive(argv[2], &argv[4], argc - 4);
         } else {
             create_archive(argv[2], &argv[3], argc - 3);
         }
+        if (catalog_first && relayout_archive(argv[2]) != 0)
+            return EXIT_FAILURE;
     } else if (strcmp(argv[1], "-x") == 0) {
         int filter_count = (argc > 3) ? (argc - 3) : 0;
         extract_archive(argv[2], &argv[3], filter_count);
@@ -48,6 +494,23 @@ int main(int argc, char *argv[]) {
         query_archive(argv[2], &argv[3], argc - 3);
     } else if (strcmp(argv[1], "-p") == 0) {
         print_hierarchy(argv[2]);
+    } else if (strcmp(argv[1], "-l") == 0) {
+        list_directory(argv[2], argc > 3 ? argv[3] : NULL);
+    } else if (strcmp(argv[1], "-g") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "Usage: %s -g <archive-file> <pattern> [files/dirs...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        long matched = grep_archive(argv[2], argv[3], &argv[4], argc - 4);
+        stats_report(stderr);
+        return matched > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if (strcmp(argv[1], "-f") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: %s -f <archive-file> '<expression>'\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (find_entries(argv[2], argv[3]) != 0)
+            return EXIT_FAILURE;
     } else if (strcmp(argv[1], "-d") == 0) {
         if (argc < 4) {
             fprintf(stderr, "Usage: %s -d <archive-file> <file/dir> ...\n", argv[0]);
@@ -55,8 +518,9 @@ int main(int argc, char *argv[]) {
         }
         delete_entities(argv[2], &argv[3], argc - 3);
     } else {
-        fprintf(stderr, "Usage: %s {-c|-a|-x|-m|-d|-p|-j} <archive-file> [files/dirs...]\nUsage of -j: %s {-c|-a} <archive-file> -j [files/dirs...]\n", argv[0], argv[0]);
+        print_usage(argv[0]);
         return EXIT_FAILURE;
     }
+    stats_report(stderr);
     return EXIT_SUCCESS;
 }
\ No newline at end of file
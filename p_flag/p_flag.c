@@ -6,6 +6,9 @@
 #include <sys/stat.h>
 #include "../structs.h"
 #include "../utils.h"
+#include "../stats.h"
+#include "../io.h"
+#include "../tree_index.h"
 #include "p_flag.h"
 
 static int count_slashes_local(const char *s)
@@ -25,39 +28,109 @@ static int cmp_metadata_local(const void *a, const void *b)
     return strcmp(ma->path, mb->path);
 }
 
+/*
+ * Streams the tree index depth-first: siblings are already in name order,
+ * so nothing is sorted and no metadata record is read.
+ * Roots are indented by their slash count, like the sorted listing.
+ */
+static int print_tree_index(FILE *archive, const ArchiveHeader *header)
+{
+    TreeReader tree;
+    stats_phase_begin(PHASE_METADATA_READ);
+    if (tree_open(&tree, archive, header, 1) != 0)
+        return -1;
+    stats_phase_end(PHASE_METADATA_READ);
+
+    size_t capacity = 64, top = 0;
+    uint32_t *ids = malloc(capacity * sizeof(uint32_t));
+    int *indents = malloc(capacity * sizeof(int));
+    if (!ids || !indents) {
+        perror("malloc");
+        free(ids);
+        free(indents);
+        tree_close(&tree);
+        return -1;
+    }
+    if (tree.hdr.first_root != TREE_NONE) {
+        ids[top] = tree.hdr.first_root;
+        indents[top++] = -1;
+    }
+    while (top > 0) {
+        uint32_t id = ids[--top];
+        int indent = indents[top];
+        TreeNode node;
+        if (tree_node(&tree, id, &node) != 0)
+            break;
+        const char *name = tree.names + node.name_offset;
+        int depth = indent;
+        if (indent < 0) {
+            depth = count_slashes_local(name);
+            const char *slash = strrchr(name, '/');
+            if (slash && slash[1] != '\0')
+                name = slash + 1;
+        }
+        for (int d = 0; d < depth; d++)
+            printf("  ");
+        if (S_ISDIR(node.mode))
+            printf("%s/\n", name);
+        else
+            printf("%s\n", name);
+        if (top + 2 > capacity) {
+            capacity *= 2;
+            uint32_t *new_ids = realloc(ids, capacity * sizeof(uint32_t));
+            int *new_indents = realloc(indents, capacity * sizeof(int));
+            if (!new_ids || !new_indents) {
+                perror("realloc");
+                free(new_ids ? new_ids : ids);
+                free(new_indents ? new_indents : indents);
+                tree_close(&tree);
+                return 0;
+            }
+            ids = new_ids;
+            indents = new_indents;
+        }
+        /* Sibling below the child so the subtree is printed first */
+        if (node.next_sibling != TREE_NONE) {
+            ids[top] = node.next_sibling;
+            indents[top++] = indent;
+        }
+        if (node.first_child != TREE_NONE) {
+            ids[top] = node.first_child;
+            indents[top++] = depth + 1;
+        }
+    }
+    free(ids);
+    free(indents);
+    tree_close(&tree);
+    return 0;
+}
+
 void print_hierarchy(const char *archive_name)
 {
-    FILE *archive = fopen(archive_name, "rb");
+    FILE *archive = io_fopen(archive_name, "rb");
     if (!archive) {
         perror("Error opening archive");
         return;
     }
     ArchiveHeader header;
-    if (fread(&header, 1, HEADER_SIZE, archive) != HEADER_SIZE) {
-        perror("Error reading header");
-        fclose(archive);
+    if (read_archive_header(archive, &header) != 0) {
+        io_fclose(archive);
         return;
     }
-    size_t meta_count = header.metadata_count;
-    FileMetadata *metas = malloc(meta_count * sizeof(FileMetadata));
-    if (!metas) {
-        perror("malloc");
-        fclose(archive);
-        return;
-    }
-    if (fseek(archive, header.metadata_offset, SEEK_SET) != 0) {
-        perror("fseek error");
-        free(metas);
-        fclose(archive);
+    /* Archives without a tree index fall back to sorting the metadata */
+    if (print_tree_index(archive, &header) == 0) {
+        io_fclose(archive);
         return;
     }
-    if (fread(metas, sizeof(FileMetadata), meta_count, archive) != meta_count) {
-        perror("Error reading metadata");
-        free(metas);
-        fclose(archive);
+    stats_phase_begin(PHASE_METADATA_READ);
+    size_t meta_count = header.metadata_count;
+    FileMetadata *metas = read_metadata_block(archive, &header);
+    if (!metas) {
+        io_fclose(archive);
         return;
     }
-    fclose(archive);
+    stats_phase_end(PHASE_METADATA_READ);
+    io_fclose(archive);
 
     qsort(metas, meta_count, sizeof(FileMetadata), cmp_metadata_local);
 
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "pathset.h"
+
+static size_t hash_path(const char *s)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    return (size_t)h;
+}
+
+PathSlot *path_find(const PathSet *set, const char *path)
+{
+    if (set->capacity == 0)
+        return NULL;
+    size_t i = hash_path(path) & (set->capacity - 1);
+    while (set->slots[i].path) {
+        if (strcmp(set->slots[i].path, path) == 0)
+            return &set->slots[i];
+        i = (i + 1) & (set->capacity - 1);
+    }
+    return NULL;
+}
+
+int path_insert(PathSet *set, const char *path, int input, size_t record)
+{
+    if ((set->count + 1) * 2 > set->capacity) {
+        size_t capacity = set->capacity ? set->capacity * 2 : 1024;
+        PathSlot *slots = calloc(capacity, sizeof(PathSlot));
+        if (!slots) {
+            perror("calloc");
+            return -1;
+        }
+        for (size_t i = 0; i < set->capacity; i++) {
+            if (!set->slots[i].path)
+                continue;
+            size_t j = hash_path(set->slots[i].path) & (capacity - 1);
+            while (slots[j].path)
+                j = (j + 1) & (capacity - 1);
+            slots[j] = set->slots[i];
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->capacity = capacity;
+    }
+    size_t i = hash_path(path) & (set->capacity - 1);
+    while (set->slots[i].path)
+        i = (i + 1) & (set->capacity - 1);
+    set->slots[i].path = path;
+    set->slots[i].input = input;
+    set->slots[i].record = record;
+    set->count++;
+    return 0;
+}
+
+void path_set_free(PathSet *set)
+{
+    free(set->slots);
+    set->slots = NULL;
+    set->count = 0;
+    set->capacity = 0;
+}
@@ -0,0 +1,28 @@
+#ifndef PATHSET_H
+#define PATHSET_H
+
+#include <stddef.h>
+
+/*
+ * Open addressing hash of archive paths (FNV-1a, linear probing), used
+ * by --merge for conflicts and by --diff to join two catalogs. The set
+ * keeps pointers to the caller's strings, they must outlive it.
+ */
+typedef struct {
+    const char *path;           // NULL marks an empty slot
+    int input;                  // Which archive/side the record belongs to
+    size_t record;
+} PathSlot;
+
+typedef struct {
+    PathSlot *slots;
+    size_t count;
+    size_t capacity;
+} PathSet;
+
+PathSlot *path_find(const PathSet *set, const char *path);
+/* Returns 0, or -1 if out of memory */
+int path_insert(PathSet *set, const char *path, int input, size_t record);
+void path_set_free(PathSet *set);
+
+#endif // PATHSET_H
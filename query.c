@@ -0,0 +1,491 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "query.h"
+#include "utils.h"
+#include "io.h"
+
+const char *where_option = NULL;
+
+enum { FIELD_SIZE, FIELD_MTIME, FIELD_UID, FIELD_GID, FIELD_MODE, FIELD_TYPE };
+enum { OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE };
+enum { NODE_CMP, NODE_AND, NODE_OR, NODE_NOT };
+
+struct QueryNode {
+    int kind;
+    int field;                  // NODE_CMP only
+    int op;
+    int64_t value;
+    struct QueryNode *left;     // NODE_AND/NODE_OR, or the operand of NODE_NOT
+    struct QueryNode *right;
+};
+
+typedef struct {
+    const char *expr;
+    const char *p;
+    int failed;
+} Parser;
+
+static const char *field_names[] = { "size", "mtime", "uid", "gid", "mode", "type" };
+
+static void parse_error(Parser *ps, const char *msg)
+{
+    if (!ps->failed)
+        fprintf(stderr, "Invalid expression '%s': %s at '%s'\n", ps->expr, msg, ps->p);
+    ps->failed = 1;
+}
+
+static void skip_spaces(Parser *ps)
+{
+    while (isspace((unsigned char)*ps->p))
+        ps->p++;
+}
+
+/* Consumes tok if it comes next */
+static int accept(Parser *ps, const char *tok)
+{
+    skip_spaces(ps);
+    size_t len = strlen(tok);
+    if (strncmp(ps->p, tok, len) != 0)
+        return 0;
+    ps->p += len;
+    return 1;
+}
+
+static struct QueryNode *new_node(Parser *ps, int kind, struct QueryNode *left, struct QueryNode *right)
+{
+    struct QueryNode *node = calloc(1, sizeof(*node));
+    if (!node) {
+        perror("calloc");
+        ps->failed = 1;
+        query_free(left);
+        query_free(right);
+        return NULL;
+    }
+    node->kind = kind;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+/* mtime values: YYYY-MM-DD[THH:MM[:SS]] (local time), @EPOCH or an age like -2d */
+static int parse_time(const char *s, int64_t *out)
+{
+    char *end;
+    if (s[0] == '@') {
+        long long v = strtoll(s + 1, &end, 10);
+        if (end == s + 1 || *end)
+            return -1;
+        *out = v;
+        return 0;
+    }
+    if (s[0] == '-') {
+        double v = strtod(s + 1, &end);
+        if (end == s + 1 || v < 0)
+            return -1;
+        double unit;
+        switch (*end) {
+            case 's': unit = 1; break;
+            case 'm': unit = 60; break;
+            case 'h': unit = 3600; break;
+            case 'd': unit = 86400; break;
+            case 'w': unit = 7 * 86400; break;
+            default: return -1;
+        }
+        if (end[1])
+            return -1;
+        *out = (int64_t)time(NULL) - (int64_t)(v * unit);
+        return 0;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    int used = 0;
+    if (sscanf(s, "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &used) != 3)
+        return -1;
+    s += used;
+    if (*s == 'T') {
+        if (sscanf(s, "T%2d:%2d%n", &tm.tm_hour, &tm.tm_min, &used) != 2)
+            return -1;
+        s += used;
+        if (*s == ':') {
+            if (sscanf(s, ":%2d%n", &tm.tm_sec, &used) != 1)
+                return -1;
+            s += used;
+        }
+    }
+    if (*s)
+        return -1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    time_t t = mktime(&tm);
+    if (t == (time_t)-1)
+        return -1;
+    *out = (int64_t)t;
+    return 0;
+}
+
+static int parse_id(const char *s, int field, int64_t *out)
+{
+    char *end;
+    unsigned long v = strtoul(s, &end, 10);
+    if (end != s && *end == '\0') {
+        *out = (int64_t)v;
+        return 0;
+    }
+    if (field == FIELD_UID) {
+        struct passwd *pw = getpwnam(s);
+        if (!pw)
+            return -1;
+        *out = (int64_t)pw->pw_uid;
+    } else {
+        struct group *gr = getgrnam(s);
+        if (!gr)
+            return -1;
+        *out = (int64_t)gr->gr_gid;
+    }
+    return 0;
+}
+
+static int parse_value(const char *s, int field, int64_t *out)
+{
+    char *end;
+    switch (field) {
+        case FIELD_SIZE: {
+            unsigned long long size;
+            if (parse_size(s, &size) != 0)
+                return -1;
+            *out = (int64_t)size;
+            return 0;
+        }
+        case FIELD_MTIME:
+            return parse_time(s, out);
+        case FIELD_UID:
+        case FIELD_GID:
+            return parse_id(s, field, out);
+        case FIELD_MODE: {
+            unsigned long v = strtoul(s, &end, 8);
+            if (end == s || *end || v > 07777)
+                return -1;
+            *out = (int64_t)v;
+            return 0;
+        }
+        default:
+            if (strcmp(s, "f") == 0 || strcmp(s, "file") == 0)
+                *out = S_IFREG;
+            else if (strcmp(s, "d") == 0 || strcmp(s, "dir") == 0)
+                *out = S_IFDIR;
+            else if (strcmp(s, "l") == 0 || strcmp(s, "link") == 0)
+                *out = S_IFLNK;
+            else
+                return -1;
+            return 0;
+    }
+}
+
+static struct QueryNode *parse_or(Parser *ps);
+
+static struct QueryNode *parse_comparison(Parser *ps)
+{
+    skip_spaces(ps);
+    int field = -1;
+    for (int f = 0; f < (int)(sizeof(field_names) / sizeof(field_names[0])); f++) {
+        size_t len = strlen(field_names[f]);
+        if (strncmp(ps->p, field_names[f], len) == 0 && !isalnum((unsigned char)ps->p[len])) {
+            field = f;
+            ps->p += len;
+            break;
+        }
+    }
+    if (field < 0) {
+        parse_error(ps, "expected size, mtime, uid, gid, mode or type");
+        return NULL;
+    }
+    int op;
+    if (accept(ps, "<="))
+        op = OP_LE;
+    else if (accept(ps, ">="))
+        op = OP_GE;
+    else if (accept(ps, "!="))
+        op = OP_NE;
+    else if (accept(ps, "==") || accept(ps, "="))
+        op = OP_EQ;
+    else if (accept(ps, "<"))
+        op = OP_LT;
+    else if (accept(ps, ">"))
+        op = OP_GT;
+    else {
+        parse_error(ps, "expected a comparison operator");
+        return NULL;
+    }
+    if ((field == FIELD_MODE || field == FIELD_TYPE) && op != OP_EQ && op != OP_NE) {
+        parse_error(ps, "mode and type only compare with == and !=");
+        return NULL;
+    }
+    skip_spaces(ps);
+    char value[64];
+    size_t len = 0;
+    while (ps->p[len] && !isspace((unsigned char)ps->p[len]) && !strchr("()&|<>=!", ps->p[len]))
+        len++;
+    if (len == 0 || len >= sizeof(value)) {
+        parse_error(ps, "expected a value");
+        return NULL;
+    }
+    memcpy(value, ps->p, len);
+    value[len] = '\0';
+    struct QueryNode *node = new_node(ps, NODE_CMP, NULL, NULL);
+    if (!node)
+        return NULL;
+    node->field = field;
+    node->op = op;
+    if (parse_value(value, field, &node->value) != 0) {
+        parse_error(ps, "invalid value");
+        free(node);
+        return NULL;
+    }
+    ps->p += len;
+    return node;
+}
+
+static struct QueryNode *parse_unary(Parser *ps)
+{
+    if (accept(ps, "!")) {
+        struct QueryNode *operand = parse_unary(ps);
+        return operand ? new_node(ps, NODE_NOT, operand, NULL) : NULL;
+    }
+    if (accept(ps, "(")) {
+        struct QueryNode *inner = parse_or(ps);
+        if (inner && !accept(ps, ")")) {
+            parse_error(ps, "expected ')'");
+            query_free(inner);
+            return NULL;
+        }
+        return inner;
+    }
+    return parse_comparison(ps);
+}
+
+static struct QueryNode *parse_and(Parser *ps)
+{
+    struct QueryNode *left = parse_unary(ps);
+    while (left && accept(ps, "&&")) {
+        struct QueryNode *right = parse_unary(ps);
+        if (!right) {
+            query_free(left);
+            return NULL;
+        }
+        left = new_node(ps, NODE_AND, left, right);
+    }
+    return left;
+}
+
+static struct QueryNode *parse_or(Parser *ps)
+{
+    struct QueryNode *left = parse_and(ps);
+    while (left && accept(ps, "||")) {
+        struct QueryNode *right = parse_and(ps);
+        if (!right) {
+            query_free(left);
+            return NULL;
+        }
+        left = new_node(ps, NODE_OR, left, right);
+    }
+    return left;
+}
+
+Query *query_compile(const char *expr)
+{
+    Parser ps = { expr, expr, 0 };
+    struct QueryNode *root = parse_or(&ps);
+    skip_spaces(&ps);
+    if (root && *ps.p) {
+        parse_error(&ps, "unexpected input");
+        query_free(root);
+        return NULL;
+    }
+    return root;
+}
+
+void query_free(Query *query)
+{
+    if (!query)
+        return;
+    query_free(query->left);
+    query_free(query->right);
+    free(query);
+}
+
+/*
+ * Column scans: one pass over one contiguous array per predicate, with
+ * the operator switch hoisted out of the loop. With SSE2 every step
+ * handles 16 records of a 32-bit column, four lanes per compare; SSE2
+ * has no 64-bit compare, so size and mtime stay branch-free scalar loops.
+ */
+
+/* col[i] op v, and col[i] >= 0 if nonneg */
+static void scan_i64(const int64_t *col, size_t n, int op, int64_t v, int nonneg, unsigned char *out)
+{
+    uint64_t sign = nonneg ? 1 : 0;
+#define SCAN_I64(cmp) \
+    for (size_t i = 0; i < n; i++) \
+        out[i] = (unsigned char)((col[i] cmp v) & ~(((uint64_t)col[i] >> 63) & sign))
+    switch (op) {
+        case OP_LT: SCAN_I64(<);  break;
+        case OP_LE: SCAN_I64(<=); break;
+        case OP_GT: SCAN_I64(>);  break;
+        case OP_GE: SCAN_I64(>=); break;
+        case OP_EQ: SCAN_I64(==); break;
+        default:    SCAN_I64(!=); break;
+    }
+#undef SCAN_I64
+}
+
+static int compare_u32(uint32_t x, int op, uint32_t v)
+{
+    switch (op) {
+        case OP_LT: return x < v;
+        case OP_LE: return x <= v;
+        case OP_GT: return x > v;
+        case OP_GE: return x >= v;
+        case OP_EQ: return x == v;
+        default:    return x != v;
+    }
+}
+
+/* (col[i] & bits) op v */
+static void scan_u32(const uint32_t *col, size_t n, int op, uint32_t v, uint32_t bits, unsigned char *out)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    // SSE2 compares are signed: flipping the top bit orders unsigned values
+    const __m128i bias = _mm_set1_epi32((int)0x80000000u);
+    const __m128i mask = _mm_set1_epi32((int)bits);
+    const __m128i value = _mm_xor_si128(_mm_set1_epi32((int)v), bias);
+    const __m128i one = _mm_set1_epi8(1);
+    // <=, >= and != are the negations of >, < and ==
+    int negate = op == OP_LE || op == OP_GE || op == OP_NE;
+    int base = op == OP_LE ? OP_GT : op == OP_GE ? OP_LT : op == OP_NE ? OP_EQ : op;
+    const __m128i flip = negate ? one : _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i r[4];
+        for (int k = 0; k < 4; k++) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(col + i + 4 * k));
+            x = _mm_xor_si128(_mm_and_si128(x, mask), bias);
+            r[k] = base == OP_EQ ? _mm_cmpeq_epi32(x, value)
+                 : base == OP_GT ? _mm_cmpgt_epi32(x, value)
+                                 : _mm_cmplt_epi32(x, value);
+        }
+        // 4 x 4 lanes of 0 / -1 saturate down to 16 bytes
+        __m128i bytes = _mm_packs_epi16(_mm_packs_epi32(r[0], r[1]), _mm_packs_epi32(r[2], r[3]));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(_mm_and_si128(bytes, one), flip));
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = (unsigned char)compare_u32(col[i] & bits, op, v);
+}
+
+/* out &= rhs, out |= rhs or out = !out, 16 bytes per step with SSE2 */
+static void combine(unsigned char *out, const unsigned char *rhs, size_t n, int kind)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i one = _mm_set1_epi8(1);
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(out + i));
+        __m128i r = kind == NODE_NOT ? _mm_xor_si128(a, one)
+                  : kind == NODE_AND ? _mm_and_si128(a, _mm_loadu_si128((const __m128i *)(rhs + i)))
+                                     : _mm_or_si128(a, _mm_loadu_si128((const __m128i *)(rhs + i)));
+        _mm_storeu_si128((__m128i *)(out + i), r);
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = kind == NODE_NOT ? out[i] ^ 1 : kind == NODE_AND ? out[i] & rhs[i] : out[i] | rhs[i];
+}
+
+static int eval_node(const struct QueryNode *node, const Columns *cols, unsigned char *out)
+{
+    size_t n = cols->count;
+    if (node->kind == NODE_CMP) {
+        switch (node->field) {
+            case FIELD_SIZE:
+                // Unknown sizes (old compressed entries) match no size predicate
+                scan_i64(cols->size, n, node->op, node->value, 1, out);
+                break;
+            case FIELD_MTIME:
+                scan_i64(cols->mtime, n, node->op, node->value, 0, out);
+                break;
+            case FIELD_UID:
+                scan_u32(cols->uid, n, node->op, (uint32_t)node->value, UINT32_MAX, out);
+                break;
+            case FIELD_GID:
+                scan_u32(cols->gid, n, node->op, (uint32_t)node->value, UINT32_MAX, out);
+                break;
+            case FIELD_MODE:
+                scan_u32(cols->mode, n, node->op, (uint32_t)node->value, 07777, out);
+                break;
+            default:
+                scan_u32(cols->mode, n, node->op, (uint32_t)node->value, S_IFMT, out);
+                break;
+        }
+        return 0;
+    }
+    if (eval_node(node->left, cols, out) != 0)
+        return -1;
+    if (node->kind == NODE_NOT) {
+        combine(out, NULL, n, NODE_NOT);
+        return 0;
+    }
+    unsigned char *rhs = malloc(n ? n : 1);
+    if (!rhs) {
+        perror("malloc");
+        return -1;
+    }
+    int rc = eval_node(node->right, cols, rhs);
+    combine(out, rhs, n, node->kind);
+    free(rhs);
+    return rc;
+}
+
+int query_eval(const Query *query, const Columns *cols, unsigned char *mask)
+{
+    return eval_node(query, cols, mask);
+}
+
+unsigned char *query_select(const char *archive_name, const char *expr, size_t *count)
+{
+    Query *query = query_compile(expr);
+    if (!query)
+        return NULL;
+    FILE *archive = io_fopen(archive_name, "rb");
+    if (!archive) {
+        perror("Error opening archive");
+        query_free(query);
+        return NULL;
+    }
+    ArchiveHeader header;
+    Columns cols;
+    unsigned char *mask = NULL;
+    if (read_archive_header(archive, &header) == 0 && columns_read(archive, &header, &cols) == 0) {
+        mask = malloc(cols.count ? cols.count : 1);
+        if (!mask)
+            perror("malloc");
+        else if (query_eval(query, &cols, mask) != 0) {
+            free(mask);
+            mask = NULL;
+        }
+        *count = cols.count;
+        columns_free(&cols);
+    }
+    io_fclose(archive);
+    query_free(query);
+    return mask;
+}
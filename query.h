@@ -0,0 +1,41 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stdio.h>
+#include "structs.h"
+#include "columns.h"
+
+/*
+ * Metadata predicates (-f EXPR, --where=EXPR), evaluated over the
+ * columnar catalog section. Grammar:
+ *
+ *   expr  := term ('||' term)*
+ *   term  := unary ('&&' unary)*
+ *   unary := '!' unary | '(' expr ')' | field op value
+ *   field := size | mtime | uid | gid | mode | type
+ *   op    := < <= > >= == = !=
+ *
+ * size takes K/M/G/T suffixes, mtime a local YYYY-MM-DD[THH:MM[:SS]],
+ * @EPOCH or an age like -2d (s, m, h, d, w), uid and gid a number or a
+ * name, mode octal permission bits and type f, d or l (mode and type only
+ * compare with == and !=).
+ */
+typedef struct QueryNode Query;
+
+/* --where expression for -x and -g, NULL if not given */
+extern const char *where_option;
+
+/* Parses an expression, prints the error and returns NULL if it is invalid */
+Query *query_compile(const char *expr);
+void query_free(Query *query);
+
+/* Sets mask[i] to 1 for every record matching the query, 0 otherwise */
+int query_eval(const Query *query, const Columns *cols, unsigned char *mask);
+
+/*
+ * Compiles expr and evaluates it over the columns of an archive file.
+ * Returns a malloc'd mask with *count (the record count) bytes, NULL on error.
+ */
+unsigned char *query_select(const char *archive_name, const char *expr, size_t *count);
+
+#endif // QUERY_H
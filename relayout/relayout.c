@@ -0,0 +1,199 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../structs.h"
+#include "../utils.h"
+#include "../stats.h"
+#include "../io.h"
+#include "../tree_index.h"
+#include "../columns.h"
+#include "../volume.h"
+#include "../dict.h"
+#include "../segment.h"
+#include "relayout.h"
+
+static int archive_fd(void *ctx, uint32_t volume)
+{
+    (void)volume;       // Only the data of volume 0 moves
+    return fileno((FILE *)ctx);
+}
+
+/*
+ * Writes the records, tree index, columns and volume table from the end of
+ * the header on and sets their header fields. Returns where they end, -1
+ * on error.
+ */
+static long write_catalog(FILE *out, ArchiveHeader *header, const FileMetadata *metas, size_t count,
+                          const VolumeTable *volumes)
+{
+    header->metadata_count = (uint32_t)count;
+    header->metadata_offset = HEADER_SIZE;
+    if (fseek(out, HEADER_SIZE, SEEK_SET) != 0 ||
+        stats_fwrite(metas, sizeof(FileMetadata), count, out) != count) {
+        perror("Error writing metadata");
+        return -1;
+    }
+    if (write_tree_index(out, header) != 0 || write_columns(out, header) != 0 ||
+        volume_table_write(out, header, volumes) != 0)
+        return -1;
+    // Every section is written after the previous one, the last leaves the position at the end
+    long end = ftell(out);
+    if (end < 0)
+        perror("ftell error");
+    return end;
+}
+
+int relayout_archive(const char *archive_name)
+{
+    FILE *orig = io_fopen(archive_name, "rb");
+    if (!orig) {
+        perror("Error opening archive");
+        return -1;
+    }
+    ArchiveHeader header;
+    struct stat st;
+    if (read_archive_header(orig, &header) != 0) {
+        io_fclose(orig);
+        return -1;
+    }
+    if (fstat(fileno(orig), &st) != 0) {
+        perror("fstat error");
+        io_fclose(orig);
+        return -1;
+    }
+    // A create that failed leaves a zeroed header behind
+    if (header.metadata_offset < HEADER_SIZE || header.metadata_offset > (long)st.st_size) {
+        fprintf(stderr, "%s: not a myz archive or corrupt archive\n", archive_name);
+        io_fclose(orig);
+        return -1;
+    }
+    stats_phase_begin(PHASE_METADATA_READ);
+    size_t count = header.metadata_count;
+    FileMetadata *metas = read_metadata_block(orig, &header);
+    stats_phase_end(PHASE_METADATA_READ);
+    if (!metas) {
+        io_fclose(orig);
+        return -1;
+    }
+    VolumeTable volumes;
+    if (volume_table_read(orig, &header, &volumes) != 0) {
+        free(metas);
+        io_fclose(orig);
+        return -1;
+    }
+    Dictionary dict;
+    if (dict_read(orig, &header, &dict) != 0) {
+        volume_table_free(&volumes);
+        free(metas);
+        io_fclose(orig);
+        return -1;
+    }
+
+    int rc = -1;
+    FILE *out = NULL;
+    FileMetadata *rebased = malloc((count ? count : 1) * sizeof(FileMetadata));
+    size_t seg_count = 0;
+    Segment *segs = segments_build(metas, count, &seg_count);
+    char temp_name[1024];
+    snprintf(temp_name, sizeof(temp_name), "%s.relayoutXXXXXX", archive_name);
+    int temp_fd = -1;
+    if (!rebased || !segs) {
+        perror("malloc");
+        goto cleanup;
+    }
+    /* Everything in the archive file itself is kept, the other volumes stay as they are */
+    segments_mark_live(segs, seg_count, metas, count, NULL);
+    for (size_t i = 0; i < seg_count; i++) {
+        if (segs[i].volume != 0)
+            segs[i].live = 0;
+    }
+
+    /* The new archive goes next to the old one, with its permissions, and replaces it at the end */
+    temp_fd = mkstemp(temp_name);
+    if (temp_fd == -1) {
+        perror("mkstemp error");
+        goto cleanup;
+    }
+    if (fchmod(temp_fd, st.st_mode & 07777) != 0)
+        perror("fchmod error");
+    out = io_fdopen(temp_fd, "wb+");
+    if (!out) {
+        perror("fdopen error");
+        close(temp_fd);
+        goto cleanup;
+    }
+
+    /* The size of the catalog does not depend on the offsets in it: write it once to know where the data starts */
+    stats_phase_begin(PHASE_METADATA_WRITE);
+    ArchiveHeader new_header;
+    init_archive_header(&new_header);
+    long data_start = write_catalog(out, &new_header, metas, count, &volumes);
+    stats_phase_end(PHASE_METADATA_WRITE);
+    if (data_start < 0)
+        goto cleanup;
+
+    stats_phase_begin(PHASE_COPY);
+    long data_offset = data_start;
+    if (fseek(out, data_offset, SEEK_SET) != 0 || (dict.size && dict_store(out, &data_offset, &dict) != 0) ||
+        fflush(out) != 0) {
+        perror("Error writing dictionary");
+        stats_phase_end(PHASE_COPY);
+        goto cleanup;
+    }
+    int copied = segments_copy(segs, seg_count, archive_fd, orig, fileno(out), &data_offset);
+    stats_phase_end(PHASE_COPY);
+    if (copied != 0)
+        goto cleanup;
+
+    /* Then again with the rebased offsets, over the first one */
+    stats_phase_begin(PHASE_METADATA_WRITE);
+    for (size_t i = 0; i < count; i++) {
+        rebased[i] = metas[i];
+        if (S_ISREG(rebased[i].mode))
+            segment_rebase(segs, seg_count, metas, &rebased[i]);
+    }
+    if (volumes.count > 0)
+        volumes.entries[0].size = (uint64_t)(data_offset - data_start);
+    init_archive_header(&new_header);
+    long catalog_end = write_catalog(out, &new_header, rebased, count, &volumes);
+    if (catalog_end != data_start) {
+        if (catalog_end >= 0)
+            fprintf(stderr, "Catalog of %s changed size while moving it\n", archive_name);
+        stats_phase_end(PHASE_METADATA_WRITE);
+        goto cleanup;
+    }
+    new_header.dict_size = dict.size;
+    new_header.dict_offset = dict.offset;
+    new_header.data_start = data_start;
+    if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&new_header, 1, HEADER_SIZE, out) != HEADER_SIZE) {
+        perror("Error writing header");
+        stats_phase_end(PHASE_METADATA_WRITE);
+        goto cleanup;
+    }
+    stats_phase_end(PHASE_METADATA_WRITE);
+    rc = io_fclose(out) == 0 ? 0 : -1;
+    out = NULL;
+    if (rc != 0)
+        perror("Error writing archive");
+    else if ((rc = rename(temp_name, archive_name)) != 0)
+        perror("rename error");
+    if (rc == 0)
+        printf("Archive %s relaid out: catalog of %zu entries in the first %ld bytes, %ld bytes of data.\n",
+               archive_name, count, data_start, data_offset - data_start);
+
+cleanup:
+    if (out)
+        io_fclose(out);
+    if (rc != 0 && temp_fd != -1)
+        remove(temp_name);
+    free(segs);
+    free(rebased);
+    free(metas);
+    dict_free(&dict);
+    volume_table_free(&volumes);
+    io_fclose(orig);
+    return rc;
+}
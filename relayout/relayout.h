@@ -0,0 +1,15 @@
+#ifndef RELAYOUT_H
+#define RELAYOUT_H
+
+/*
+ * --relayout: rewrites an archive with the header, catalog, tree index,
+ * columns and volume table contiguous at the front and the data after
+ * them (ArchiveHeader.data_start), offsets rebased. Listing or planning
+ * an extraction then needs one read of the start of the file, instead of
+ * a seek to the far end on tape or a second ranged fetch from object
+ * storage. Dead data left behind by -a on such an archive is dropped.
+ * Returns 0, or -1 on error (the archive is left as it was).
+ */
+int relayout_archive(const char *archive_name);
+
+#endif // RELAYOUT_H
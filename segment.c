@@ -0,0 +1,167 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "segment.h"
+#include "utils.h"
+#include "stats.h"
+
+static int cmp_segments(const void *a, const void *b)
+{
+    const Segment *x = a, *y = b;
+    if (x->volume != y->volume)
+        return x->volume < y->volume ? -1 : 1;
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    if (x->inode != y->inode)
+        return x->inode < y->inode ? -1 : 1;
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    return 0;
+}
+
+Segment *segments_build(const FileMetadata *metas, size_t count, size_t *seg_count)
+{
+    Segment *segs = malloc((count ? count : 1) * sizeof(Segment));
+    if (!segs) {
+        perror("malloc");
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        const FileMetadata *meta = &metas[i];
+        if (!S_ISREG(meta->mode) || meta->is_hardlink)
+            continue;
+        Segment *seg = &segs[n++];
+        memset(seg, 0, sizeof(*seg));
+        seg->volume = meta->volume;
+        seg->offset = meta->data_offset;
+        seg->inode = meta->inode;
+        seg->dev = meta->dev;
+        seg->size = meta->size;
+        seg->record = i;
+        seg->new_offset = meta->data_offset;
+    }
+    qsort(segs, n, sizeof(Segment), cmp_segments);
+    *seg_count = n;
+    return segs;
+}
+
+/* Hard links find their original like extraction does: same data, inode and device */
+Segment *segment_find(Segment *segs, size_t seg_count, const FileMetadata *meta)
+{
+    Segment key;
+    key.volume = meta->volume;
+    key.offset = meta->data_offset;
+    key.inode = meta->inode;
+    key.dev = meta->dev;
+    return bsearch(&key, segs, seg_count, sizeof(Segment), cmp_segments);
+}
+
+/* The segment of a delta's base: empty files may share its offset, the base has data */
+static Segment *segment_base(Segment *segs, size_t seg_count, const FileMetadata *meta)
+{
+    size_t lo = 0, hi = seg_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (segs[mid].volume < meta->delta_base_volume ||
+            (segs[mid].volume == meta->delta_base_volume && segs[mid].offset < meta->delta_base))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < seg_count && segs[lo].volume == meta->delta_base_volume && segs[lo].offset == meta->delta_base; lo++) {
+        if (segs[lo].size > 0)
+            return &segs[lo];
+    }
+    return NULL;
+}
+
+void segments_keep_bases(Segment *segs, size_t seg_count, const FileMetadata *metas, size_t count,
+                         unsigned char *keep)
+{
+    for (size_t i = 0; i < count; i++) {
+        const FileMetadata *meta = &metas[i];
+        if (!keep[i] || !S_ISREG(meta->mode) || meta->is_hardlink)
+            continue;
+        // Chains get shorter towards the full copy, so this ends
+        while (meta->flags & ENTRY_DELTA) {
+            Segment *base = segment_base(segs, seg_count, meta);
+            if (!base || keep[base->record])
+                break;
+            keep[base->record] = 1;
+            meta = &metas[base->record];
+        }
+    }
+}
+
+void segments_mark_live(Segment *segs, size_t seg_count, const FileMetadata *metas, size_t count,
+                        const unsigned char *keep)
+{
+    for (size_t i = 0; i < count; i++) {
+        if ((keep && !keep[i]) || !S_ISREG(metas[i].mode))
+            continue;
+        Segment *seg = segment_find(segs, seg_count, &metas[i]);
+        if (!seg)
+            continue;
+        seg->live = 1;
+        if (!metas[i].is_hardlink)
+            seg->original_kept = 1;
+    }
+}
+
+int segments_copy(Segment *segs, size_t seg_count, int (*volume_fd)(void *ctx, uint32_t volume), void *ctx,
+                  int out_fd, long *out_pos)
+{
+    size_t i = 0;
+    while (i < seg_count) {
+        if (!segs[i].live) {
+            i++;
+            continue;
+        }
+        uint32_t volume = segs[i].volume;
+        long run_start = segs[i].offset;
+        long run_end = run_start + segs[i].size;
+        size_t j = i + 1;
+        while (j < seg_count && segs[j].live && segs[j].volume == volume && segs[j].offset == run_end) {
+            run_end += segs[j].size;
+            j++;
+        }
+        int fd = volume_fd(ctx, volume);
+        if (fd == -1 || copy_file_data(fd, run_start, out_fd, *out_pos, run_end - run_start) != 0)
+            return -1;
+        for (size_t s = i; s < j; s++)
+            segs[s].new_offset = *out_pos + (segs[s].offset - run_start);
+        *out_pos += run_end - run_start;
+        stats_add_bytes(run_end - run_start, run_end - run_start);
+        i = j;
+    }
+    return 0;
+}
+
+void segment_rebase(Segment *segs, size_t seg_count, const FileMetadata *metas, FileMetadata *meta)
+{
+    Segment *seg = segment_find(segs, seg_count, meta);
+    if (!seg)
+        return;
+    meta->data_offset = seg->new_offset;
+    if (meta->is_hardlink && !seg->original_kept) {
+        /* The original was dropped: this link now owns the data */
+        const FileMetadata *orig = &metas[seg->record];
+        meta->is_hardlink = 0;
+        meta->size = orig->size;
+        // The storage flags come with the data, whether the path is current stays the link's own
+        meta->flags = (orig->flags & ~ENTRY_SUPERSEDED) | (meta->flags & ENTRY_SUPERSEDED);
+        meta->logical_size = orig->logical_size;
+        meta->delta_depth = orig->delta_depth;
+        meta->delta_base = orig->delta_base;
+        meta->delta_base_volume = orig->delta_base_volume;
+        seg->original_kept = 1;
+    }
+    if (meta->flags & ENTRY_DELTA) {
+        Segment *base = segment_base(segs, seg_count, meta);
+        if (base)
+            meta->delta_base = base->new_offset;
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stddef.h>
+#include "structs.h"
+
+/*
+ * Stored data ranges of an archive, for compaction (-d) and --merge.
+ * Segments are sorted by (volume, offset), so the surviving data is read
+ * in one ascending pass per volume and adjacent segments are copied as
+ * one run, whatever order the catalog is in.
+ */
+typedef struct {
+    uint32_t volume;
+    long offset;
+    ino_t inode;
+    uint64_t dev;
+    off_t size;
+    size_t record;              // Record that owns the data
+    long new_offset;            // Where the data ends up, the old offset if not copied
+    int live;                   // Referenced by a kept record
+    int original_kept;          // The owning record itself is kept
+} Segment;
+
+/* One segment per data-owning regular record, NULL if out of memory */
+Segment *segments_build(const FileMetadata *metas, size_t count, size_t *seg_count);
+/* The segment holding the data of a regular record (hard links included) */
+Segment *segment_find(Segment *segs, size_t seg_count, const FileMetadata *meta);
+/*
+ * Keeps the older versions the kept delta records are built on (see
+ * delta.h), so that no chain loses its base.
+ */
+void segments_keep_bases(Segment *segs, size_t seg_count, const FileMetadata *metas, size_t count,
+                         unsigned char *keep);
+/* Marks the segments used by the kept records, keep == NULL keeps everything */
+void segments_mark_live(Segment *segs, size_t seg_count, const FileMetadata *metas, size_t count,
+                        const unsigned char *keep);
+/*
+ * Copies the live segments to out_fd from *out_pos, adjacent ranges of a
+ * volume as one copy_file_data() run, and sets their new offsets.
+ * volume_fd returns the descriptor of a volume, -1 on error.
+ */
+int segments_copy(Segment *segs, size_t seg_count, int (*volume_fd)(void *ctx, uint32_t volume), void *ctx,
+                  int out_fd, long *out_pos);
+/*
+ * Points a kept regular record at the new location of its data, and a
+ * delta record at that of its base. A hard link whose original was
+ * dropped becomes the owner of the data.
+ */
+void segment_rebase(Segment *segs, size_t seg_count, const FileMetadata *metas, FileMetadata *meta);
+
+#endif // SEGMENT_H
@@ -0,0 +1,333 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "stats.h"
+#include "governor.h"
+
+#define HIST_BUCKETS 26   // log2 buckets in microseconds: <1us .. >=16s
+#define SLOWEST_FILES 5
+
+int stats_enabled = 0;
+
+typedef struct {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t histogram[HIST_BUCKETS];
+} IoStats;
+
+typedef struct {
+    char path[256];
+    uint64_t ns;
+    off_t bytes;
+} SlowFile;
+
+static struct {
+    const char *command;
+    int json;
+    uint64_t start_ns;
+    uint64_t phase_ns[PHASE_COUNT];
+    uint64_t phase_start[PHASE_COUNT];
+    int phase_depth[PHASE_COUNT];
+    uint64_t files, dirs, symlinks, hardlinks;
+    uint64_t raw_bytes, stored_bytes;
+    IoStats read, write;
+    SlowFile slowest[SLOWEST_FILES];
+    int slowest_count;
+} stats;
+
+// Volume writer and reader threads update the counters concurrently
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *phase_names[PHASE_COUNT] = {
+    "traverse", "compress", "decompress", "metadata-read",
+    "metadata-write", "extract", "copy", "search", "compare"
+};
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void stats_init(const char *command, int json)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.command = command;
+    stats.json = json;
+    stats.start_ns = stats_now();
+    stats_enabled = 1;
+}
+
+// Phases may nest (process_path() is recursive), only the outermost pair is timed
+void stats_phase_begin(StatsPhase phase)
+{
+    if (!stats_enabled)
+        return;
+    pthread_mutex_lock(&stats_lock);
+    if (stats.phase_depth[phase]++ == 0)
+        stats.phase_start[phase] = stats_now();
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_phase_end(StatsPhase phase)
+{
+    if (!stats_enabled)
+        return;
+    pthread_mutex_lock(&stats_lock);
+    if (stats.phase_depth[phase] > 0 && --stats.phase_depth[phase] == 0)
+        stats.phase_ns[phase] += stats_now() - stats.phase_start[phase];
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void record_io(IoStats *io, uint64_t ns, size_t bytes)
+{
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+    while (us > 0 && bucket < HIST_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    pthread_mutex_lock(&stats_lock);
+    io->calls++;
+    io->bytes += bytes;
+    io->total_ns += ns;
+    io->histogram[bucket]++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* The wrappers are also where the governor paces I/O and measures its latency */
+static void io_done(IoStats *io, int kind, uint64_t start_ns, size_t bytes)
+{
+    uint64_t ns = stats_now() - start_ns;
+    if (stats_enabled)
+        record_io(io, ns, bytes);
+    governor_done(kind, ns, bytes);
+}
+
+size_t stats_fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+    if (!stats_enabled && !governor_enabled)
+        return fread(ptr, size, nmemb, stream);
+    governor_wait(GOV_READ, size * nmemb);
+    uint64_t start = stats_now();
+    size_t n = fread(ptr, size, nmemb, stream);
+    io_done(&stats.read, GOV_READ, start, n * size);
+    return n;
+}
+
+size_t stats_fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+    if (!stats_enabled && !governor_enabled)
+        return fwrite(ptr, size, nmemb, stream);
+    governor_wait(GOV_WRITE, size * nmemb);
+    uint64_t start = stats_now();
+    size_t n = fwrite(ptr, size, nmemb, stream);
+    io_done(&stats.write, GOV_WRITE, start, n * size);
+    return n;
+}
+
+// Only reads gzip's output pipe: counted as a read, but paced by --max-cpu alone
+ssize_t stats_read(int fd, void *buf, size_t count)
+{
+    if (!stats_enabled && !governor_enabled)
+        return read(fd, buf, count);
+    governor_wait(GOV_CPU, 0);
+    uint64_t start = stats_now();
+    ssize_t n = read(fd, buf, count);
+    io_done(&stats.read, GOV_CPU, start, n > 0 ? (size_t)n : 0);
+    return n;
+}
+
+ssize_t stats_pread(int fd, void *buf, size_t count, off_t offset)
+{
+    if (!stats_enabled && !governor_enabled)
+        return pread(fd, buf, count, offset);
+    governor_wait(GOV_READ, count);
+    uint64_t start = stats_now();
+    ssize_t n = pread(fd, buf, count, offset);
+    io_done(&stats.read, GOV_READ, start, n > 0 ? (size_t)n : 0);
+    return n;
+}
+
+ssize_t stats_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    if (!stats_enabled && !governor_enabled)
+        return pwrite(fd, buf, count, offset);
+    governor_wait(GOV_WRITE, count);
+    uint64_t start = stats_now();
+    ssize_t n = pwrite(fd, buf, count, offset);
+    io_done(&stats.write, GOV_WRITE, start, n > 0 ? (size_t)n : 0);
+    return n;
+}
+
+void stats_count_entry(mode_t mode, int is_hardlink)
+{
+    if (!stats_enabled)
+        return;
+    pthread_mutex_lock(&stats_lock);
+    if (S_ISDIR(mode))
+        stats.dirs++;
+    else if (S_ISLNK(mode))
+        stats.symlinks++;
+    else if (is_hardlink)
+        stats.hardlinks++;
+    else
+        stats.files++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_add_bytes(off_t raw, off_t stored)
+{
+    if (!stats_enabled)
+        return;
+    pthread_mutex_lock(&stats_lock);
+    stats.raw_bytes += (uint64_t)raw;
+    stats.stored_bytes += (uint64_t)stored;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Keeps the SLOWEST_FILES slowest files, sorted from slowest to fastest
+void stats_file_done(const char *path, uint64_t start_ns, off_t bytes)
+{
+    if (!stats_enabled)
+        return;
+    uint64_t ns = stats_now() - start_ns;
+    pthread_mutex_lock(&stats_lock);
+    int pos = stats.slowest_count;
+    while (pos > 0 && stats.slowest[pos - 1].ns < ns)
+        pos--;
+    if (pos >= SLOWEST_FILES) {
+        pthread_mutex_unlock(&stats_lock);
+        return;
+    }
+    int last = (stats.slowest_count < SLOWEST_FILES) ? stats.slowest_count : SLOWEST_FILES - 1;
+    memmove(&stats.slowest[pos + 1], &stats.slowest[pos], (last - pos) * sizeof(SlowFile));
+    strncpy(stats.slowest[pos].path, path, sizeof(stats.slowest[pos].path) - 1);
+    stats.slowest[pos].path[sizeof(stats.slowest[pos].path) - 1] = '\0';
+    stats.slowest[pos].ns = ns;
+    stats.slowest[pos].bytes = bytes;
+    if (stats.slowest_count < SLOWEST_FILES)
+        stats.slowest_count++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static double ratio(void)
+{
+    return stats.raw_bytes ? (double)stats.stored_bytes / (double)stats.raw_bytes : 0.0;
+}
+
+static void print_json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void print_io_json(FILE *out, const char *name, const IoStats *io)
+{
+    fprintf(out, "\"%s\":{\"calls\":%llu,\"bytes\":%llu,\"time_ns\":%llu,\"histogram_us\":[",
+            name, (unsigned long long)io->calls, (unsigned long long)io->bytes,
+            (unsigned long long)io->total_ns);
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        fprintf(out, "%s%llu", b ? "," : "", (unsigned long long)io->histogram[b]);
+    fprintf(out, "]}");
+}
+
+static void report_json(FILE *out, uint64_t wall_ns)
+{
+    fprintf(out, "{\"command\":");
+    print_json_string(out, stats.command ? stats.command : "");
+    fprintf(out, ",\"wall_ns\":%llu,\"phases\":{", (unsigned long long)wall_ns);
+    for (int p = 0; p < PHASE_COUNT; p++)
+        fprintf(out, "%s\"%s\":%llu", p ? "," : "", phase_names[p],
+                (unsigned long long)stats.phase_ns[p]);
+    fprintf(out, "},\"entries\":{\"files\":%llu,\"dirs\":%llu,\"symlinks\":%llu,\"hardlinks\":%llu}",
+            (unsigned long long)stats.files, (unsigned long long)stats.dirs,
+            (unsigned long long)stats.symlinks, (unsigned long long)stats.hardlinks);
+    fprintf(out, ",\"bytes\":{\"raw\":%llu,\"stored\":%llu,\"ratio\":%.4f},\"io\":{",
+            (unsigned long long)stats.raw_bytes, (unsigned long long)stats.stored_bytes, ratio());
+    print_io_json(out, "read", &stats.read);
+    fputc(',', out);
+    print_io_json(out, "write", &stats.write);
+    fprintf(out, "},\"slowest\":[");
+    for (int i = 0; i < stats.slowest_count; i++) {
+        fprintf(out, "%s{\"path\":", i ? "," : "");
+        print_json_string(out, stats.slowest[i].path);
+        fprintf(out, ",\"ns\":%llu,\"bytes\":%lld}", (unsigned long long)stats.slowest[i].ns,
+                (long long)stats.slowest[i].bytes);
+    }
+    fprintf(out, "]}\n");
+}
+
+static void print_histogram(FILE *out, const char *name, const IoStats *io)
+{
+    fprintf(out, "%s calls: %llu, bytes: %llu, time: %.3f ms\n", name,
+            (unsigned long long)io->calls, (unsigned long long)io->bytes, io->total_ns / 1e6);
+    uint64_t max = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        if (io->histogram[b] > max)
+            max = io->histogram[b];
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        if (!io->histogram[b])
+            continue;
+        int bar = (int)(io->histogram[b] * 40 / max);
+        if (b <= 1)
+            fprintf(out, "  %10s us ", b ? "1" : "<1");
+        else
+            fprintf(out, "  %4llu-%-5llu us ", 1ull << (b - 1), (1ull << b) - 1);
+        fprintf(out, "%10llu |", (unsigned long long)io->histogram[b]);
+        for (int i = 0; i < bar; i++)
+            fputc('#', out);
+        fputc('\n', out);
+    }
+}
+
+static void report_text(FILE *out, uint64_t wall_ns)
+{
+    fprintf(out, "==== myz stats (%s) ====\n", stats.command ? stats.command : "");
+    fprintf(out, "Wall time: %.3f ms\n", wall_ns / 1e6);
+    fprintf(out, "Phases (inclusive):\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        if (stats.phase_ns[p])
+            fprintf(out, "  %-15s %12.3f ms\n", phase_names[p], stats.phase_ns[p] / 1e6);
+    }
+    fprintf(out, "Entries: %llu files, %llu dirs, %llu symlinks, %llu hard links\n",
+            (unsigned long long)stats.files, (unsigned long long)stats.dirs,
+            (unsigned long long)stats.symlinks, (unsigned long long)stats.hardlinks);
+    fprintf(out, "Bytes: %llu raw, %llu stored (ratio %.4f)\n",
+            (unsigned long long)stats.raw_bytes, (unsigned long long)stats.stored_bytes, ratio());
+    print_histogram(out, "Read", &stats.read);
+    print_histogram(out, "Write", &stats.write);
+    if (stats.slowest_count > 0) {
+        fprintf(out, "Slowest files:\n");
+        for (int i = 0; i < stats.slowest_count; i++)
+            fprintf(out, "  %10.3f ms %12lld bytes  %s\n", stats.slowest[i].ns / 1e6,
+                    (long long)stats.slowest[i].bytes, stats.slowest[i].path);
+    }
+}
+
+void stats_report(FILE *out)
+{
+    if (!stats_enabled)
+        return;
+    uint64_t wall_ns = stats_now() - stats.start_ns;
+    if (stats.json)
+        report_json(out, wall_ns);
+    else
+        report_text(out, wall_ns);
+}
@@ -0,0 +1,49 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Runtime instrumentation enabled with --stats.
+ * Every hook returns immediately while stats_enabled is 0, so the
+ * cost of an instrumented call with the flag off is a single branch.
+ */
+
+typedef enum {
+    PHASE_TRAVERSE,         // process_path() recursion (create/append)
+    PHASE_COMPRESS,         // gzip child in compress_file_to_archive()
+    PHASE_DECOMPRESS,       // gunzip of compressed entries on extract
+    PHASE_METADATA_READ,    // header + metadata block load
+    PHASE_METADATA_WRITE,   // metadata flush + header rewrite
+    PHASE_EXTRACT,          // directory/file/link recreation
+    PHASE_COPY,             // data copy of surviving entries (-d)
+    PHASE_SEARCH,           // content search (-g)
+    PHASE_COMPARE,          // catalog comparison (--diff)
+    PHASE_COUNT
+} StatsPhase;
+
+extern int stats_enabled;
+
+/* Enables collection; json selects the JSON report instead of text. */
+void stats_init(const char *command, int json);
+
+uint64_t stats_now(void);
+void stats_phase_begin(StatsPhase phase);
+void stats_phase_end(StatsPhase phase);
+
+/* Latency-tracked stdio/syscall wrappers (fall through when disabled) */
+size_t stats_fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
+size_t stats_fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream);
+ssize_t stats_read(int fd, void *buf, size_t count);
+ssize_t stats_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t stats_pwrite(int fd, const void *buf, size_t count, off_t offset);
+
+void stats_count_entry(mode_t mode, int is_hardlink);
+void stats_add_bytes(off_t raw, off_t stored);
+void stats_file_done(const char *path, uint64_t start_ns, off_t bytes);
+
+void stats_report(FILE *out);
+
+#endif // STATS_H
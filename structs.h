@@ -4,16 +4,29 @@
 #include <sys/types.h>
 #include <time.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #define MAX_PATH_LENGTH 255
 #define HEADER_SIZE 256
 
+#define MYZ_MAGIC 0x315A594D    // "MYZ1", absent (0) in archives written before versioning
+#define MYZ_VERSION 2
+
+/* FileMetadata.flags */
+#define ENTRY_GZIP   0x1        // Data is a gzip stream
+#define ENTRY_SPARSE 0x2        // Data starts with an extent map, holes are not stored
+#define ENTRY_DICT   0x4        // Data is a zlib stream compressed against the archive dictionary
+#define ENTRY_DELTA  0x8        // Data is a delta against an older version (see delta.h)
+#define ENTRY_SUPERSEDED 0x10   // Older version of a path, kept as the base of newer ones,
+                                // or a path removed from the tree (--watch tombstone)
+#define ENTRY_BLOCKS 0x20       // With ENTRY_GZIP: one gzip member per block, then the block table (blocks.h)
+
 typedef struct {
     char path[MAX_PATH_LENGTH];
     mode_t mode;
     uid_t uid;
     gid_t gid;
-    off_t size;
+    off_t size;                 // Bytes stored in the archive
     time_t atime;
     time_t mtime;
     time_t ctime;
@@ -21,18 +34,151 @@ typedef struct {
     ino_t inode;                // For hard links
     int is_hardlink;            // 1 if it's a hard link, 0 otherwise
     char link_target[MAX_PATH_LENGTH]; // For symlinks
+    uint32_t flags;             // ENTRY_* flags
+    off_t logical_size;         // Size of the file on disk (st_size)
+    uint32_t volume;            // Volume holding the data, 0 = the archive file itself
+    uint32_t delta_depth;       // ENTRY_DELTA: length of the chain down to a full copy
+    long delta_base;            // ENTRY_DELTA: data offset of the base version
+    uint32_t delta_base_volume; // and its volume
+    uint32_t unused;            // Keeps dev aligned
+    uint64_t dev;               // Device of regular files, hard links match their original on (dev, inode);
+                                // 0 in archives written before it was stored
+    char reserved[16];          // In case I need to add more fields
 } FileMetadata;
 
+_Static_assert(sizeof(FileMetadata) == 640, "FileMetadata records are 640 bytes");
+
+/* Metadata record of archives without MYZ_MAGIC (version 1) */
+typedef struct {
+    char path[MAX_PATH_LENGTH];
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    off_t size;
+    time_t atime;
+    time_t mtime;
+    time_t ctime;
+    long data_offset;
+    ino_t inode;
+    int is_hardlink;
+    char link_target[MAX_PATH_LENGTH];
+} LegacyFileMetadata;
+
+/*
+ * Sparse entries (ENTRY_SPARSE) store a uint64_t extent count followed by
+ * that many extents, then the data of every extent back to back
+ * (gzip-compressed as one stream if ENTRY_GZIP is also set).
+ */
+typedef struct {
+    int64_t offset;
+    int64_t length;
+} SparseExtent;
+
+/*
+ * Block-compressed entries (ENTRY_BLOCKS) end with the compressed size of
+ * every gzip member (a uint64_t each) and this trailer, both carried in the
+ * extra field of empty gzip members (see blocks.h). Every block but the
+ * last holds block_size bytes of content.
+ */
+typedef struct {
+    uint64_t block_size;
+    uint64_t block_count;
+} BlockTrailer;
+
 typedef struct {
     uint32_t metadata_count;
     long metadata_offset;
-    char reserved[HEADER_SIZE - sizeof(uint32_t) - sizeof(long)]; // In case I need to add more fields
+    uint32_t magic;
+    uint32_t version;
+    long tree_offset;           // Directory tree index, 0 if absent
+    long volume_offset;         // Volume table, 0 for single-file archives
+    uint32_t volume_count;
+    uint32_t dict_size;         // Compression dictionary (--dict), 0 if absent
+    long dict_offset;           // Stored at the start of the data area
+    long column_offset;         // Columnar catalog section, 0 if absent
+    long data_start;            // Data area after a catalog moved to the front (--relayout), 0 = right after the header
+    char reserved[HEADER_SIZE - 6 * sizeof(uint32_t) - 6 * sizeof(long)]; // In case I need to add more fields
 } ArchiveHeader;
 
+_Static_assert(sizeof(ArchiveHeader) == HEADER_SIZE, "ArchiveHeader must fill HEADER_SIZE");
+
+/*
+ * Directory tree index, written after the metadata block:
+ * a TreeIndexHeader, one TreeNode per metadata record (same order) and
+ * the name pool. Children (and roots) are linked in name order.
+ * Roots are entries whose parent directory is not archived, their name is
+ * the full path, every other node stores its basename.
+ */
+#define TREE_NONE UINT32_MAX
+
+typedef struct {
+    uint32_t node_count;
+    uint32_t first_root;
+    uint64_t names_size;
+} TreeIndexHeader;
+
+typedef struct {
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t mode;
+    uint64_t name_offset;       // Into the name pool, NUL-terminated
+} TreeNode;
+
+/*
+ * Columnar catalog section, written after the tree index: a ColumnHeader,
+ * then one array per attribute with an element per metadata record (same
+ * order): int64 logical sizes (-1 if unknown), int64 mtimes, then uint32
+ * uids, gids and modes. Predicates (-f, --where) scan these arrays instead
+ * of the 640-byte records.
+ */
+#define COLUMN_COUNT 5
+
+typedef struct {
+    uint64_t count;             // Records covered, equal to metadata_count
+    uint32_t columns;           // COLUMN_COUNT
+    uint32_t reserved;
+} ColumnHeader;
+
+/*
+ * Multi-volume archives (--volumes / --volume-size) spread the file data
+ * over several files. The volume table, written after the tree index, has
+ * one entry per volume; entry 0 is the archive file itself. Paths are
+ * relative to the directory of the archive unless absolute (--volume-path).
+ * Data offsets of entries in other volumes are relative to their volume file.
+ */
+typedef struct {
+    uint64_t size;              // Data bytes in the volume
+    char path[MAX_PATH_LENGTH + 1];
+} VolumeEntry;
+
+/* Hash index (dev, inode) -> data offset, only holds files with st_nlink > 1 */
+typedef struct {
+    dev_t dev;
+    ino_t inode;                // 0 marks an empty slot
+    long data_offset;
+} InodeSlot;
+
+typedef struct {
+    InodeSlot *slots;
+    size_t count;
+    size_t capacity;
+} InodeIndex;
+
+/*
+ * Records collected during create/append.
+ * With a memory limit the records are flushed to a spill file whenever the
+ * in-memory part is full: 'count' is then only the in-memory tail and the
+ * total is spilled + count (see metadata_total()).
+ */
 typedef struct {
     FileMetadata *records;
     size_t count;
     size_t capacity;
+    size_t max_records;         // 0 = unbounded
+    FILE *spill;
+    size_t spilled;
+    InodeIndex links;           // Hard link lookup
 } MetadataArray;
 
 #endif // STRUCTS_H
@@ -0,0 +1,877 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "../structs.h"
+#include "../utils.h"
+#include "../stats.h"
+#include "../io.h"
+#include "../filter.h"
+#include "../tree_index.h"
+#include "../columns.h"
+#include "../libmyz.h"
+#include "../query.h"
+#include "tar.h"
+
+#define TAR_BLOCK 512
+#define TAR_RECORD (20 * TAR_BLOCK)     // tar pads its output to whole records of 20 blocks
+#define PAX_MAX (1 << 20)               // Larger extended headers are not ours to read
+#define OCTAL_LIMIT(digits) (1ull << (3 * (digits)))
+
+const char *from_tar_option = NULL;
+const char *to_tar_option = NULL;
+
+/* POSIX ustar header */
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} TarHeader;
+
+_Static_assert(sizeof(TarHeader) == TAR_BLOCK, "TarHeader must fill a tar block");
+
+static size_t padding(uint64_t size)
+{
+    return (size_t)((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+}
+
+static unsigned long header_sum(const TarHeader *h)
+{
+    const unsigned char *p = (const unsigned char *)h;
+    unsigned long sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; i++)
+        sum += (i >= offsetof(TarHeader, chksum) && i < offsetof(TarHeader, typeflag)) ? ' ' : p[i];
+    return sum;
+}
+
+/* Import */
+
+/* Octal with optional spaces and NULs, or GNU base-256 when the high bit of the first byte is set */
+static uint64_t parse_number(const char *field, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)field;
+    uint64_t value = 0;
+    if (p[0] & 0x80) {
+        value = p[0] & 0x3f;
+        for (size_t i = 1; i < len; i++)
+            value = value << 8 | p[i];
+        return value;
+    }
+    size_t i = 0;
+    while (i < len && p[i] == ' ')
+        i++;
+    for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+        value = value * 8 + (uint64_t)(p[i] - '0');
+    return value;
+}
+
+/* Attributes of the next entry from pax ('x') and GNU long name ('L', 'K') headers */
+typedef struct {
+    char path[4096];
+    char linkpath[4096];
+    uint64_t size, uid, gid;
+    time_t mtime, atime, ctime;
+    int has_path, has_linkpath, has_size, has_uid, has_gid, has_mtime, has_atime, has_ctime;
+    int sparse;                 // GNU.sparse.*: the data is not the file content
+} TarOverrides;
+
+/* Data of regular files by path, for hard links (a 64-bit hash per file, not the paths) */
+typedef struct {
+    uint64_t hash;              // 0 marks an empty slot
+    long data_offset;
+    ino_t inode;
+    off_t logical_size;
+} LinkSlot;
+
+typedef struct {
+    LinkSlot *slots;
+    size_t count;
+    size_t capacity;
+} LinkMap;
+
+static uint64_t path_hash(const char *path)
+{
+    uint64_t h = 1469598103934665603ull;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++)
+        h = (h ^ *p) * 1099511628211ull;
+    return h ? h : 1;
+}
+
+static LinkSlot *link_find(const LinkMap *map, uint64_t hash)
+{
+    if (map->capacity == 0)
+        return NULL;
+    size_t mask = map->capacity - 1;
+    for (size_t i = hash & mask; map->slots[i].hash; i = (i + 1) & mask) {
+        if (map->slots[i].hash == hash)
+            return &map->slots[i];
+    }
+    return NULL;
+}
+
+static int link_add(LinkMap *map, const FileMetadata *meta)
+{
+    if ((map->count + 1) * 2 > map->capacity) {
+        size_t capacity = map->capacity ? map->capacity * 2 : 1024;
+        LinkSlot *slots = calloc(capacity, sizeof(LinkSlot));
+        if (!slots) {
+            perror("calloc");
+            return -1;
+        }
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (!map->slots[i].hash)
+                continue;
+            size_t j = map->slots[i].hash & (capacity - 1);
+            while (slots[j].hash)
+                j = (j + 1) & (capacity - 1);
+            slots[j] = map->slots[i];
+        }
+        free(map->slots);
+        map->slots = slots;
+        map->capacity = capacity;
+    }
+    uint64_t hash = path_hash(meta->path);
+    LinkSlot *slot = link_find(map, hash);
+    if (!slot) {
+        size_t j = hash & (map->capacity - 1);
+        while (map->slots[j].hash)
+            j = (j + 1) & (map->capacity - 1);
+        slot = &map->slots[j];
+        map->count++;
+    }
+    // A path stored again (later wins in tar) is linked to its last version
+    *slot = (LinkSlot){ hash, meta->data_offset, meta->inode, meta->logical_size };
+    return 0;
+}
+
+typedef struct {
+    FILE *in;
+    FILE *archive;
+    long data_offset;
+    unsigned char *buffer;
+    size_t buffer_size;
+    int gzip;
+    z_stream z;
+    unsigned char zbuf[65536];
+} TarImport;
+
+static int read_exact(TarImport *t, void *buf, size_t n)
+{
+    if (stats_fread(buf, 1, n, t->in) != n) {
+        if (ferror(t->in))
+            perror("Error reading tar stream");
+        else
+            fprintf(stderr, "Unexpected end of tar stream\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads and drops n bytes, the input may be a pipe */
+static int skip_bytes(TarImport *t, uint64_t n)
+{
+    while (n > 0) {
+        size_t step = n < t->buffer_size ? (size_t)n : t->buffer_size;
+        if (read_exact(t, t->buffer, step) != 0)
+            return -1;
+        n -= step;
+    }
+    return 0;
+}
+
+/* Data of a special header ('x', 'L', 'K') as a NUL-terminated string */
+static char *read_special(TarImport *t, uint64_t size)
+{
+    if (size > PAX_MAX) {
+        fprintf(stderr, "Tar extended header too large (%llu bytes)\n", (unsigned long long)size);
+        return NULL;
+    }
+    char *data = malloc((size_t)size + 1);
+    if (!data) {
+        perror("malloc");
+        return NULL;
+    }
+    if (read_exact(t, data, (size_t)size) != 0 || skip_bytes(t, padding(size)) != 0) {
+        free(data);
+        return NULL;
+    }
+    data[size] = '\0';
+    return data;
+}
+
+/* "%d key=value\n" records, the length counting the whole record */
+static void parse_pax(const char *data, size_t size, TarOverrides *ov)
+{
+    size_t pos = 0;
+    while (pos < size) {
+        char *end;
+        unsigned long len = strtoul(data + pos, &end, 10);
+        if (len == 0 || *end != ' ' || pos + len > size || data[pos + len - 1] != '\n')
+            return;
+        const char *key = end + 1;
+        const char *eq = memchr(key, '=', (size_t)(data + pos + len - 1 - key));
+        if (!eq)
+            return;
+        size_t key_len = (size_t)(eq - key);
+        const char *value = eq + 1;
+        size_t value_len = (size_t)(data + pos + len - 1 - value);
+        char text[4096];
+        snprintf(text, sizeof(text), "%.*s", (int)value_len, value);
+        if (key_len == 4 && strncmp(key, "path", 4) == 0) {
+            snprintf(ov->path, sizeof(ov->path), "%s", text);
+            ov->has_path = 1;
+        } else if (key_len == 8 && strncmp(key, "linkpath", 8) == 0) {
+            snprintf(ov->linkpath, sizeof(ov->linkpath), "%s", text);
+            ov->has_linkpath = 1;
+        } else if (key_len == 4 && strncmp(key, "size", 4) == 0) {
+            ov->size = strtoull(text, NULL, 10);
+            ov->has_size = 1;
+        } else if (key_len == 3 && strncmp(key, "uid", 3) == 0) {
+            ov->uid = strtoull(text, NULL, 10);
+            ov->has_uid = 1;
+        } else if (key_len == 3 && strncmp(key, "gid", 3) == 0) {
+            ov->gid = strtoull(text, NULL, 10);
+            ov->has_gid = 1;
+        } else if (key_len == 5 && strncmp(key, "mtime", 5) == 0) {
+            ov->mtime = (time_t)strtoll(text, NULL, 10);    // Fractions are dropped
+            ov->has_mtime = 1;
+        } else if (key_len == 5 && strncmp(key, "atime", 5) == 0) {
+            ov->atime = (time_t)strtoll(text, NULL, 10);
+            ov->has_atime = 1;
+        } else if (key_len == 5 && strncmp(key, "ctime", 5) == 0) {
+            ov->ctime = (time_t)strtoll(text, NULL, 10);
+            ov->has_ctime = 1;
+        } else if (key_len > 11 && strncmp(key, "GNU.sparse.", 11) == 0) {
+            ov->sparse = 1;
+        }
+        pos += len;
+    }
+}
+
+static int deflate_out(TarImport *t, int flush)
+{
+    do {
+        t->z.next_out = t->zbuf;
+        t->z.avail_out = sizeof(t->zbuf);
+        int zr = deflate(&t->z, flush);
+        if (zr != Z_OK && zr != Z_STREAM_END && zr != Z_BUF_ERROR) {
+            fprintf(stderr, "Error compressing tar entry\n");
+            return -1;
+        }
+        size_t n = sizeof(t->zbuf) - t->z.avail_out;
+        if (n > 0 && stats_fwrite(t->zbuf, 1, n, t->archive) != n) {
+            perror("Error writing file data to archive");
+            return -1;
+        }
+        t->data_offset += (long)n;
+        if (zr == Z_STREAM_END)
+            break;
+    } while (t->z.avail_in > 0 || t->z.avail_out == 0 || flush == Z_FINISH);
+    return 0;
+}
+
+/* Copies the data of a regular entry from the stream into the archive (a gzip stream with -j) */
+static int store_entry_data(TarImport *t, uint64_t size, FileMetadata *meta)
+{
+    meta->data_offset = t->data_offset;
+    meta->logical_size = (off_t)size;
+    if (t->gzip) {
+        stats_phase_begin(PHASE_COMPRESS);
+        deflateReset(&t->z);
+    }
+    uint64_t left = size;
+    int rc = 0;
+    while (left > 0 && rc == 0) {
+        size_t step = left < t->buffer_size ? (size_t)left : t->buffer_size;
+        if (read_exact(t, t->buffer, step) != 0) {
+            rc = -1;
+            break;
+        }
+        if (t->gzip) {
+            t->z.next_in = t->buffer;
+            t->z.avail_in = (uInt)step;
+            rc = deflate_out(t, Z_NO_FLUSH);
+        } else if (stats_fwrite(t->buffer, 1, step, t->archive) != step) {
+            perror("Error writing file data to archive");
+            rc = -1;
+        } else {
+            t->data_offset += (long)step;
+        }
+        left -= step;
+    }
+    if (t->gzip) {
+        if (rc == 0) {
+            t->z.avail_in = 0;
+            rc = deflate_out(t, Z_FINISH);
+        }
+        stats_phase_end(PHASE_COMPRESS);
+        meta->flags |= ENTRY_GZIP;
+    }
+    if (rc == 0)
+        rc = skip_bytes(t, padding(size));
+    meta->size = t->data_offset - meta->data_offset;
+    stats_add_bytes((off_t)size, meta->size);
+    return rc;
+}
+
+/* "./a//b/" -> "./a//b", "/etc/x" -> "etc/x"; "" and "." are not entries */
+static int entry_path(const TarHeader *h, const TarOverrides *ov, char *path, size_t size)
+{
+    char full[4096];
+    if (ov->has_path)
+        snprintf(full, sizeof(full), "%s", ov->path);
+    else if (memcmp(h->magic, "ustar", 5) == 0 && h->prefix[0])
+        snprintf(full, sizeof(full), "%.155s/%.100s", h->prefix, h->name);
+    else
+        snprintf(full, sizeof(full), "%.100s", h->name);
+    const char *start = full;
+    while (*start == '/')
+        start++;
+    size_t len = strlen(start);
+    while (len > 0 && start[len - 1] == '/')
+        len--;
+    if (len == 0 || (len == 1 && start[0] == '.'))
+        return 1;
+    if (len >= size) {
+        fprintf(stderr, "Path too long, skipped: %.*s\n", (int)len, start);
+        return -1;
+    }
+    memcpy(path, start, len);
+    path[len] = '\0';
+    return 0;
+}
+
+void tar_import(const char *archive_name, const char *tar_name)
+{
+    int from_stdin = strcmp(tar_name, "-") == 0;
+    FILE *in = from_stdin ? stdin : io_fopen(tar_name, "rb");
+    if (!in) {
+        perror(tar_name);
+        return;
+    }
+    FILE *archive = io_fopen(archive_name, "wb+");
+    if (!archive) {
+        perror("Error creating archive");
+        if (!from_stdin)
+            io_fclose(in);
+        return;
+    }
+    TarImport t;
+    memset(&t, 0, sizeof(t));
+    t.in = in;
+    t.archive = archive;
+    t.data_offset = HEADER_SIZE;
+    t.buffer_size = io_buffer_size;
+    t.buffer = io_alloc(t.buffer_size);
+    t.gzip = compress_flag;
+    MetadataArray marr;
+    init_metadata_array(&marr);
+    LinkMap links = { NULL, 0, 0 };
+    int failed = !t.buffer;
+    if (!t.buffer)
+        perror("malloc");
+    if (!failed && t.gzip && deflateInit2(&t.z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                                          Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Error initializing zlib\n");
+        t.gzip = 0;
+        failed = 1;
+    }
+    if (!failed && fseek(archive, HEADER_SIZE, SEEK_SET) != 0) {
+        perror("fseek error");
+        failed = 1;
+    }
+
+    stats_phase_begin(PHASE_TRAVERSE);
+    TarOverrides ov;
+    memset(&ov, 0, sizeof(ov));
+    ino_t next_inode = 1;       // tar has no inode numbers, every file gets its own
+    size_t skipped = 0;
+    while (!failed) {
+        TarHeader h;
+        size_t got = stats_fread(&h, 1, TAR_BLOCK, in);
+        if (got == 0 && !ferror(in))
+            break;              // Some writers stop after one or no end block
+        if (got != TAR_BLOCK) {
+            fprintf(stderr, "Unexpected end of tar stream\n");
+            failed = 1;
+            break;
+        }
+        static const TarHeader zero;
+        if (memcmp(&h, &zero, TAR_BLOCK) == 0)
+            break;              // End of archive
+        if (header_sum(&h) != parse_number(h.chksum, sizeof(h.chksum))) {
+            fprintf(stderr, "Not a tar stream, or a corrupt header\n");
+            failed = 1;
+            break;
+        }
+        uint64_t size = ov.has_size ? ov.size : parse_number(h.size, sizeof(h.size));
+        char type = h.typeflag;
+        if (type == 'x' || type == 'L' || type == 'K') {
+            char *data = read_special(&t, size);
+            if (!data) {
+                failed = 1;
+                break;
+            }
+            if (type == 'x') {
+                parse_pax(data, (size_t)size, &ov);
+            } else {
+                char *target = type == 'L' ? ov.path : ov.linkpath;
+                snprintf(target, sizeof(ov.path), "%s", data);
+                *(type == 'L' ? &ov.has_path : &ov.has_linkpath) = 1;
+            }
+            free(data);
+            continue;
+        }
+        int regular = type == '0' || type == '\0' || type == '7';
+        uint64_t data_left = size;  // Still to be read after the record is built
+        char path[MAX_PATH_LENGTH];
+        int path_rc = entry_path(&h, &ov, path, sizeof(path));
+        if (path_rc < 0)
+            skipped++;
+        FileMetadata meta;
+        memset(&meta, 0, sizeof(meta));
+        if (path_rc == 0 && !filter_path_excluded(path)) {
+            snprintf(meta.path, sizeof(meta.path), "%s", path);
+            mode_t perms = (mode_t)(parse_number(h.mode, sizeof(h.mode)) & 07777);
+            meta.uid = (uid_t)(ov.has_uid ? ov.uid : parse_number(h.uid, sizeof(h.uid)));
+            meta.gid = (gid_t)(ov.has_gid ? ov.gid : parse_number(h.gid, sizeof(h.gid)));
+            meta.mtime = ov.has_mtime ? ov.mtime : (time_t)parse_number(h.mtime, sizeof(h.mtime));
+            meta.atime = ov.has_atime ? ov.atime : meta.mtime;
+            meta.ctime = ov.has_ctime ? ov.ctime : meta.mtime;
+            const char *link = ov.has_linkpath ? ov.linkpath : NULL;
+            char linkname[101];
+            if (!link) {
+                snprintf(linkname, sizeof(linkname), "%.100s", h.linkname);
+                link = linkname;
+            }
+            if (regular && !ov.sparse) {
+                meta.mode = S_IFREG | perms;
+                meta.inode = next_inode++;
+                failed = store_entry_data(&t, size, &meta) != 0 || link_add(&links, &meta) != 0;
+                data_left = 0;
+                if (!failed) {
+                    add_metadata(&marr, &meta);
+                    stats_count_entry(meta.mode, 0);
+                }
+            } else if (type == '5') {
+                meta.mode = S_IFDIR | perms;
+                add_metadata(&marr, &meta);
+                stats_count_entry(meta.mode, 0);
+            } else if (type == '2' && strlen(link) < MAX_PATH_LENGTH) {
+                meta.mode = S_IFLNK | perms;
+                snprintf(meta.link_target, sizeof(meta.link_target), "%s", link);
+                add_metadata(&marr, &meta);
+                stats_count_entry(meta.mode, 0);
+            } else if (type == '1') {
+                while (*link == '/')
+                    link++;
+                const LinkSlot *target = link_find(&links, path_hash(link));
+                if (!target) {
+                    fprintf(stderr, "Hard link target not in the stream, skipped: %s -> %s\n", path, link);
+                    skipped++;
+                } else {
+                    meta.mode = S_IFREG | perms;
+                    meta.is_hardlink = 1;
+                    meta.data_offset = target->data_offset;
+                    meta.inode = target->inode;
+                    meta.logical_size = target->logical_size;
+                    add_metadata(&marr, &meta);
+                    stats_count_entry(meta.mode, 1);
+                }
+            } else {
+                fprintf(stderr, "Skipping unsupported tar entry (type '%c'): %s\n", type ? type : '0', path);
+                skipped++;
+            }
+        }
+        if (!failed && data_left > 0)
+            failed = skip_bytes(&t, data_left + padding(data_left)) != 0;
+        memset(&ov, 0, sizeof(ov));
+    }
+    stats_phase_end(PHASE_TRAVERSE);
+    if (t.gzip)
+        deflateEnd(&t.z);
+    free(t.buffer);
+    free(links.slots);
+    if (!from_stdin)
+        io_fclose(in);
+    if (failed) {
+        free_metadata_array(&marr);
+        io_fclose(archive);
+        remove(archive_name);
+        return;
+    }
+
+    stats_phase_begin(PHASE_METADATA_WRITE);
+    long metadata_offset = t.data_offset;
+    if (write_metadata_array(&marr, archive) != 0) {
+        stats_phase_end(PHASE_METADATA_WRITE);
+        free_metadata_array(&marr);
+        io_fclose(archive);
+        return;
+    }
+    ArchiveHeader header;
+    init_archive_header(&header);
+    header.metadata_count = metadata_total(&marr);
+    header.metadata_offset = metadata_offset;
+    write_tree_index(archive, &header);
+    write_columns(archive, &header);
+    if (fseek(archive, 0, SEEK_SET) != 0 || fwrite(&header, 1, HEADER_SIZE, archive) != HEADER_SIZE)
+        perror("Error writing header");
+    io_fclose(archive);
+    stats_phase_end(PHASE_METADATA_WRITE);
+    free_metadata_array(&marr);
+    if (skipped)
+        printf("Skipped %zu tar entries.\n", skipped);
+    printf("Archive %s created successfully.\n", archive_name);
+}
+
+/* Export */
+
+typedef struct {
+    FILE *out;
+    uint64_t written;           // For the padding of the last record
+    unsigned char *buffer;
+    size_t buffer_size;
+    int failed;
+} TarExport;
+
+static void out_write(TarExport *t, const void *data, size_t n)
+{
+    if (t->failed || n == 0)
+        return;
+    if (stats_fwrite(data, 1, n, t->out) != n) {
+        perror("Error writing tar stream");
+        t->failed = 1;
+        return;
+    }
+    t->written += n;
+}
+
+static void out_zeros(TarExport *t, size_t n)
+{
+    static const char zero[TAR_BLOCK];
+    while (n > 0) {
+        size_t step = n < sizeof(zero) ? n : sizeof(zero);
+        out_write(t, zero, step);
+        n -= step;
+    }
+}
+
+static void pax_add(char *pax, size_t *len, size_t cap, const char *key, const char *value)
+{
+    // The length counts its own digits
+    size_t body = strlen(key) + strlen(value) + 3;
+    size_t total = body + 1;
+    while (snprintf(NULL, 0, "%zu", total) + body != total)
+        total++;
+    if (*len + total < cap)
+        *len += (size_t)snprintf(pax + *len, cap - *len, "%zu %s=%s\n", total, key, value);
+}
+
+static void put_octal(char *field, size_t width, uint64_t value)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%0*llo", (int)width - 1, (unsigned long long)value);
+    memcpy(field, text, width - 1);
+    field[width - 1] = '\0';
+}
+
+static void put_header(TarExport *t, TarHeader *h)
+{
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+    put_octal(h->chksum, 7, header_sum(h));
+    h->chksum[7] = ' ';
+    out_write(t, h, TAR_BLOCK);
+}
+
+/* Header of one entry, preceded by a pax header for what ustar cannot hold */
+static void write_header(TarExport *t, const myz_entry *e, char type, const char *linkname, uint64_t size)
+{
+    TarHeader h;
+    memset(&h, 0, sizeof(h));
+    char pax[2048];
+    size_t pax_len = 0;
+    char name[MAX_PATH_LENGTH + 2];
+    snprintf(name, sizeof(name), "%s%s", e->path, type == '5' ? "/" : "");
+    size_t len = strlen(name);
+    if (len <= sizeof(h.name)) {
+        memcpy(h.name, name, len);
+    } else {
+        // ustar splits long names at a slash into prefix and name
+        const char *split = NULL;
+        for (const char *s = strchr(name, '/'); s; s = strchr(s + 1, '/')) {
+            if ((size_t)(s - name) <= sizeof(h.prefix) && len - (size_t)(s - name) - 1 <= sizeof(h.name) &&
+                s[1] != '\0') {
+                split = s;
+                break;
+            }
+        }
+        if (split) {
+            memcpy(h.prefix, name, (size_t)(split - name));
+            memcpy(h.name, split + 1, len - (size_t)(split - name) - 1);
+        } else {
+            memcpy(h.name, name, sizeof(h.name));
+            pax_add(pax, &pax_len, sizeof(pax), "path", name);
+        }
+    }
+    if (linkname) {
+        size_t link_len = strlen(linkname);
+        memcpy(h.linkname, linkname, link_len < sizeof(h.linkname) ? link_len : sizeof(h.linkname));
+        if (link_len > sizeof(h.linkname))
+            pax_add(pax, &pax_len, sizeof(pax), "linkpath", linkname);
+    }
+    char number[32];
+    put_octal(h.mode, sizeof(h.mode), (uint64_t)(e->mode & 07777));
+    if ((uint64_t)e->uid >= OCTAL_LIMIT(7)) {
+        snprintf(number, sizeof(number), "%lu", (unsigned long)e->uid);
+        pax_add(pax, &pax_len, sizeof(pax), "uid", number);
+    } else {
+        put_octal(h.uid, sizeof(h.uid), (uint64_t)e->uid);
+    }
+    if ((uint64_t)e->gid >= OCTAL_LIMIT(7)) {
+        snprintf(number, sizeof(number), "%lu", (unsigned long)e->gid);
+        pax_add(pax, &pax_len, sizeof(pax), "gid", number);
+    } else {
+        put_octal(h.gid, sizeof(h.gid), (uint64_t)e->gid);
+    }
+    if (size >= OCTAL_LIMIT(11)) {
+        snprintf(number, sizeof(number), "%llu", (unsigned long long)size);
+        pax_add(pax, &pax_len, sizeof(pax), "size", number);
+    } else {
+        put_octal(h.size, sizeof(h.size), size);
+    }
+    if (e->mtime < 0 || (uint64_t)e->mtime >= OCTAL_LIMIT(11)) {
+        snprintf(number, sizeof(number), "%lld", (long long)e->mtime);
+        pax_add(pax, &pax_len, sizeof(pax), "mtime", number);
+    } else {
+        put_octal(h.mtime, sizeof(h.mtime), (uint64_t)e->mtime);
+    }
+    h.typeflag = type;
+    if (pax_len > 0) {
+        TarHeader x;
+        memset(&x, 0, sizeof(x));
+        const char *base = strrchr(e->path, '/');
+        snprintf(x.name, sizeof(x.name), "PaxHeaders/%.88s", base ? base + 1 : e->path);
+        put_octal(x.mode, sizeof(x.mode), 0644);
+        memcpy(x.uid, h.uid, sizeof(x.uid));
+        memcpy(x.gid, h.gid, sizeof(x.gid));
+        memcpy(x.mtime, h.mtime, sizeof(x.mtime));
+        put_octal(x.size, sizeof(x.size), pax_len);
+        x.typeflag = 'x';
+        put_header(t, &x);
+        out_write(t, pax, pax_len);
+        out_zeros(t, padding(pax_len));
+    }
+    put_header(t, &h);
+}
+
+/* A regular entry with its content (holes of sparse entries as zeros) */
+static void write_file(TarExport *t, myz_archive *archive, const myz_entry *e)
+{
+    myz_stream *stream;
+    int rc = myz_stream_open(archive, e->index, &stream);
+    if (rc != MYZ_OK) {
+        print_myz_error(e->path, rc);
+        t->failed = 1;
+        return;
+    }
+    uint64_t size = (uint64_t)e->size;
+    ssize_t n;
+    if (e->size < 0) {
+        // Old compressed entries do not record their size: decode once to count
+        size = 0;
+        while ((n = myz_stream_read(stream, t->buffer, t->buffer_size)) > 0)
+            size += (uint64_t)n;
+        myz_stream_close(stream);
+        if (n < 0 || (rc = myz_stream_open(archive, e->index, &stream)) != MYZ_OK) {
+            print_myz_error(e->path, n < 0 ? (int)n : rc);
+            t->failed = 1;
+            return;
+        }
+    }
+    write_header(t, e, '0', NULL, size);
+    uint64_t done = 0;
+    while (done < size && !t->failed && (n = myz_stream_read(stream, t->buffer, t->buffer_size)) > 0) {
+        size_t step = (uint64_t)n < size - done ? (size_t)n : (size_t)(size - done);
+        out_write(t, t->buffer, step);
+        done += step;
+    }
+    myz_stream_close(stream);
+    if (done < size) {
+        // The header is out already, keep the stream readable
+        if (n < 0)
+            print_myz_error(e->path, (int)n);
+        else
+            fprintf(stderr, "Content shorter than its size: %s\n", e->path);
+        out_zeros(t, (size_t)(size - done));
+        t->failed = 1;
+    }
+    out_zeros(t, padding(size));
+    stats_add_bytes((off_t)size, e->stored_size);
+}
+
+/* Data owners by location, the order they are written in */
+typedef struct {
+    uint32_t volume;
+    off_t offset;
+    size_t index;
+} Owner;
+
+static int cmp_owners(const void *a, const void *b)
+{
+    const Owner *x = a, *y = b;
+    if (x->volume != y->volume)
+        return x->volume < y->volume ? -1 : 1;
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+int tar_export(const char *archive_name, const char *tar_name, char **filter, int filter_count)
+{
+    stats_phase_begin(PHASE_METADATA_READ);
+    myz_archive *archive;
+    int rc = myz_open(archive_name, &archive);
+    stats_phase_end(PHASE_METADATA_READ);
+    if (rc != MYZ_OK) {
+        print_myz_error("Error opening archive", rc);
+        return -1;
+    }
+    size_t meta_count = myz_entry_count(archive);
+    unsigned char *where = NULL;
+    if (where_option) {
+        size_t where_count = 0;
+        where = query_select(archive_name, where_option, &where_count);
+        if (!where || where_count != meta_count) {
+            free(where);
+            myz_close(archive);
+            return -1;
+        }
+    }
+    PathFilter *path_filter = filter_compile(filter, filter_count, 0);
+    unsigned char *selected = calloc(meta_count ? meta_count : 1, 1);
+    Owner *owners = malloc((meta_count ? meta_count : 1) * sizeof(Owner));
+    if (!path_filter || !selected || !owners) {
+        perror("malloc");
+        free(where);
+        filter_free(path_filter);
+        free(selected);
+        free(owners);
+        myz_close(archive);
+        return -1;
+    }
+    size_t owner_count = 0;
+    myz_iter iter;
+    myz_entry entry;
+    myz_iter_init(&iter, archive);
+    while (myz_iter_next(&iter, &entry)) {
+        selected[entry.index] = (unsigned char)(filter_match(path_filter, entry.path) &&
+                                                (!where || where[entry.index]));
+        if (S_ISREG(entry.mode) && !entry.is_hardlink)
+            owners[owner_count++] = (Owner){ entry.volume, entry.offset, entry.index };
+    }
+    filter_free(path_filter);
+    free(where);
+    qsort(owners, owner_count, sizeof(Owner), cmp_owners);
+
+    int to_stdout = strcmp(tar_name, "-") == 0;
+    TarExport t;
+    memset(&t, 0, sizeof(t));
+    t.out = to_stdout ? stdout : io_fopen(tar_name, "wb");
+    t.buffer_size = io_buffer_size;
+    t.buffer = io_alloc(t.buffer_size);
+    if (!t.out || !t.buffer) {
+        perror(t.out ? "malloc" : tar_name);
+        if (t.out && !to_stdout)
+            io_fclose(t.out);
+        free(t.buffer);
+        free(selected);
+        free(owners);
+        myz_close(archive);
+        return -1;
+    }
+    stats_phase_begin(PHASE_EXTRACT);
+    /* Directories, so that extracting tar creates them with their modes */
+    myz_iter_init(&iter, archive);
+    while (!t.failed && myz_iter_next(&iter, &entry)) {
+        if (selected[entry.index] && S_ISDIR(entry.mode)) {
+            write_header(&t, &entry, '5', NULL, 0);
+            stats_count_entry(entry.mode, 0);
+        }
+    }
+    /* Files in data order, so the archive is read front to back */
+    for (size_t i = 0; i < owner_count && !t.failed; i++) {
+        if (!selected[owners[i].index])
+            continue;
+        myz_entry_at(archive, owners[i].index, &entry);
+        write_file(&t, archive, &entry);
+        stats_count_entry(entry.mode, 0);
+    }
+    /* Links last, their targets are in the stream by then */
+    myz_iter_init(&iter, archive);
+    while (!t.failed && myz_iter_next(&iter, &entry)) {
+        if (!selected[entry.index])
+            continue;
+        if (S_ISLNK(entry.mode)) {
+            write_header(&t, &entry, '2', entry.link_target, 0);
+            stats_count_entry(entry.mode, 0);
+        } else if (S_ISREG(entry.mode) && entry.is_hardlink) {
+            // Older versions are never selected
+            myz_entry orig;
+            int found = myz_link_origin(archive, entry.index, &orig) == MYZ_OK;
+            if (found && selected[orig.index]) {
+                write_header(&t, &entry, '1', orig.path, 0);
+            } else {
+                // The original is not in the stream: the link carries its data
+                if (found) {
+                    entry.size = orig.size;
+                    entry.stored_size = orig.stored_size;
+                    entry.index = orig.index;
+                }
+                write_file(&t, archive, &entry);
+            }
+            stats_count_entry(entry.mode, 1);
+        }
+    }
+    /* Two zero blocks end the archive, zeros fill the last record */
+    out_zeros(&t, 2 * TAR_BLOCK);
+    out_zeros(&t, (size_t)((TAR_RECORD - t.written % TAR_RECORD) % TAR_RECORD));
+    stats_phase_end(PHASE_EXTRACT);
+    if (to_stdout) {
+        if (fflush(stdout) != 0 && !t.failed) {
+            perror("Error writing tar stream");
+            t.failed = 1;
+        }
+    } else if (io_fclose(t.out) != 0 && !t.failed) {
+        perror("Error writing tar stream");
+        t.failed = 1;
+    }
+    free(t.buffer);
+    free(selected);
+    free(owners);
+    myz_close(archive);
+    if (t.failed)
+        return -1;
+    // The tar stream may be on stdout
+    fprintf(to_stdout ? stderr : stdout, "Archive %s written as tar to %s.\n", archive_name,
+            to_stdout ? "standard output" : tar_name);
+    return 0;
+}
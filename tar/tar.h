@@ -0,0 +1,25 @@
+#ifndef TAR_H
+#define TAR_H
+
+/* -c --from-tar / -x --to-tar: tar file, or "-" for stdin / stdout */
+extern const char *from_tar_option;
+extern const char *to_tar_option;
+
+/*
+ * Creates an archive from a tar stream (ustar, pax and GNU long names) in
+ * one pass: the data of every regular file goes straight from the stream
+ * into the archive (through zlib with -j), hard links and symlinks become
+ * the matching records. Devices, FIFOs and sparse tar entries are skipped.
+ */
+void tar_import(const char *archive_name, const char *tar_name);
+
+/*
+ * Writes the selected entries of an archive as a ustar stream, with pax
+ * headers for paths, link targets, sizes and ids that do not fit.
+ * Directories come first, then the files in data order, then the links.
+ * filter / filter_count select paths like -x, --where applies too.
+ * Returns 0 on success, -1 on error.
+ */
+int tar_export(const char *archive_name, const char *tar_name, char **filter, int filter_count);
+
+#endif // TAR_H
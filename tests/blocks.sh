@@ -0,0 +1,48 @@
+#!/bin/sh
+# Compresses files large enough for parallel gzip blocks with -j and checks
+# that the stored data is still one valid gzip stream, and that -x, -g,
+# --to-tar and --delta read the content back unchanged.
+set -e
+MYZ=${MYZ:-$(pwd)/myz}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+fail() {
+    echo "blocks: $*" >&2
+    exit 1
+}
+extract() {
+    rm -rf out
+    mkdir out
+    (cd out && "$MYZ" -x ../"$1" > /dev/null)
+    diff -rq src out/src || fail "$1 differs after extraction"
+}
+
+mkdir src
+seq 1 2000000 > src/big
+"$MYZ" -c one.myz -j src > /dev/null
+# The only file's data lies between the 256-byte header and the catalog,
+# whose offset is the long at byte 8 of the header
+catalog=$(od -An -t d8 -j 8 -N 8 one.myz | tr -d ' ')
+head -c "$catalog" one.myz | tail -c +257 > payload.gz
+gzip -t payload.gz 2> /dev/null || fail "stored data is not a valid gzip stream"
+gzip -dc payload.gz | cmp - src/big || fail "stored data does not decompress to the content"
+extract one.myz
+
+ln src/big src/link
+head -c 3000000 /dev/urandom > src/random
+cat src/random src/random src/random > src/repeated
+"$MYZ" -c t.myz -j src > /dev/null
+extract t.myz
+"$MYZ" -g t.myz 1999999 | grep -qx src/big || fail "-g did not find content in the last block"
+mkdir from-tar
+"$MYZ" -x t.myz --to-tar - 2> /dev/null | tar -xf - -C from-tar
+diff -rq src from-tar/src || fail "--to-tar output differs from the tree"
+
+echo 2000001 >> src/big
+"$MYZ" -a t.myz -j --delta src/big > /dev/null
+rm -rf out
+mkdir out
+(cd out && "$MYZ" -x ../t.myz > /dev/null)
+cmp out/src/big src/big || fail "delta against a block-compressed version differs"
+echo "blocks: ok"
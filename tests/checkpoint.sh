@@ -0,0 +1,46 @@
+#!/bin/sh
+# Kills a throttled -c and a throttled -x with --checkpoint=1 halfway,
+# resumes both with --resume and checks that the results are complete.
+set -e
+MYZ=${MYZ:-$(pwd)/myz}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+fail() {
+    echo "checkpoint: $*" >&2
+    exit 1
+}
+# Runs a command in the background and kills it after a few checkpoints
+interrupt() {
+    "$@" > /dev/null 2>&1 &
+    pid=$!
+    sleep 3
+    kill -9 $pid 2> /dev/null || fail "$* finished before it could be interrupted"
+    wait $pid 2> /dev/null || true
+}
+
+mkdir src
+i=1
+while [ $i -le 24 ]; do
+    head -c 1000000 /dev/urandom > src/f$i
+    i=$((i + 1))
+done
+ln src/f3 src/link
+
+interrupt "$MYZ" -c t.myz --checkpoint=1 --max-read-rate=4M src
+[ -f t.myz.ckpt ] || fail "-c left no checkpoint"
+"$MYZ" -c t.myz --checkpoint=1 --resume src > resume.log
+grep -q Resuming resume.log || fail "-c --resume did not use the checkpoint"
+[ ! -e t.myz.ckpt ] || fail "checkpoint of -c kept after the archive was completed"
+
+mkdir out
+cd out
+interrupt "$MYZ" -x ../t.myz --checkpoint=1 --max-write-rate=4M
+[ -f .t.myz.xckpt ] || fail "-x left no checkpoint"
+"$MYZ" -x ../t.myz --checkpoint=1 --resume > ../resume.log
+cd ..
+grep -q Resumed resume.log || fail "-x --resume did not use the checkpoint"
+diff -rq src out/src || fail "resumed extraction differs from the tree"
+[ "$(stat -c %i out/src/link)" = "$(stat -c %i out/src/f3)" ] || fail "hard link not restored"
+[ ! -e out/.t.myz.xckpt ] || fail "checkpoint of -x kept after the extraction"
+echo "checkpoint: ok"
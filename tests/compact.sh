@@ -0,0 +1,61 @@
+#!/bin/sh
+# Deletes entries with -d from an archive whose catalog is out of data
+# order (appends, --delta versions, hard links, a second volume) and checks
+# that the space is reclaimed and every remaining entry extracts as before.
+set -e
+MYZ=${MYZ:-$(pwd)/myz}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+fail() {
+    echo "compact: $*" >&2
+    exit 1
+}
+extract() {
+    rm -rf out
+    mkdir out
+    (cd out && "$MYZ" -x ../"$1" > /dev/null)
+}
+
+mkdir -p src/keep src/drop
+seq 1 20000 > src/keep/a
+seq 5 30000 > src/drop/b
+ln src/drop/b src/keep/b-link
+printf 'small\n' > src/keep/c
+: > src/keep/empty
+"$MYZ" -c t.myz -j src > /dev/null
+# Appended entries come first in the catalog but last in the data
+seq 1 40000 > src/drop/late
+printf 'late\n' > src/keep/late
+"$MYZ" -a t.myz src/drop/late src/keep/late > /dev/null
+# Two versions of a, the newer ones stored as deltas
+echo v2 >> src/keep/a
+"$MYZ" -a t.myz --delta src/keep/a > /dev/null
+echo v3 >> src/keep/a
+"$MYZ" -a t.myz --delta src/keep/a > /dev/null
+
+before=$(stat -c %s t.myz)
+"$MYZ" -d t.myz src/drop > /dev/null
+after=$(stat -c %s t.myz)
+[ "$after" -lt "$before" ] || fail "archive did not shrink ($before -> $after bytes)"
+rm -rf src/drop
+extract t.myz
+diff -rq src out/src || fail "remaining entries differ after -d"
+[ "$("$MYZ" -p t.myz | grep -c ' a$')" = 1 ] || fail "src/keep/a not listed once"
+
+# A second compaction moves the delta bases again
+"$MYZ" -d t.myz src/keep/c > /dev/null
+rm src/keep/c
+extract t.myz
+diff -rq src out/src || fail "remaining entries differ after a second -d"
+
+# Only the archive file is compacted, other volumes keep their data
+mkdir vol
+seq 1 10000 > vol/x
+seq 1 12000 > vol/y
+"$MYZ" -c v.myz --volumes=2 vol > /dev/null
+"$MYZ" -d v.myz vol/x > /dev/null
+rm vol/x
+extract v.myz
+diff -rq vol out/vol || fail "multi-volume archive differs after -d"
+echo "compact: ok"
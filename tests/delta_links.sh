@@ -0,0 +1,52 @@
+#!/bin/sh
+# Stores a new version of a hard-linked path with --delta, then compacts the
+# archive with -d: every path still listed must extract with its content.
+set -e
+MYZ=${MYZ:-$(pwd)/myz}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+fail() {
+    echo "delta_links: $*" >&2
+    exit 1
+}
+extract() {
+    rm -rf out
+    mkdir out
+    (cd out && "$MYZ" -x ../"$1" > /dev/null)
+}
+
+# A link to an original that gets a new version keeps the old content
+mkdir src
+seq 1 5000 > src/a
+ln src/a src/b
+seq 1 5000 > old
+"$MYZ" -c one.myz --order=path src > /dev/null
+echo new >> src/a
+"$MYZ" -a one.myz --delta src/a > /dev/null
+extract one.myz
+cmp out/src/a src/a || fail "new version of src/a not extracted"
+cmp out/src/b old || fail "src/b lost the content it was archived with"
+rm -rf out
+mkdir out
+"$MYZ" -x one.myz --to-tar - 2> /dev/null | (cd out && tar -xf -)
+cmp out/src/b old || fail "--to-tar gives src/b another content than -x"
+"$MYZ" -d one.myz src/a > /dev/null
+[ "$("$MYZ" -p one.myz | grep -c ' b$')" = 1 ] || fail "src/b not listed once after -d src/a"
+extract one.myz
+[ ! -e out/src/a ] || fail "src/a extracted after -d"
+cmp out/src/b old || fail "src/b lost its content after -d src/a"
+
+# A link with a new version of its own stays current when its original goes
+rm -rf src
+mkdir src
+seq 1 5000 > src/orig
+ln src/orig src/big.txt
+"$MYZ" -c two.myz --order=path src > /dev/null
+echo new >> src/big.txt
+"$MYZ" -a two.myz --delta src/big.txt > /dev/null
+"$MYZ" -d two.myz src/orig > /dev/null
+[ "$("$MYZ" -p two.myz | grep -c 'big.txt$')" = 1 ] || fail "src/big.txt not listed once after -d src/orig"
+extract two.myz
+cmp out/src/big.txt src/big.txt || fail "src/big.txt extracted with an old version"
+echo "delta_links: ok"
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Compresses many small, similar files against a trained --dict, then
+# appends, deletes and merges, checking the content after each step.
+set -e
+MYZ=${MYZ:-$(pwd)/myz}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+fail() {
+    echo "dict: $*" >&2
+    exit 1
+}
+extract() {
+    rm -rf out
+    mkdir out
+    (cd out && "$MYZ" -x ../"$1" > /dev/null)
+    diff -rq src out/src || fail "$1 differs after extraction"
+}
+
+mkdir src
+i=0
+while [ $i -lt 200 ]; do
+    printf '{"id": %d, "service": "frontend", "status": "ok", "region": "eu-west-1", "latency_ms": %d}\n' \
+        $i $((i * 7 % 113)) > src/rec$i.json
+    i=$((i + 1))
+done
+"$MYZ" -c plain.myz -j src > /dev/null
+"$MYZ" -c t.myz -j --dict src > /dev/null
+[ "$(stat -c %s t.myz)" -lt "$(stat -c %s plain.myz)" ] || fail "the dictionary did not make the archive smaller"
+extract t.myz
+
+printf '{"id": 999, "service": "backend", "status": "ok"}\n' > src/new.json
+"$MYZ" -a t.myz -j src/new.json > /dev/null
+extract t.myz
+
+"$MYZ" -d t.myz src/rec1.json > /dev/null
+rm src/rec1.json
+extract t.myz
+
+# Inputs without a dictionary merge, inputs with another one cannot
+"$MYZ" --merge m.myz t.myz plain.myz > /dev/null 2>&1 || fail "merging with a dictionary-less archive failed"
+mkdir other
+for i in 1 2 3 4 5 6 7 8; do
+    printf 'unrelated content of another kind, file %d\n' $i > other/x$i
+done
+"$MYZ" -c other.myz -j --dict other > /dev/null
+if "$MYZ" --merge bad.myz t.myz other.myz > /dev/null 2>&1; then
+    fail "archives with different dictionaries were merged"
+fi
+echo "dict: ok"
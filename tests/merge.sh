@@ -0,0 +1,62 @@
+#!/bin/sh
+# Merges a compressed archive with hard links and a multi-volume archive,
+# checks that the result extracts like the inputs, then that every
+# --on-conflict policy resolves a shared path and that failures exit 1.
+set -e
+MYZ=${MYZ:-$(pwd)/myz}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+fail() {
+    echo "merge: $*" >&2
+    exit 1
+}
+extract() {
+    rm -rf out
+    mkdir out
+    (cd out && "$MYZ" -x ../"$1" > /dev/null)
+}
+
+mkdir -p one/sub two
+seq 1 20000 > one/sub/big
+ln one/sub/big one/link
+printf 'first\n' > one/shared
+seq 1 3000 > two/a
+seq 3000 9000 > two/b
+printf 'second\n' > two/shared
+"$MYZ" -c one.myz -j one > /dev/null
+"$MYZ" -c two.myz --volumes=2 two > /dev/null
+"$MYZ" --merge both.myz one.myz two.myz > /dev/null || fail "merge failed"
+rm -f two.myz two.myz.*
+extract both.myz
+diff -rq one out/one || fail "first input differs after merge"
+diff -rq two out/two || fail "second input differs after merge"
+[ "$(stat -c %i out/one/link)" = "$(stat -c %i out/one/sub/big)" ] || fail "hard link not restored"
+
+# The same path in both inputs
+mkdir -p c1/d c2/d
+printf 'from c1\n' > c1/d/f
+printf 'from c2\n' > c2/d/f
+(cd c1 && "$MYZ" -c ../c1.myz d > /dev/null)
+(cd c2 && "$MYZ" -c ../c2.myz d > /dev/null)
+"$MYZ" --merge first.myz --on-conflict=first c1.myz c2.myz > /dev/null
+extract first.myz
+cmp out/d/f c1/d/f || fail "--on-conflict=first did not keep the first entry"
+"$MYZ" --merge last.myz --on-conflict=last c1.myz c2.myz > /dev/null
+extract last.myz
+cmp out/d/f c2/d/f || fail "--on-conflict=last did not keep the last entry"
+"$MYZ" --merge rename.myz c1.myz c2.myz > /dev/null
+extract rename.myz
+cmp out/d/f c1/d/f || fail "rename changed the first entry"
+cmp "out/d/f(1)" c2/d/f || fail "rename did not keep the later entry as f(1)"
+
+# Failures leave no output and exit 1
+if "$MYZ" --merge error.myz --on-conflict=error c1.myz c2.myz > /dev/null 2>&1; then
+    fail "--on-conflict=error exited 0 on a conflict"
+fi
+[ ! -e error.myz ] || fail "--on-conflict=error left an output archive"
+if "$MYZ" --merge missing.myz c1.myz nothing.myz > /dev/null 2>&1; then
+    fail "a missing input exited 0"
+fi
+[ ! -e missing.myz ] || fail "a missing input left an output archive"
+echo "merge: ok"
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Moves the catalog to the front with --relayout and -c --catalog-first,
+# then appends and deletes, checking the listing and content each time.
+set -e
+MYZ=${MYZ:-$(pwd)/myz}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+fail() {
+    echo "relayout: $*" >&2
+    exit 1
+}
+extract() {
+    rm -rf out
+    mkdir out
+    (cd out && "$MYZ" -x ../"$1" > /dev/null)
+    diff -rq src out/src || fail "$1 differs after extraction"
+}
+# data_start, the long at byte 64 of the header, is 0 unless the catalog is in front
+data_start() {
+    od -An -t d8 -j 64 -N 8 "$1" | tr -d ' '
+}
+
+mkdir -p src/d
+seq 1 20000 > src/a
+seq 1 300 > src/d/b
+ln src/a src/d/link
+ln -s a src/sym
+"$MYZ" -c t.myz -j src > /dev/null
+"$MYZ" -p t.myz > before.txt
+[ "$(data_start t.myz)" = 0 ] || fail "a new archive has its catalog in front"
+"$MYZ" --relayout t.myz > /dev/null
+[ "$(data_start t.myz)" -gt 256 ] || fail "--relayout left the catalog at the end"
+"$MYZ" -p t.myz | cmp - before.txt || fail "listing changed by --relayout"
+extract t.myz
+
+"$MYZ" -c f.myz --catalog-first src > /dev/null
+[ "$(data_start f.myz)" -gt 256 ] || fail "-c --catalog-first left the catalog at the end"
+extract f.myz
+
+printf 'added\n' > src/new
+"$MYZ" -a f.myz src/new > /dev/null
+extract f.myz
+"$MYZ" -d f.myz src/d/b > /dev/null
+rm src/d/b
+extract f.myz
+"$MYZ" --relayout f.myz > /dev/null
+extract f.myz
+echo "relayout: ok"
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Archives the same tree twice with --order=path and compares the bytes.
+# The tree is dated in the past so that any access would move its atimes.
+set -e
+MYZ=${MYZ:-$(pwd)/myz}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+mkdir -p "$work/tree/b/c" "$work/tree/a"
+printf 'one\n' > "$work/tree/b/one.txt"
+printf 'two\n' > "$work/tree/b/c/two.c"
+seq 1 20000 > "$work/tree/a/big.log"
+ln "$work/tree/a/big.log" "$work/tree/b/link.log"
+find "$work/tree" -exec touch -d '2020-01-01 00:00:00' {} +
+cd "$work"
+"$MYZ" -c first.myz -j --order=path tree > /dev/null
+"$MYZ" -c second.myz -j --order=path tree > /dev/null
+if ! cmp first.myz second.myz; then
+    echo "reproducible: archives of the same tree differ" >&2
+    exit 1
+fi
+echo "reproducible: ok"
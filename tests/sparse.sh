@@ -0,0 +1,32 @@
+#!/bin/sh
+# Archives a file that is mostly holes, with and without -j, and checks
+# that only its data is stored and that extraction recreates the holes.
+set -e
+MYZ=${MYZ:-$(pwd)/myz}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+fail() {
+    echo "sparse: $*" >&2
+    exit 1
+}
+
+mkdir src
+truncate -s 50M src/holes
+printf 'head' | dd of=src/holes conv=notrunc 2> /dev/null
+seq 1 5000 | dd of=src/holes bs=4096 seek=5000 conv=notrunc 2> /dev/null
+truncate -s 60M src/tail-hole
+seq 1 1000 > src/dense
+for opt in "" -j; do
+    "$MYZ" -c t.myz $opt src > /dev/null
+    [ "$(stat -c %s t.myz)" -lt 1048576 ] || fail "holes stored as data ($opt)"
+    rm -rf out
+    mkdir out
+    (cd out && "$MYZ" -x ../t.myz > /dev/null)
+    diff -rq src out/src || fail "content differs after extraction ($opt)"
+    for f in holes tail-hole; do
+        [ "$(stat -c %b out/src/$f)" -le "$(stat -c %b src/$f)" ] || fail "holes of $f filled ($opt)"
+    done
+    rm t.myz
+done
+echo "sparse: ok"
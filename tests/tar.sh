@@ -0,0 +1,47 @@
+#!/bin/sh
+# Converts a tree through tar in both directions (--to-tar, --from-tar,
+# also on a pipe) and checks content, hard links, symlinks and long names.
+set -e
+MYZ=${MYZ:-$(pwd)/myz}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+fail() {
+    echo "tar: $*" >&2
+    exit 1
+}
+
+long=src/a-directory-name-long-enough-to-need-more-than-one-ustar-field/and-a-file-name-that-pushes-the-path-beyond-one-hundred.txt
+mkdir -p "$(dirname "$long")" src/sub
+seq 1 30000 > src/sub/data
+printf 'short\n' > "$long"
+ln src/sub/data src/sub/link
+ln -s ../sub/data src/sub/sym
+: > src/empty
+
+# myz to tar
+"$MYZ" -c t.myz -j src > /dev/null
+"$MYZ" -x t.myz --to-tar t.tar > /dev/null
+mkdir from-myz
+tar -xf t.tar -C from-myz
+diff -rq src from-myz/src || fail "--to-tar output differs from the tree"
+[ "$(stat -c %i from-myz/src/sub/link)" = "$(stat -c %i from-myz/src/sub/data)" ] || fail "--to-tar lost a hard link"
+"$MYZ" -x t.myz --to-tar - 2> /dev/null | cmp - t.tar || fail "--to-tar - differs from the file"
+
+# tar to myz, from a file and from a pipe
+tar -cf src.tar src
+for input in src.tar -; do
+    rm -f u.myz
+    if [ "$input" = - ]; then
+        "$MYZ" -c u.myz -j --from-tar - < src.tar > /dev/null
+    else
+        "$MYZ" -c u.myz --from-tar src.tar > /dev/null
+    fi
+    rm -rf out
+    mkdir out
+    (cd out && "$MYZ" -x ../u.myz > /dev/null)
+    diff -rq src out/src || fail "--from-tar $input differs from the tree"
+    [ "$(stat -c %i out/src/sub/link)" = "$(stat -c %i out/src/sub/data)" ] || fail "--from-tar $input lost a hard link"
+    [ "$(readlink out/src/sub/sym)" = ../sub/data ] || fail "--from-tar $input lost a symlink"
+done
+echo "tar: ok"
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Spreads a tree over several volume files with --volumes, --volume-size
+# and --volume-path, and checks that each archive extracts unchanged.
+set -e
+MYZ=${MYZ:-$(pwd)/myz}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+fail() {
+    echo "volumes: $*" >&2
+    exit 1
+}
+extract() {
+    rm -rf out
+    mkdir out
+    (cd out && "$MYZ" -x ../"$1" > /dev/null)
+    diff -rq src out/src || fail "$1 differs after extraction"
+}
+
+mkdir -p src/a src/b
+for i in 1 2 3 4 5 6; do
+    seq 1 $((i * 20000)) > src/a/f$i
+done
+seq 1 100 > src/b/small
+ln src/a/f6 src/b/link
+ln -s ../a/f1 src/b/sym
+
+"$MYZ" -c n.myz --volumes=3 src > /dev/null
+[ -f n.myz.vol1 ] && [ -f n.myz.vol2 ] || fail "--volumes=3 wrote no volume files"
+extract n.myz
+
+"$MYZ" -c s.myz -j --volume-size=400K src > /dev/null
+[ -f s.myz.vol1 ] || fail "--volume-size wrote no volume file"
+extract s.myz
+
+mkdir d1 d2
+"$MYZ" -c p.myz --volumes=3 --volume-path=d1 --volume-path=d2 src > /dev/null
+[ -n "$(ls d1)" ] && [ -n "$(ls d2)" ] || fail "--volume-path directories left empty"
+extract p.myz
+# Volumes only hold data, the catalog stays in the archive file
+mkdir moved
+mv p.myz moved/
+(cd moved && "$MYZ" -p p.myz | grep -q small) || fail "catalog not readable without its volumes"
+echo "volumes: ok"
@@ -0,0 +1,355 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "utils.h"
+#include "stats.h"
+#include "tree_index.h"
+
+#define READ_CHUNK 256
+
+/* Growable byte pool for names and directory paths */
+typedef struct {
+    char *data;
+    uint64_t size;
+    uint64_t capacity;
+} StringPool;
+
+static int pool_add(StringPool *pool, const char *s, size_t len, uint64_t *offset)
+{
+    if (pool->size + len + 1 > pool->capacity) {
+        uint64_t capacity = pool->capacity ? pool->capacity : 4096;
+        while (pool->size + len + 1 > capacity)
+            capacity *= 2;
+        char *data = realloc(pool->data, capacity);
+        if (!data) {
+            report_perror("realloc");
+            return -1;
+        }
+        pool->data = data;
+        pool->capacity = capacity;
+    }
+    *offset = pool->size;
+    memcpy(pool->data + pool->size, s, len);
+    pool->data[pool->size + len] = '\0';
+    pool->size += len + 1;
+    return 0;
+}
+
+/* Directory path -> node, open addressing over the directory path pool */
+typedef struct {
+    uint32_t *slots;            // Node index, TREE_NONE when empty
+    uint64_t *path_offsets;     // Indexed by node
+    size_t count;
+    size_t capacity;
+    StringPool paths;
+} DirMap;
+
+static uint64_t hash_path(const char *s, size_t len)
+{
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static uint32_t dirmap_find(const DirMap *map, const char *path, size_t len)
+{
+    if (map->capacity == 0)
+        return TREE_NONE;
+    size_t mask = map->capacity - 1;
+    for (size_t i = hash_path(path, len) & mask; map->slots[i] != TREE_NONE; i = (i + 1) & mask) {
+        const char *candidate = map->paths.data + map->path_offsets[map->slots[i]];
+        if (strncmp(candidate, path, len) == 0 && candidate[len] == '\0')
+            return map->slots[i];
+    }
+    return TREE_NONE;
+}
+
+static int dirmap_add(DirMap *map, uint32_t node, const char *path, size_t len)
+{
+    if ((map->count + 1) * 2 > map->capacity) {
+        size_t capacity = map->capacity ? map->capacity * 2 : 256;
+        uint32_t *slots = malloc(capacity * sizeof(uint32_t));
+        if (!slots) {
+            report_perror("malloc");
+            return -1;
+        }
+        memset(slots, 0xFF, capacity * sizeof(uint32_t));
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->slots[i] == TREE_NONE)
+                continue;
+            const char *p = map->paths.data + map->path_offsets[map->slots[i]];
+            size_t j = hash_path(p, strlen(p)) & (capacity - 1);
+            while (slots[j] != TREE_NONE)
+                j = (j + 1) & (capacity - 1);
+            slots[j] = map->slots[i];
+        }
+        free(map->slots);
+        map->slots = slots;
+        map->capacity = capacity;
+    }
+    if (pool_add(&map->paths, path, len, &map->path_offsets[node]) != 0)
+        return -1;
+    size_t mask = map->capacity - 1;
+    size_t i = hash_path(path, len) & mask;
+    while (map->slots[i] != TREE_NONE)
+        i = (i + 1) & mask;
+    map->slots[i] = node;
+    map->count++;
+    return 0;
+}
+
+/* qsort context: order nodes by parent, then by name */
+static const TreeNode *sort_nodes;
+static const char *sort_names;
+
+static int cmp_node_ids(const void *a, const void *b)
+{
+    const TreeNode *na = &sort_nodes[*(const uint32_t *)a];
+    const TreeNode *nb = &sort_nodes[*(const uint32_t *)b];
+    if (na->parent != nb->parent)
+        return na->parent < nb->parent ? -1 : 1;
+    return strcmp(sort_names + na->name_offset, sort_names + nb->name_offset);
+}
+
+int write_tree_index(FILE *archive, ArchiveHeader *header)
+{
+    header->tree_offset = 0;
+    uint32_t count = header->metadata_count;
+    TreeNode *nodes = calloc(count ? count : 1, sizeof(TreeNode));
+    uint32_t *order = malloc((count ? count : 1) * sizeof(uint32_t));
+    FileMetadata *chunk = malloc(READ_CHUNK * sizeof(FileMetadata));
+    DirMap dirs;
+    memset(&dirs, 0, sizeof(dirs));
+    dirs.path_offsets = calloc(count ? count : 1, sizeof(uint64_t));
+    StringPool names;
+    memset(&names, 0, sizeof(names));
+    int rc = -1;
+    if (!nodes || !order || !chunk || !dirs.path_offsets) {
+        report_perror("malloc");
+        goto out;
+    }
+    if (fflush(archive) != 0) {
+        report_perror("fflush error");
+        goto out;
+    }
+
+    /* Pass 1: directory paths */
+    MetadataReader reader;
+    metadata_reader_init(&reader, archive, header);
+    size_t n, base = 0;
+    while ((n = metadata_reader_next(&reader, chunk, READ_CHUNK)) > 0) {
+        for (size_t j = 0; j < n; j++) {
+            const char *path = chunk[j].path;
+            size_t len = strlen(path);
+            if (S_ISDIR(chunk[j].mode) && dirmap_find(&dirs, path, len) == TREE_NONE &&
+                dirmap_add(&dirs, (uint32_t)(base + j), path, len) != 0)
+                goto out;
+        }
+        base += n;
+    }
+    if (base != count)
+        goto out;
+
+    /* Pass 2: parents and names; older versions (-a --delta) stay unlinked */
+    metadata_reader_init(&reader, archive, header);
+    base = 0;
+    uint32_t linked = 0;
+    while ((n = metadata_reader_next(&reader, chunk, READ_CHUNK)) > 0) {
+        for (size_t j = 0; j < n; j++) {
+            TreeNode *node = &nodes[base + j];
+            const char *path = chunk[j].path;
+            const char *slash = strrchr(path, '/');
+            node->parent = TREE_NONE;
+            node->first_child = TREE_NONE;
+            node->next_sibling = TREE_NONE;
+            node->mode = chunk[j].mode;
+            if (slash && slash != path)
+                node->parent = dirmap_find(&dirs, path, (size_t)(slash - path));
+            if (node->parent == base + j)
+                node->parent = TREE_NONE;
+            const char *name = (node->parent == TREE_NONE) ? path : slash + 1;
+            if (pool_add(&names, name, strlen(name), &node->name_offset) != 0)
+                goto out;
+            if (!(chunk[j].flags & ENTRY_SUPERSEDED))
+                order[linked++] = (uint32_t)(base + j);
+        }
+        base += n;
+    }
+    if (base != count)
+        goto out;
+
+    /* Link siblings in name order */
+    sort_nodes = nodes;
+    sort_names = names.data;
+    qsort(order, linked, sizeof(uint32_t), cmp_node_ids);
+    TreeIndexHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.node_count = count;
+    hdr.first_root = TREE_NONE;
+    hdr.names_size = names.size;
+    for (uint32_t k = 0; k < linked; k++) {
+        TreeNode *node = &nodes[order[k]];
+        if (k == 0 || nodes[order[k - 1]].parent != node->parent) {
+            if (node->parent == TREE_NONE)
+                hdr.first_root = order[k];
+            else
+                nodes[node->parent].first_child = order[k];
+        }
+        if (k + 1 < linked && nodes[order[k + 1]].parent == node->parent)
+            node->next_sibling = order[k + 1];
+    }
+
+    long offset = header->metadata_offset + (long)count * (long)sizeof(FileMetadata);
+    if (fseek(archive, offset, SEEK_SET) != 0) {
+        report_perror("fseek error");
+        goto out;
+    }
+    if (stats_fwrite(&hdr, sizeof(hdr), 1, archive) != 1 ||
+        stats_fwrite(nodes, sizeof(TreeNode), count, archive) != count ||
+        stats_fwrite(names.data, 1, names.size, archive) != names.size) {
+        report_perror("Error writing tree index");
+        goto out;
+    }
+    header->tree_offset = offset;
+    rc = 0;
+out:
+    free(nodes);
+    free(order);
+    free(chunk);
+    free(dirs.slots);
+    free(dirs.path_offsets);
+    free(dirs.paths.data);
+    free(names.data);
+    return rc;
+}
+
+int tree_open(TreeReader *tree, FILE *archive, const ArchiveHeader *header, int load_all)
+{
+    memset(tree, 0, sizeof(*tree));
+    if (is_legacy_archive(header) || header->tree_offset == 0)
+        return -1;
+    tree->archive = archive;
+    if (fseek(archive, header->tree_offset, SEEK_SET) != 0 ||
+        stats_fread(&tree->hdr, sizeof(tree->hdr), 1, archive) != 1) {
+        report_perror("Error reading tree index");
+        return -1;
+    }
+    tree->nodes_offset = header->tree_offset + (long)sizeof(TreeIndexHeader);
+    tree->names_offset = tree->nodes_offset + (long)tree->hdr.node_count * (long)sizeof(TreeNode);
+    if (!load_all)
+        return 0;
+    tree->nodes = malloc((tree->hdr.node_count ? tree->hdr.node_count : 1) * sizeof(TreeNode));
+    tree->names = malloc(tree->hdr.names_size ? tree->hdr.names_size : 1);
+    if (!tree->nodes || !tree->names) {
+        report_perror("malloc");
+        tree_close(tree);
+        return -1;
+    }
+    if (stats_fread(tree->nodes, sizeof(TreeNode), tree->hdr.node_count, archive) != tree->hdr.node_count ||
+        stats_fread(tree->names, 1, tree->hdr.names_size, archive) != tree->hdr.names_size) {
+        report_perror("Error reading tree index");
+        tree_close(tree);
+        return -1;
+    }
+    return 0;
+}
+
+void tree_close(TreeReader *tree)
+{
+    free(tree->nodes);
+    free(tree->names);
+    tree->nodes = NULL;
+    tree->names = NULL;
+}
+
+int tree_node(TreeReader *tree, uint32_t index, TreeNode *node)
+{
+    if (index >= tree->hdr.node_count)
+        return -1;
+    if (tree->nodes) {
+        *node = tree->nodes[index];
+        return 0;
+    }
+    if (fseek(tree->archive, tree->nodes_offset + (long)index * (long)sizeof(TreeNode), SEEK_SET) != 0 ||
+        stats_fread(node, sizeof(TreeNode), 1, tree->archive) != 1) {
+        report_perror("Error reading tree index");
+        return -1;
+    }
+    return 0;
+}
+
+int tree_name(TreeReader *tree, const TreeNode *node, char *buf, size_t size)
+{
+    if (tree->names) {
+        strncpy(buf, tree->names + node->name_offset, size - 1);
+        buf[size - 1] = '\0';
+        return 0;
+    }
+    if (fseek(tree->archive, tree->names_offset + (long)node->name_offset, SEEK_SET) != 0) {
+        report_perror("Error reading tree index");
+        return -1;
+    }
+    size_t i = 0;
+    int c;
+    while (i + 1 < size && (c = fgetc(tree->archive)) != EOF && c != '\0')
+        buf[i++] = (char)c;
+    buf[i] = '\0';
+    return 0;
+}
+
+/* Finds the child of parent called name (siblings are sorted) */
+static uint32_t find_child(TreeReader *tree, uint32_t first, const char *name, size_t len)
+{
+    char buf[MAX_PATH_LENGTH + 1];
+    for (uint32_t id = first; id != TREE_NONE;) {
+        TreeNode node;
+        if (tree_node(tree, id, &node) != 0 || tree_name(tree, &node, buf, sizeof(buf)) != 0)
+            return TREE_NONE;
+        int cmp = strncmp(buf, name, len);
+        if (cmp == 0 && buf[len] == '\0')
+            return id;
+        if (cmp > 0)
+            break;
+        id = node.next_sibling;
+    }
+    return TREE_NONE;
+}
+
+uint32_t tree_lookup(TreeReader *tree, const char *path)
+{
+    char buf[MAX_PATH_LENGTH + 1];
+    /* Roots hold full paths: find the one that is a prefix of path */
+    for (uint32_t id = tree->hdr.first_root; id != TREE_NONE;) {
+        TreeNode node;
+        if (tree_node(tree, id, &node) != 0 || tree_name(tree, &node, buf, sizeof(buf)) != 0)
+            return TREE_NONE;
+        size_t len = strlen(buf);
+        if (strncmp(path, buf, len) == 0 && (path[len] == '\0' || path[len] == '/')) {
+            const char *rest = path + len;
+            uint32_t cur = id;
+            while (*rest == '/') {
+                rest++;
+                const char *end = strchr(rest, '/');
+                size_t comp = end ? (size_t)(end - rest) : strlen(rest);
+                if (comp == 0)
+                    break;
+                TreeNode cur_node;
+                if (tree_node(tree, cur, &cur_node) != 0)
+                    return TREE_NONE;
+                cur = find_child(tree, cur_node.first_child, rest, comp);
+                if (cur == TREE_NONE)
+                    break;
+                rest += comp;
+            }
+            if (cur != TREE_NONE && (*rest == '\0' || strcmp(rest, "/") == 0))
+                return cur;
+        }
+        id = node.next_sibling;
+    }
+    return TREE_NONE;
+}
@@ -0,0 +1,35 @@
+#ifndef TREE_INDEX_H
+#define TREE_INDEX_H
+
+#include <stdio.h>
+#include "structs.h"
+
+/*
+ * Builds the directory tree index from the metadata block described by
+ * header and writes it right after that block. On success sets
+ * header->tree_offset and returns 0, otherwise leaves it at 0.
+ */
+int write_tree_index(FILE *archive, ArchiveHeader *header);
+
+/*
+ * Read access to a tree index. Nodes and names are read on demand,
+ * unless the whole index was loaded with load_all.
+ */
+typedef struct {
+    FILE *archive;
+    TreeIndexHeader hdr;
+    long nodes_offset;
+    long names_offset;
+    TreeNode *nodes;            // Only with load_all
+    char *names;                // Only with load_all
+} TreeReader;
+
+int tree_open(TreeReader *tree, FILE *archive, const ArchiveHeader *header, int load_all);
+void tree_close(TreeReader *tree);
+int tree_node(TreeReader *tree, uint32_t index, TreeNode *node);
+int tree_name(TreeReader *tree, const TreeNode *node, char *buf, size_t size);
+
+/* Returns the node of an archived path, or TREE_NONE */
+uint32_t tree_lookup(TreeReader *tree, const char *path);
+
+#endif // TREE_INDEX_H
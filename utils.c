@@ -1,8 +1,20 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdint.h>
+#include <stdarg.h>
 #include <dirent.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <pthread.h>
 #include "utils.h"
+#include "stats.h"
+#include "filter.h"
+#include "volume.h"
+#include "libmyz.h"
+#include "dict.h"
+#include "io.h"
+#include "governor.h"
+#include "checkpoint.h"
+#include "blocks.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,8 +23,147 @@
 #include <sys/stat.h>
 #include <libgen.h>
 #include <errno.h>
+#include <fcntl.h>
 
-extern int compress_flag;
+/* Global compression flag (-j), defined here so libmyz links without myz.c */
+int compress_flag = 0;
+
+/* In-memory catalog budget for create/append (--max-memory), 0 = unbounded */
+unsigned long long catalog_memory_limit = 0;
+
+/* --threads, 0 = one per online CPU */
+unsigned int thread_option = 0;
+
+/* --order, ORDER_NONE keeps the readdir() order */
+int order_option = ORDER_NONE;
+
+long worker_count(size_t jobs)
+{
+    long threads = thread_option ? (long)thread_option : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    if ((size_t)threads > jobs)
+        threads = jobs ? (long)jobs : 1;
+    return threads;
+}
+
+int order_parse(const char *name)
+{
+    if (strcmp(name, "path") == 0)
+        return ORDER_PATH;
+    if (strcmp(name, "type") == 0)
+        return ORDER_TYPE;
+    if (strcmp(name, "size") == 0)
+        return ORDER_SIZE;
+    return -1;
+}
+
+/* A directory child and its --order sort key */
+typedef struct {
+    char *name;
+    const char *ext;            // After the last dot, "" for none (or a leading dot only)
+    off_t size;                 // Regular files only, 0 for everything else
+} DirChild;
+
+// Names compare as bytes (strcmp), not by locale, so the order is the same everywhere
+static int cmp_children(const void *a, const void *b)
+{
+    const DirChild *x = a, *y = b;
+    if (order_option == ORDER_TYPE) {
+        int c = strcmp(x->ext, y->ext);
+        if (c != 0)
+            return c;
+    } else if (order_option == ORDER_SIZE && x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+char **read_dir_entries(const char *path, size_t *count) {
+    DIR *dir = io_opendir(path);
+    if (!dir)
+        return NULL;
+    DirChild *children = NULL;
+    size_t n = 0, capacity = 0;
+    struct dirent *entry;
+    int failed = 0;
+    while (!failed && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (n == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            DirChild *grown = realloc(children, capacity * sizeof(DirChild));
+            if (!grown) {
+                failed = 1;
+                break;
+            }
+            children = grown;
+        }
+        DirChild *child = &children[n];
+        child->name = strdup(entry->d_name);
+        if (!child->name) {
+            failed = 1;
+            break;
+        }
+        const char *dot = strrchr(child->name, '.');
+        child->ext = dot && dot != child->name ? dot + 1 : "";
+        child->size = 0;
+        if (order_option == ORDER_SIZE) {
+            struct stat st;
+            if (fstatat(dirfd(dir), child->name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode))
+                child->size = st.st_size;
+        }
+        n++;
+    }
+    closedir(dir);
+    char **names = failed ? NULL : malloc((n ? n : 1) * sizeof(char *));
+    if (!names) {
+        report_perror("malloc");
+        for (size_t i = 0; i < n; i++)
+            free(children[i].name);
+        free(children);
+        return NULL;
+    }
+    if (order_option != ORDER_NONE)
+        qsort(children, n, sizeof(DirChild), cmp_children);
+    for (size_t i = 0; i < n; i++)
+        names[i] = children[i].name;
+    free(children);
+    *count = n;
+    return names;
+}
+
+void free_dir_entries(char **names, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+}
+
+_Thread_local int quiet_errors = 0;
+
+void report_perror(const char *msg)
+{
+    if (!quiet_errors)
+        perror(msg);
+}
+
+void report_error(const char *fmt, ...)
+{
+    if (quiet_errors)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+void print_myz_error(const char *msg, int err)
+{
+    if (err == MYZ_ERR_IO)
+        perror(msg);
+    else
+        fprintf(stderr, "%s: %s\n", msg, myz_strerror(err));
+}
 
 // Turns access rights into a string representation
 void mode_to_string(mode_t mode, char *str) {
@@ -28,35 +179,212 @@ void mode_to_string(mode_t mode, char *str) {
     str[9] = '\0';
 }
 
+/*
+   Parses a size such as "512", "64K", "1.5G" (binary units, optional trailing 'B').
+   Returns 0 on success, -1 if the string is not a size.
+*/
+int parse_size(const char *str, unsigned long long *out) {
+    char *end;
+    errno = 0;
+    double value = strtod(str, &end);
+    if (end == str || errno != 0 || value < 0)
+        return -1;
+    double mult = 1;
+    switch (*end) {
+        case 'k': case 'K': mult = 1024.0; end++; break;
+        case 'm': case 'M': mult = 1024.0 * 1024; end++; break;
+        case 'g': case 'G': mult = 1024.0 * 1024 * 1024; end++; break;
+        case 't': case 'T': mult = 1024.0 * 1024 * 1024 * 1024; end++; break;
+        default: break;
+    }
+    if (*end == 'b' || *end == 'B')
+        end++;
+    if (*end != '\0')
+        return -1;
+    *out = (unsigned long long)(value * mult);
+    return 0;
+}
+
 // Initializes the metadata array
-void init_metadata_array(MetadataArray *arr) {
-    arr->count = 0;
+// With --max-memory the in-memory part never grows past the limit
+// Returns 0, or -1 when out of memory (nothing is printed)
+int try_init_metadata_array(MetadataArray *arr) {
+    memset(arr, 0, sizeof(*arr));
     arr->capacity = 10;
+    if (catalog_memory_limit) {
+        arr->max_records = catalog_memory_limit / sizeof(FileMetadata);
+        if (arr->max_records < 16)
+            arr->max_records = 16;
+        if (arr->capacity > arr->max_records)
+            arr->capacity = arr->max_records;
+    }
     arr->records = malloc(arr->capacity * sizeof(FileMetadata));
-    if (!arr->records) {
+    return arr->records ? 0 : -1;
+}
+
+void init_metadata_array(MetadataArray *arr) {
+    if (try_init_metadata_array(arr) != 0) {
         perror("malloc");
         exit(EXIT_FAILURE);
     }
 }
 
+// Moves the in-memory records to the spill file
+static int spill_metadata(MetadataArray *arr) {
+    if (!arr->spill) {
+        arr->spill = tmpfile();
+        if (!arr->spill) {
+            report_perror("tmpfile");
+            return -1;
+        }
+    }
+    if (fseek(arr->spill, 0, SEEK_END) != 0 ||
+        fwrite(arr->records, sizeof(FileMetadata), arr->count, arr->spill) != arr->count) {
+        report_perror("Error writing metadata spill file");
+        return -1;
+    }
+    arr->spilled += arr->count;
+    arr->count = 0;
+    return 0;
+}
+
 // Adds a metadata record to the array
-void add_metadata(MetadataArray *arr, FileMetadata meta) {
+// Returns 0, or -1 when the record cannot be kept (out of memory, spill file error)
+int try_add_metadata(MetadataArray *arr, const FileMetadata *meta) {
     if (arr->count == arr->capacity) {
-        arr->capacity *= 2;
-        arr->records = realloc(arr->records, arr->capacity * sizeof(FileMetadata));
-        if (!arr->records) {
-            perror("realloc");
-            exit(EXIT_FAILURE);
+        if (arr->max_records && arr->capacity >= arr->max_records) {
+            if (spill_metadata(arr) != 0)
+                return -1;
+        } else {
+            size_t capacity = arr->capacity * 2;
+            if (arr->max_records && capacity > arr->max_records)
+                capacity = arr->max_records;
+            FileMetadata *records = realloc(arr->records, capacity * sizeof(FileMetadata));
+            if (!records) {
+                report_perror("realloc");
+                return -1;
+            }
+            arr->records = records;
+            arr->capacity = capacity;
         }
     }
-    arr->records[arr->count++] = meta;
+    arr->records[arr->count++] = *meta;
+    return 0;
+}
+
+void add_metadata(MetadataArray *arr, const FileMetadata *meta) {
+    if (try_add_metadata(arr, meta) != 0)
+        exit(EXIT_FAILURE);
+}
+
+// Total number of records, spilled ones included
+size_t metadata_total(const MetadataArray *arr) {
+    return arr->spilled + arr->count;
+}
+
+/*
+   Writes every record in insertion order at the current position of the
+   archive. Spilled catalogs are streamed through the in-memory buffer.
+   Returns 0 on success, -1 on error.
+*/
+int write_metadata_array(MetadataArray *arr, FILE *archive) {
+    if (arr->spill) {
+        if (arr->count > 0 && spill_metadata(arr) != 0)
+            return -1;
+        if (fflush(arr->spill) != 0 || fseek(arr->spill, 0, SEEK_SET) != 0) {
+            report_perror("Error reading metadata spill file");
+            return -1;
+        }
+        size_t remaining = arr->spilled;
+        while (remaining > 0) {
+            size_t chunk = remaining < arr->capacity ? remaining : arr->capacity;
+            if (fread(arr->records, sizeof(FileMetadata), chunk, arr->spill) != chunk) {
+                report_perror("Error reading metadata spill file");
+                return -1;
+            }
+            if (stats_fwrite(arr->records, sizeof(FileMetadata), chunk, archive) != chunk) {
+                report_perror("Error writing metadata");
+                return -1;
+            }
+            remaining -= chunk;
+        }
+        return 0;
+    }
+    if (arr->count > 0 &&
+        stats_fwrite(arr->records, sizeof(FileMetadata), arr->count, archive) != arr->count) {
+        report_perror("Error writing metadata");
+        return -1;
+    }
+    return 0;
 }
 
 // Frees the metadata array
 void free_metadata_array(MetadataArray *arr) {
     free(arr->records);
+    if (arr->spill)
+        fclose(arr->spill);
+    inode_index_free(&arr->links);
     arr->records = NULL;
-    arr->count = arr->capacity = 0;
+    arr->spill = NULL;
+    arr->count = arr->capacity = arr->spilled = 0;
+}
+
+static size_t inode_hash(dev_t dev, ino_t inode) {
+    uint64_t h = (uint64_t)inode * 0x9E3779B97F4A7C15ull ^ (uint64_t)dev * 0xC2B2AE3D27D4EB4Full;
+    return (size_t)(h ^ (h >> 29));
+}
+
+// Looks up a hard-linked inode, returns 1 and its data offset if present
+int inode_index_find(const InodeIndex *index, dev_t dev, ino_t inode, long *data_offset) {
+    if (index->capacity == 0)
+        return 0;
+    size_t mask = index->capacity - 1;
+    for (size_t i = inode_hash(dev, inode) & mask; index->slots[i].inode != 0; i = (i + 1) & mask) {
+        if (index->slots[i].inode == inode && index->slots[i].dev == dev) {
+            *data_offset = index->slots[i].data_offset;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Inserts an inode (open addressing, kept at most half full)
+// Returns -1 when out of memory: later links to the inode then store their data again
+int inode_index_add(InodeIndex *index, dev_t dev, ino_t inode, long data_offset) {
+    if ((index->count + 1) * 2 > index->capacity) {
+        size_t new_capacity = index->capacity ? index->capacity * 2 : 64;
+        InodeSlot *slots = calloc(new_capacity, sizeof(InodeSlot));
+        if (!slots) {
+            report_perror("calloc");
+            return -1;
+        }
+        for (size_t i = 0; i < index->capacity; i++) {
+            if (index->slots[i].inode == 0)
+                continue;
+            size_t j = inode_hash(index->slots[i].dev, index->slots[i].inode) & (new_capacity - 1);
+            while (slots[j].inode != 0)
+                j = (j + 1) & (new_capacity - 1);
+            slots[j] = index->slots[i];
+        }
+        free(index->slots);
+        index->slots = slots;
+        index->capacity = new_capacity;
+    }
+    size_t mask = index->capacity - 1;
+    size_t i = inode_hash(dev, inode) & mask;
+    while (index->slots[i].inode != 0)
+        i = (i + 1) & mask;
+    index->slots[i].dev = dev;
+    index->slots[i].inode = inode;
+    index->slots[i].data_offset = data_offset;
+    index->count++;
+    return 0;
+}
+
+void inode_index_free(InodeIndex *index) {
+    free(index->slots);
+    index->slots = NULL;
+    index->count = index->capacity = 0;
 }
 
 // Ensures that the parent directories of a file exist
@@ -70,7 +398,7 @@ void ensure_parent_dirs(const char *filepath) {
         // Recursively create parent directories
         ensure_parent_dirs(dir);
         if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
-            perror("Error creating parent directories");
+            report_perror("Error creating parent directories");
         }
     }
 }
@@ -147,25 +475,6 @@ void generate_unique_filename(char *filepath) {
     }
 }
 
-// Checks if a path should be extracted based on a list of filters
-int should_extract(const char *metadata_path, char **filter, int filter_count) {
-    if (filter_count == 0)
-        return 1;
-    for (int i = 0; i < filter_count; i++) {
-        int len = strlen(filter[i]);
-        // Exact match
-        if (strcmp(metadata_path, filter[i]) == 0)
-            return 1;
-        // If the path starts with the filter and is followed by a slash or the end of the string or '(' (for names with collisions, e.g. "abc(1)")
-        if (strncmp(metadata_path, filter[i], len) == 0) {
-            char c = metadata_path[len];
-            if (c == '/' || c == '\0' || c == '(')
-                return 1;
-        }
-    }
-    return 0;
-}
-
 // Extracts the top component of a path (the first directory or filename)
 void get_top_component(const char *path, char *top, size_t size) {
     const char *slash = strchr(path, '/');
@@ -180,147 +489,664 @@ void get_top_component(const char *path, char *top, size_t size) {
     }
 }
 
+// Initializes a header for an archive written in the current format
+void init_archive_header(ArchiveHeader *header) {
+    memset(header, 0, sizeof(*header));
+    header->magic = MYZ_MAGIC;
+    header->version = MYZ_VERSION;
+}
+
+// Reads the fixed-size header at the start of the archive
+int read_archive_header(FILE *archive, ArchiveHeader *header) {
+    if (fseek(archive, 0, SEEK_SET) != 0 ||
+        stats_fread(header, 1, HEADER_SIZE, archive) != HEADER_SIZE) {
+        report_perror("Error reading header");
+        return -1;
+    }
+    // Fields added after version 1 are not set in legacy headers
+    if (is_legacy_archive(header)) {
+        header->tree_offset = 0;
+        header->volume_offset = 0;
+        header->volume_count = 0;
+        header->dict_size = 0;
+        header->dict_offset = 0;
+        header->column_offset = 0;
+        header->data_start = 0;
+    }
+    return 0;
+}
+
+long archive_data_start(const ArchiveHeader *header) {
+    return header->data_start ? header->data_start : HEADER_SIZE;
+}
+
+// The catalog follows the data, unless --relayout moved it to the front: then the data runs to the end of the file
+long archive_data_end(FILE *archive, const ArchiveHeader *header) {
+    if (header->metadata_offset >= archive_data_start(header))
+        return header->metadata_offset;
+    struct stat st;
+    if (fstat(fileno(archive), &st) != 0) {
+        report_perror("fstat error");
+        return -1;
+    }
+    return (long)st.st_size;
+}
+
+// Archives written before MYZ_MAGIC existed use LegacyFileMetadata records
+int is_legacy_archive(const ArchiveHeader *header) {
+    return header->magic != MYZ_MAGIC;
+}
+
+void metadata_reader_init(MetadataReader *reader, FILE *archive, const ArchiveHeader *header) {
+    reader->archive = archive;
+    reader->header = *header;
+    reader->next = 0;
+}
+
+/*
+   Reads up to max records into buf, converting legacy records to the
+   current FileMetadata layout. Returns the number of records read,
+   0 at the end of the block or on error.
+*/
+size_t metadata_reader_next(MetadataReader *reader, FileMetadata *buf, size_t max) {
+    size_t remaining = reader->header.metadata_count - reader->next;
+    size_t n = remaining < max ? remaining : max;
+    if (n == 0)
+        return 0;
+    int legacy = is_legacy_archive(&reader->header);
+    size_t record_size = legacy ? sizeof(LegacyFileMetadata) : sizeof(FileMetadata);
+    if (fseek(reader->archive, reader->header.metadata_offset + (long)(reader->next * record_size), SEEK_SET) != 0) {
+        report_perror("fseek error");
+        return 0;
+    }
+    if (!legacy) {
+        if (stats_fread(buf, sizeof(FileMetadata), n, reader->archive) != n) {
+            report_perror("Error reading metadata");
+            return 0;
+        }
+        reader->next += n;
+        return n;
+    }
+    LegacyFileMetadata old;
+    for (size_t i = 0; i < n; i++) {
+        if (stats_fread(&old, sizeof(old), 1, reader->archive) != 1) {
+            report_perror("Error reading metadata");
+            return 0;
+        }
+        memset(&buf[i], 0, sizeof(FileMetadata));
+        memcpy(buf[i].path, old.path, MAX_PATH_LENGTH);
+        buf[i].mode = old.mode;
+        buf[i].uid = old.uid;
+        buf[i].gid = old.gid;
+        buf[i].size = old.size;
+        buf[i].atime = old.atime;
+        buf[i].mtime = old.mtime;
+        buf[i].ctime = old.ctime;
+        buf[i].data_offset = old.data_offset;
+        buf[i].inode = old.inode;
+        buf[i].is_hardlink = old.is_hardlink;
+        memcpy(buf[i].link_target, old.link_target, MAX_PATH_LENGTH);
+        buf[i].logical_size = old.is_hardlink ? -1 : old.size;   // Hard links stored no size
+    }
+    /* Version 1 had no flags, compressed data was recognised by the gzip magic bytes */
+    for (size_t i = 0; i < n; i++) {
+        unsigned char magic[2];
+        if (!S_ISREG(buf[i].mode) || buf[i].is_hardlink || buf[i].size < 2)
+            continue;
+        if (fseek(reader->archive, buf[i].data_offset, SEEK_SET) != 0 ||
+            stats_fread(magic, 1, 2, reader->archive) != 2) {
+            report_perror("Error reading magic bytes");
+            continue;
+        }
+        if (magic[0] == 0x1F && magic[1] == 0x8B) {
+            buf[i].flags |= ENTRY_GZIP;
+            buf[i].logical_size = -1;     // Unknown without decompressing
+        }
+    }
+    reader->next += n;
+    return n;
+}
+
+/*
+   Reads the whole metadata block described by the header.
+   Returns a malloc'd array of header->metadata_count records, or NULL on error.
+*/
+FileMetadata *read_metadata_block(FILE *archive, const ArchiveHeader *header) {
+    size_t meta_count = header->metadata_count;
+    FileMetadata *metas = malloc((meta_count ? meta_count : 1) * sizeof(FileMetadata));
+    if (!metas) {
+        report_perror("malloc");
+        return NULL;
+    }
+    MetadataReader reader;
+    metadata_reader_init(&reader, archive, header);
+    if (metadata_reader_next(&reader, metas, meta_count) != meta_count) {
+        free(metas);
+        return NULL;
+    }
+    return metas;
+}
+
+/*
+   Lists the data extents of a file with SEEK_DATA/SEEK_HOLE.
+   *extents is left NULL when the file has no holes (nothing to gain).
+   Returns -1 if the filesystem cannot report extents.
+*/
+int find_data_extents(int fd, off_t size, SparseExtent **extents, size_t *count) {
+    *extents = NULL;
+    *count = 0;
+    size_t capacity = 0;
+    SparseExtent *list = NULL;
+    off_t data_bytes = 0;
+    off_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data == -1) {
+            if (errno == ENXIO)
+                break;  // Only a hole remains
+            free(list);
+            return -1;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1) {
+            free(list);
+            return -1;
+        }
+        if (hole > size)
+            hole = size;
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            SparseExtent *grown = realloc(list, capacity * sizeof(SparseExtent));
+            if (!grown) {
+                report_perror("realloc");
+                free(list);
+                return -1;
+            }
+            list = grown;
+        }
+        list[*count].offset = data;
+        list[*count].length = hole - data;
+        (*count)++;
+        data_bytes += hole - data;
+        pos = hole;
+    }
+    if (data_bytes >= size) {
+        free(list);
+        *count = 0;
+        return 0;
+    }
+    *extents = list ? list : malloc(sizeof(SparseExtent));
+    return 0;
+}
+
+// Reads the extent map at the current position of a sparse entry
+int read_extent_map(FILE *archive, SparseExtent **extents, uint64_t *count) {
+    if (stats_fread(count, sizeof(*count), 1, archive) != 1) {
+        report_perror("Error reading extent map");
+        return -1;
+    }
+    *extents = malloc((*count ? *count : 1) * sizeof(SparseExtent));
+    if (!*extents) {
+        report_perror("malloc");
+        return -1;
+    }
+    if (stats_fread(*extents, sizeof(SparseExtent), *count, archive) != *count) {
+        report_perror("Error reading extent map");
+        free(*extents);
+        *extents = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// io_read_range() sink appending file data to the archive
+typedef struct {
+    FILE *archive;
+    long *data_offset;
+} ArchiveSink;
+
+static int archive_sink(void *ctx, const void *data, size_t n) {
+    ArchiveSink *sink = ctx;
+    if (stats_fwrite(data, 1, n, sink->archive) != n) {
+        report_perror("Error writing file data to archive");
+        return -1;
+    }
+    *sink->data_offset += (long)n;
+    return 0;
+}
+
+/*
+   Copies len bytes between two files at explicit offsets with copy_file_range(),
+   so the data never passes through user space (and is shared on filesystems
+   with reflinks). Falls back to pread/pwrite where it is not supported.
+   Returns 0 on success, -1 on error.
+*/
+int copy_file_data(int in_fd, off_t in_off, int out_fd, off_t out_off, off_t len) {
+    while (len > 0) {
+        // Under the governor, in buffer-sized steps charged as a read and a write
+        size_t step = governor_enabled && len > (off_t)io_buffer_size ? io_buffer_size : (size_t)len;
+        governor_wait(GOV_READ, step);
+        governor_wait(GOV_WRITE, step);
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, step, 0);
+        if (n > 0) {
+            len -= n;
+            continue;
+        }
+        if (n == 0) {
+            report_error("Unexpected end of file while copying data\n");
+            return -1;
+        }
+        if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) {
+            report_perror("copy_file_range error");
+            return -1;
+        }
+        break;
+    }
+    size_t size = (off_t)io_buffer_size < len ? io_buffer_size : (size_t)len;
+    char *buffer = len > 0 ? io_alloc(size) : NULL;
+    if (len > 0 && !buffer) {
+        report_perror("malloc");
+        return -1;
+    }
+    while (len > 0) {
+        size_t chunk = (len < (off_t)size) ? (size_t)len : size;
+        ssize_t r = stats_pread(in_fd, buffer, chunk, in_off);
+        if (r <= 0) {
+            report_perror("Error reading data");
+            free(buffer);
+            return -1;
+        }
+        if (stats_pwrite(out_fd, buffer, (size_t)r, out_off) != r) {
+            report_perror("Error writing data");
+            free(buffer);
+            return -1;
+        }
+        in_off += r;
+        out_off += r;
+        len -= r;
+    }
+    free(buffer);
+    return 0;
+}
+
+// io_read_range() sink writing into a pipe
+static int pipe_sink(void *ctx, const void *data, size_t n) {
+    int fd = *(int *)ctx;
+    const char *p = data;
+    while (n > 0) {
+        ssize_t written = write(fd, p, n);
+        if (written <= 0)
+            return -1;
+        p += written;
+        n -= (size_t)written;
+    }
+    return 0;
+}
+
+typedef struct {
+    const char *fs_path;
+    const SparseExtent *extents;
+    size_t extent_count;
+    int fd;                     // Write end of gzip's stdin, closed when done
+} Feeder;
+
+// Writes the data extents of a file back to back into a pipe (gzip's stdin)
+static void *feed_extents(void *arg) {
+    Feeder *feeder = arg;
+    // A gzip that died early must fail the write with EPIPE, not kill the process
+    sigset_t pipe_signal;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+    IoFile file;
+    if (io_open(&file, feeder->fs_path) != 0) {
+        report_perror("Error opening file for archiving");
+    } else {
+        for (size_t i = 0; i < feeder->extent_count; i++) {
+            if (io_read_range(&file, feeder->extents[i].offset, feeder->extents[i].length, pipe_sink, &feeder->fd) != 0)
+                break;
+        }
+        io_close(&file);
+    }
+    close(feeder->fd);
+    return NULL;
+}
+
 // Compresses a file to an archive
-void compress_file_to_archive(const char *fs_path, FILE *archive, long *data_offset, off_t *size_out) {
+// For sparse files (extents != NULL) only the data extents are fed to gzip, by
+// a thread of this process so that the governor paces the reads
+// Returns 0, or -1 when gzip could not run, failed or its output could not be written
+int compress_file_to_archive(const char *fs_path, const SparseExtent *extents, size_t extent_count,
+                              FILE *archive, long *data_offset, off_t *size_out) {
     int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        perror("pipe error");
-        return;
+    int feedfd[2] = { -1, -1 };
+    // Close-on-exec: with volume writers running, a gzip forked by another
+    // thread must not inherit (and keep open) the ends of these pipes
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        report_perror("pipe error");
+        return -1;
+    }
+    if (extents && pipe2(feedfd, O_CLOEXEC) == -1) {
+        report_perror("pipe error");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
     }
     pid_t pid = fork();
     if (pid == -1) {
-        perror("fork error");
+        report_perror("fork error");
         close(pipefd[0]);
         close(pipefd[1]);
-        return;
+        if (extents) {
+            close(feedfd[0]);
+            close(feedfd[1]);
+        }
+        return -1;
     }
     if (pid == 0) {
         // Child process
         close(pipefd[0]); // close read end
         if (dup2(pipefd[1], STDOUT_FILENO) == -1) {
-            perror("dup2 error");
-            exit(1);
+            report_perror("dup2 error");
+            _exit(1);
         }
         close(pipefd[1]);
-        execlp("gzip", "gzip", "-c", fs_path, (char *)NULL);
-        perror("execlp error");
-        exit(1);
+        if (extents) {
+            close(feedfd[1]);
+            if (dup2(feedfd[0], STDIN_FILENO) == -1) {
+                report_perror("dup2 error");
+                _exit(1);
+            }
+            close(feedfd[0]);
+            execlp("gzip", "gzip", "-c", (char *)NULL);
+        } else {
+            execlp("gzip", "gzip", "-c", fs_path, (char *)NULL);
+        }
+        report_perror("execlp error");
+        _exit(1);
     }
     // Parent process
     close(pipefd[1]); // close write end
-    char buffer[1024];
+    governor_child(pid, 1);
+    Feeder feeder = { fs_path, extents, extent_count, feedfd[1] };
+    pthread_t feeder_thread;
+    int feeding = 0;
+    if (extents) {
+        close(feedfd[0]);
+        feeding = pthread_create(&feeder_thread, NULL, feed_extents, &feeder) == 0;
+        if (!feeding) {
+            report_perror("pthread_create");
+            close(feedfd[1]);
+        }
+    }
+    stats_phase_begin(PHASE_COMPRESS);
+    char buffer[65536];     // A pipe never returns more at once
     ssize_t bytes;
     off_t total_bytes = 0;
-    while ((bytes = read(pipefd[0], buffer, sizeof(buffer))) > 0) {
-        if (fwrite(buffer, 1, bytes, archive) != (size_t)bytes) {
-            perror("Error writing compressed data to archive");
+    int rc = 0;
+    while ((bytes = stats_read(pipefd[0], buffer, sizeof(buffer))) > 0) {
+        if (stats_fwrite(buffer, 1, bytes, archive) != (size_t)bytes) {
+            report_perror("Error writing compressed data to archive");
+            rc = -1;
             break;
         }
         total_bytes += bytes;
         *data_offset += bytes;
     }
     close(pipefd[0]);
+    if (feeding)
+        pthread_join(feeder_thread, NULL);
     int status;
-    waitpid(pid, &status, 0);
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        if (rc == 0)
+            report_error("gzip failed on %s\n", fs_path);
+        rc = -1;
+    }
+    governor_child(pid, 0);
+    stats_phase_end(PHASE_COMPRESS);
     *size_out = total_bytes;
+    return rc;
+}
+
+/*
+   Writes the data of a regular file at the current position of the archive
+   and fills data_offset, size, logical_size and flags of its record.
+   Sparse files store an extent map and their data extents only, and with
+   compress (-j) the data goes through gzip (or zlib with the archive's
+   dictionary, see dict.h; large files are compressed in blocks, see blocks.h).
+   Returns 0 on success, -1 on error.
+*/
+int store_file_data(const char *path, const struct stat *st, FILE *archive, long *data_offset, FileMetadata *meta,
+                    int compress) {
+    uint64_t file_start = stats_enabled ? stats_now() : 0;
+    meta->data_offset = *data_offset;
+    meta->logical_size = st->st_size;
+    // Only files with fewer allocated blocks than their size can have holes
+    SparseExtent *extents = NULL;
+    size_t extent_count = 0;
+    if ((off_t)st->st_blocks * 512 < st->st_size) {
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+            find_data_extents(fd, st->st_size, &extents, &extent_count);
+            close(fd);
+        }
+    }
+    if (extents) {
+        // Extent map first, followed by the data of every extent
+        uint64_t count = extent_count;
+        if (stats_fwrite(&count, sizeof(count), 1, archive) != 1 ||
+            stats_fwrite(extents, sizeof(SparseExtent), extent_count, archive) != extent_count) {
+            report_perror("Error writing extent map to archive");
+            free(extents);
+            return -1;
+        }
+        *data_offset += sizeof(count) + extent_count * sizeof(SparseExtent);
+        meta->flags |= ENTRY_SPARSE;
+    }
+    if (compress && archive_dict.size) {
+        // In-process zlib against the archive's trained dictionary
+        if (dict_compress_file(path, extents, extent_count, st->st_size, &archive_dict, archive, data_offset) != 0) {
+            free(extents);
+            return -1;
+        }
+        meta->flags |= ENTRY_DICT;
+    } else if (compress && !extents && block_compress_wanted(st->st_size)) {
+        // Large dense files are compressed in blocks by all cores
+        if (block_compress_file(path, st->st_size, archive, data_offset) != 0) {
+            free(extents);
+            return -1;
+        }
+        meta->flags |= ENTRY_GZIP | ENTRY_BLOCKS;
+    } else if (compress) {
+        off_t comp_size = 0;
+        // gzip gets the file through a pipe under the governor, so the reads are paced, and
+        // with --order, so no atime changes and no file name or mtime in the gzip header
+        SparseExtent whole = { 0, st->st_size };
+        int rc;
+        if (!extents && (governor_enabled || order_option != ORDER_NONE))
+            rc = compress_file_to_archive(path, &whole, 1, archive, data_offset, &comp_size);
+        else
+            rc = compress_file_to_archive(path, extents, extent_count, archive, data_offset, &comp_size);
+        if (rc != 0) {
+            free(extents);
+            return -1;
+        }
+        meta->flags |= ENTRY_GZIP;
+    } else {
+        IoFile file;
+        if (io_open(&file, path) != 0) {
+            report_perror("Error opening file for archiving");
+            free(extents);
+            return -1;
+        }
+        ArchiveSink sink = { archive, data_offset };
+        int rc = 0;
+        if (extents) {
+            for (size_t i = 0; i < extent_count && rc == 0; i++)
+                rc = io_read_range(&file, extents[i].offset, extents[i].length, archive_sink, &sink);
+        } else {
+            rc = io_read_range(&file, 0, st->st_size, archive_sink, &sink);
+        }
+        io_close(&file);
+        if (rc != 0) {
+            free(extents);
+            return -1;
+        }
+    }
+    free(extents);
+    meta->size = *data_offset - meta->data_offset;
+    stats_add_bytes(st->st_size, meta->size);
+    stats_file_done(path, file_start, st->st_size);
+    return 0;
+}
+
+// A failed entry ends a stop_on_error walk (libmyz), the CLI reports it and goes on
+static int walk_failed(int stop_on_error, int err) {
+    return stop_on_error ? err : WALK_OK;
 }
 
 // Manages files, directories, symlinks, and hard links
-// For regular files: if compress_flag is active, reads through compress_file_to_archive
+// For regular files: store_file_data() writes the data, through gzip when compress is set
 // Also checks if the inode has already been stored (hard link): if so, sets is_hardlink = 1 and
 // copies the data_offset from the first occurrence (without storing data again)
 // For symlinks: reads the target with readlink and stores it in link_target
-void process_path(const char *path, FILE *archive, long *data_offset, MetadataArray *marr) {
-    struct stat st;
-    if (lstat(path, &st) == -1) {
-        perror("lstat error");
-        return;
-    }
+static int walk_entry(const char *path, const struct stat *st, int restored, FILE *archive, long *data_offset,
+                      MetadataArray *marr, int compress, int stop_on_error) {
     FileMetadata meta;
     memset(&meta, 0, sizeof(meta));
-    strncpy(meta.path, path, MAX_PATH_LENGTH-1);
-    meta.path[MAX_PATH_LENGTH-1] = '\0';
-    meta.mode = st.st_mode;
-    meta.uid = st.st_uid;
-    meta.gid = st.st_gid;
-    meta.atime = st.st_atime;
-    meta.mtime = st.st_mtime;
-    meta.ctime = st.st_ctime;
-    meta.inode = st.st_ino;
+    strcpy(meta.path, path);
+    meta.mode = st->st_mode;
+    meta.uid = st->st_uid;
+    meta.gid = st->st_gid;
+    meta.atime = st->st_atime;
+    meta.mtime = st->st_mtime;
+    meta.ctime = st->st_ctime;
+    meta.inode = st->st_ino;
+    meta.dev = (uint64_t)st->st_dev;
     meta.is_hardlink = 0;
     meta.link_target[0] = '\0';
-    
-    if (S_ISDIR(st.st_mode)) {
+
+    if (S_ISDIR(st->st_mode)) {
         meta.data_offset = 0;
-        add_metadata(marr, meta);
-        DIR *dir = opendir(path);
-        if (!dir) {
-            perror("opendir error");
-            return;
-        }
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL) {
-            if (strcmp(entry->d_name, ".")==0 || strcmp(entry->d_name, "..")==0)
+        if (!restored) {
+            if (try_add_metadata(marr, &meta) != 0)
+                return WALK_ERR_NOMEM;
+            stats_count_entry(st->st_mode, 0);
+        }
+        // The children are read (and sorted with --order) before any is stored
+        size_t count;
+        char **names = read_dir_entries(path, &count);
+        if (!names) {
+            report_perror("opendir error");
+            return walk_failed(stop_on_error, WALK_ERR_IO);
+        }
+        int rc = WALK_OK;
+        for (size_t i = 0; i < count && rc == WALK_OK; i++) {
+            char full_path[MAX_PATH_LENGTH];
+            int len = snprintf(full_path, sizeof(full_path), "%s/%s", path, names[i]);
+            if (len < 0 || (size_t)len >= sizeof(full_path)) {
+                report_error("Path too long, skipping: %s/%s\n", path, names[i]);
+                rc = walk_failed(stop_on_error, WALK_ERR_TOOLONG);
                 continue;
-            char full_path[1024];
-            snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-            process_path(full_path, archive, data_offset, marr);
+            }
+            rc = walk_path(full_path, archive, data_offset, marr, compress, stop_on_error);
         }
-        closedir(dir);
+        free_dir_entries(names, count);
+        return rc;
     }
-    else if (S_ISLNK(st.st_mode)) {
+    if (S_ISLNK(st->st_mode)) {
         // Read the target of the symlink
-        ssize_t len = readlink(path, meta.link_target, MAX_PATH_LENGTH-1);
+        ssize_t len = readlink(path, meta.link_target, MAX_PATH_LENGTH);
         if (len == -1) {
-            perror("readlink error");
+            report_perror("readlink error");
+            if (stop_on_error)
+                return WALK_ERR_IO;
             meta.link_target[0] = '\0';
+        } else if (len == MAX_PATH_LENGTH) {
+            report_error("Symlink target too long, skipping: %s\n", path);
+            return walk_failed(stop_on_error, WALK_ERR_TOOLONG);
         } else {
             meta.link_target[len] = '\0';
         }
         meta.data_offset = 0;
-        add_metadata(marr, meta);
-    }
-    else if (S_ISREG(st.st_mode)) {
-        // Check if the file is a hard link by comparing inodes
-        for (size_t i = 0; i < marr->count; i++) {
-            if (!S_ISDIR(marr->records[i].mode) && 
-                marr->records[i].inode == st.st_ino) {
-                // Same inode, hard link
-                meta.is_hardlink = 1;
-                meta.data_offset = marr->records[i].data_offset;
-                meta.size = 0;
-                add_metadata(marr, meta);
-                return;
-            }
-        }
-        // If the file is not a hard link, store the data
-        meta.data_offset = *data_offset;
-        char buffer[1024];
-        size_t bytes;
-        if (compress_flag) {
-            off_t comp_size = 0;
-            compress_file_to_archive(path, archive, data_offset, &comp_size);
-            meta.size = comp_size;
-        } else {
-            FILE *file = fopen(path, "rb");
-            if (!file) {
-                perror("Error opening file for archiving");
-                return;
-            }
-            while ((bytes = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-                if (fwrite(buffer, 1, bytes, archive) != bytes) {
-                    perror("Error writing file data to archive");
-                    fclose(file);
-                    return;
-                }
-                *data_offset += bytes;
-            }
-            fclose(file);
-            meta.size = st.st_size;
-        }
-        add_metadata(marr, meta);
+        if (try_add_metadata(marr, &meta) != 0)
+            return WALK_ERR_NOMEM;
+        stats_count_entry(st->st_mode, 0);
+        return WALK_OK;
+    }
+    if (!S_ISREG(st->st_mode)) {
+        report_error("Skipping unsupported file type: %s\n", path);
+        return WALK_OK;
+    }
+    // Check if the file is a hard link: only inodes with several links can be,
+    // and those are kept in the inode index of the metadata array
+    long link_offset;
+    if (st->st_nlink > 1 && inode_index_find(&marr->links, st->st_dev, st->st_ino, &link_offset)) {
+        // Same inode, hard link
+        meta.is_hardlink = 1;
+        meta.data_offset = link_offset;
+        meta.size = 0;
+        meta.logical_size = st->st_size;   // For size predicates (-f)
+        if (try_add_metadata(marr, &meta) != 0)
+            return WALK_ERR_NOMEM;
+        stats_count_entry(st->st_mode, 1);
+        return WALK_OK;
+    }
+    // Volume mode: the data is written later by the volume's writer thread,
+    // until then hard links refer to the record index of their original
+    if (active_volume_writer) {
+        size_t index = metadata_total(marr);
+        meta.logical_size = st->st_size;
+        meta.volume = volume_enqueue(active_volume_writer, path, st, index);
+        if (st->st_nlink > 1)
+            inode_index_add(&marr->links, st->st_dev, st->st_ino, (long)index);
+        if (try_add_metadata(marr, &meta) != 0)
+            return WALK_ERR_NOMEM;
+        stats_count_entry(st->st_mode, 0);
+        return WALK_OK;
+    }
+    // If the file is not a hard link, store the data
+    if (store_file_data(path, st, archive, data_offset, &meta, compress) != 0)
+        return walk_failed(stop_on_error, WALK_ERR_IO);
+    // Without the index entry, later links store the data again
+    if (st->st_nlink > 1 && inode_index_add(&marr->links, st->st_dev, st->st_ino, meta.data_offset) != 0 &&
+        stop_on_error)
+        return WALK_ERR_NOMEM;
+    if (try_add_metadata(marr, &meta) != 0)
+        return WALK_ERR_NOMEM;
+    stats_count_entry(st->st_mode, 0);
+    return WALK_OK;
+}
+
+int walk_path(const char *path, FILE *archive, long *data_offset, MetadataArray *marr, int compress,
+              int stop_on_error) {
+    // Excluded paths are skipped before lstat, excluded directories are never walked
+    if (filter_path_excluded(path))
+        return WALK_OK;
+    // Records hold MAX_PATH_LENGTH - 1 bytes of path, a longer one is never cut short
+    if (strlen(path) >= MAX_PATH_LENGTH) {
+        report_error("Path too long, skipping: %s\n", path);
+        return walk_failed(stop_on_error, WALK_ERR_TOOLONG);
     }
-    else {
-        fprintf(stderr, "Skipping unsupported file type: %s\n", path);
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        report_perror("lstat error");
+        return walk_failed(stop_on_error, WALK_ERR_IO);
     }
-}
\ No newline at end of file
+    // Resumed create: what the checkpoint stored is skipped, directories are still walked
+    int restored = active_checkpoint && checkpoint_restored(active_checkpoint, path, &st, marr);
+    if (restored && !S_ISDIR(st.st_mode))
+        return WALK_OK;
+    stats_phase_begin(PHASE_TRAVERSE);
+    int rc = walk_entry(path, &st, restored, archive, data_offset, marr, compress, stop_on_error);
+    if (rc == WALK_OK && active_checkpoint)
+        checkpoint_tick(active_checkpoint, archive, *data_offset, marr);
+    stats_phase_end(PHASE_TRAVERSE);
+    return rc;
+}
+
+void process_path(const char *path, FILE *archive, long *data_offset, MetadataArray *marr) {
+    // A catalog that cannot grow is the one error a create cannot go on from
+    if (walk_path(path, archive, data_offset, marr, compress_flag, 0) == WALK_ERR_NOMEM)
+        exit(EXIT_FAILURE);
+}
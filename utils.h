@@ -3,16 +3,103 @@
 
 #include "structs.h"
 #include <stdio.h>
+#include <sys/stat.h>
+
+/* Compress regular file data (-j) in create, append, --from-tar and --watch */
+extern int compress_flag;
+
+/* Upper bound for in-memory catalog records (--max-memory), 0 = unbounded */
+extern unsigned long long catalog_memory_limit;
+
+/* Worker threads of -g and --diff (--threads), 0 = one per online CPU */
+extern unsigned int thread_option;
+
+/* --order: how create and append walk the children of a directory */
+#define ORDER_NONE 0    // As readdir() returns them
+#define ORDER_PATH 1    // By name, so the same tree always gives the same archive
+#define ORDER_TYPE 2    // By extension, then name: similar files stored together
+#define ORDER_SIZE 3    // By size of regular files, then name
+
+extern int order_option;
+
+/* Sequential, chunked access to an archive's metadata block */
+typedef struct {
+    FILE *archive;
+    ArchiveHeader header;
+    size_t next;                // Index of the next record to read
+} MetadataReader;
+
+/*
+ * The shared helpers report their errors on stderr through these. libmyz
+ * returns error codes instead and sets quiet_errors around the helpers it
+ * calls, for the calling thread only.
+ */
+extern _Thread_local int quiet_errors;
+void report_perror(const char *msg);
+void report_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
 void mode_to_string(mode_t mode, char *str);
+/* Prints a libmyz error code, with errno for MYZ_ERR_IO */
+void print_myz_error(const char *msg, int err);
+int parse_size(const char *str, unsigned long long *out);
+/* Threads to start for jobs independent tasks: --threads or the CPU count, at most jobs, at least 1 */
+long worker_count(size_t jobs);
+/* Returns the --order value for its name ("path", "type", "size"), -1 if unknown */
+int order_parse(const char *name);
+/*
+ * The names of the children of a directory, without "." and "..", in
+ * --order. Returns an array of count strings to free with
+ * free_dir_entries(), or NULL if the directory cannot be read.
+ */
+char **read_dir_entries(const char *path, size_t *count);
+void free_dir_entries(char **names, size_t count);
+/* Both exit when out of memory, the try_ versions return -1 instead */
 void init_metadata_array(MetadataArray *arr);
-void add_metadata(MetadataArray *arr, FileMetadata meta);
+void add_metadata(MetadataArray *arr, const FileMetadata *meta);
+int try_init_metadata_array(MetadataArray *arr);
+int try_add_metadata(MetadataArray *arr, const FileMetadata *meta);
+size_t metadata_total(const MetadataArray *arr);
+int write_metadata_array(MetadataArray *arr, FILE *archive);
 void free_metadata_array(MetadataArray *arr);
+int inode_index_find(const InodeIndex *index, dev_t dev, ino_t inode, long *data_offset);
+int inode_index_add(InodeIndex *index, dev_t dev, ino_t inode, long data_offset);
+void inode_index_free(InodeIndex *index);
 void ensure_parent_dirs(const char *filepath);
 void generate_unique_filename(char *filepath);
-int should_extract(const char *metadata_path, char **filter, int filter_count);
 void get_top_component(const char *path, char *top, size_t size);
+void init_archive_header(ArchiveHeader *header);
+int read_archive_header(FILE *archive, ArchiveHeader *header);
+int is_legacy_archive(const ArchiveHeader *header);
+/* Start and end of the data area of the archive file, -1 on error */
+long archive_data_start(const ArchiveHeader *header);
+long archive_data_end(FILE *archive, const ArchiveHeader *header);
+void metadata_reader_init(MetadataReader *reader, FILE *archive, const ArchiveHeader *header);
+size_t metadata_reader_next(MetadataReader *reader, FileMetadata *buf, size_t max);
+FileMetadata *read_metadata_block(FILE *archive, const ArchiveHeader *header);
+int find_data_extents(int fd, off_t size, SparseExtent **extents, size_t *count);
+int read_extent_map(FILE *archive, SparseExtent **extents, uint64_t *count);
+int copy_file_data(int in_fd, off_t in_off, int out_fd, off_t out_off, off_t len);
+int store_file_data(const char *path, const struct stat *st, FILE *archive, long *data_offset, FileMetadata *meta,
+                    int compress);
+
+/* walk_path() results */
+#define WALK_OK 0
+#define WALK_ERR_IO -1          // errno holds the cause
+#define WALK_ERR_NOMEM -2
+#define WALK_ERR_TOOLONG -3     // Path or symlink target does not fit in a record
+
+/*
+ * Stores path, and everything under a directory, in the archive and marr:
+ * the walk of -c, -a and libmyz. compress is -j. With stop_on_error the
+ * first entry that cannot be stored ends the walk and its error is
+ * returned; otherwise the entry is reported and skipped and only
+ * WALK_ERR_NOMEM ends it.
+ */
+int walk_path(const char *path, FILE *archive, long *data_offset, MetadataArray *marr, int compress,
+              int stop_on_error);
+/* walk_path() with -j from compress_flag, exits when the catalog runs out of memory */
 void process_path(const char *path, FILE *archive, long *data_offset, MetadataArray *marr);
-void compress_file_to_archive(const char *fs_path, FILE *archive, long *data_offset, off_t *size_out);
+int compress_file_to_archive(const char *fs_path, const SparseExtent *extents, size_t extent_count,
+                             FILE *archive, long *data_offset, off_t *size_out);
 
 #endif // UTILS_H
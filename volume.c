@@ -0,0 +1,346 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <libgen.h>
+#include <pthread.h>
+#include "volume.h"
+#include "utils.h"
+#include "stats.h"
+#include "io.h"
+
+unsigned int volume_count_option = 0;
+unsigned long long volume_size_option = 0;
+VolumeWriter *active_volume_writer = NULL;
+
+static char **volume_paths = NULL;
+static int volume_path_count = 0;
+
+typedef struct {
+    char *path;
+    struct stat st;
+    size_t index;               // Metadata record of the file
+} VolumeJob;
+
+typedef struct {
+    VolumeJob *jobs;
+    size_t count;
+    size_t capacity;
+    unsigned long long load;    // Bytes queued, allocated size for sparse files
+    char fs_path[PATH_MAX];
+    FILE *out;
+    long data_start;
+    long data_end;
+    MetadataArray *marr;
+} Volume;
+
+struct VolumeWriter {
+    char archive_name[PATH_MAX];
+    Volume *volumes;
+    VolumeTable table;
+};
+
+int volume_add_path(const char *dir)
+{
+    // Stored absolute, the archive may later be read from another directory
+    char *resolved = realpath(dir, NULL);
+    if (!resolved) {
+        perror("Invalid volume path");
+        return -1;
+    }
+    char **grown = realloc(volume_paths, (volume_path_count + 1) * sizeof(char *));
+    if (!grown) {
+        perror("realloc");
+        free(resolved);
+        return -1;
+    }
+    volume_paths = grown;
+    volume_paths[volume_path_count++] = resolved;
+    return 0;
+}
+
+int volume_mode_requested(void)
+{
+    return volume_count_option > 0 || volume_size_option > 0;
+}
+
+/* Path of a volume file: absolute, or relative to the directory of the archive */
+static void resolve_volume_path(const char *archive_name, const VolumeEntry *entry, char *buf, size_t size)
+{
+    if (entry->path[0] == '/') {
+        snprintf(buf, size, "%s", entry->path);
+        return;
+    }
+    char copy[PATH_MAX];
+    snprintf(copy, sizeof(copy), "%s", archive_name);
+    snprintf(buf, size, "%s/%s", dirname(copy), entry->path);
+}
+
+int volume_table_read(FILE *archive, const ArchiveHeader *header, VolumeTable *table)
+{
+    table->count = 0;
+    table->entries = NULL;
+    if (is_legacy_archive(header) || header->volume_count == 0 || header->volume_offset == 0)
+        return 0;
+    table->entries = malloc(header->volume_count * sizeof(VolumeEntry));
+    if (!table->entries) {
+        report_perror("malloc");
+        return -1;
+    }
+    if (fseek(archive, header->volume_offset, SEEK_SET) != 0 ||
+        stats_fread(table->entries, sizeof(VolumeEntry), header->volume_count, archive) != header->volume_count) {
+        report_perror("Error reading volume table");
+        free(table->entries);
+        table->entries = NULL;
+        return -1;
+    }
+    table->count = header->volume_count;
+    return 0;
+}
+
+int volume_table_write(FILE *archive, ArchiveHeader *header, const VolumeTable *table)
+{
+    header->volume_offset = 0;
+    header->volume_count = 0;
+    if (table->count == 0)
+        return 0;
+    // Right after the tree index and columns, or after the metadata block if there are none
+    long offset = (header->tree_offset || header->column_offset) ? ftell(archive)
+                                      : header->metadata_offset + (long)header->metadata_count * (long)sizeof(FileMetadata);
+    if (offset < 0 || fseek(archive, offset, SEEK_SET) != 0) {
+        report_perror("fseek error");
+        return -1;
+    }
+    if (stats_fwrite(table->entries, sizeof(VolumeEntry), table->count, archive) != table->count) {
+        report_perror("Error writing volume table");
+        return -1;
+    }
+    header->volume_offset = offset;
+    header->volume_count = table->count;
+    return 0;
+}
+
+void volume_table_free(VolumeTable *table)
+{
+    free(table->entries);
+    table->entries = NULL;
+    table->count = 0;
+}
+
+int volume_file_path(const char *archive_name, const VolumeTable *table, uint32_t volume, char *buf, size_t size)
+{
+    if (volume >= table->count)
+        return -1;
+    resolve_volume_path(archive_name, &table->entries[volume], buf, size);
+    return 0;
+}
+
+FILE *volume_open(const char *archive_name, const VolumeTable *table, uint32_t volume)
+{
+    if (volume >= table->count) {
+        report_error("Archive refers to missing volume %u\n", volume);
+        return NULL;
+    }
+    char path[PATH_MAX];
+    resolve_volume_path(archive_name, &table->entries[volume], path, sizeof(path));
+    FILE *in = io_fopen(path, "rb");
+    if (!in)
+        report_perror(path);
+    return in;
+}
+
+/* Adds volume k: "<archive>.vol<k>" next to the archive, or in the --volume-path directories */
+static uint32_t add_volume(VolumeWriter *writer)
+{
+    uint32_t k = writer->table.count;
+    VolumeEntry *entries = realloc(writer->table.entries, (k + 1) * sizeof(VolumeEntry));
+    Volume *volumes = entries ? realloc(writer->volumes, (k + 1) * sizeof(Volume)) : NULL;
+    if (entries)
+        writer->table.entries = entries;
+    if (!volumes) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    writer->volumes = volumes;
+    memset(&entries[k], 0, sizeof(VolumeEntry));
+    memset(&volumes[k], 0, sizeof(Volume));
+    if (k > 0) {
+        char copy[PATH_MAX];
+        snprintf(copy, sizeof(copy), "%s", writer->archive_name);
+        const char *base = basename(copy);
+        int len;
+        if (volume_path_count > 0)
+            len = snprintf(entries[k].path, sizeof(entries[k].path), "%s/%s.vol%u",
+                           volume_paths[(k - 1) % volume_path_count], base, k);
+        else
+            len = snprintf(entries[k].path, sizeof(entries[k].path), "%s.vol%u", base, k);
+        if (len < 0 || (size_t)len >= sizeof(entries[k].path)) {
+            fprintf(stderr, "Volume path too long for volume %u\n", k);
+            exit(EXIT_FAILURE);
+        }
+        resolve_volume_path(writer->archive_name, &entries[k], volumes[k].fs_path, sizeof(volumes[k].fs_path));
+    }
+    writer->table.count = k + 1;
+    return k;
+}
+
+VolumeWriter *volume_writer_create(const char *archive_name)
+{
+    VolumeWriter *writer = calloc(1, sizeof(VolumeWriter));
+    if (!writer) {
+        perror("calloc");
+        return NULL;
+    }
+    snprintf(writer->archive_name, sizeof(writer->archive_name), "%s", archive_name);
+    // --volumes creates all of them up front, --volume-size on demand
+    uint32_t initial = volume_count_option ? volume_count_option : 1;
+    for (uint32_t k = 0; k < initial; k++)
+        add_volume(writer);
+    return writer;
+}
+
+uint32_t volume_enqueue(VolumeWriter *writer, const char *path, const struct stat *st, size_t index)
+{
+    uint32_t v = 0;
+    // Sparse files only store their allocated blocks
+    off_t allocated = (off_t)st->st_blocks * 512;
+    unsigned long long size = (unsigned long long)(allocated < st->st_size ? allocated : st->st_size);
+    if (volume_size_option) {
+        v = writer->table.count - 1;
+        if (writer->volumes[v].load > 0 && writer->volumes[v].load + size > volume_size_option)
+            v = add_volume(writer);
+    } else {
+        // Least loaded volume, ties go to the lowest number
+        for (uint32_t k = 1; k < writer->table.count; k++) {
+            if (writer->volumes[k].load < writer->volumes[v].load)
+                v = k;
+        }
+    }
+    Volume *vol = &writer->volumes[v];
+    if (vol->count == vol->capacity) {
+        size_t capacity = vol->capacity ? vol->capacity * 2 : 64;
+        VolumeJob *grown = realloc(vol->jobs, capacity * sizeof(VolumeJob));
+        if (!grown) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        vol->jobs = grown;
+        vol->capacity = capacity;
+    }
+    vol->jobs[vol->count].path = strdup(path);
+    if (!vol->jobs[vol->count].path) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    vol->jobs[vol->count].st = *st;
+    vol->jobs[vol->count].index = index;
+    vol->count++;
+    vol->load += size;
+    return v;
+}
+
+static void *write_volume(void *arg)
+{
+    Volume *vol = arg;
+    for (size_t i = 0; i < vol->count; i++) {
+        FileMetadata *meta = &vol->marr->records[vol->jobs[i].index];
+        if (store_file_data(vol->jobs[i].path, &vol->jobs[i].st, vol->out, &vol->data_end, meta, compress_flag) != 0) {
+            // The record already exists (hard links may point to it), keep it as an empty file
+            fprintf(stderr, "Error archiving %s, stored as an empty file\n", vol->jobs[i].path);
+            meta->flags = 0;
+            meta->size = 0;
+            meta->logical_size = 0;
+            meta->data_offset = vol->data_end;
+        }
+    }
+    return NULL;
+}
+
+int volume_writer_run(VolumeWriter *writer, FILE *archive, long *data_offset, MetadataArray *marr)
+{
+    if (marr->spilled > 0) {
+        fprintf(stderr, "Multi-volume archives need the whole catalog in memory\n");
+        return -1;
+    }
+    uint32_t count = writer->table.count;
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+    int *started = calloc(count, sizeof(int));
+    if (!threads || !started) {
+        perror("calloc");
+        free(threads);
+        free(started);
+        return -1;
+    }
+    int rc = 0;
+    for (uint32_t k = 0; k < count; k++) {
+        Volume *vol = &writer->volumes[k];
+        vol->marr = marr;
+        if (k == 0) {
+            vol->out = archive;
+            vol->data_start = *data_offset;
+        } else {
+            vol->out = io_fopen(vol->fs_path, "wb");
+            if (!vol->out) {
+                perror(vol->fs_path);
+                rc = -1;
+                break;
+            }
+        }
+        vol->data_end = vol->data_start;
+        if (vol->count == 0)
+            continue;
+        if (pthread_create(&threads[k], NULL, write_volume, vol) != 0) {
+            perror("pthread_create");
+            rc = -1;
+            break;
+        }
+        started[k] = 1;
+    }
+    for (uint32_t k = 0; k < count; k++) {
+        if (started[k])
+            pthread_join(threads[k], NULL);
+        Volume *vol = &writer->volumes[k];
+        writer->table.entries[k].size = (uint64_t)(vol->data_end - vol->data_start);
+        if (k > 0 && vol->out && io_fclose(vol->out) != 0) {
+            perror(vol->fs_path);
+            rc = -1;
+        }
+        vol->out = NULL;
+    }
+    free(threads);
+    free(started);
+    if (rc != 0)
+        return -1;
+    *data_offset = writer->volumes[0].data_end;
+
+    // Hard links were queued with the record index of their original
+    for (size_t i = 0; i < marr->count; i++) {
+        FileMetadata *meta = &marr->records[i];
+        if (S_ISREG(meta->mode) && meta->is_hardlink) {
+            const FileMetadata *orig = &marr->records[meta->data_offset];
+            meta->data_offset = orig->data_offset;
+            meta->volume = orig->volume;
+        }
+    }
+    return 0;
+}
+
+const VolumeTable *volume_writer_table(const VolumeWriter *writer)
+{
+    return &writer->table;
+}
+
+void volume_writer_free(VolumeWriter *writer)
+{
+    if (!writer)
+        return;
+    for (uint32_t k = 0; k < writer->table.count; k++) {
+        for (size_t i = 0; i < writer->volumes[k].count; i++)
+            free(writer->volumes[k].jobs[i].path);
+        free(writer->volumes[k].jobs);
+    }
+    free(writer->volumes);
+    volume_table_free(&writer->table);
+    free(writer);
+}
@@ -0,0 +1,54 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include "structs.h"
+
+/*
+ * Multi-volume archives (--volumes=N, --volume-size=SIZE, --volume-path=DIR).
+ *
+ * While creating, process_path() only queues regular files on a volume:
+ * balanced by size over N volumes, or filling every volume up to SIZE
+ * before opening the next one. After the traversal each volume is written
+ * by its own thread. Extraction reads the volumes in parallel too.
+ */
+
+/* Volume options, set by myz.c */
+extern unsigned int volume_count_option;        // --volumes, 0 = not set
+extern unsigned long long volume_size_option;   // --volume-size, 0 = not set
+int volume_add_path(const char *dir);            // --volume-path, repeatable
+int volume_mode_requested(void);
+
+typedef struct {
+    uint32_t count;             // 0 for single-file archives
+    VolumeEntry *entries;
+} VolumeTable;
+
+int volume_table_read(FILE *archive, const ArchiveHeader *header, VolumeTable *table);
+/* Writes the table after the tree index (or metadata block) and sets the header fields */
+int volume_table_write(FILE *archive, ArchiveHeader *header, const VolumeTable *table);
+void volume_table_free(VolumeTable *table);
+/* Filesystem path of a volume, -1 if the table has no such volume */
+int volume_file_path(const char *archive_name, const VolumeTable *table, uint32_t volume, char *buf, size_t size);
+/* Opens volume > 0 of an archive for reading */
+FILE *volume_open(const char *archive_name, const VolumeTable *table, uint32_t volume);
+
+typedef struct VolumeWriter VolumeWriter;
+
+/* Set by create_archive() while process_path() should queue files instead of writing them */
+extern VolumeWriter *active_volume_writer;
+
+VolumeWriter *volume_writer_create(const char *archive_name);
+/* Queues the regular file of metadata record 'index', returns its volume */
+uint32_t volume_enqueue(VolumeWriter *writer, const char *path, const struct stat *st, size_t index);
+/*
+ * Writes all volumes in parallel, volume 0 into archive from *data_offset,
+ * and fills the data fields of the queued records (hard links included).
+ * The records must all be in memory (no --max-memory spill).
+ */
+int volume_writer_run(VolumeWriter *writer, FILE *archive, long *data_offset, MetadataArray *marr);
+const VolumeTable *volume_writer_table(const VolumeWriter *writer);
+void volume_writer_free(VolumeWriter *writer);
+
+#endif // VOLUME_H
@@ -0,0 +1,345 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "../structs.h"
+#include "../utils.h"
+#include "../filter.h"
+#include "../pathset.h"
+#include "../c_flag/c_flag.h"
+#include "../a_flag/a_flag.h"
+#include "watch.h"
+
+/* What happened to a path during a batch (PathSlot.input) */
+#define CHANGE_SEEN     0x1     // Created, written, its attributes changed or moved here
+#define CHANGE_GONE     0x2     // Deleted or moved away
+#define CHANGE_GONE_DIR 0x4     // A directory deleted or moved away, with everything under it
+
+#define DIR_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_EXCL_UNLINK)
+#define FILE_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+unsigned int watch_interval = 0;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+/* One inotify watch, indexed by its descriptor (they are handed out counting up) */
+typedef struct {
+    char *path;                 // NULL when the watch is gone
+    int is_file;                // A file given on the command line, its events carry no name
+} Watch;
+
+typedef struct {
+    int fd;
+    Watch *watches;
+    size_t capacity;
+    size_t active;
+    int full;                   // Out of watches (fs.inotify.max_user_watches), reported once
+    PathSet batch;              // Changed paths (owned copies), CHANGE_* in input
+    struct timespec deadline;   // When the batch is appended
+    dev_t archive_dev;          // The archive itself is never a change
+    ino_t archive_ino;
+} Watcher;
+
+static int watch_set(Watcher *w, int wd, const char *path, int is_file)
+{
+    if ((size_t)wd >= w->capacity) {
+        size_t capacity = w->capacity ? w->capacity : 256;
+        while (capacity <= (size_t)wd)
+            capacity *= 2;
+        Watch *grown = realloc(w->watches, capacity * sizeof(Watch));
+        if (!grown) {
+            perror("realloc");
+            return -1;
+        }
+        memset(grown + w->capacity, 0, (capacity - w->capacity) * sizeof(Watch));
+        w->watches = grown;
+        w->capacity = capacity;
+    }
+    Watch *watch = &w->watches[wd];
+    if (watch->path) {
+        // The same directory again (watched under another path): the newest path wins
+        free(watch->path);
+        w->active--;
+    }
+    watch->path = strdup(path);
+    if (!watch->path) {
+        perror("strdup");
+        return -1;
+    }
+    watch->is_file = is_file;
+    w->active++;
+    return 0;
+}
+
+static void watch_drop(Watcher *w, int wd)
+{
+    if (wd < 0 || (size_t)wd >= w->capacity || !w->watches[wd].path)
+        return;
+    free(w->watches[wd].path);
+    w->watches[wd].path = NULL;
+    w->active--;
+}
+
+/* Watches a directory and every directory under it, or a single file */
+static int watch_tree(Watcher *w, const char *path)
+{
+    struct stat st;
+    if (filter_path_excluded(path) || lstat(path, &st) == -1)
+        return 0;
+    int is_dir = S_ISDIR(st.st_mode);
+    int wd = inotify_add_watch(w->fd, path, is_dir ? DIR_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW
+                                                   : FILE_EVENTS | IN_DONT_FOLLOW);
+    if (wd == -1) {
+        if (errno == ENOSPC && !w->full) {
+            fprintf(stderr, "Out of inotify watches at %s, raise fs.inotify.max_user_watches\n", path);
+            w->full = 1;
+        } else if (errno != ENOENT && errno != ENOSPC) {
+            perror(path);
+        }
+        return 0;       // Gone already, or a change that will not be seen
+    }
+    if (watch_set(w, wd, path, !is_dir) != 0)
+        return -1;
+    if (!is_dir)
+        return 0;
+    size_t count;
+    char **names = read_dir_entries(path, &count);
+    if (!names)
+        return 0;
+    int rc = 0;
+    for (size_t i = 0; i < count && rc == 0; i++) {
+        char full_path[1024];
+        snprintf(full_path, sizeof(full_path), "%s/%s", path, names[i]);
+        if (lstat(full_path, &st) == 0 && S_ISDIR(st.st_mode))
+            rc = watch_tree(w, full_path);
+    }
+    free_dir_entries(names, count);
+    return rc;
+}
+
+/* A directory moved away: its watches (and those under it) would report the old paths */
+static void unwatch_tree(Watcher *w, const char *path)
+{
+    size_t len = strlen(path);
+    for (size_t wd = 0; wd < w->capacity; wd++) {
+        const char *p = w->watches[wd].path;
+        if (p && strncmp(p, path, len) == 0 && (p[len] == '\0' || p[len] == '/')) {
+            inotify_rm_watch(w->fd, (int)wd);
+            watch_drop(w, (int)wd);
+        }
+    }
+}
+
+static int batch_add(Watcher *w, const char *path, int change)
+{
+    PathSlot *slot = path_find(&w->batch, path);
+    if (slot) {
+        slot->input |= change;
+        return 0;
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        perror("strdup");
+        return -1;
+    }
+    if (w->batch.count == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &w->deadline);
+        w->deadline.tv_sec += watch_interval;
+    }
+    if (path_insert(&w->batch, copy, change, 0) != 0) {
+        free(copy);
+        return -1;
+    }
+    return 0;
+}
+
+static void batch_clear(Watcher *w)
+{
+    for (size_t i = 0; i < w->batch.capacity; i++)
+        free((char *)w->batch.slots[i].path);
+    path_set_free(&w->batch);
+}
+
+static int cmp_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Appends the batch: what exists now is stored (as a new version when it
+ * is archived), what is gone becomes a tombstone. A directory that went
+ * away, or anything replaced by a directory, is a tombstone too when the
+ * path exists again, so that the old entries under it disappear.
+ */
+static int batch_flush(Watcher *w, const char *archive_name)
+{
+    if (w->batch.count == 0)
+        return 0;
+    char **files = malloc(w->batch.count * sizeof(char *));
+    char **removed = malloc(w->batch.count * sizeof(char *));
+    if (!files || !removed) {
+        perror("malloc");
+        free(files);
+        free(removed);
+        batch_clear(w);
+        return -1;
+    }
+    int file_count = 0, removed_count = 0;
+    for (size_t i = 0; i < w->batch.capacity; i++) {
+        const PathSlot *slot = &w->batch.slots[i];
+        if (!slot->path)
+            continue;
+        struct stat st;
+        int exists = lstat(slot->path, &st) == 0;
+        if (exists && st.st_dev == w->archive_dev && st.st_ino == w->archive_ino)
+            continue;
+        if (!exists || (slot->input & CHANGE_GONE_DIR) || ((slot->input & CHANGE_GONE) && S_ISDIR(st.st_mode)))
+            removed[removed_count++] = (char *)slot->path;
+        if (exists)
+            files[file_count++] = (char *)slot->path;
+    }
+    qsort(files, (size_t)file_count, sizeof(char *), cmp_paths);
+    qsort(removed, (size_t)removed_count, sizeof(char *), cmp_paths);
+    int rc = file_count + removed_count > 0 ? append_changes(archive_name, files, file_count, removed, removed_count)
+                                            : 0;
+    fflush(stdout);
+    free(files);
+    free(removed);
+    batch_clear(w);
+    return rc;
+}
+
+static int handle_event(Watcher *w, const struct inotify_event *ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW) {
+        fprintf(stderr, "inotify queue overflowed, changes were lost (raise fs.inotify.max_queued_events"
+                        " and create the archive again)\n");
+        return 0;
+    }
+    if (ev->mask & IN_IGNORED) {
+        watch_drop(w, ev->wd);
+        return 0;
+    }
+    if (ev->wd < 0 || (size_t)ev->wd >= w->capacity || !w->watches[ev->wd].path)
+        return 0;
+    const Watch *watch = &w->watches[ev->wd];
+    char path[1024];
+    if (ev->len > 0)
+        snprintf(path, sizeof(path), "%s/%s", watch->path, ev->name);
+    else if (watch->is_file)
+        snprintf(path, sizeof(path), "%s", watch->path);
+    else
+        return 0;       // A watched directory itself: its parent reports what happened to it
+    if (filter_path_excluded(path))
+        return 0;
+    int change = CHANGE_SEEN;
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        change = CHANGE_GONE;
+        if (ev->mask & IN_ISDIR) {
+            change |= CHANGE_GONE_DIR;
+            unwatch_tree(w, path);
+        }
+    } else if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && (ev->mask & IN_ISDIR)) {
+        // Entries created before the watch is in place are stored with the directory
+        if (watch_tree(w, path) != 0)
+            return -1;
+    }
+    return batch_add(w, path, change);
+}
+
+int watch_archive(const char *archive_name, char *paths[], int path_count)
+{
+    Watcher w;
+    memset(&w, 0, sizeof(w));
+    w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w.fd == -1) {
+        perror("inotify_init1");
+        return -1;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* The watches go in first, so nothing changed while the archive is created is missed */
+    int rc = 0;
+    for (int i = 0; i < path_count && rc == 0; i++)
+        rc = watch_tree(&w, paths[i]);
+    struct stat st;
+    if (rc == 0) {
+        create_archive(archive_name, paths, path_count);
+        if (stat(archive_name, &st) != 0) {
+            perror(archive_name);
+            rc = -1;
+        } else {
+            w.archive_dev = st.st_dev;
+            w.archive_ino = st.st_ino;
+            printf("Watching %zu paths, appending changes every %u s.\n", w.active, watch_interval);
+            fflush(stdout);
+        }
+    }
+
+    _Alignas(struct inotify_event) char buf[65536];
+    while (rc == 0 && !stop_requested) {
+        int timeout = -1;
+        if (w.batch.count > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long ms = (long long)(w.deadline.tv_sec - now.tv_sec) * 1000 +
+                           (w.deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (ms <= 0) {
+                rc = batch_flush(&w, archive_name);
+                continue;
+            }
+            timeout = (int)ms;
+        }
+        struct pollfd pfd = { w.fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, timeout);
+        if (ready == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+                rc = -1;
+            }
+            continue;
+        }
+        if (ready == 0)
+            continue;
+        ssize_t n = 0;
+        while (rc == 0 && (n = read(w.fd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + n && rc == 0;) {
+                const struct inotify_event *ev = (const struct inotify_event *)p;
+                rc = handle_event(&w, ev);
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+        if (rc == 0 && n == -1 && errno != EAGAIN && errno != EINTR) {
+            perror("Error reading inotify events");
+            rc = -1;
+        }
+    }
+    /* Stopped: the changes seen so far still go in */
+    if (rc == 0 && batch_flush(&w, archive_name) != 0)
+        rc = -1;
+    batch_clear(&w);
+    for (size_t i = 0; i < w.capacity; i++)
+        free(w.watches[i].path);
+    free(w.watches);
+    close(w.fd);
+    return rc;
+}
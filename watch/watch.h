@@ -0,0 +1,18 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#define WATCH_DEFAULT_INTERVAL 5
+
+extern unsigned int watch_interval;     // --watch[=SECONDS], 0 when off
+
+/*
+ * -c --watch: subscribes to inotify events on the given files and
+ * directories (recursively), creates the archive from them and then keeps
+ * it current: the paths changed within watch_interval seconds of the first
+ * change of a batch are appended as one batch (see append_changes()).
+ * Runs until SIGINT or SIGTERM, which flush the pending batch.
+ * Returns 0 on a clean stop, -1 on error.
+ */
+int watch_archive(const char *archive_name, char *paths[], int path_count);
+
+#endif // WATCH_H
@@ -7,206 +7,538 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <utime.h>
-#include <libgen.h>
 #include <sys/types.h>
+#include <pthread.h>
 #include "../structs.h"
 #include "../utils.h"
+#include "../stats.h"
+#include "../io.h"
+#include "../filter.h"
+#include "../libmyz.h"
+#include "../query.h"
+#include "../checkpoint.h"
 #include "x_flag.h"
 
+int restore_policy = RESTORE_RENAME;
+
+/* Serializes the collision check and creation of output files between volume threads */
+static pthread_mutex_t create_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* --checkpoint: the extracted entries are journaled, extract_file() reports to it */
+static ExtractCheckpoint *extract_checkpoint = NULL;
+
+/*
+ * Writes the content of an entry to out, each chunk at its file offset, so
+ * the holes of sparse entries are never written. Returns 0, 1 when the
+ * content is cut short by an error, -1 when nothing could be read.
+ */
+static int copy_stream(myz_archive *archive, const myz_entry *entry, int out, off_t *written)
+{
+    myz_stream *stream;
+    int rc = myz_stream_open(archive, entry->index, &stream);
+    if (rc != MYZ_OK) {
+        print_myz_error(entry->path, rc);
+        return -1;
+    }
+    size_t buffer_size = entry->size > 0 && (unsigned long long)entry->size < io_buffer_size ? (size_t)entry->size : io_buffer_size;
+    char *buffer = io_alloc(buffer_size);
+    if (!buffer) {
+        perror("malloc");
+        myz_stream_close(stream);
+        return -1;
+    }
+    off_t offset;
+    ssize_t n;
+    while ((n = myz_stream_read_chunk(stream, buffer, buffer_size, &offset)) > 0) {
+        if (stats_pwrite(out, buffer, (size_t)n, offset) != n) {
+            perror("Error writing file data");
+            n = MYZ_ERR_IO;
+            break;
+        }
+        *written += n;
+    }
+    if (n < 0 && n != MYZ_ERR_IO)
+        print_myz_error(entry->path, (int)n);
+    free(buffer);
+    myz_stream_close(stream);
+    return n < 0 ? 1 : 0;
+}
+
+/* A block-compressed entry being extracted, its blocks are handed out in order */
+typedef struct {
+    myz_blocks *blocks;
+    int out;
+    uint64_t block_size;
+    uint64_t count;
+    uint64_t next;
+    off_t written;
+    int rc;                     // First error, MYZ_OK if none
+    pthread_mutex_t lock;
+} BlockCopy;
+
+static void *copy_block_worker(void *arg)
+{
+    BlockCopy *copy = arg;
+    char *buffer = malloc(copy->block_size);
+    for (;;) {
+        pthread_mutex_lock(&copy->lock);
+        if (!buffer && copy->rc == MYZ_OK)
+            copy->rc = MYZ_ERR_NOMEM;
+        if (copy->rc != MYZ_OK || copy->next == copy->count) {
+            pthread_mutex_unlock(&copy->lock);
+            break;
+        }
+        uint64_t block = copy->next++;
+        pthread_mutex_unlock(&copy->lock);
+        ssize_t n = myz_blocks_read(copy->blocks, block, buffer, copy->block_size);
+        if (n >= 0 && stats_pwrite(copy->out, buffer, (size_t)n, (off_t)(block * copy->block_size)) != n)
+            n = MYZ_ERR_IO;
+        pthread_mutex_lock(&copy->lock);
+        if (n < 0 && copy->rc == MYZ_OK)
+            copy->rc = (int)n;
+        else if (n > 0)
+            copy->written += n;
+        pthread_mutex_unlock(&copy->lock);
+    }
+    free(buffer);
+    return NULL;
+}
+
+/* Like copy_stream(), with the blocks of a MYZ_ENTRY_BLOCKS entry decoded by all cores */
+static int copy_blocks(myz_archive *archive, const myz_entry *entry, int out, off_t *written)
+{
+    BlockCopy copy;
+    memset(&copy, 0, sizeof(copy));
+    int rc = myz_blocks_open(archive, entry->index, &copy.blocks);
+    if (rc != MYZ_OK) {
+        print_myz_error(entry->path, rc);
+        return -1;
+    }
+    myz_blocks_layout(copy.blocks, &copy.block_size, &copy.count);
+    copy.out = out;
+    pthread_mutex_init(&copy.lock, NULL);
+    long workers = worker_count(copy.count);
+    pthread_t *threads = calloc((size_t)workers, sizeof(pthread_t));
+    long started = 0;
+    while (threads && started < workers && pthread_create(&threads[started], NULL, copy_block_worker, &copy) == 0)
+        started++;
+    if (started == 0)
+        copy_block_worker(&copy);
+    for (long i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&copy.lock);
+    myz_blocks_close(copy.blocks);
+    *written = copy.written;
+    if (copy.rc != MYZ_OK) {
+        print_myz_error(entry->path, copy.rc);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Extracts one regular file (or a hard link whose original is not archived).
+ */
+static void extract_file(myz_archive *archive, const myz_entry *entry)
+{
+    uint64_t file_start = stats_enabled ? stats_now() : 0;
+    off_t written = 0;
+    char extraction_path[1024];
+    strncpy(extraction_path, entry->path, sizeof(extraction_path));
+    extraction_path[sizeof(extraction_path)-1] = '\0';
+
+    /* Ensure the parent directories exist before creating the file */
+    ensure_parent_dirs(extraction_path);
+
+    pthread_mutex_lock(&create_lock);
+    if (restore_policy == RESTORE_RENAME && access(extraction_path, F_OK) == 0) {
+        generate_unique_filename(extraction_path);
+        printf("File collision: extracted file renamed to '%s'.\n  Original archive path: '%s'\n",
+               extraction_path, entry->path);
+    }
+    int out = open(extraction_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    pthread_mutex_unlock(&create_lock);
+    if (out == -1) {
+        perror("Error creating output file");
+        return;
+    }
+    int rc = entry->flags & MYZ_ENTRY_BLOCKS ? copy_blocks(archive, entry, out, &written)
+                                             : copy_stream(archive, entry, out, &written);
+    if (rc < 0) {
+        close(out);
+        return;
+    }
+    if (entry->flags & MYZ_ENTRY_SPARSE) {
+        /* Trailing holes: extend the file without writing zeros */
+        if (ftruncate(out, entry->size) != 0)
+            perror("ftruncate error");
+    }
+    if (io_direct) {
+        // Keep restored files from filling the page cache
+        fdatasync(out);
+        posix_fadvise(out, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(out);
+    chmod(extraction_path, entry->mode);
+    chown(extraction_path, entry->uid, entry->gid);
+    struct utimbuf times;
+    times.actime = entry->atime;
+    times.modtime = entry->mtime;
+    utime(extraction_path, &times);
+    stats_count_entry(entry->mode, 0);
+    stats_add_bytes(written, entry->stored_size);
+    stats_file_done(entry->path, file_start, written);
+    if (extract_checkpoint && rc == 0)
+        checkpoint_extract_mark(extract_checkpoint, entry->index);
+}
+
+/*
+ * --resume: whether the entry was extracted before the interruption. For
+ * the others, what the interrupted run may have left at the path is
+ * removed, so it is neither renamed around nor taken as up to date.
+ */
+static int resume_skip(const myz_entry *entry)
+{
+    if (!extract_checkpoint || !checkpoint_extract_resuming(extract_checkpoint))
+        return 0;
+    if (checkpoint_extract_done(extract_checkpoint, entry->index))
+        return 1;
+    struct stat st;
+    if (lstat(entry->path, &st) == 0 && !S_ISDIR(st.st_mode) && unlink(entry->path) != 0)
+        perror(entry->path);
+    return 0;
+}
+
+/*
+ * --update: whether the path already holds the entry. Regular files match
+ * on size and mtime (extraction sets the mtime last, so an interrupted
+ * file never matches), symlinks on their target and hard links on being
+ * the same inode as their original.
+ */
+static int up_to_date(const myz_entry *entry, const struct stat *st, const char *orig_path)
+{
+    if ((st->st_mode & S_IFMT) != (entry->mode & S_IFMT))
+        return 0;
+    if (S_ISLNK(entry->mode)) {
+        char target[1024];
+        ssize_t n = readlink(entry->path, target, sizeof(target) - 1);
+        if (n < 0)
+            return 0;
+        target[n] = '\0';
+        return strcmp(target, entry->link_target) == 0;
+    }
+    if (orig_path) {
+        struct stat orig;
+        return stat(orig_path, &orig) == 0 && orig.st_dev == st->st_dev && orig.st_ino == st->st_ino;
+    }
+    return entry->size >= 0 && st->st_size == entry->size && st->st_mtime == entry->mtime;
+}
+
+/*
+ * Applies the restore policy to an entry whose path may exist. Returns 1
+ * if the existing path stays as it is and the entry is skipped, 0 if the
+ * entry is to be created (anything in the way has been removed, except
+ * under the default policy, where regular files are renamed).
+ */
+static int keep_existing(const myz_entry *entry, const char *orig_path)
+{
+    struct stat st;
+    if (restore_policy == RESTORE_RENAME || lstat(entry->path, &st) != 0)
+        return 0;
+    if (restore_policy == RESTORE_SKIP)
+        return 1;
+    if (restore_policy == RESTORE_UPDATE && up_to_date(entry, &st, orig_path))
+        return 1;
+    if (S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Not replacing directory '%s' with a file\n", entry->path);
+        return 1;
+    }
+    if (unlink(entry->path) != 0) {
+        perror("Error removing existing file");
+        return 1;
+    }
+    return 0;
+}
+
+#define PREFETCH_WINDOW (8 << 20)      // How far ahead of the current file reads are hinted
+#define PREFETCH_GAP (1 << 20)         // Smaller gaps between files are read through
+
+/* A regular file to extract, ordered by where its data is stored */
+typedef struct {
+    off_t offset;
+    off_t size;
+    size_t index;
+} ExtractItem;
+
+/* The selected regular files stored in one volume */
+typedef struct {
+    myz_archive *archive;
+    uint32_t volume;
+    ExtractItem *items;
+    size_t count;
+    size_t capacity;
+} VolumeExtract;
+
+static int cmp_items(const void *a, const void *b)
+{
+    const ExtractItem *x = a, *y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static int add_item(VolumeExtract *job, const myz_entry *entry)
+{
+    if (job->count == job->capacity) {
+        size_t capacity = job->capacity ? job->capacity * 2 : 64;
+        ExtractItem *grown = realloc(job->items, capacity * sizeof(ExtractItem));
+        if (!grown) {
+            perror("realloc");
+            return -1;
+        }
+        job->items = grown;
+        job->capacity = capacity;
+    }
+    job->items[job->count++] = (ExtractItem){ entry->offset, entry->stored_size, entry->index };
+    return 0;
+}
+
+/*
+ * Hints the data of the files that start less than PREFETCH_WINDOW after
+ * the current one. Neighbouring files go out as one range, so the kernel
+ * reads the archive ahead in large sequential requests.
+ */
+static void prefetch_ahead(const VolumeExtract *job, size_t current, size_t *next, off_t *hinted)
+{
+    off_t limit = job->items[current].offset + PREFETCH_WINDOW;
+    off_t start = -1, end = 0;
+    for (; *next < job->count && job->items[*next].offset < limit; (*next)++) {
+        const ExtractItem *item = &job->items[*next];
+        off_t from = item->offset > *hinted ? item->offset : *hinted;
+        off_t to = item->offset + item->size;
+        if (to <= from)
+            continue;
+        if (start >= 0 && from - end > PREFETCH_GAP) {
+            myz_prefetch(job->archive, job->volume, start, end - start);
+            start = -1;
+        }
+        if (start < 0)
+            start = from;
+        end = to;
+        *hinted = to;
+    }
+    if (start >= 0)
+        myz_prefetch(job->archive, job->volume, start, end - start);
+}
+
+/* Extracts the files of one volume in ascending data order, whatever the catalog order */
+static void *extract_volume(void *arg)
+{
+    VolumeExtract *job = arg;
+    qsort(job->items, job->count, sizeof(ExtractItem), cmp_items);
+    size_t next = 0;
+    off_t hinted = 0;
+    for (size_t i = 0; i < job->count; i++) {
+        prefetch_ahead(job, i, &next, &hinted);
+        myz_entry entry;
+        myz_entry_at(job->archive, job->items[i].index, &entry);
+        extract_file(job->archive, &entry);
+    }
+    return NULL;
+}
+
 /*
  * This function extracts all items from the archive, optionally filtering
  * which paths are extracted (if filter_count > 0).
  * Compressed files are automatically decompressed.
  * Hard links and symbolic links are recreated appropriately.
+ * The volumes of a multi-volume archive are extracted in parallel.
  */
  void extract_archive(const char *archive_name, char **filter, int filter_count) {
-    FILE *archive = fopen(archive_name, "rb");
-    if (!archive) {
-        perror("Error opening archive");
+    stats_phase_begin(PHASE_METADATA_READ);
+    myz_archive *archive;
+    int rc = myz_open(archive_name, &archive);
+    stats_phase_end(PHASE_METADATA_READ);
+    if (rc != MYZ_OK) {
+        print_myz_error("Error opening archive", rc);
         return;
     }
-    ArchiveHeader header;
-    if (fread(&header, 1, HEADER_SIZE, archive) != HEADER_SIZE) {
-        perror("Error reading header");
-        fclose(archive);
-        return;
+    size_t meta_count = myz_entry_count(archive);
+
+    /* --where: metadata predicate over the columnar catalog */
+    unsigned char *where = NULL;
+    if (where_option) {
+        size_t where_count = 0;
+        where = query_select(archive_name, where_option, &where_count);
+        if (!where || where_count != meta_count) {
+            free(where);
+            myz_close(archive);
+            return;
+        }
     }
-    size_t meta_count = header.metadata_count;
-    FileMetadata *metas = malloc(meta_count * sizeof(FileMetadata));
-    if (!metas) {
+
+    /* Match every path once against the compiled filters */
+    PathFilter *path_filter = filter_compile(filter, filter_count, FILTER_COLLISIONS);
+    unsigned char *selected = malloc(meta_count ? meta_count : 1);
+    if (!path_filter || !selected) {
         perror("malloc");
-        fclose(archive);
+        free(where);
+        filter_free(path_filter);
+        free(selected);
+        myz_close(archive);
         return;
     }
-    if (fseek(archive, header.metadata_offset, SEEK_SET) != 0) {
-        perror("fseek error");
-        free(metas);
-        fclose(archive);
-        return;
+    uint32_t volume_count = 1;
+    myz_iter iter;
+    myz_entry entry;
+    myz_iter_init(&iter, archive);
+    while (myz_iter_next(&iter, &entry)) {
+        selected[entry.index] = (unsigned char)(filter_match(path_filter, entry.path) &&
+                                                (!where || where[entry.index]));
+        if (entry.volume >= volume_count)
+            volume_count = entry.volume + 1;
     }
-    if (fread(metas, sizeof(FileMetadata), meta_count, archive) != meta_count) {
-        perror("Error reading metadata");
-        free(metas);
-        fclose(archive);
-        return;
+    filter_free(path_filter);
+    free(where);
+    if (checkpoint_interval) {
+        extract_checkpoint = checkpoint_extract_begin(archive_name, meta_count, resume_flag);
+        if (!extract_checkpoint) {
+            free(selected);
+            myz_close(archive);
+            return;
+        }
     }
+    stats_phase_begin(PHASE_EXTRACT);
     
     /* Extract directories first */
-    for (size_t i = 0; i < meta_count; i++) {
-        if (!should_extract(metas[i].path, filter, filter_count))
+    myz_iter_init(&iter, archive);
+    while (myz_iter_next(&iter, &entry)) {
+        if (!selected[entry.index])
             continue;
-        if (S_ISDIR(metas[i].mode)) {
-            ensure_parent_dirs(metas[i].path);
-            if (access(metas[i].path, F_OK) != 0) {
-                if (mkdir(metas[i].path, metas[i].mode) != 0 && errno != EEXIST) {
+        if (S_ISDIR(entry.mode)) {
+            ensure_parent_dirs(entry.path);
+            if (access(entry.path, F_OK) != 0) {
+                if (mkdir(entry.path, entry.mode) != 0 && errno != EEXIST) {
                     perror("Error creating directory");
                 }
             }
+            stats_count_entry(entry.mode, 0);
         }
     }
-    
-    /* Extract regular files, hard links, and symbolic links */
-    for (size_t i = 0; i < meta_count; i++) {
-        if (!should_extract(metas[i].path, filter, filter_count))
+
+    /* Then the regular files, one thread per volume */
+    VolumeExtract *jobs = calloc(volume_count, sizeof(VolumeExtract));
+    pthread_t *threads = calloc(volume_count, sizeof(pthread_t));
+    size_t skipped = 0, resumed = 0;
+    int failed = !jobs || !threads;
+    if (failed)
+        perror("calloc");
+    for (uint32_t v = 0; !failed && v < volume_count; v++) {
+        jobs[v].archive = archive;
+        jobs[v].volume = v;
+    }
+    myz_iter_init(&iter, archive);
+    while (!failed && myz_iter_next(&iter, &entry)) {
+        if (!selected[entry.index] || !S_ISREG(entry.mode) || entry.is_hardlink)
             continue;
-        if (S_ISREG(metas[i].mode)) {
-            if (metas[i].is_hardlink) {
-                /* For hard links: find the first occurrence (not marked as hard link)
-                   with the same inode */
-                const char *orig_path = NULL;
-                for (size_t j = 0; j < i; j++) {
-                    if (!S_ISDIR(metas[j].mode) && !metas[j].is_hardlink &&
-                        metas[j].inode == metas[i].inode) {
-                        orig_path = metas[j].path;
-                        break;
-                    }
-                }
-                if (orig_path) {
-                    if (link(orig_path, metas[i].path) == -1) {
-                        perror("Error creating hard link");
-                    } else {
-                        printf("Created hard link: %s -> %s\n", metas[i].path, orig_path);
-                    }
-                    continue;  // No need to extract file data again
-                }
-            }
-            /* Extract regular file (or first occurrence of a hard link) */
-            char extraction_path[1024];
-            strncpy(extraction_path, metas[i].path, sizeof(extraction_path));
-            extraction_path[sizeof(extraction_path)-1] = '\0';
-            
-            /* Ensure the parent directories exist before creating the file */
-            ensure_parent_dirs(extraction_path);
-
-            if (access(extraction_path, F_OK) == 0) {
-                generate_unique_filename(extraction_path);
-                printf("File collision: extracted file renamed to '%s'.\n  Original archive path: '%s'\n",
-                       extraction_path, metas[i].path);
-            }
-            FILE *out = fopen(extraction_path, "wb");
-            if (!out) {
-                perror("Error creating output file");
-                continue;
-            }
-            if (fseek(archive, metas[i].data_offset, SEEK_SET) != 0) {
-                perror("fseek error");
-                fclose(out);
-                continue;
-            }
-            unsigned char magic[2];
-            if (fread(magic, 1, 2, archive) != 2) {
-                perror("Error reading magic bytes");
-                fclose(out);
+        if (resume_skip(&entry)) {
+            resumed++;
+            continue;
+        }
+        // Skipped files are never read, so a repeated restore only pays for what changed
+        if (keep_existing(&entry, NULL))
+            skipped++;
+        else
+            failed = add_item(&jobs[entry.volume], &entry) != 0;
+    }
+    if (failed) {
+        for (uint32_t v = 0; jobs && v < volume_count; v++)
+            free(jobs[v].items);
+        free(jobs);
+        free(threads);
+        free(selected);
+        myz_close(archive);
+        checkpoint_extract_end(extract_checkpoint, 0);
+        extract_checkpoint = NULL;
+        stats_phase_end(PHASE_EXTRACT);
+        return;
+    }
+    uint32_t started = 0;
+    for (uint32_t v = 0; v < volume_count; v++) {
+        if (volume_count == 1) {
+            extract_volume(&jobs[v]);
+        } else if (pthread_create(&threads[v], NULL, extract_volume, &jobs[v]) != 0) {
+            perror("pthread_create");
+            break;
+        } else {
+            started++;
+        }
+    }
+    for (uint32_t v = 0; v < started; v++)
+        pthread_join(threads[v], NULL);
+    for (uint32_t v = 0; v < volume_count; v++)
+        free(jobs[v].items);
+    free(jobs);
+    free(threads);
+
+    /* Hard links and symbolic links, once their targets exist */
+    myz_iter_init(&iter, archive);
+    while (myz_iter_next(&iter, &entry)) {
+        if (!selected[entry.index] || S_ISDIR(entry.mode))
+            continue;
+        if ((entry.is_hardlink || S_ISLNK(entry.mode)) && resume_skip(&entry)) {
+            resumed++;
+            continue;
+        }
+        if (S_ISREG(entry.mode) && entry.is_hardlink) {
+            /* For hard links: the entry the link was made from, unless it is an
+               older version that is not extracted */
+            const char *orig_path = NULL;
+            myz_entry orig;
+            if (myz_link_origin(archive, entry.index, &orig) == MYZ_OK && !(orig.flags & MYZ_ENTRY_SUPERSEDED))
+                orig_path = orig.path;
+            if (keep_existing(&entry, orig_path)) {
+                skipped++;
                 continue;
             }
-            if (fseek(archive, metas[i].data_offset, SEEK_SET) != 0) {
-                perror("fseek error");
-                fclose(out);
+            if (!orig_path) {
+                /* Original not extracted: extract the data as a regular file */
+                extract_file(archive, &entry);
                 continue;
             }
-            if (magic[0] == 0x1F && magic[1] == 0x8B) {
-                /* Compressed file: decompress via gunzip */
-                unsigned char *comp_data = malloc((size_t)metas[i].size);
-                if (!comp_data) {
-                    perror("malloc error");
-                    fclose(out);
-                    continue;
-                }
-                if (fread(comp_data, 1, (size_t)metas[i].size, archive) != (size_t)metas[i].size) {
-                    perror("Error reading compressed data");
-                    free(comp_data);
-                    fclose(out);
-                    continue;
-                }
-                char temp_filename[] = "/tmp/myzXXXXXX";
-                int temp_fd = mkstemp(temp_filename);
-                if (temp_fd == -1) {
-                    perror("mkstemp error");
-                    free(comp_data);
-                    fclose(out);
-                    continue;
-                }
-                if (write(temp_fd, comp_data, metas[i].size) != metas[i].size) {
-                    perror("Error writing to temp file");
-                    close(temp_fd);
-                    remove(temp_filename);
-                    free(comp_data);
-                    fclose(out);
-                    continue;
-                }
-                close(temp_fd);
-                free(comp_data);
-                char cmd[1024];
-                snprintf(cmd, sizeof(cmd), "gunzip -c %s", temp_filename);
-                FILE *pipe = popen(cmd, "r");
-                if (!pipe) {
-                    perror("popen error");
-                    remove(temp_filename);
-                    fclose(out);
-                    continue;
-                }
-                char buffer[1024];
-                size_t bytes;
-                while ((bytes = fread(buffer, 1, sizeof(buffer), pipe)) > 0) {
-                    fwrite(buffer, 1, bytes, out);
-                }
-                pclose(pipe);
-                remove(temp_filename);
+            if (link(orig_path, entry.path) == -1) {
+                perror("Error creating hard link");
             } else {
-                off_t remaining = metas[i].size;
-                char buffer[1024];
-                while (remaining > 0) {
-                    off_t chunk_off = (remaining < (off_t)sizeof(buffer)) ? remaining : (off_t)sizeof(buffer);
-                    size_t chunk = (size_t)chunk_off;
-                    size_t bytes = fread(buffer, 1, chunk, archive);
-                    if (bytes != chunk) {
-                        perror("Error reading file data");
-                        break;
-                    }
-                    fwrite(buffer, 1, bytes, out);
-                    remaining -= (off_t)bytes;
-                }
+                printf("Created hard link: %s -> %s\n", entry.path, orig_path);
+                stats_count_entry(entry.mode, 1);
+                if (extract_checkpoint)
+                    checkpoint_extract_mark(extract_checkpoint, entry.index);
             }
-            fclose(out);
-            chmod(extraction_path, metas[i].mode);
-            chown(extraction_path, metas[i].uid, metas[i].gid);
-            struct utimbuf times;
-            times.actime = metas[i].atime;
-            times.modtime = metas[i].mtime;
-            utime(extraction_path, &times);
         }
-        else if (S_ISLNK(metas[i].mode)) {
+        else if (S_ISLNK(entry.mode)) {
+            if (keep_existing(&entry, NULL)) {
+                skipped++;
+                continue;
+            }
             /* For symbolic links: create the symlink using the stored target */
-            if (symlink(metas[i].link_target, metas[i].path) == -1) {
+            if (symlink(entry.link_target, entry.path) == -1) {
                 perror("Error creating symbolic link");
             } else {
-                printf("Created symbolic link: %s -> %s\n", metas[i].path, metas[i].link_target);
+                printf("Created symbolic link: %s -> %s\n", entry.path, entry.link_target);
+                stats_count_entry(entry.mode, 0);
+                if (extract_checkpoint)
+                    checkpoint_extract_mark(extract_checkpoint, entry.index);
             }
         }
     }
     
-    free(metas);
-    fclose(archive);
+    stats_phase_end(PHASE_EXTRACT);
+    free(selected);
+    myz_close(archive);
+    checkpoint_extract_end(extract_checkpoint, 1);
+    extract_checkpoint = NULL;
+    if (resumed)
+        printf("Resumed: %zu entries were extracted before the interruption.\n", resumed);
+    if (skipped)
+        printf("Skipped %zu existing entries.\n", skipped);
     printf("Archive %s extracted successfully.\n", archive_name);
 }
-
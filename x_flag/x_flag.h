@@ -1,10 +1,18 @@
 #ifndef X_FLAG_H
 #define X_FLAG_H
 
+/* What -x does with a path that already exists on disk */
+#define RESTORE_RENAME   0  // Extract next to it with a "(1)" suffix
+#define RESTORE_SKIP     1  // --skip-existing: leave it alone
+#define RESTORE_OVERWRITE 2 // --overwrite: replace it
+#define RESTORE_UPDATE   3  // --update: replace it unless type, size and mtime match
+
+extern int restore_policy;
+
 /*
  * Extracts the contents of an archive.
  * archive_name: The name/path of the archive to extract.
- * filter: Array of file/directory paths to extract (if any).
+ * filter: Array of file/directory paths or glob patterns to extract (if any).
  * filter_count: Number of items in 'filter'.
  * If filter_count == 0, everything is extracted.
  */